@@ -0,0 +1,241 @@
+/*
+ * FLPR pulse sequencer. Runs on the nRF54L15's FLPR (RISC-V VPR) core as an image of its
+ * own and plays the plan the application core commits to the mailbox (src/flpr_mbox.h,
+ * src/flpr_seq.h): the switch pins and the DAC word of every edge, timed by a free-running
+ * TIMER21 that nothing else touches. Everything is polled, with no interrupts, so nothing
+ * but the loop itself stands between an edge and its time.
+ *
+ * Sources: this file and ../src/seq_core.c, with ../src on the include path. Board
+ * nrf54l15dk/nrf54l15/cpuflpr with app.overlay (the mailbox RAM); built from the
+ * application's sysbuild as its FLPR image (prj.conf).
+ */
+#include <zephyr/kernel.h>
+#include <hal/nrf_timer.h>
+#include <hal/nrf_spim.h>
+#include <hal/nrf_gpio.h>
+#include "seq_core.h"
+#include "flpr_mbox.h"
+#include "stim_pins.h"
+#include "config.h"
+
+#define LEAD_TICKS (FLPR_SEQ_TICK_HZ / 100000u)    // 10 us: first onset, or an onset a new plan moved
+#define SPIN_TICKS (FLPR_SEQ_TICK_HZ / 1000000u)   // last 1 us before an edge: nothing but the clock is read
+#define LATE_TICKS ((uint32_t)((uint64_t)CONFIG_FLPR_SEQ_LATE_NS * FLPR_SEQ_TICK_HZ / 1000000000u))
+
+static volatile flpr_mbox *const mbox = FLPR_MBOX;
+static flpr_mbox_hw hw;
+static seq_core seq;
+static flpr_mbox_telemetry telem;
+static uint32_t plan_seen;              // plan_seq of the last plan read
+static uint32_t applied_seen;           // seq.applied already counted in telem
+static uint32_t accepted_seq;           // plan_seq of the newest plan seq_init or seq_commit took
+static uint32_t onset_applied;          // seq.applied at the last onset
+static uint32_t onset_seq;              // plan_seq of the plan the current pulse runs under
+static uint32_t heartbeat;
+/* DAC word. In RAM, not const: SPIM EasyDMA cannot read flash. */
+static uint8_t dac_tx[2];
+
+static inline uint32_t now(void)
+{
+    nrf_timer_task_trigger(FLPR_SEQ_TIMER, NRF_TIMER_TASK_CAPTURE0);
+    return nrf_timer_cc_get(FLPR_SEQ_TIMER, NRF_TIMER_CC_CHANNEL0);
+}
+
+static inline void beat(void)
+{
+    mbox->heartbeat = ++heartbeat;
+}
+
+static void telem_publish(void)
+{
+    telem.plans_applied += seq.applied - applied_seen;
+    applied_seen = seq.applied;
+    flpr_mbox_write(&mbox->telem_seq, (volatile uint32_t *)&mbox->telem, &telem, FLPR_MBOX_WORDS(telem));
+}
+
+/* Nothing to run: the application core sees FAULT, halts this core and makes the switches safe */
+static void fault(void)
+{
+    mbox->state = FLPR_STATE_FAULT;
+    for (;;) {
+        beat();
+    }
+}
+
+static void timer_start(void)
+{
+    nrf_timer_mode_set(FLPR_SEQ_TIMER, NRF_TIMER_MODE_TIMER);
+    nrf_timer_bit_width_set(FLPR_SEQ_TIMER, NRF_TIMER_BIT_WIDTH_32);
+    nrf_timer_prescaler_set(FLPR_SEQ_TIMER, 0);
+    nrf_timer_task_trigger(FLPR_SEQ_TIMER, NRF_TIMER_TASK_CLEAR);
+    nrf_timer_task_trigger(FLPR_SEQ_TIMER, NRF_TIMER_TASK_START);
+    telem.tick_hz = NRF_TIMER_BASE_FREQUENCY_GET(FLPR_SEQ_TIMER);
+}
+
+/* Mode 0, MSB first, as spi_init; CS is driven here, the application core left it high */
+static void spim_start(void)
+{
+    nrf_gpio_pin_clear(hw.sck_pin);
+    nrf_gpio_cfg(hw.sck_pin, NRF_GPIO_PIN_DIR_OUTPUT, NRF_GPIO_PIN_INPUT_CONNECT,
+                 NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_S0S1, NRF_GPIO_PIN_NOSENSE);
+    nrf_gpio_pin_clear(hw.mosi_pin);
+    nrf_gpio_cfg_output(hw.mosi_pin);
+    nrf_gpio_cfg_input(hw.miso_pin, NRF_GPIO_PIN_NOPULL);
+
+    nrf_spim_pins_set(FLPR_SEQ_SPIM, hw.sck_pin, hw.mosi_pin, hw.miso_pin);
+    nrf_spim_configure(FLPR_SEQ_SPIM, NRF_SPIM_MODE_0, NRF_SPIM_BIT_ORDER_MSB_FIRST);
+    nrf_spim_prescaler_set(FLPR_SEQ_SPIM, NRF_SPIM_BASE_FREQUENCY_GET(FLPR_SEQ_SPIM) / hw.spi_hz);
+    nrf_spim_tx_buffer_set(FLPR_SEQ_SPIM, dac_tx, sizeof(dac_tx));
+    nrf_spim_rx_buffer_set(FLPR_SEQ_SPIM, NULL, 0);
+    nrf_spim_enable(FLPR_SEQ_SPIM);
+}
+
+static void dac_write(uint16_t code)
+{
+    dac_tx[0] = (uint8_t)(code >> 8);
+    dac_tx[1] = (uint8_t)code;
+    nrf_gpio_pin_clear(hw.dac_cs_pin);
+    nrf_spim_event_clear(FLPR_SEQ_SPIM, NRF_SPIM_EVENT_END);
+    nrf_spim_task_trigger(FLPR_SEQ_SPIM, NRF_SPIM_TASK_START);
+    while (!nrf_spim_event_check(FLPR_SEQ_SPIM, NRF_SPIM_EVENT_END)) {
+    }
+    /* CS held past the last clock, as spi_write_dac1 */
+    for (volatile uint32_t i = 0; i < SPI_CS_HOLD_DELAY_LOOPS; i++) {
+        (void)i;
+    }
+    nrf_gpio_pin_set(hw.dac_cs_pin);
+}
+
+/* Clears on every port before any set: break-before-make */
+static inline void pins_apply(seq_edge_kind kind)
+{
+    for (uint32_t p = 0; p < STIM_PORT_COUNT; p++) {
+        if (hw.clr[kind][p]) {
+            nrf_gpio_port_out_clear(stim_port_reg(p), hw.clr[kind][p]);
+        }
+    }
+    for (uint32_t p = 0; p < STIM_PORT_COUNT; p++) {
+        if (hw.set[kind][p]) {
+            nrf_gpio_port_out_set(stim_port_reg(p), hw.set[kind][p]);
+        }
+    }
+}
+
+/* A plan newer than the last one read: 1 if it moved the next edge, else 0 */
+static int plan_poll(void)
+{
+    uint32_t s = mbox->plan_seq;
+    seq_plan plan;
+
+    if (s == plan_seen || (s & 1u)) {
+        return 0;
+    }
+    if (!flpr_mbox_read(&mbox->plan_seq, (const volatile uint32_t *)&mbox->plan, &plan,
+                        FLPR_MBOX_WORDS(plan), &s)) {
+        return 0;                       // written meanwhile: the next pass reads it
+    }
+    plan_seen = s;
+    telem.applied_seq = s;
+
+    int moved = seq_commit(&seq, &plan, now() + LEAD_TICKS);
+
+    if (moved < 0) {
+        telem.plans_rejected++;
+    } else {
+        accepted_seq = s;
+    }
+    telem_publish();
+    return moved > 0;
+}
+
+/* Poll until e is due; false if a new plan moved it first */
+static bool edge_wait(seq_edge e)
+{
+    for (;;) {
+        int32_t left = (int32_t)(e.at - now());
+
+        if (left <= 0) {
+            uint32_t late = (uint32_t)-left;
+
+            if (late > LATE_TICKS) {
+                telem.late_edges++;
+            }
+            if (late > telem.worst_late_ticks) {
+                telem.worst_late_ticks = late;
+            }
+            return true;
+        }
+        if (left > (int32_t)SPIN_TICKS) {
+            beat();
+            if (plan_poll()) {
+                return false;
+            }
+        }
+    }
+}
+
+int main(void)
+{
+    mbox->state = FLPR_STATE_READY;
+    while (mbox->magic != FLPR_MBOX_MAGIC) {
+        beat();
+    }
+    FLPR_MBOX_BARRIER();
+    if (mbox->version != FLPR_MBOX_VERSION) {
+        fault();
+    }
+
+    volatile uint32_t *src = (volatile uint32_t *)&mbox->hw;
+    uint32_t *dst = (uint32_t *)&hw;
+
+    for (size_t i = 0; i < FLPR_MBOX_WORDS(hw); i++) {
+        dst[i] = src[i];
+    }
+    timer_start();
+    spim_start();
+
+    /* The first plan was written before magic */
+    seq_plan plan;
+
+    if (mbox->plan_seq == 0 ||
+        !flpr_mbox_read(&mbox->plan_seq, (const volatile uint32_t *)&mbox->plan, &plan,
+                        FLPR_MBOX_WORDS(plan), &plan_seen) ||
+        seq_init(&seq, telem.tick_hz, &plan, now() + LEAD_TICKS) != 0) {
+        fault();
+    }
+    telem.applied_seq = plan_seen;
+    accepted_seq = plan_seen;
+    onset_seq = plan_seen;
+    onset_applied = seq.applied;
+    telem_publish();
+    mbox->state = FLPR_STATE_RUNNING;
+
+    uint16_t words[2] = { 0 };          // this pulse's DAC words, published when it ends
+
+    for (;;) {
+        seq_edge e = seq_peek(&seq);
+
+        if (!edge_wait(e)) {
+            continue;
+        }
+        pins_apply(e.kind);
+        if (e.kind == SEQ_EDGE_ONSET || e.kind == SEQ_EDGE_PHASE2) {
+            dac_write(e.dac_code);
+            words[e.kind == SEQ_EDGE_PHASE2] = e.dac_code;
+        }
+        if (e.kind == SEQ_EDGE_ONSET && seq.applied != onset_applied) {
+            /* A plan is taken between pulses: the newest one taken is the one this pulse runs */
+            onset_applied = seq.applied;
+            onset_seq = accepted_seq;
+        }
+        seq_advance(&seq);
+        if (e.kind == SEQ_EDGE_END) {
+            telem.pulses++;
+            telem.pulse_seq = onset_seq;
+            telem.pulse_phase1 = words[0];
+            telem.pulse_phase2 = words[1];
+            telem_publish();
+        }
+    }
+    return 0;
+}
@@ -26,15 +26,52 @@
 #include <zephyr/logging/log.h>
 #include "BLE.h"
 #include "data.h"
+#include "ctrl_frame.h"
+#include "energy.h"
+#include "config.h"
 
 LOG_MODULE_REGISTER(LOG_MODULE_NAME);
-K_SEM_DEFINE(ble_init_ok, 0, 1);
 
 #if defined(CONFIG_BT)
 const struct device *uart = DEVICE_DT_GET(DT_CHOSEN(nordic_nus_uart));
 struct k_work_delayable uart_work;
 static K_FIFO_DEFINE(fifo_uart_tx_data);
-static K_FIFO_DEFINE(fifo_uart_rx_data);
+K_MEM_SLAB_DEFINE_STATIC(uart_tx_slab, sizeof(struct uart_data_t), UART_TX_BUF_COUNT, 4);
+
+/* A span the driver reported (UART_RX_RDY), still inside its DMA buffer */
+struct uart_rx_slice {
+	const uint8_t *data;
+	uint16_t len;
+	uint8_t buf;
+	uint8_t gen;            // uart_rx_gen[buf] when queued: stale once the buffer is reused
+	bool gap;               // slices before this one were lost
+};
+
+BUILD_ASSERT(UART_RX_BUF_COUNT >= 4, "the driver holds up to two buffers and the parser one");
+
+/* Shared between the UART callback and uart_rx_work, under irq_lock */
+static uint8_t uart_rx_bufs[UART_RX_BUF_COUNT][UART_RX_BUF_LEN];
+static uint8_t uart_rx_unparsed[UART_RX_BUF_COUNT];     // slices queued per buffer
+static uint8_t uart_rx_gen[UART_RX_BUF_COUNT];
+static uint8_t uart_rx_driver;                          // bit per buffer the driver holds
+static int8_t uart_rx_parsing = -1;                     // buffer the parser is in
+static uint8_t uart_rx_next;                            // buffer the driver gets next
+static bool uart_rx_lost;
+static uint32_t uart_rx_overruns;                       // slices lost: queue full or buffer reused
+K_MSGQ_DEFINE(uart_rx_msgq, sizeof(struct uart_rx_slice), 4 * UART_RX_BUF_COUNT, 4);
+static struct k_work uart_rx_work;
+static void uart_rx_work_handler(struct k_work *work);
+
+/* NUS writes, copied out of the BT RX thread; commands run from comms_workq as UART ones do */
+struct nus_rx_msg {
+	uint8_t data[BLE_DATA_BUFFER_SIZE];
+	uint16_t len;
+};
+
+K_MSGQ_DEFINE(nus_rx_msgq, sizeof(struct nus_rx_msg), NUS_RX_QUEUE_LEN, 4);
+static void nus_rx_work_handler(struct k_work *work);
+static K_WORK_DEFINE(nus_rx_work, nus_rx_work_handler);
+static uint32_t nus_rx_dropped;                         // too long, or the queue was full
 #endif
 
 #if defined(CONFIG_BT)
@@ -54,20 +91,72 @@ bool ble_data_ready = false;
 #endif
 
 #if defined(CONFIG_BT)
-void uart_work_handler(struct k_work *item)
+/*
+ * Next buffer for the driver, which always gets one: reception never stops for a slow parser.
+ * The first buffer in turn that is fully parsed is taken; with every free one still queued,
+ * the oldest is reused and its slices are dropped, counted as overruns.
+ */
+static uint8_t uart_rx_take(void)
 {
-	struct uart_data_t *buf;
+	unsigned int key = irq_lock();
+	int pick = -1;
 
-	buf = k_malloc(sizeof(*buf));
-	if (buf) {
-		buf->len = 0;
-	} else {
-		LOG_WRN("Not able to allocate UART receive buffer");
-		k_work_reschedule(&uart_work, UART_WAIT_FOR_BUF_DELAY);
-		return;
+	for (uint8_t n = 0; n < UART_RX_BUF_COUNT; n++) {
+		uint8_t i = (uart_rx_next + n) % UART_RX_BUF_COUNT;
+
+		if ((uart_rx_driver & BIT(i)) || i == uart_rx_parsing) {
+			continue;
+		}
+		if (pick < 0) {
+			pick = i;
+		}
+		if (uart_rx_unparsed[i] == 0) {
+			pick = i;
+			break;
+		}
+	}
+	if (uart_rx_unparsed[pick]) {
+		uart_rx_overruns += uart_rx_unparsed[pick];
+		uart_rx_unparsed[pick] = 0;
+		uart_rx_gen[pick]++;
+	}
+	uart_rx_driver |= BIT(pick);
+	uart_rx_next = (pick + 1) % UART_RX_BUF_COUNT;
+	irq_unlock(key);
+	return pick;
+}
+
+static void uart_rx_give_back(uint8_t i)
+{
+	unsigned int key = irq_lock();
+
+	uart_rx_driver &= ~BIT(i);
+	irq_unlock(key);
+}
+
+/* Start reception; retried from uart_work if the driver refuses */
+static int uart_rx_start(void)
+{
+	uint8_t i = uart_rx_take();
+	int err = uart_rx_enable(uart, uart_rx_bufs[i], UART_RX_BUF_LEN, UART_RX_IDLE_US);
+
+	if (err) {
+		uart_rx_give_back(i);
+		if (err != -EBUSY) {
+			k_work_reschedule(&uart_work, UART_WAIT_FOR_BUF_DELAY);
+		}
 	}
+	return err;
+}
+
+void uart_work_handler(struct k_work *item)
+{
+	ARG_UNUSED(item);
+	int err = uart_rx_start();
 
-	uart_rx_enable(uart, buf->data, sizeof(buf->data), UART_WAIT_FOR_RX);
+	if (err && err != -EBUSY) {
+		LOG_WRN("UART receive restart failed (err %d)", err);
+	}
 }
 
 bool uart_test_async_api(const struct device *dev)
@@ -90,6 +179,10 @@ void adv_work_handler(struct k_work *work)
 	}
 
 	LOG_INF("Advertising successfully started");
+#if ENERGY_ACCOUNTING_ENABLE
+	/* BT_LE_ADV_CONN_FAST_2: the controller advertises at the short end of the range */
+	energy_radio_set(ENERGY_RADIO_ADV, BT_GAP_ADV_FAST_INT_MIN_2 * 625u);
+#endif
 }
 
 void advertising_start(void)
@@ -110,6 +203,13 @@ void connected(struct bt_conn *conn, uint8_t err)
 	LOG_INF("Connected %s", addr);
 
 	current_conn = bt_conn_ref(conn);
+#if ENERGY_ACCOUNTING_ENABLE
+	struct bt_conn_info info;
+
+	if (bt_conn_get_info(conn, &info) == 0) {
+		energy_radio_set(ENERGY_RADIO_CONN, info.le.interval * 1250u);
+	}
+#endif
 
 	dk_set_led_on(CON_STATUS_LED);
 }
@@ -121,6 +221,9 @@ void disconnected(struct bt_conn *conn, uint8_t reason)
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	LOG_INF("Disconnected: %s, reason 0x%02x %s", addr, reason, bt_hci_err_to_str(reason));
+#if ENERGY_ACCOUNTING_ENABLE
+	energy_radio_set(ENERGY_RADIO_IDLE, 0);
+#endif
 
 	if (auth_conn) {
 		bt_conn_unref(auth_conn);
@@ -134,6 +237,15 @@ void disconnected(struct bt_conn *conn, uint8_t reason)
 	}
 }
 
+void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+	LOG_INF("Connection parameters: interval %u.%02u ms, latency %u, timeout %u ms",
+		interval * 125u / 100u, (interval * 125u) % 100u, latency, timeout * 10u);
+#if ENERGY_ACCOUNTING_ENABLE
+	energy_radio_set(ENERGY_RADIO_CONN, interval * 1250u);
+#endif
+}
+
 void recycled_cb(void)
 {
 	LOG_INF("Connection object available from previous conn. Disconnect is complete!");
@@ -292,23 +404,40 @@ void error(void)
 #endif /* CONFIG_BT */
 
 #if defined(CONFIG_BT)
+/* comms_workq: runs the queued NUS writes in order, under the command lock like UART frames */
+static void nus_rx_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+	struct nus_rx_msg msg;
+
+	while (k_msgq_get(&nus_rx_msgq, &msg, K_NO_WAIT) == 0) {
+		memcpy(ble_received_data, msg.data, msg.len);
+		ble_data_length = msg.len;
+		ble_data_ready = true;
+		process_received_data(&settings, ble_received_data, ble_data_length);
+	}
+}
+
+/* BT RX thread: commands take the command lock and some block, so they are only queued here */
 void bt_receive_cb(struct bt_conn *conn, const uint8_t *const data,
 			  uint16_t len)
 {
-    // Store the data
-    if (len <= BLE_DATA_BUFFER_SIZE) {
-        memcpy(ble_received_data, data, len);
-        ble_data_length = len;
-        ble_data_ready = true;
-    }
-
-    process_received_data(&settings, ble_received_data, ble_data_length);
-	int err;
+	struct nus_rx_msg msg = { .len = len };
 	char addr[BT_ADDR_LE_STR_LEN] = {0};
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, ARRAY_SIZE(addr));
+	LOG_INF("Received data from: %s: %u bytes", addr, len);
 
-	LOG_INF("Received data from: %s: %X", addr, ble_received_data);
+	if (len > BLE_DATA_BUFFER_SIZE) {
+		LOG_WRN("NUS write of %u bytes dropped (%u)", len, ++nus_rx_dropped);
+		return;
+	}
+	memcpy(msg.data, data, len);
+	if (k_msgq_put(&nus_rx_msgq, &msg, K_NO_WAIT)) {
+		LOG_WRN("NUS command queue full, write dropped (%u)", ++nus_rx_dropped);
+		return;
+	}
+	k_work_submit_to_queue(&comms_workq, &nus_rx_work);
 }
 #endif /* CONFIG_BT */
 
@@ -320,7 +449,6 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 	static size_t aborted_len;
 	struct uart_data_t *buf;
 	static uint8_t *aborted_buf;
-	static bool disable_req;
 
 	switch (evt->type) {
 	case UART_TX_DONE:
@@ -340,7 +468,7 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 					   data[0]);
 		}
 
-		k_free(buf);
+		k_mem_slab_free(&uart_tx_slab, buf);
 
 		buf = k_fifo_get(&fifo_uart_tx_data, K_NO_WAIT);
 		if (!buf) {
@@ -353,64 +481,47 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 
 		break;
 
-	case UART_RX_RDY:
-		LOG_DBG("UART_RX_RDY");
-		buf = CONTAINER_OF(evt->data.rx.buf, struct uart_data_t, data[0]);
-		buf->len += evt->data.rx.len;
-
-		if (disable_req) {
-			return;
-		}
-
-		if ((evt->data.rx.buf[buf->len - 1] == '\n') ||
-		    (evt->data.rx.buf[buf->len - 1] == '\r')) {
-			disable_req = true;
-			uart_rx_disable(uart);
+	case UART_RX_RDY: {
+		uint8_t i = (evt->data.rx.buf - uart_rx_bufs[0]) / UART_RX_BUF_LEN;
+		unsigned int key = irq_lock();
+		struct uart_rx_slice slice = {
+			.data = &evt->data.rx.buf[evt->data.rx.offset],
+			.len = evt->data.rx.len,
+			.buf = i,
+			.gen = uart_rx_gen[i],
+			.gap = uart_rx_lost,
+		};
+
+		if (k_msgq_put(&uart_rx_msgq, &slice, K_NO_WAIT) == 0) {
+			uart_rx_unparsed[i]++;
+			uart_rx_lost = false;
+		} else {
+			uart_rx_overruns++;
+			uart_rx_lost = true;
 		}
-
+		irq_unlock(key);
+		k_work_submit_to_queue(&comms_workq, &uart_rx_work);
 		break;
+	}
 
 	case UART_RX_DISABLED:
 		LOG_DBG("UART_RX_DISABLED");
-		disable_req = false;
-
-		buf = k_malloc(sizeof(*buf));
-		if (buf) {
-			buf->len = 0;
-		} else {
-			LOG_WRN("Not able to allocate UART receive buffer");
-			k_work_reschedule(&uart_work, UART_WAIT_FOR_BUF_DELAY);
-			return;
-		}
-
-		uart_rx_enable(uart, buf->data, sizeof(buf->data),
-			       UART_WAIT_FOR_RX);
-
+		uart_rx_driver = 0;
+		(void)uart_rx_start();
 		break;
 
-	case UART_RX_BUF_REQUEST:
-		LOG_DBG("UART_RX_BUF_REQUEST");
-		buf = k_malloc(sizeof(*buf));
-		if (buf) {
-			buf->len = 0;
-			uart_rx_buf_rsp(uart, buf->data, sizeof(buf->data));
-		} else {
-			LOG_WRN("Not able to allocate UART receive buffer");
-		}
+	case UART_RX_BUF_REQUEST: {
+		uint8_t i = uart_rx_take();
 
+		if (uart_rx_buf_rsp(uart, uart_rx_bufs[i], UART_RX_BUF_LEN)) {
+			uart_rx_give_back(i);
+		}
 		break;
+	}
 
 	case UART_RX_BUF_RELEASED:
 		LOG_DBG("UART_RX_BUF_RELEASED");
-		buf = CONTAINER_OF(evt->data.rx_buf.buf, struct uart_data_t,
-				   data[0]);
-
-		if (buf->len > 0) {
-			k_fifo_put(&fifo_uart_rx_data, buf);
-		} else {
-			k_free(buf);
-		}
-
+		uart_rx_give_back((evt->data.rx_buf.buf - uart_rx_bufs[0]) / UART_RX_BUF_LEN);
 		break;
 
 	case UART_TX_ABORTED:
@@ -437,57 +548,52 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 #if defined(CONFIG_BT)
 int uart_init(void)
 {
+	static bool prepared;
 	int err;
 	int pos;
-	struct uart_data_t *rx;
 	struct uart_data_t *tx;
 
-	if (!device_is_ready(uart)) {
-		return -ENODEV;
-	}
-
-	if (IS_ENABLED(CONFIG_USB_DEVICE_STACK)) {
-		err = usb_enable(NULL);
-		if (err && (err != -EALREADY)) {
-			LOG_ERR("Failed to enable USB");
-			return err;
+	if (!prepared) {
+		if (!device_is_ready(uart)) {
+			return -ENODEV;
 		}
-	}
-
-	rx = k_malloc(sizeof(*rx));
-	if (rx) {
-		rx->len = 0;
-	} else {
-		return -ENOMEM;
-	}
 
-	k_work_init_delayable(&uart_work, uart_work_handler);
+		if (IS_ENABLED(CONFIG_USB_DEVICE_STACK)) {
+			err = usb_enable(NULL);
+			if (err && (err != -EALREADY)) {
+				LOG_ERR("Failed to enable USB");
+				return err;
+			}
+		}
 
+		k_work_init_delayable(&uart_work, uart_work_handler);
+		k_work_init(&uart_rx_work, uart_rx_work_handler);
 
-	if (IS_ENABLED(CONFIG_UART_ASYNC_ADAPTER) && !uart_test_async_api(uart)) {
-		/* Implement API adapter */
-		uart_async_adapter_init(async_adapter, uart);
-		uart = async_adapter;
-	}
+		if (IS_ENABLED(CONFIG_UART_ASYNC_ADAPTER) && !uart_test_async_api(uart)) {
+			/* Implement API adapter */
+			uart_async_adapter_init(async_adapter, uart);
+			uart = async_adapter;
+		}
 
-	err = uart_callback_set(uart, uart_cb, NULL);
-	if (err) {
-		k_free(rx);
-		LOG_ERR("Cannot initialize UART callback");
-		return err;
+		err = uart_callback_set(uart, uart_cb, NULL);
+		if (err) {
+			LOG_ERR("Cannot initialize UART callback");
+			return err;
+		}
+		prepared = true;
+		if (IS_ENABLED(CONFIG_UART_LINE_CTRL)) {
+			LOG_INF("Wait for DTR");
+		}
 	}
 
 	if (IS_ENABLED(CONFIG_UART_LINE_CTRL)) {
-		LOG_INF("Wait for DTR");
-		while (true) {
-			uint32_t dtr = 0;
+		uint32_t dtr = 0;
 
-			uart_line_ctrl_get(uart, UART_LINE_CTRL_DTR, &dtr);
-			if (dtr) {
-				break;
-			}
-			/* Give CPU resources to low priority threads. */
-			k_sleep(K_MSEC(100));
+		/* Polled by the caller rather than slept on, so comms_workq keeps running NUS
+		 * commands while no host has the port open */
+		uart_line_ctrl_get(uart, UART_LINE_CTRL_DTR, &dtr);
+		if (!dtr) {
+			return -EAGAIN;
 		}
 		LOG_INF("DTR set");
 		err = uart_line_ctrl_set(uart, UART_LINE_CTRL_DCD, 1);
@@ -500,85 +606,128 @@ int uart_init(void)
 		}
 	}
 
-	tx = k_malloc(sizeof(*tx));
-
-	if (tx) {
+	if (k_mem_slab_alloc(&uart_tx_slab, (void **)&tx, K_NO_WAIT) == 0) {
 		pos = snprintf(tx->data, sizeof(tx->data),
 			       "Starting Nordic UART service sample\r\n");
 
 		if ((pos < 0) || (pos >= sizeof(tx->data))) {
-			k_free(rx);
-			k_free(tx);
+			k_mem_slab_free(&uart_tx_slab, tx);
 			LOG_ERR("snprintf returned %d", pos);
 			return -ENOMEM;
 		}
 
 		tx->len = pos;
 	} else {
-		k_free(rx);
 		return -ENOMEM;
 	}
 
 	err = uart_tx(uart, tx->data, tx->len, SYS_FOREVER_MS);
 	if (err) {
-		k_free(rx);
-		k_free(tx);
+		k_mem_slab_free(&uart_tx_slab, tx);
 		LOG_ERR("Cannot display welcome message (err: %d)", err);
 		return err;
 	}
 
-	err = uart_rx_enable(uart, rx->data, sizeof(rx->data), UART_WAIT_FOR_RX);
+	err = uart_rx_start();
 	if (err) {
 		LOG_ERR("Cannot enable uart reception (err: %d)", err);
-		/* Free the rx buffer only because the tx buffer will be handled in the callback */
-		k_free(rx);
+		return err;
 	}
 
-	return err;
+	return 0;
 }
 #endif /* CONFIG_BT */
 
-void ble_write_thread(void)
-{
 #if defined(CONFIG_BT)
-	/* Don't go any further until BLE is initialized */
-	k_sem_take(&ble_init_ok, K_FOREVER);
-	struct uart_data_t nus_data = {
-		.len = 0,
-	};
-
-	for (;;) {
-		/* Wait indefinitely for data to be sent over bluetooth */
-		struct uart_data_t *buf = k_fifo_get(&fifo_uart_rx_data,
-						     K_FOREVER);
-
-		int plen = MIN(sizeof(nus_data.data) - nus_data.len, buf->len);
-		int loc = 0;
-
-		while (plen > 0) {
-			memcpy(&nus_data.data[nus_data.len], &buf->data[loc], plen);
-			nus_data.len += plen;
-			loc += plen;
-
-			if (nus_data.len >= sizeof(nus_data.data) ||
-			   (nus_data.data[nus_data.len - 1] == '\n') ||
-			   (nus_data.data[nus_data.len - 1] == '\r')) {
-				if (bt_nus_send(NULL, nus_data.data, nus_data.len)) {
-					LOG_WRN("Failed to send data over BLE connection");
-				}
-				nus_data.len = 0;
-			}
+int uart_ctrl_send(const uint8_t *data, uint16_t len)
+{
+	uint8_t hdr[2] = { CTRL_UART_SYNC, (uint8_t)len };
+	uint16_t total = sizeof(hdr) + len;
+	uint16_t pos = 0;
+
+	if (len == 0 || len > UINT8_MAX) {
+		return -EINVAL;
+	}
+	while (pos < total) {
+		struct uart_data_t *tx;
 
-			plen = MIN(sizeof(nus_data.data), buf->len - loc);
+		/* Waits for the UART to drain: a host pipelining commands is held to the reply rate */
+		if (k_mem_slab_alloc(&uart_tx_slab, (void **)&tx, K_MSEC(CTRL_UART_TIMEOUT_MS))) {
+			return -ENOMEM;
 		}
+		tx->len = 0;
+		while (tx->len < sizeof(tx->data) && pos < total) {
+			tx->data[tx->len++] = pos < sizeof(hdr) ? hdr[pos] : data[pos - sizeof(hdr)];
+			pos++;
+		}
+		if (uart_tx(uart, tx->data, tx->len, SYS_FOREVER_MS)) {
+			k_fifo_put(&fifo_uart_tx_data, tx);
+		}
+	}
+	return 0;
+}
+#endif /* CONFIG_BT */
+
+#if defined(CONFIG_BT)
+/* UART control frames (ctrl_frame.h) and the NUS bridge; comms_workq only */
+static void ctrl_rx_frame(void *ctx, const uint8_t *data, uint16_t len)
+{
+	ARG_UNUSED(ctx);
+	process_uart_command(data, len);
+}
 
-		k_free(buf);
+static void ctrl_rx_bridge(void *ctx, const uint8_t *data, uint16_t len)
+{
+	ARG_UNUSED(ctx);
+	if (current_conn && bt_nus_send(NULL, data, len)) {
+		LOG_WRN("Failed to send data over BLE connection");
 	}
-#else
-	/* BLE disabled: block thread so it never runs */
-	k_sem_take(&ble_init_ok, K_FOREVER);
-	for (;;) {
-		k_sleep(K_FOREVER);
+}
+
+static uint8_t ctrl_rx_nus[UART_BUF_SIZE];
+static ctrl_frame_rx ctrl_rx = {
+	.state = CTRL_IDLE,
+	.bridge = ctrl_rx_nus,
+	.bridge_size = sizeof(ctrl_rx_nus),
+	.on_frame = ctrl_rx_frame,
+	.on_bridge = ctrl_rx_bridge,
+};
+static uint32_t ctrl_rx_overruns;
+
+/* Submitted from the UART callback for every received span; drains whatever is queued */
+static void uart_rx_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+	struct uart_rx_slice slice;
+
+	if (uart_rx_overruns != ctrl_rx_overruns) {
+		ctrl_rx_overruns = uart_rx_overruns;
+		LOG_WRN("UART receive overrun (%u)", ctrl_rx_overruns);
 	}
-#endif
-}
\ No newline at end of file
+	while (k_msgq_get(&uart_rx_msgq, &slice, K_NO_WAIT) == 0) {
+		unsigned int key = irq_lock();
+		/* A buffer the parser is in is not reused under it */
+		bool stale = slice.gen != uart_rx_gen[slice.buf];
+
+		if (!stale) {
+			uart_rx_parsing = slice.buf;
+		}
+		irq_unlock(key);
+
+		/* Bytes are missing before this slice, or it was overwritten and is skipped */
+		if (slice.gap || stale) {
+			ctrl_frame_resync(&ctrl_rx);
+		}
+		if (stale) {
+			continue;
+		}
+		ctrl_frame_feed(&ctrl_rx, slice.data, slice.len, k_uptime_get_32());
+
+		/* Every byte of the slice is consumed: the driver may have its buffer back */
+		key = irq_lock();
+		uart_rx_unparsed[slice.buf]--;
+		uart_rx_parsing = -1;
+		irq_unlock(key);
+	}
+}
+#endif /* CONFIG_BT */
@@ -7,14 +7,12 @@
 #define LOG_MODULE_NAME peripheral_uart
 
 #if defined(CONFIG_BT)
-#define STACKSIZE CONFIG_BT_NUS_THREAD_STACK_SIZE
 #define PRIORITY 7
 #define DEVICE_NAME CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
 #define UART_BUF_SIZE CONFIG_BT_NUS_UART_BUFFER_SIZE
 #define UART_WAIT_FOR_RX CONFIG_BT_NUS_UART_RX_WAIT_TIME
 #else
-#define STACKSIZE 256
 #define PRIORITY 7
 #define DEVICE_NAME "Chronos"
 #define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
@@ -26,6 +24,23 @@
 
 #define UART_WAIT_FOR_BUF_DELAY K_MSEC(50)
 
+/*
+ * UART receive: a fixed set of static buffers the async driver fills by DMA in turn (a
+ * circular RX buffer split into UART_RX_BUF_COUNT parts). The idle-line timeout hands over what
+ * has arrived a few character times after the host stops sending, so a command is parsed as
+ * soon as its frame is complete. Received spans are parsed in place. The driver always gets a
+ * buffer: one already parsed if there is one, else the oldest, whose unparsed spans are then
+ * dropped and counted as overruns (the parser drops a frame cut by the loss). The buffer the
+ * parser is in is never handed back.
+ */
+#define UART_RX_BUF_COUNT 4
+#define UART_RX_BUF_LEN   256
+#define UART_RX_IDLE_US   1000
+/* NUS writes waiting for comms_workq; one more is dropped and counted */
+#define NUS_RX_QUEUE_LEN  4
+/* Transmit buffers (struct uart_data_t) queued for the UART; replies wait for a free one */
+#define UART_TX_BUF_COUNT 16
+
 #if defined(CONFIG_BT)
 #ifdef CONFIG_UART_ASYNC_ADAPTER
 UART_ASYNC_ADAPTER_INST_DEFINE(async_adapter);
@@ -44,8 +59,9 @@ UART_ASYNC_ADAPTER_INST_DEFINE(async_adapter);
 #define KEY_PASSKEY_REJECT 0
 #endif
 
-extern struct k_sem ble_init_ok;
 #if defined(CONFIG_BT)
+/* Communications work queue (main.c): BLE and UART start-up, then UART and NUS commands */
+extern struct k_work_q comms_workq;
 extern struct k_work_delayable uart_work;
 extern const struct device *uart;
 void uart_work_handler(struct k_work *item);
@@ -53,9 +69,11 @@ bool uart_test_async_api(const struct device *dev);
 void configure_gpio(void);
 void error(void);
 void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data);
+/** Bring up the NUS UART. -EAGAIN while line control waits for DTR: call again later. */
 int uart_init(void);
+/** Send one control reply on the UART as [CTRL_UART_SYNC][len][data]. */
+int uart_ctrl_send(const uint8_t *data, uint16_t len);
 #endif
-void ble_write_thread(void);
 
 #if defined(CONFIG_BT)
 extern struct k_work adv_work;
@@ -70,6 +88,7 @@ void adv_work_handler(struct k_work *work);
 void advertising_start(void);
 void connected(struct bt_conn *conn, uint8_t err);
 void disconnected(struct bt_conn *conn, uint8_t reason);
+void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout);
 void recycled_cb(void);
 void bt_receive_cb(struct bt_conn *conn, const uint8_t *const data, uint16_t len);
 
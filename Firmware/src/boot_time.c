@@ -0,0 +1,58 @@
+/*
+ * Boot-phase timestamps. Each stage stores the kernel cycle counter once, converted to
+ * microseconds since kernel start, so the boot-to-stimulation budget can be checked after
+ * any reset (console at the end of comms bring-up, or over BLE with CMD_BOOT_PHASES).
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include "boot_time.h"
+
+static uint32_t phase_us[BOOT_PHASE_COUNT];
+static atomic_t phase_seen;
+
+static const char *const phase_name[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_MAIN] = "main",
+    [BOOT_PHASE_CLOCK] = "clock/pins/spi",
+    [BOOT_PHASE_PLAN] = "stim plan",
+    [BOOT_PHASE_STIM_ARMED] = "stim armed",
+    [BOOT_PHASE_FIRST_PULSE] = "first pulse",
+    [BOOT_PHASE_BT_READY] = "bt ready",
+    [BOOT_PHASE_ADV] = "advertising",
+    [BOOT_PHASE_UART_READY] = "uart ready",
+};
+
+void boot_mark(boot_phase phase)
+{
+    if (phase >= BOOT_PHASE_COUNT || atomic_test_bit(&phase_seen, phase)) {
+        return;
+    }
+    phase_us[phase] = k_cyc_to_us_floor32(k_cycle_get_32());
+    atomic_set_bit(&phase_seen, phase);
+}
+
+uint32_t boot_phase_us(boot_phase phase)
+{
+    if (phase >= BOOT_PHASE_COUNT || !atomic_test_bit(&phase_seen, phase)) {
+        return 0;
+    }
+    return phase_us[phase];
+}
+
+bool boot_within_budget(void)
+{
+    return atomic_test_bit(&phase_seen, BOOT_PHASE_FIRST_PULSE) &&
+           phase_us[BOOT_PHASE_FIRST_PULSE] <= BOOT_STIM_BUDGET_US;
+}
+
+void boot_report(void)
+{
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        if (atomic_test_bit(&phase_seen, i)) {
+            printf("Boot %-14s %8lu us\n", phase_name[i], phase_us[i]);
+        } else {
+            printf("Boot %-14s  pending\n", phase_name[i]);
+        }
+    }
+    printf("Boot-to-stimulation %s budget of %u us\n",
+           boot_within_budget() ? "within" : "OVER", BOOT_STIM_BUDGET_US);
+}
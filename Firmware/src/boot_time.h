@@ -0,0 +1,37 @@
+#ifndef BOOT_TIME_H
+#define BOOT_TIME_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Boot-to-stimulation budget: phase 1 of the first pulse must start within this time of
+ * kernel start (default plan: first pulse is one period after the timer is armed). */
+#define BOOT_STIM_BUDGET_US 50000u
+
+/* Boot stages in the order they normally complete. Stimulation is armed before any
+ * communication subsystem is started; the COMMS stages run later on the comms work queue. */
+typedef enum {
+    BOOT_PHASE_MAIN = 0,        // main() entered
+    BOOT_PHASE_CLOCK,           // HFCLK running, pins and SPI configured
+    BOOT_PHASE_PLAN,            // stim plan restored (or defaults chosen)
+    BOOT_PHASE_STIM_ARMED,      // period timer / RTC / trigger armed
+    BOOT_PHASE_FIRST_PULSE,     // phase 1 onset of the first pulse
+    BOOT_PHASE_BT_READY,        // bt_enable() returned, settings loaded
+    BOOT_PHASE_ADV,             // NUS registered, advertising started
+    BOOT_PHASE_UART_READY,      // USB/UART bridge up (after DTR if line control is enabled)
+    BOOT_PHASE_COUNT
+} boot_phase;
+
+/** Record the current time for a stage. The first record of each stage wins; ISR safe. */
+void boot_mark(boot_phase phase);
+
+/** Time of a stage in us since kernel start, or 0 if it has not been reached. */
+uint32_t boot_phase_us(boot_phase phase);
+
+/** True once the first pulse is recorded and it started within BOOT_STIM_BUDGET_US. */
+bool boot_within_budget(void);
+
+/** Print the stage table and the budget verdict. */
+void boot_report(void);
+
+#endif /* BOOT_TIME_H */
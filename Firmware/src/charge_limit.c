@@ -0,0 +1,316 @@
+/*
+ * Charge safety limiter. All of the arithmetic (DAC code to current, charge per phase, how
+ * many pulses of a plan the counted span holds) happens when a plan is committed, in integer
+ * pC. The pulse path only adds the committed charge per phase to a ring of CHARGE_SLOTS + 1
+ * slots, each 1/CHARGE_SLOTS s, and compares their sum with the limit. Any one-second span
+ * ending at a pulse lies inside those slots, so no one-second span delivers more than the
+ * limit. The ring is charge, not pulses, and a commit leaves it alone: a new plan starts with
+ * what the previous one delivered still counted.
+ */
+#include <zephyr/kernel.h>
+#include <nrfx_timer.h>
+#include <string.h>
+#include "charge_limit.h"
+#include "timer.h"
+#include "trigger.h"
+#include "spi.h"
+#include "stim_pins.h"
+#include "deadline.h"
+#include "session_log.h"
+#include "sync.h"
+#include "config.h"
+
+#if CHARGE_LIMIT_ACTIVE
+
+BUILD_ASSERT(CONFIG_DAC_FULL_SCALE_UA > 0 && CHARGE_LIMIT_PHASE_PC > 0 && CHARGE_LIMIT_PER_S_PC > 0,
+             "charge limits must be non-zero");
+BUILD_ASSERT(CHARGE_PHASE_PC(CONFIG_STIM_AMPLITUDE, CONFIG_PULSE_WIDTH_US) <= CHARGE_LIMIT_PHASE_PC,
+             "CONFIG_STIM_* defaults exceed the charge-per-phase limit");
+BUILD_ASSERT(CHARGE_PHASE_PC(CONFIG_STIM_AMPLITUDE, CONFIG_PULSE_WIDTH_US) *
+             CHARGE_SPAN_PULSES(CONFIG_STIM_RATE_MHZ ? CONFIG_STIM_RATE_MHZ : CONFIG_STIM_FREQUENCY_HZ * 1000u) <=
+             CHARGE_LIMIT_PER_S_PC, "CONFIG_STIM_* defaults exceed the charge-per-second limit");
+
+BUILD_ASSERT(CHARGE_LIMIT_PER_S_PC + CHARGE_LIMIT_PHASE_PC <= UINT32_MAX,
+             "a charge slot is 32 bits: CONFIG_LIMIT_CHARGE_PER_S_UC too large");
+
+/* Cap on the reported pulse budget; far above any rate the engines run at (5 kHz) */
+#define CHARGE_BUDGET_MAX (1u << 20)
+#define CHARGE_RING       (CHARGE_SLOTS + 1u)
+
+typedef struct {
+    bool stopped;
+    uint16_t amplitude;         // committed plan, for the fault record
+    uint16_t pulse_width_us;
+    uint32_t rate_mhz;
+    uint32_t phase_charge_pc;
+    uint32_t budget;
+    uint16_t prev_amplitude;    // plan before this one, accepted until the new word is sent
+    bool handover;
+} limiter_state;
+
+/* Charge delivered, per slot; kept across commits and reverts */
+typedef struct {
+    uint32_t slot_cyc;          // k_cycle_get_32() cycles per slot
+    uint32_t slot_start;        // start of the current slot
+    uint8_t slot;               // current slot in pc[]
+    uint32_t pc[CHARGE_RING];
+    uint32_t total_pc;          // sum of pc[]
+} charge_window;
+
+static limiter_state guard;
+static limiter_state guard_before;  // for charge_limit_revert()
+static charge_window window;
+static bool committed;
+static bool committed_before;
+
+static uint32_t faults;
+static uint32_t rejected;
+static charge_fault_record last_fault;
+static struct k_work fault_log_work;
+#if DEADLINE_ACTIVE
+static struct k_timer feed_timer;
+#endif
+static bool initialized;
+
+static void fault_log_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    charge_fault_record r;
+    unsigned int key = irq_lock();
+
+    r = last_fault;
+    irq_unlock(key);
+    printf("Charge limit: %s (reason %u, %lu over limit %lu), amplitude 0x%04X %u us %lu mHz\n",
+           r.stopped ? "SAFE STOP" : "plan rejected", r.reason, r.value, r.limit,
+           r.amplitude, r.pulse_width_us, r.rate_mhz);
+#if SESSION_LOG_ACTIVE
+    session_log_fault(r.stopped ? SLOG_FAULT_CHARGE_STOP : SLOG_FAULT_CHARGE_REJECT, r.reason, r.value, r.limit);
+#endif
+}
+
+#if DEADLINE_ACTIVE
+/* A deliberate stop is not a stalled engine: keep the pulse watchdog fed meanwhile */
+static void feed_timer_handler(struct k_timer *timer)
+{
+    ARG_UNUSED(timer);
+    deadline_feed();
+}
+#endif
+
+static void limiter_init(void)
+{
+    if (initialized) {
+        return;
+    }
+    k_work_init(&fault_log_work, fault_log_work_handler);
+#if DEADLINE_ACTIVE
+    k_timer_init(&feed_timer, feed_timer_handler, NULL);
+#endif
+    window.slot_cyc = sys_clock_hw_cycles_per_sec() / CHARGE_SLOTS;
+    window.slot_start = k_cycle_get_32();
+    initialized = true;
+}
+
+static void fault_record(charge_fault reason, bool stopped, uint16_t amplitude,
+                         uint16_t pulse_width_us, uint32_t rate_mhz, uint8_t channel,
+                         uint64_t value, uint64_t limit)
+{
+    last_fault.reason = reason;
+    last_fault.channel = channel;
+    last_fault.stopped = stopped;
+    last_fault.amplitude = amplitude;
+    last_fault.pulse_width_us = pulse_width_us;
+    last_fault.rate_mhz = rate_mhz;
+    last_fault.value = (uint32_t)MIN(value, UINT32_MAX);
+    last_fault.limit = (uint32_t)MIN(limit, UINT32_MAX);
+    last_fault.uptime_ms = k_uptime_get_32();
+    k_work_submit(&fault_log_work);
+}
+
+/* Register writes and task triggers only: runs from the pulse ISR */
+static void safe_stop(void)
+{
+#if TRIGGER_MODE
+    trigger_abort();
+#else
+    /* BLE engine: no more compares. RTC engine: the caller skips the shot and the re-arm. */
+    nrf_timer_task_trigger(timer_stim_instance()->p_reg, NRF_TIMER_TASK_STOP);
+#endif
+    stim_pins_safe();
+#if SYNC_OUT_ENABLE
+    /* The onset link set it; the COMPARE1 that clears it will not come */
+    sync_out_abort();
+#endif
+#if DEADLINE_ACTIVE
+    deadline_resync();
+#endif
+}
+
+int charge_limit_check(uint16_t amplitude, uint16_t pulse_width_us, uint32_t rate_mhz, uint8_t channel)
+{
+    uint32_t ua = CHARGE_AMPLITUDE_UA(amplitude);
+    uint64_t q = CHARGE_PHASE_PC(amplitude, pulse_width_us);
+    charge_fault reason = CHARGE_FAULT_NONE;
+    uint64_t value = 0;
+    uint64_t limit = 0;
+
+    limiter_init();
+    if (ua > CONFIG_LIMIT_AMPLITUDE_UA) {
+        reason = CHARGE_FAULT_AMPLITUDE;
+        value = ua;
+        limit = CONFIG_LIMIT_AMPLITUDE_UA;
+    } else if (pulse_width_us > CONFIG_LIMIT_PULSE_WIDTH_US) {
+        reason = CHARGE_FAULT_PULSE_WIDTH;
+        value = pulse_width_us;
+        limit = CONFIG_LIMIT_PULSE_WIDTH_US;
+    } else if (q > CHARGE_LIMIT_PHASE_PC) {
+        reason = CHARGE_FAULT_PHASE_CHARGE;
+        value = q;
+        limit = CHARGE_LIMIT_PHASE_PC;
+    } else if (q * CHARGE_SPAN_PULSES(rate_mhz) > CHARGE_LIMIT_PER_S_PC) {
+        /* Also a single pulse over the window limit, however slow the plan */
+        reason = CHARGE_FAULT_CHARGE_RATE;
+        value = q * CHARGE_SPAN_PULSES(rate_mhz);
+        limit = CHARGE_LIMIT_PER_S_PC;
+    }
+    if (reason == CHARGE_FAULT_NONE) {
+        return 0;
+    }
+
+    unsigned int key = irq_lock();
+
+    rejected++;
+    fault_record(reason, false, amplitude, pulse_width_us, rate_mhz, channel, value, limit);
+    irq_unlock(key);
+    return -EPERM;
+}
+
+int charge_limit_commit(uint16_t amplitude, uint16_t pulse_width_us, uint32_t rate_mhz)
+{
+    int err = charge_limit_check(amplitude, pulse_width_us, rate_mhz, 0);
+
+    if (err) {
+        return err;
+    }
+
+    uint32_t q = (uint32_t)CHARGE_PHASE_PC(amplitude, pulse_width_us);
+    uint32_t budget = q ? (uint32_t)MIN(CHARGE_LIMIT_PER_S_PC / q, CHARGE_BUDGET_MAX) : CHARGE_BUDGET_MAX;
+    unsigned int key = irq_lock();
+
+    guard_before = guard;
+    committed_before = committed;
+    guard.prev_amplitude = guard.amplitude;
+    guard.handover = committed;
+    guard.amplitude = amplitude;
+    guard.pulse_width_us = pulse_width_us;
+    guard.rate_mhz = rate_mhz;
+    guard.phase_charge_pc = q;
+    guard.budget = budget;
+    guard.stopped = false;
+    /* With the plan, so no pulse sees the one without the other */
+    dac_words_set(amplitude);
+    committed = true;
+    irq_unlock(key);
+#if DEADLINE_ACTIVE
+    k_timer_stop(&feed_timer);
+#endif
+    return 0;
+}
+
+void charge_limit_revert(void)
+{
+    unsigned int key = irq_lock();
+    uint16_t reverted = guard.amplitude;
+
+    if (committed_before) {
+        guard = guard_before;
+        /* A pulse since the commit may have latched the reverted word */
+        guard.prev_amplitude = reverted;
+        guard.handover = true;
+        dac_words_set(guard.amplitude);
+    } else {
+        guard.stopped = true;
+    }
+    committed = committed_before;
+    committed_before = false;
+    bool stopped = guard.stopped;
+    irq_unlock(key);
+#if DEADLINE_ACTIVE
+    if (stopped) {
+        k_timer_start(&feed_timer, K_MSEC(DEADLINE_WDT_MS / 4), K_MSEC(DEADLINE_WDT_MS / 4));
+    }
+#else
+    ARG_UNUSED(stopped);
+#endif
+}
+
+/* ISR: stop the engine for good (until the next commit) and record why */
+static bool run_fault(charge_fault reason, uint64_t value, uint64_t limit)
+{
+    guard.stopped = true;
+    safe_stop();
+    faults++;
+    fault_record(reason, true, guard.amplitude, guard.pulse_width_us, guard.rate_mhz, 0, value, limit);
+#if DEADLINE_ACTIVE
+    k_timer_start(&feed_timer, K_MSEC(DEADLINE_WDT_MS / 4), K_MSEC(DEADLINE_WDT_MS / 4));
+#endif
+    return false;
+}
+
+bool charge_limit_pulse_ok(uint16_t dac_code)
+{
+    uint32_t elapsed = k_cycle_get_32() - window.slot_start;
+
+    if (guard.stopped) {
+        safe_stop();
+        return false;
+    }
+    if (dac_code == guard.amplitude) {
+        guard.handover = false;
+    } else if (!guard.handover || dac_code != guard.prev_amplitude) {
+        return run_fault(CHARGE_FAULT_DAC_WORD, dac_code, guard.amplitude);
+    }
+    if (elapsed >= window.slot_cyc) {
+        uint32_t n = elapsed / window.slot_cyc;
+
+        window.slot_start += n * window.slot_cyc;
+        /* Slots the pulse skipped over leave the ring; at most the whole ring */
+        for (n = MIN(n, CHARGE_RING); n > 0; n--) {
+            window.slot = (window.slot + 1u) % CHARGE_RING;
+            window.total_pc -= window.pc[window.slot];
+            window.pc[window.slot] = 0;
+        }
+    }
+    if (window.total_pc + guard.phase_charge_pc <= CHARGE_LIMIT_PER_S_PC) {
+        window.pc[window.slot] += guard.phase_charge_pc;
+        window.total_pc += guard.phase_charge_pc;
+        return true;
+    }
+    return run_fault(CHARGE_FAULT_WINDOW, (uint64_t)window.total_pc + guard.phase_charge_pc,
+                     CHARGE_LIMIT_PER_S_PC);
+}
+
+void charge_limit_clear(void)
+{
+    unsigned int key = irq_lock();
+
+    faults = 0;
+    rejected = 0;
+    memset(&last_fault, 0, sizeof(last_fault));
+    irq_unlock(key);
+}
+
+void get_charge_limit_stats(charge_limit_stats *stats)
+{
+    unsigned int key = irq_lock();
+
+    stats->stopped = guard.stopped;
+    stats->faults = faults;
+    stats->rejected = rejected;
+    stats->phase_charge_pc = guard.phase_charge_pc;
+    stats->pulses_per_s_max = guard.budget;
+    stats->last = last_fault;
+    irq_unlock(key);
+}
+
+#endif /* CHARGE_LIMIT_ACTIVE */
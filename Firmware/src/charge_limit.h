@@ -0,0 +1,120 @@
+#ifndef CHARGE_LIMIT_H
+#define CHARGE_LIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+#if CHARGE_LIMIT_ENABLE
+#define CHARGE_LIMIT_ACTIVE 1
+#else
+#define CHARGE_LIMIT_ACTIVE 0
+#endif
+
+/*
+ * Stimulation safety envelope. A plan (amplitude, pulse width, rate) is checked against the
+ * CONFIG_LIMIT_* values when it is committed, before any of it reaches the engine. The pulse
+ * path then counts the charge each pulse delivers (charge_limit_pulse_ok), which catches
+ * rates the commit could not see: stochastic intervals, trigger edges from outside, PLL
+ * corrections.
+ *
+ * What holds: no one-second span delivers more than CONFIG_LIMIT_CHARGE_PER_S_UC, across
+ * plan changes too. The pulse path sums the charge of the current 1/CHARGE_SLOTS s slot and
+ * the CHARGE_SLOTS slots before it and stops the engine before a pulse would take the sum
+ * over the limit. That span is up to (CHARGE_SLOTS + 1) / CHARGE_SLOTS s long, so a commit
+ * refuses a plan whose own steady rate would fill it (CHARGE_SPAN_PULSES): a plan is
+ * accepted up to about 97% of the limit, not 100%. The app-core engines also check that the DAC
+ * word each pulse carries is the committed amplitude, so the envelope is checked on what is
+ * actually sent.
+ *
+ * Charge is counted per phase (the two phases are balanced). A DAC code's current is
+ * |code - 0x8000| / 0x8000 of CONFIG_DAC_FULL_SCALE_UA; 1 uA for 1 us is 1 pC.
+ *
+ * Exempt from the pulse path:
+ *  - the multichannel plan is fixed once compiled, so each channel is checked at
+ *    sched_set_channel and no run-time guard is needed there
+ *  - the FLPR sequencer (flpr_seq.h) runs exactly the committed plan and has no per-pulse
+ *    budget: its plans are checked at commit only, and the DAC words are checked by sampling
+ *    its last pulse once per CONFIG_FLPR_SEQ_WATCH_MS, not on every pulse
+ */
+#define CHARGE_DAC_MID 0x8000u
+#define CHARGE_DAC_MAG(code) ((code) >= CHARGE_DAC_MID ? (code) - CHARGE_DAC_MID : CHARGE_DAC_MID - (code))
+#define CHARGE_AMPLITUDE_UA(code) ((uint32_t)(((uint64_t)CHARGE_DAC_MAG(code) * CONFIG_DAC_FULL_SCALE_UA) / CHARGE_DAC_MID))
+#define CHARGE_PHASE_PC(code, pw_us) (((uint64_t)CHARGE_DAC_MAG(code) * CONFIG_DAC_FULL_SCALE_UA * (pw_us)) / CHARGE_DAC_MID)
+
+/* Per-phase charge limit from the density limit: uC/cm^2 * um^2 * 1e-8 cm^2/um^2 * 1e6 pC/uC */
+#define CHARGE_LIMIT_PHASE_PC ((uint64_t)CONFIG_LIMIT_CHARGE_DENSITY_UC_CM2 * CONFIG_ELECTRODE_AREA_UM2 / 100u)
+#define CHARGE_LIMIT_PER_S_PC ((uint64_t)CONFIG_LIMIT_CHARGE_PER_S_UC * 1000000u)
+
+/* The pulse path counts charge in slots of 1/CHARGE_SLOTS s */
+#define CHARGE_SLOTS 32u
+/* Most pulses a steady rate puts in the CHARGE_SLOTS + 1 slots the pulse path sums */
+#define CHARGE_SPAN_PULSES(rate_mhz) ((uint64_t)(rate_mhz) * (CHARGE_SLOTS + 1u) / (CHARGE_SLOTS * 1000u) + 1u)
+
+typedef enum {
+    CHARGE_FAULT_NONE = 0,
+    CHARGE_FAULT_AMPLITUDE = 1,     // amplitude above CONFIG_LIMIT_AMPLITUDE_UA (value/limit in uA)
+    CHARGE_FAULT_PULSE_WIDTH = 2,   // pulse width above CONFIG_LIMIT_PULSE_WIDTH_US (us)
+    CHARGE_FAULT_PHASE_CHARGE = 3,  // charge per phase above the density limit (pC)
+    CHARGE_FAULT_CHARGE_RATE = 4,   // the plan's own rate fills the counted span (pC in CHARGE_SPAN_PULSES pulses)
+    CHARGE_FAULT_WINDOW = 5,        // a pulse would take the counted span over the limit (pC)
+    CHARGE_FAULT_DAC_WORD = 6,      // pulse DAC word differs from the committed amplitude (value: word sent, limit: committed)
+} charge_fault;
+
+typedef struct {
+    uint8_t reason;             // charge_fault
+    uint8_t channel;            // multichannel channel, 0 otherwise
+    bool stopped;               // true: found while running, safe stop; false: plan rejected at commit
+    uint16_t amplitude;         // DAC code of the offending plan
+    uint16_t pulse_width_us;
+    uint32_t rate_mhz;
+    uint32_t value;             // what was measured, in the unit of the reason
+    uint32_t limit;
+    uint32_t uptime_ms;
+} charge_fault_record;
+
+typedef struct {
+    bool stopped;               // stimulation held in the safe state until the next commit
+    uint32_t faults;            // run-time limit hits (safe stops)
+    uint32_t rejected;          // plans refused at commit
+    uint32_t phase_charge_pc;   // committed plan
+    uint32_t pulses_per_s_max;  // pulses of the committed plan the charge-per-second limit holds
+    charge_fault_record last;   // reason CHARGE_FAULT_NONE: nothing recorded
+} charge_limit_stats;
+
+/**
+ * Check a plan against the envelope without applying anything. A violation is recorded
+ * (charge_limit_stats.last, rejected) and returned as -EPERM. Thread context.
+ */
+int charge_limit_check(uint16_t amplitude, uint16_t pulse_width_us, uint32_t rate_mhz, uint8_t channel);
+
+/**
+ * Check a single-channel plan and, if it passes, precompute the run-time pulse budget for it,
+ * set the engines' DAC words to its amplitude (dac_words_set, under the same lock) and leave
+ * a safe stop. Call before the rest of the plan reaches the engine; if the engine then
+ * refuses it, charge_limit_revert(). Returns 0 or -EPERM.
+ */
+int charge_limit_commit(uint16_t amplitude, uint16_t pulse_width_us, uint32_t rate_mhz);
+
+/**
+ * Undo the last charge_limit_commit(): the plan, DAC words and safe-stop state before it.
+ * Nothing committed before it: stays in the safe stop. Thread context.
+ */
+void charge_limit_revert(void);
+
+/**
+ * Pulse onset, ISR context, bounded time (at most CHARGE_SLOTS + 1 slots to retire). dac_code
+ * is the phase 1 word of this pulse as sent to DAC1. Returns false if this pulse must not be
+ * delivered: it would take the counted span over the charge-per-second limit or the word is not the committed amplitude (the engine is then stopped, the switches
+ * driven to the safe state and a fault recorded), or a safe stop is already in effect. Until
+ * the first pulse carrying a newly committed word, the previous plan's word is accepted too:
+ * a trigger-mode train may already hold it in DAC1.
+ */
+bool charge_limit_pulse_ok(uint16_t dac_code);
+
+/** Forget the last fault record and the counters; a safe stop stays until the next commit. */
+void charge_limit_clear(void);
+
+void get_charge_limit_stats(charge_limit_stats *stats);
+
+#endif /* CHARGE_LIMIT_H */
@@ -0,0 +1,263 @@
+/*
+ * Closed-loop signal path (cl_dsp.h). Per raw sample: one add. Per filter sample: two
+ * biquads with 64-bit accumulators and an envelope update. Per zero crossing (two a cycle):
+ * one division for the crossing time, the period update and at most one target. The only
+ * floating point is in cl_dsp_init.
+ */
+#include <math.h>
+#include <string.h>
+#include "cl_dsp.h"
+
+#define CDEG_CYCLE 36000
+#define CDEG_RISING 27000
+#define CDEG_FALLING 9000
+
+/* RBJ band-pass, 0 dB peak: zero phase at the centre frequency */
+static void biquad_design(cl_biquad *bq, double fs, double f0, double q)
+{
+    const double scale = (double)(1u << CL_DSP_COEF_Q);
+    double w0 = 2.0 * M_PI * f0 / fs;
+    double alpha = sin(w0) / (2.0 * q);
+    double a0 = 1.0 + alpha;
+
+    memset(bq, 0, sizeof(*bq));
+    bq->b0 = (int32_t)lround(alpha / a0 * scale);
+    bq->a1 = (int32_t)lround(-2.0 * cos(w0) / a0 * scale);
+    bq->a2 = (int32_t)lround((1.0 - alpha) / a0 * scale);
+}
+
+static inline int32_t biquad_run(cl_biquad *bq, int32_t x)
+{
+    int64_t acc = (int64_t)bq->b0 * (x - bq->x2) - (int64_t)bq->a1 * bq->y1 - (int64_t)bq->a2 * bq->y2;
+    /* Rounded, not floored: the poles' DC gain (~1/w0^2) would turn a floor's half-LSB bias
+     * into an offset of several percent of the band, and skew rising against falling crossings */
+    int32_t y = (int32_t)((acc + (1 << (CL_DSP_COEF_Q - 1))) >> CL_DSP_COEF_Q);
+
+    bq->x2 = bq->x1;
+    bq->x1 = x;
+    bq->y2 = bq->y1;
+    bq->y1 = y;
+    return y;
+}
+
+static uint32_t q8_from_us(uint32_t sample_hz, uint32_t us)
+{
+    return (uint32_t)(((uint64_t)us * sample_hz * 256u) / 1000000u);
+}
+
+int cl_dsp_init(cl_dsp *dsp, const cl_dsp_config *cfg)
+{
+    uint32_t fs_dhz = cfg->sample_hz * 10u / cfg->decimation;
+
+    if (cfg->decimation == 0 || cfg->band_lo_dhz == 0 || cfg->band_hi_dhz <= cfg->band_lo_dhz ||
+        cfg->band_hi_dhz >= fs_dhz / 2u || cfg->target_deg >= 360) {
+        return -1;
+    }
+
+    memset(dsp, 0, sizeof(*dsp));
+    dsp->cfg = *cfg;
+
+    double lo = cfg->band_lo_dhz / 10.0;
+    double hi = cfg->band_hi_dhz / 10.0;
+    double f0 = sqrt(lo * hi);
+
+    for (int i = 0; i < CL_DSP_SECTIONS; i++) {
+        biquad_design(&dsp->sec[i], fs_dhz / 10.0, f0, f0 / (hi - lo));
+    }
+
+    /* One cycle at the band edges, in raw samples Q8 */
+    dsp->period_min_q8 = (uint32_t)((uint64_t)cfg->sample_hz * 2560u / cfg->band_hi_dhz);
+    dsp->period_max_q8 = (uint32_t)((uint64_t)cfg->sample_hz * 2560u / cfg->band_lo_dhz);
+    dsp->refractory_q8 = q8_from_us(cfg->sample_hz, cfg->refractory_ms * 1000u);
+    dsp->min_lead_q8 = q8_from_us(cfg->sample_hz, cfg->min_lead_us);
+    dsp->target_cdeg = cfg->target_deg * 100;
+    return 0;
+}
+
+static void evaluate(cl_dsp *dsp, uint32_t rise_q8, uint32_t interval_q8)
+{
+    int32_t d = (int32_t)(dsp->fired_q8 - dsp->last_cross_q8[0]);
+
+    if ((int32_t)(dsp->fired_q8 - rise_q8) >= 0) {
+        return;                         // reached after this crossing: next cycle's
+    }
+    dsp->fired_valid = false;
+    if (d < 0) {
+        return;                         // before the previous rising crossing: no reference
+    }
+
+    int32_t realized = (CDEG_RISING + (int32_t)((int64_t)d * CDEG_CYCLE / interval_q8)) % CDEG_CYCLE;
+    int32_t err = realized - dsp->target_cdeg;
+
+    if (err >= CDEG_CYCLE / 2) {
+        err -= CDEG_CYCLE;
+    } else if (err < -CDEG_CYCLE / 2) {
+        err += CDEG_CYCLE;
+    }
+    uint32_t abs_err = (uint32_t)(err < 0 ? -err : err);
+
+    dsp->stats.evaluated++;
+    dsp->stats.err_sum_cdeg += err;
+    dsp->stats.abs_err_sum_cdeg += abs_err;
+    if (abs_err > dsp->stats.abs_err_max_cdeg) {
+        dsp->stats.abs_err_max_cdeg = abs_err;
+    }
+}
+
+static cl_decision_kind target(cl_dsp *dsp, uint32_t cross_q8, int32_t phase_cdeg,
+                               uint32_t block_end_q8, uint32_t *at_q8)
+{
+    uint32_t period = dsp->stats.period_q8;
+    int32_t delay_cdeg = (dsp->target_cdeg - phase_cdeg + CDEG_CYCLE) % CDEG_CYCLE;
+    uint32_t at = cross_q8 + (uint32_t)((uint64_t)period * (uint32_t)delay_cdeg / CDEG_CYCLE);
+
+    bool deferred = (int32_t)(at - block_end_q8) < (int32_t)dsp->min_lead_q8;
+
+    if (deferred) {
+        at += period;
+    }
+
+    if (dsp->pending) {
+        int32_t moved = (int32_t)(at - dsp->pending_q8);
+
+        if ((uint32_t)(moved < 0 ? -moved : moved) >= period / 2u) {
+            return CL_DECISION_NONE;    // a later cycle: the pending one stays
+        }
+        dsp->pending_q8 = at;
+        dsp->last_q8 = at;
+        dsp->stats.refreshed++;
+        dsp->stats.deferred += deferred;
+        *at_q8 = at;
+        return CL_DECISION_REFRESH;
+    }
+    if (dsp->have_last && (int32_t)(at - dsp->last_q8) < (int32_t)dsp->refractory_q8) {
+        return CL_DECISION_NONE;
+    }
+    dsp->pending = true;
+    dsp->pending_q8 = at;
+    dsp->have_last = true;
+    dsp->last_q8 = at;
+    dsp->stats.scheduled++;
+    dsp->stats.deferred += deferred;
+    *at_q8 = at;
+    return CL_DECISION_SCHEDULE;
+}
+
+/* One zero crossing at t, rising (dir 0) or falling (dir 1) */
+static cl_decision_kind crossing(cl_dsp *dsp, int dir, uint32_t t, uint32_t block_end_q8, uint32_t *at_q8)
+{
+    dsp->stats.crossings++;
+
+    if (dsp->cross_valid[dir]) {
+        uint32_t interval = t - dsp->last_cross_q8[dir];
+
+        if (interval >= dsp->period_min_q8 && interval <= dsp->period_max_q8) {
+            if (dir == 0 && dsp->fired_valid) {
+                evaluate(dsp, t, interval);
+            }
+            /* EMA over a few cycles: follows the slow drift of a rhythm, not single cycles */
+            dsp->stats.period_q8 = dsp->stats.period_q8
+                ? dsp->stats.period_q8 + (int32_t)(interval - dsp->stats.period_q8) / 4
+                : interval;
+            if (dsp->lock < UINT8_MAX) {
+                dsp->lock++;
+            }
+        } else {
+            dsp->stats.rejected++;
+            dsp->lock = 0;
+        }
+    }
+    dsp->last_cross_q8[dir] = t;
+    dsp->cross_valid[dir] = true;
+
+    /* Peak of a sine is pi/2 times its mean absolute value */
+    uint32_t peak = (uint32_t)(((uint64_t)dsp->env * 201u / 128u) >> CL_DSP_IN_SHIFT) / dsp->cfg.decimation;
+
+    dsp->stats.envelope = peak;
+    if (dsp->lock < CL_DSP_LOCK || peak < dsp->cfg.min_amplitude) {
+        dsp->stats.gated++;
+        return CL_DECISION_NONE;
+    }
+    return target(dsp, t, dir == 0 ? CDEG_RISING : CDEG_FALLING, block_end_q8, at_q8);
+}
+
+cl_decision cl_dsp_block(cl_dsp *dsp, const int16_t *samples, uint32_t count)
+{
+    const uint32_t step_q8 = (uint32_t)dsp->cfg.decimation << 8;
+    /* A filter sample stands for the middle of the raw samples it averages */
+    const uint32_t centre_q8 = (uint32_t)(dsp->cfg.decimation - 1u) << 7;
+    uint32_t block_end_q8 = dsp->next_q8 + (count << 8);
+    cl_decision out = { .kind = CL_DECISION_NONE };
+
+    if (!dsp->primed && count > 0) {
+        /* Start from a settled filter at the first sample's level: no step response */
+        int32_t x = ((int32_t)samples[0] * dsp->cfg.decimation) << CL_DSP_IN_SHIFT;
+
+        for (int i = 0; i < CL_DSP_SECTIONS; i++) {
+            dsp->sec[i].x1 = dsp->sec[i].x2 = x;
+            x = 0;
+        }
+        dsp->primed = true;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        dsp->acc += samples[i];
+        dsp->next_q8 += 256u;
+        if (++dsp->acc_n < dsp->cfg.decimation) {
+            continue;
+        }
+
+        uint32_t t = dsp->next_q8 - step_q8 + centre_q8;
+        int32_t y = dsp->acc << CL_DSP_IN_SHIFT;
+
+        dsp->acc = 0;
+        dsp->acc_n = 0;
+        for (int s = 0; s < CL_DSP_SECTIONS; s++) {
+            y = biquad_run(&dsp->sec[s], y);
+        }
+        dsp->env += ((y < 0 ? -y : y) - dsp->env) >> CL_DSP_ENV_SHIFT;
+
+        if (dsp->pending && (int32_t)(t - dsp->pending_q8) >= 0) {
+            dsp->pending = false;
+            dsp->fired_valid = true;
+            dsp->fired_q8 = dsp->pending_q8;
+        }
+
+        int dir = -1;
+        int32_t num = 0, den = 1;
+
+        if (dsp->y_prev < 0 && y >= 0) {
+            dir = 0;
+            num = -dsp->y_prev;
+            den = y - dsp->y_prev;
+        } else if (dsp->y_prev >= 0 && y < 0) {
+            dir = 1;
+            num = dsp->y_prev;
+            den = dsp->y_prev - y;
+        }
+        if (dir >= 0) {
+            uint32_t cross = dsp->t_prev_q8 + (uint32_t)((int64_t)num * step_q8 / den);
+            uint32_t at;
+            cl_decision_kind kind = crossing(dsp, dir, cross, block_end_q8, &at);
+
+            if (kind != CL_DECISION_NONE) {
+                out.kind = (out.kind == CL_DECISION_SCHEDULE) ? CL_DECISION_SCHEDULE : kind;
+                out.at_q8 = at;
+                out.crossing_q8 = cross;
+            }
+        }
+        dsp->y_prev = y;
+        dsp->t_prev_q8 = t;
+    }
+    return out;
+}
+
+void cl_dsp_cancel(cl_dsp *dsp)
+{
+    dsp->pending = false;
+}
+
+uint32_t cl_dsp_now(const cl_dsp *dsp)
+{
+    return dsp->next_q8;
+}
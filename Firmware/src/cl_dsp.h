@@ -0,0 +1,115 @@
+#ifndef CL_DSP_H
+#define CL_DSP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Closed-loop signal path: decimation, band-pass and phase estimator, in fixed point.
+ * Plain C with no kernel or driver dependencies, so the code closed_loop.c runs on the
+ * SAADC blocks is the code Tools/cl_replay.c runs on a recording on the host.
+ *
+ * Times are raw sample indices in Q8 (1/256 sample), modulo 2^32: sample i of the stream
+ * is at i << 8. Differences are taken as int32, so any two times compared must be within
+ * 2^23 samples (17 min at 8 kHz) of each other; the estimator only compares times a few
+ * cycles apart.
+ *
+ * Phase is that of a cosine at the band centre: 0 deg the positive peak, 90 the falling
+ * zero crossing, 180 the trough, 270 the rising zero crossing. The band-pass is two
+ * identical sections with zero phase at the centre frequency, so a crossing of the
+ * filtered signal is a crossing of the input there; off centre the filter's phase shift is
+ * part of the error the replay and the device report.
+ */
+
+#define CL_DSP_SECTIONS  2      // band-pass biquads in cascade
+#define CL_DSP_COEF_Q    28     // coefficient fraction bits (poles of a theta band at 2 kHz sit within 2^-10 of 1)
+#define CL_DSP_IN_SHIFT  8      // fraction bits carried through the filter (12-bit codes x decimation <= 16 fit)
+#define CL_DSP_ENV_SHIFT 8      // envelope EMA weight 1/2^n per filter sample
+#define CL_DSP_LOCK      2      // in-band intervals in a row before targets are handed out
+
+typedef struct {
+    uint32_t sample_hz;         // raw input rate
+    uint16_t decimation;        // raw samples averaged per filter sample
+    uint16_t band_lo_dhz;       // pass band, 0.1 Hz
+    uint16_t band_hi_dhz;
+    uint16_t target_deg;        // phase to stimulate at, 0-359
+    uint16_t min_amplitude;     // envelope gate, in input codes (peak of the band-passed signal)
+    uint16_t refractory_ms;     // shortest time between two stimulation targets
+    uint16_t min_lead_us;       // a target closer than this to the end of its block waits a cycle
+} cl_dsp_config;
+
+typedef struct {
+    uint32_t crossings;         // zero crossings of the filtered signal
+    uint32_t rejected;          // of which with an interval outside the band (noise, phase slips)
+    uint32_t gated;             // crossings not used for lack of amplitude or lock
+    uint32_t deferred;          // targets too close to their crossing, moved one cycle on
+    uint32_t scheduled;         // targets handed out (refreshes of a pending target not counted)
+    uint32_t refreshed;         // pending targets moved by a later crossing
+    uint32_t evaluated;         // targets whose phase was measured at the next rising crossing
+    int64_t err_sum_cdeg;       // phase error of evaluated targets, centidegrees, signed
+    uint64_t abs_err_sum_cdeg;
+    uint32_t abs_err_max_cdeg;
+    uint32_t period_q8;         // current cycle estimate, raw samples Q8 (0 until locked)
+    uint32_t envelope;          // amplitude of the band-passed signal, input codes (peak)
+} cl_dsp_stats;
+
+typedef enum {
+    CL_DECISION_NONE = 0,
+    CL_DECISION_SCHEDULE,       // new target
+    CL_DECISION_REFRESH,        // pending target moved
+} cl_decision_kind;
+
+typedef struct {
+    cl_decision_kind kind;
+    uint32_t at_q8;             // target time
+    uint32_t crossing_q8;       // crossing the target was predicted from
+} cl_decision;
+
+typedef struct {
+    int32_t b0, a1, a2;                 // Q CL_DSP_COEF_Q; b1 = 0, b2 = -b0
+    int32_t x1, x2, y1, y2;
+} cl_biquad;
+
+typedef struct {
+    cl_dsp_config cfg;
+    cl_biquad sec[CL_DSP_SECTIONS];
+    bool primed;
+    uint32_t next_q8;                   // time of the next raw sample
+    int32_t acc;                        // partial decimation sum
+    uint16_t acc_n;
+    int32_t y_prev;
+    uint32_t t_prev_q8;                 // time of y_prev
+    int32_t env;                        // mean |filtered|, decimation sum Q CL_DSP_IN_SHIFT
+    uint32_t last_cross_q8[2];          // rising, falling
+    bool cross_valid[2];
+    uint8_t lock;                       // consecutive in-band intervals
+    uint32_t period_min_q8, period_max_q8;
+    uint32_t refractory_q8, min_lead_q8;
+    int32_t target_cdeg;
+    bool pending;                       // a target not yet reached
+    uint32_t pending_q8;
+    bool fired_valid;                   // last reached target, not yet evaluated
+    uint32_t fired_q8;
+    bool have_last;                     // a target was handed out (refractory reference)
+    uint32_t last_q8;
+    cl_dsp_stats stats;
+} cl_dsp;
+
+/** Compute the filter and reset all state. Returns -1 for a band outside (0, sample_hz / decimation / 2). */
+int cl_dsp_init(cl_dsp *dsp, const cl_dsp_config *cfg);
+
+/**
+ * Run one block of raw samples. The first sample of the block is at the time following the
+ * previous block (0 for the first). Returns the last decision the block produced; a
+ * SCHEDULE or REFRESH replaces any earlier target. A target the stream has passed counts
+ * as delivered, at its time.
+ */
+cl_decision cl_dsp_block(cl_dsp *dsp, const int16_t *samples, uint32_t count);
+
+/** Forget the pending target (the caller could not arm it); it is not evaluated. */
+void cl_dsp_cancel(cl_dsp *dsp);
+
+/** Time of the next raw sample, Q8. */
+uint32_t cl_dsp_now(const cl_dsp *dsp);
+
+#endif /* CL_DSP_H */
@@ -0,0 +1,250 @@
+/*
+ * CPU clock policy. The hold count is the only shared state on the pulse path: the first
+ * hold switches up (BOOST), the last release switches down, and every hold/release pair
+ * adds its DWT delta to the counters of the policy in effect. Nothing here runs periodically.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/arch/arm/cortex_m/dwt.h>
+#include <string.h>
+#if defined(CONFIG_SOC_SERIES_NRF54LX)
+#include <hal/nrf_oscillators.h>
+#else
+#include <hal/nrf_clock.h>
+#endif
+#include "clock_policy.h"
+#include "config.h"
+
+#if CLOCK_POLICY_ACTIVE
+
+BUILD_ASSERT(CONFIG_CLOCK_POLICY < CLOCK_POLICY_COUNT, "CONFIG_CLOCK_POLICY: 0 high, 1 low, 2 boost");
+
+static clock_policy policy = CONFIG_CLOCK_POLICY;
+static uint32_t cur_mhz;
+static uint32_t holders;
+static uint32_t hold_start;         // DWT at the outermost hold
+
+/* Per policy; time and thread cycles of the policy in effect are added on read */
+static struct {
+    int64_t time_ms;
+    uint64_t thread_cycles;
+    uint64_t held_ns;
+    uint32_t switches;
+    uint32_t switch_max_ns;
+    struct {
+        uint32_t calls;
+        uint64_t sum_ns;
+        uint32_t max_ns;
+    } path[CLOCK_PATH_COUNT];
+} acc[CLOCK_POLICY_COUNT];
+
+static int64_t since_ms;            // k_uptime_get() when the policy in effect was entered
+static uint64_t thread_base;
+
+/* 32-bit only: no 64-bit division on the pulse path */
+static inline uint32_t cyc_ns(uint32_t cycles, uint32_t mhz)
+{
+    return (cycles / mhz) * 1000u + (cycles % mhz) * 1000u / mhz;
+}
+
+static uint64_t runtime_cycles(void)
+{
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+    k_thread_runtime_stats_t rt;
+
+    k_thread_runtime_stats_all_get(&rt);
+    return rt.total_cycles;
+#else
+    return 0;
+#endif
+}
+
+/* Interrupts locked by the caller */
+static void cpu_clock_set(uint32_t mhz)
+{
+    if (mhz == cur_mhz) {
+        return;
+    }
+
+    uint32_t t0 = z_arm_dwt_get_cycles();
+
+#if defined(CONFIG_SOC_SERIES_NRF54LX)
+    nrf_oscillators_pll_freq_t freq = (mhz == CLOCK_MHZ_HIGH) ? NRF_OSCILLATORS_PLL_FREQ_128M
+                                                              : NRF_OSCILLATORS_PLL_FREQ_64M;
+
+    nrf_oscillators_pll_freq_set(NRF_OSCILLATORS, freq);
+    /* The CPU runs at the new frequency once CURRENTFREQ reports it */
+    while ((NRF_OSCILLATORS->PLL.CURRENTFREQ & OSCILLATORS_PLL_CURRENTFREQ_CURRENTFREQ_Msk) != (uint32_t)freq) {
+        /* spin */
+    }
+#else
+    nrf_clock_hfclk_div_set(NRF_CLOCK_S, (mhz == CLOCK_MHZ_HIGH) ? NRF_CLOCK_HFCLK_DIV_1
+                                                                 : NRF_CLOCK_HFCLK_DIV_2);
+#endif
+    /* Cycles of both clocks counted at the slower one: an upper bound */
+    uint32_t ns = cyc_ns(z_arm_dwt_get_cycles() - t0, MIN(mhz, cur_mhz));
+
+    cur_mhz = mhz;
+    SystemCoreClock = mhz * 1000000u;
+    acc[policy].switches++;
+    if (ns > acc[policy].switch_max_ns) {
+        acc[policy].switch_max_ns = ns;
+    }
+}
+
+static uint32_t policy_mhz(clock_policy p)
+{
+    if (p == CLOCK_POLICY_HIGH || (p == CLOCK_POLICY_BOOST && holders != 0)) {
+        return CLOCK_MHZ_HIGH;
+    }
+    return CLOCK_MHZ_LOW;
+}
+
+int clock_policy_init(void)
+{
+    int err = z_arm_dwt_init();
+
+    if (err) {
+        printf("Clock policy: no DWT (%d)\n", err);
+        return err;
+    }
+    z_arm_dwt_init_cycle_counter();
+
+    uint64_t thread = runtime_cycles();
+    unsigned int key = irq_lock();
+
+    cur_mhz = SystemCoreClock / 1000000u;
+    since_ms = k_uptime_get();
+    thread_base = thread;
+    cpu_clock_set(policy_mhz(policy));
+    irq_unlock(key);
+    printf("Clock policy %u: CPU at %lu MHz\n", policy, cur_mhz);
+    return 0;
+}
+
+int clock_policy_set(clock_policy p)
+{
+    if (p >= CLOCK_POLICY_COUNT) {
+        return -EINVAL;
+    }
+
+    uint64_t thread = runtime_cycles();
+    unsigned int key = irq_lock();
+    int64_t now = k_uptime_get();
+
+    acc[policy].time_ms += now - since_ms;
+    acc[policy].thread_cycles += thread - thread_base;
+    since_ms = now;
+    thread_base = thread;
+    policy = p;
+    cpu_clock_set(policy_mhz(p));
+    irq_unlock(key);
+    return 0;
+}
+
+clock_policy clock_policy_get(void)
+{
+    return policy;
+}
+
+uint32_t clock_policy_mhz(void)
+{
+    return cur_mhz;
+}
+
+void clock_policy_hold(clock_hold *hold)
+{
+    unsigned int key = irq_lock();
+
+    hold->start = z_arm_dwt_get_cycles();
+    hold->mhz_before = (uint8_t)cur_mhz;
+    if (holders++ == 0) {
+        hold_start = hold->start;
+        if (policy == CLOCK_POLICY_BOOST) {
+            cpu_clock_set(CLOCK_MHZ_HIGH);
+        }
+    }
+    hold->switched = (cur_mhz != hold->mhz_before) ? z_arm_dwt_get_cycles() : hold->start;
+    irq_unlock(key);
+}
+
+void clock_policy_release(clock_path path, clock_hold *hold)
+{
+    unsigned int key = irq_lock();
+    uint32_t end = z_arm_dwt_get_cycles();
+    /* Switch up at the clock it started from, the work at the clock it ran at */
+    uint32_t ns = cyc_ns(hold->switched - hold->start, MIN(hold->mhz_before, cur_mhz)) +
+                  cyc_ns(end - hold->switched, cur_mhz);
+
+    acc[policy].path[path].calls++;
+    acc[policy].path[path].sum_ns += ns;
+    if (ns > acc[policy].path[path].max_ns) {
+        acc[policy].path[path].max_ns = ns;
+    }
+    if (--holders == 0) {
+        acc[policy].held_ns += cyc_ns(end - hold_start, cur_mhz);
+        if (policy == CLOCK_POLICY_BOOST) {
+            cpu_clock_set(CLOCK_MHZ_LOW);
+        }
+    }
+    irq_unlock(key);
+}
+
+void get_clock_policy_stats(clock_policy p, clock_policy_stats *stats)
+{
+    uint64_t thread = runtime_cycles();
+    unsigned int key = irq_lock();
+    int64_t time_ms = acc[p].time_ms;
+    uint64_t thread_cycles = acc[p].thread_cycles;
+
+    if (p == policy) {
+        time_ms += k_uptime_get() - since_ms;
+        thread_cycles += thread - thread_base;
+    }
+    uint64_t held_ns = acc[p].held_ns;
+    uint64_t edge_ns = acc[p].path[CLOCK_PATH_EDGE].sum_ns;
+
+    stats->switches = acc[p].switches;
+    stats->switch_max_ns = acc[p].switch_max_ns;
+    for (int i = 0; i < CLOCK_PATH_COUNT; i++) {
+        uint32_t calls = acc[p].path[i].calls;
+
+        stats->path[i].calls = calls;
+        stats->path[i].avg_ns = calls ? (uint32_t)(acc[p].path[i].sum_ns / calls) : 0;
+        stats->path[i].max_ns = acc[p].path[i].max_ns;
+    }
+    irq_unlock(key);
+
+    /* Busy time as energy.c counts it: threads plus stim ISRs (charged to idle by the kernel) */
+    uint64_t time_us = (uint64_t)time_ms * 1000u;
+    uint64_t busy_us = MIN(k_cyc_to_us_floor64(thread_cycles) + edge_ns / 1000u, time_us);
+    uint64_t high_us = 0;
+
+    if (p == CLOCK_POLICY_HIGH) {
+        high_us = busy_us;
+    } else if (p == CLOCK_POLICY_BOOST) {
+        high_us = MIN(held_ns / 1000u, busy_us);
+    }
+
+    /* Charge in uA*us */
+    uint64_t charge = high_us * CONFIG_CLOCK_UA_HIGH +
+                      (busy_us - high_us) * CONFIG_CLOCK_UA_LOW +
+                      (time_us - busy_us) * CONFIG_ENERGY_SLEEP_UA;
+
+    stats->time_ms = (uint32_t)time_ms;
+    stats->held_us = (uint32_t)MIN(held_ns / 1000u, UINT32_MAX);
+    stats->busy_ms = (uint32_t)(busy_us / 1000u);
+    stats->est_cpu_ua = time_us ? (uint32_t)(charge / time_us) : 0;
+}
+
+void clock_policy_reset(void)
+{
+    uint64_t thread = runtime_cycles();
+    unsigned int key = irq_lock();
+
+    memset(acc, 0, sizeof(acc));
+    since_ms = k_uptime_get();
+    thread_base = thread;
+    irq_unlock(key);
+}
+
+#endif /* CLOCK_POLICY_ACTIVE */
@@ -0,0 +1,103 @@
+#ifndef CLOCK_POLICY_H
+#define CLOCK_POLICY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Both application cores run from a 128 MHz clock with a /2 setting: HFCLKCTRL on the nRF5340,
+ * the PLL frequency on the nRF54L */
+#if CLOCK_POLICY_ENABLE && (defined(CONFIG_SOC_SERIES_NRF54LX) || defined(CONFIG_SOC_NRF5340_CPUAPP))
+#define CLOCK_POLICY_ACTIVE 1
+#else
+#define CLOCK_POLICY_ACTIVE 0
+#endif
+
+#define CLOCK_MHZ_HIGH 128u
+#define CLOCK_MHZ_LOW  64u
+
+/*
+ * CPU clock policy. The stimulation hot paths (timer_handler and rtc_handler, one call per
+ * pulse edge; a plan commit from the control channel) hold the clock while they run, and the
+ * policy decides what that means:
+ *  - HIGH: 128 MHz throughout, the clock the firmware was written at
+ *  - LOW: 64 MHz throughout
+ *  - BOOST: 64 MHz, raised to 128 MHz for as long as any hot path holds it. BLE/UART work,
+ *    the workqueues and idle run at 64 MHz; an edge pays for one switch up before its work
+ *    and one switch down after it.
+ *
+ * Each policy keeps its own counters, so the three can be run in turn on one plan and
+ * compared (chronos_ctl.py clock --compare): hot-path latency in ns from the DWT counts,
+ * switch up included, and a CPU current estimate from busy time at each clock weighted by
+ * CONFIG_CLOCK_UA_HIGH/LOW. Busy time is the edge path time plus thread time
+ * (CONFIG_SCHED_THREAD_USAGE_ALL; edges only without it).
+ *
+ * Loop-timed delays scale with the clock: SPI_CS_HOLD_DELAY_LOOPS holds CS twice as long at
+ * 64 MHz, and the isr_cycles.h budgets and the energy.h estimate convert cycles at the boot
+ * clock.
+ */
+typedef enum {
+    CLOCK_POLICY_HIGH = 0,
+    CLOCK_POLICY_LOW = 1,
+    CLOCK_POLICY_BOOST = 2,
+    CLOCK_POLICY_COUNT
+} clock_policy;
+
+typedef enum {
+    CLOCK_PATH_EDGE = 0,        // timer_handler / rtc_handler, one call
+    CLOCK_PATH_COMMIT,          // plan check and apply (settings, CMD_SET_RATE, CMD_CHANNEL_CONFIG)
+    CLOCK_PATH_COUNT
+} clock_path;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t avg_ns;
+    uint32_t max_ns;
+} clock_path_stats;
+
+typedef struct {
+    uint32_t time_ms;           // time this policy was in effect
+    uint32_t held_us;           // time a hot path held the clock (at 128 MHz under BOOST)
+    uint32_t busy_ms;           // CPU busy, as used by the estimate
+    uint32_t switches;          // clock changes
+    uint32_t switch_max_ns;     // longest clock change
+    uint32_t est_cpu_ua;        // estimated average CPU current over time_ms
+    clock_path_stats path[CLOCK_PATH_COUNT];
+} clock_policy_stats;
+
+/* Per-call state of a hot path; lives on the caller's stack */
+typedef struct {
+    uint32_t start;             // DWT at entry
+    uint32_t switched;          // DWT after the switch up (start if none)
+    uint8_t mhz_before;
+} clock_hold;
+
+#if CLOCK_POLICY_ACTIVE
+#define CLOCK_HOT_BEGIN(var)      clock_hold var; clock_policy_hold(&var)
+#define CLOCK_HOT_END(path, var)  clock_policy_release((path), &var)
+#else
+#define CLOCK_HOT_BEGIN(var)
+#define CLOCK_HOT_END(path, var)
+#endif
+
+/** Start the DWT counter and apply CONFIG_CLOCK_POLICY. Call before stimulation starts. */
+int clock_policy_init(void);
+
+/** Switch policy; counters of the old one stop, those of the new one continue. Thread context. */
+int clock_policy_set(clock_policy policy);
+
+clock_policy clock_policy_get(void);
+
+/** CPU clock now, MHz. */
+uint32_t clock_policy_mhz(void);
+
+/* Hot path entry and exit, through CLOCK_HOT_BEGIN/END. ISR safe, nest. */
+void clock_policy_hold(clock_hold *hold);
+void clock_policy_release(clock_path path, clock_hold *hold);
+
+void get_clock_policy_stats(clock_policy policy, clock_policy_stats *stats);
+
+/** Restart the counters of every policy from now. */
+void clock_policy_reset(void);
+
+#endif /* CLOCK_POLICY_H */
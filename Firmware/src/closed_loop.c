@@ -0,0 +1,321 @@
+/*
+ * Closed-loop stimulation (closed_loop.h). Everything between a sample and a pulse is
+ * hardware or the SAADC interrupt: EasyDMA fills a block, the handler runs the estimator
+ * and sets a measurement TIMER compare, and DPPI starts the pulse at the compare. Thread
+ * context only starts, stops and reconfigures.
+ */
+#include <nrfx_saadc.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_timer.h>
+#include <zephyr/kernel.h>
+#include <string.h>
+#include "closed_loop.h"
+#include "cl_dsp.h"
+#include "trigger.h"
+#include "timer.h"
+#include "isr_cycles.h"
+#include "config.h"
+
+#if CLOSED_LOOP_ACTIVE
+
+/* SAADC internal timer: CC = 16 MHz / rate, 80..2047 */
+#define SAADC_TIMER_HZ 16000000u
+
+BUILD_ASSERT(SAADC_TIMER_HZ % CONFIG_CL_SAMPLE_HZ == 0 &&
+             SAADC_TIMER_HZ / CONFIG_CL_SAMPLE_HZ >= 80 && SAADC_TIMER_HZ / CONFIG_CL_SAMPLE_HZ <= 2047,
+             "CONFIG_CL_SAMPLE_HZ: 16 MHz / rate must be a whole number in 80..2047");
+BUILD_ASSERT(CONFIG_CL_BLOCK_SAMPLES % CONFIG_CL_DECIMATION == 0,
+             "CONFIG_CL_BLOCK_SAMPLES must be a multiple of CONFIG_CL_DECIMATION");
+
+/* Least time between arming the compare and reaching it: the write and the DPPI connect */
+#define ARM_MARGIN_US 5u
+
+static nrf_saadc_value_t buffers[2][CONFIG_CL_BLOCK_SAMPLES];
+static uint8_t next_buffer;
+
+static closed_loop_params params = {
+    .target_deg = CONFIG_CL_TARGET_DEG,
+    .band_lo_dhz = CONFIG_CL_BAND_LO_DHZ,
+    .band_hi_dhz = CONFIG_CL_BAND_HI_DHZ,
+    .min_amplitude = CONFIG_CL_MIN_AMPLITUDE,
+};
+static cl_dsp dsp;
+static bool running;
+
+static uint32_t compare_eep;        // measurement TIMER COMPARE event, published on the start channel while armed
+static bool armed;
+static uint32_t ticks_per_sample;   // measurement TIMER ticks
+static uint32_t ticks_per_us;
+
+/* Time base: TIMER ticks at the last raw sample of the previous block */
+static bool anchored;
+static uint32_t last_tick;
+
+static uint32_t blocks, resyncs, missed, fired;
+static uint32_t latency_count, latency_max_ticks, over_latency;
+static uint64_t latency_sum_ticks;
+static uint64_t cycles_base;
+static int64_t start_ms;
+
+static void config_from_params(cl_dsp_config *cfg, const closed_loop_params *p)
+{
+    *cfg = (cl_dsp_config){
+        .sample_hz = CONFIG_CL_SAMPLE_HZ,
+        .decimation = CONFIG_CL_DECIMATION,
+        .band_lo_dhz = p->band_lo_dhz,
+        .band_hi_dhz = p->band_hi_dhz,
+        .target_deg = p->target_deg,
+        .min_amplitude = p->min_amplitude,
+        .refractory_ms = CONFIG_CL_REFRACTORY_MS,
+        .min_lead_us = CONFIG_CL_MIN_LEAD_US,
+    };
+}
+
+/* Estimator time (Q8 samples) to TIMER ticks, from the last sample of this block */
+static inline uint32_t to_ticks(uint32_t t_q8)
+{
+    int32_t d = (int32_t)(t_q8 - (cl_dsp_now(&dsp) - 256u));
+
+    return last_tick + (uint32_t)(((int64_t)d * ticks_per_sample) >> 8);
+}
+
+static void disarm(void)
+{
+    nrfx_gppi_event_endpoint_clear(trigger_start_channel(), compare_eep);
+    armed = false;
+}
+
+/* True if the armed compare has been reached; disarms it then */
+static bool armed_reached(nrfx_timer_t const *meas)
+{
+    if (!armed || !nrf_timer_event_check(meas->p_reg, nrf_timer_compare_event_get(CL_MEAS_CC))) {
+        return false;
+    }
+    disarm();
+    fired++;
+    return true;
+}
+
+static void block_process(const nrf_saadc_value_t *samples, uint16_t count)
+{
+    ISR_CYC_BEGIN(cyc);
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    uint32_t now = nrfx_timer_capture(meas, CL_MEAS_CC_NOW);
+    uint32_t expected = last_tick + count * ticks_per_sample;
+    int32_t lag = (int32_t)(now - expected);
+
+    /* The interrupt is never early: a negative lag means the anchor was taken late */
+    if (!anchored || lag < 0 || lag > (int32_t)(CONFIG_CL_BLOCK_SAMPLES * ticks_per_sample)) {
+        resyncs += (anchored && lag > 0);
+        anchored = true;
+        last_tick = now;
+    } else {
+        last_tick = expected;
+    }
+    blocks++;
+
+    (void)armed_reached(meas);
+
+    cl_decision d = cl_dsp_block(&dsp, samples, count);
+
+    if (d.kind != CL_DECISION_NONE) {
+        uint32_t at = to_ticks(d.at_q8);
+
+        if (armed) {
+            /* Moving an armed compare: take it off the channel first so it cannot fire twice.
+             * If it was reached meanwhile the pulse is out; the estimator loses that one. */
+            disarm();
+            if (nrf_timer_event_check(meas->p_reg, nrf_timer_compare_event_get(CL_MEAS_CC))) {
+                fired++;
+                cl_dsp_cancel(&dsp);
+                d.kind = CL_DECISION_NONE;
+            }
+        }
+        now = nrfx_timer_capture(meas, CL_MEAS_CC_NOW);
+        if (d.kind != CL_DECISION_NONE && (int32_t)(at - now) < (int32_t)(ARM_MARGIN_US * ticks_per_us)) {
+            missed++;
+            cl_dsp_cancel(&dsp);
+        } else if (d.kind != CL_DECISION_NONE) {
+            nrf_timer_cc_set(meas->p_reg, CL_MEAS_CC, at);
+            nrf_timer_event_clear(meas->p_reg, nrf_timer_compare_event_get(CL_MEAS_CC));
+            nrfx_gppi_event_endpoint_setup(trigger_start_channel(), compare_eep);
+            armed = true;
+
+            uint32_t latency = now - to_ticks(d.crossing_q8);
+
+            latency_count++;
+            latency_sum_ticks += latency;
+            if (latency > latency_max_ticks) {
+                latency_max_ticks = latency;
+            }
+            if (latency > CONFIG_CL_LATENCY_BUDGET_US * ticks_per_us) {
+                over_latency++;
+            }
+        }
+    }
+    ISR_CYC_END(ISR_PATH_CLOSED_LOOP, cyc);
+}
+
+static void saadc_handler(nrfx_saadc_evt_t const *p_event)
+{
+    switch (p_event->type) {
+        case NRFX_SAADC_EVT_BUF_REQ:
+            (void)nrfx_saadc_buffer_set(buffers[next_buffer], CONFIG_CL_BLOCK_SAMPLES);
+            next_buffer ^= 1;
+            break;
+
+        case NRFX_SAADC_EVT_DONE:
+            if (running) {
+                block_process(p_event->data.done.p_buffer, p_event->data.done.size);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+int closed_loop_init(void)
+{
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    nrfx_saadc_channel_t channel = NRFX_SAADC_DEFAULT_CHANNEL_SE(CL_SAADC_INPUT, 0);
+    nrfx_saadc_adv_config_t adv = NRFX_SAADC_DEFAULT_ADV_CONFIG;
+
+    ticks_per_us = nrfx_timer_us_to_ticks(meas, 1);
+    ticks_per_sample = nrfx_timer_us_to_ticks(meas, 1000u) * 1000u / CONFIG_CL_SAMPLE_HZ;
+    compare_eep = nrfx_timer_compare_event_address_get(meas, CL_MEAS_CC);
+
+    if (nrfx_saadc_init(NRFX_SAADC_DEFAULT_CONFIG_IRQ_PRIORITY) != NRFX_SUCCESS ||
+        nrfx_saadc_channel_config(&channel) != NRFX_SUCCESS) {
+        printf("Closed loop: SAADC init failed\n");
+        return -EIO;
+    }
+    /* Offset calibration once, before the internal timer starts sampling */
+    (void)nrfx_saadc_offset_calibrate(NULL);
+
+    adv.internal_timer_cc = SAADC_TIMER_HZ / CONFIG_CL_SAMPLE_HZ;
+    adv.start_on_end = true;
+    if (nrfx_saadc_advanced_mode_set(BIT(0), NRF_SAADC_RESOLUTION_12BIT, &adv, saadc_handler) != NRFX_SUCCESS) {
+        printf("Closed loop: SAADC mode failed\n");
+        return -EIO;
+    }
+
+    int err = closed_loop_start();
+
+    if (err == 0) {
+        printf("Closed loop: %u Hz input, %u.%u-%u.%u Hz band, target %u deg\n",
+               CONFIG_CL_SAMPLE_HZ, params.band_lo_dhz / 10, params.band_lo_dhz % 10,
+               params.band_hi_dhz / 10, params.band_hi_dhz % 10, params.target_deg);
+    }
+    return err;
+}
+
+int closed_loop_start(void)
+{
+    cl_dsp_config cfg;
+
+    if (running) {
+        return -EALREADY;
+    }
+    config_from_params(&cfg, &params);
+    if (cl_dsp_init(&dsp, &cfg) != 0) {
+        return -EINVAL;
+    }
+
+    anchored = false;
+    blocks = resyncs = missed = fired = 0;
+    latency_count = latency_max_ticks = over_latency = 0;
+    latency_sum_ticks = 0;
+    cycles_base = isr_cycles_total(ISR_PATH_CLOSED_LOOP);
+    start_ms = k_uptime_get();
+
+    next_buffer = 0;
+    if (nrfx_saadc_buffer_set(buffers[0], CONFIG_CL_BLOCK_SAMPLES) != NRFX_SUCCESS ||
+        nrfx_saadc_buffer_set(buffers[1], CONFIG_CL_BLOCK_SAMPLES) != NRFX_SUCCESS) {
+        return -EIO;
+    }
+    running = true;
+    if (nrfx_saadc_mode_trigger() != NRFX_SUCCESS) {
+        running = false;
+        return -EIO;
+    }
+    return 0;
+}
+
+void closed_loop_stop(void)
+{
+    if (!running) {
+        return;
+    }
+    nrfx_saadc_abort();
+
+    unsigned int key = irq_lock();
+
+    running = false;
+    if (armed) {
+        disarm();
+    }
+    irq_unlock(key);
+}
+
+int closed_loop_configure(const closed_loop_params *p)
+{
+    cl_dsp_config cfg;
+    static cl_dsp check;
+
+    config_from_params(&cfg, p);
+    if (cl_dsp_init(&check, &cfg) != 0) {
+        return -EINVAL;
+    }
+
+    bool was_running = running;
+
+    closed_loop_stop();
+    params = *p;
+    return was_running ? closed_loop_start() : 0;
+}
+
+void get_closed_loop_params(closed_loop_params *p)
+{
+    *p = params;
+}
+
+void get_closed_loop_stats(closed_loop_stats *stats)
+{
+    isr_cycle_stats cyc;
+    uint32_t cpu_mhz = SystemCoreClock / 1000000u;
+    unsigned int key = irq_lock();
+    cl_dsp_stats ds = dsp.stats;
+
+    stats->running = running;
+    stats->blocks = blocks;
+    stats->resyncs = resyncs;
+    stats->missed = missed;
+    stats->fired = fired;
+    stats->over_latency = over_latency;
+    stats->latency_avg_us = latency_count ? (uint32_t)(latency_sum_ticks / latency_count) / ticks_per_us : 0;
+    stats->latency_max_us = latency_max_ticks / ticks_per_us;
+    uint64_t cycles = isr_cycles_total(ISR_PATH_CLOSED_LOOP) - cycles_base;
+    int64_t elapsed_ms = k_uptime_get() - start_ms;
+    irq_unlock(key);
+
+    stats->crossings = ds.crossings;
+    stats->rejected = ds.rejected;
+    stats->gated = ds.gated;
+    stats->deferred = ds.deferred;
+    stats->scheduled = ds.scheduled;
+    stats->refreshed = ds.refreshed;
+    stats->evaluated = ds.evaluated;
+    stats->err_mean_cdeg = ds.evaluated ? (int32_t)(ds.err_sum_cdeg / (int32_t)ds.evaluated) : 0;
+    stats->abs_err_mean_cdeg = ds.evaluated ? (uint32_t)(ds.abs_err_sum_cdeg / ds.evaluated) : 0;
+    stats->abs_err_max_cdeg = ds.abs_err_max_cdeg;
+    stats->period_us = (uint32_t)(((uint64_t)ds.period_q8 * 1000000u / CONFIG_CL_SAMPLE_HZ) >> 8);
+    stats->amplitude = ds.envelope;
+
+    get_isr_cycle_stats(ISR_PATH_CLOSED_LOOP, &cyc);
+    stats->block_max_us = cyc.max_cycles / cpu_mhz;
+    stats->load_ppm = elapsed_ms > 0 ? (uint32_t)(cycles * 1000u / ((uint64_t)elapsed_ms * cpu_mhz)) : 0;
+}
+
+#endif /* CLOSED_LOOP_ACTIVE */
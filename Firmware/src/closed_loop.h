@@ -0,0 +1,96 @@
+#ifndef CLOSED_LOOP_H
+#define CLOSED_LOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Pulses are started the way a trigger edge starts them, so the trigger engine is the one used */
+#if CLOSED_LOOP_ENABLE && TRIGGER_MODE
+#define CLOSED_LOOP_ACTIVE 1
+#else
+#define CLOSED_LOOP_ACTIVE 0
+#endif
+
+/* Analog input, single-ended at the default gain and reference: AIN1, P0.05 on the nRF5340,
+ * P1.05 on the nRF54L15 (AIN0 is TRIGGER_PIN there) */
+#define CL_SAADC_INPUT NRFX_ANALOG_EXTERNAL_AIN1
+
+/* Measurement TIMER channels: the pulse compare (CC4 is RTC-mode only) and the software "now"
+ * capture sync.c also uses (a capture by either between the other's capture and read is
+ * still a valid, slightly later, now) */
+#define CL_MEAS_CC     NRF_TIMER_CC_CHANNEL4
+#define CL_MEAS_CC_NOW NRF_TIMER_CC_CHANNEL5
+
+/*
+ * Phase-locked closed-loop stimulation. SAADC samples the input at CONFIG_CL_SAMPLE_HZ from
+ * its own timer into two EasyDMA buffers of CONFIG_CL_BLOCK_SAMPLES; each full block runs
+ * the cl_dsp.h band-pass and phase estimator in the SAADC interrupt. At each zero crossing
+ * of the band the estimator predicts when the target phase comes next, and the handler
+ * arms a measurement TIMER compare at that time whose event is a second publisher on the
+ * trigger engine's start channel: the pulse starts in hardware, exactly at the compare,
+ * as from a trigger edge (train length, charge limiter and the end-of-train re-arm
+ * included). A later crossing of the same cycle moves the compare to a fresher estimate.
+ *
+ * Budgets, reported by get_closed_loop_stats:
+ *  - decision latency: the crossing sample to the compare armed, at most one block plus
+ *    the handler (0.5 ms at the defaults); over CONFIG_CL_LATENCY_BUDGET_US is counted
+ *  - CPU: the block handler is the ISR_PATH_CLOSED_LOOP path of isr_cycles.h, against
+ *    CONFIG_CYC_BUDGET_CL_US per block; its share of the CPU is reported in ppm
+ *  - phase accuracy: each delivered pulse's phase, measured against the cycle it fell in
+ *    at the next rising crossing
+ * The SAADC and the measurement TIMER run from the same HFCLK, so sample times are kept
+ * as a count of sample periods from the first block; a block the interrupt reaches more
+ * than a block late re-anchors the count to the TIMER (a resync).
+ *
+ * An edge on TRIGGER_PIN still starts a train; leave it unconnected (it is pulled down).
+ */
+typedef struct {
+    uint16_t target_deg;        // 0 peak, 90 falling zero crossing, 180 trough, 270 rising
+    uint16_t band_lo_dhz;       // pass band, 0.1 Hz
+    uint16_t band_hi_dhz;
+    uint16_t min_amplitude;     // SAADC codes, peak of the band
+} closed_loop_params;
+
+typedef struct {
+    bool running;
+    uint32_t blocks;
+    uint32_t resyncs;
+    uint32_t crossings;         // zero crossings of the band
+    uint32_t rejected;          // of which a cycle outside the band
+    uint32_t gated;             // crossings below the amplitude gate or before lock
+    uint32_t deferred;          // targets too close to their crossing, moved one cycle on
+    uint32_t scheduled;         // pulses armed
+    uint32_t refreshed;         // armed pulses moved by a later crossing
+    uint32_t missed;            // targets already too near to arm when the block was done
+    uint32_t fired;             // compares that started a pulse
+    uint32_t evaluated;         // pulses whose phase was measured
+    int32_t err_mean_cdeg;      // phase error, centidegrees
+    uint32_t abs_err_mean_cdeg;
+    uint32_t abs_err_max_cdeg;
+    uint32_t period_us;         // cycle estimate
+    uint32_t amplitude;         // band amplitude, SAADC codes (peak)
+    uint32_t latency_avg_us;    // crossing sample -> compare armed
+    uint32_t latency_max_us;
+    uint32_t over_latency;      // decisions over CONFIG_CL_LATENCY_BUDGET_US
+    uint32_t block_max_us;      // longest block handler
+    uint32_t load_ppm;          // block handler share of the CPU since start
+} closed_loop_stats;
+
+/** SAADC, calibration and the DPPI route; starts the loop with the CONFIG_CL_* parameters. Call after trigger_init(). */
+int closed_loop_init(void);
+
+/** Start sampling from a reset estimator and zeroed counters. Thread context. */
+int closed_loop_start(void);
+
+/** Stop sampling and take back an armed pulse. Thread context. */
+void closed_loop_stop(void);
+
+/** New parameters; a running loop restarts with them. -EINVAL for a band outside the filter rate. */
+int closed_loop_configure(const closed_loop_params *params);
+
+void get_closed_loop_params(closed_loop_params *params);
+
+void get_closed_loop_stats(closed_loop_stats *stats);
+
+#endif /* CLOSED_LOOP_H */
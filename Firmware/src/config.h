@@ -16,5 +16,137 @@
 #define CONFIG_INTER_PHASE_GAP_US    10u       /* Gap between phase 1 and phase 2 (us). Typically 10 us.
                                                   Note: Actual gap is SWITCH_PERIOD in timer.h; timer not modified. */
 #define CONFIG_STIM_FREQUENCY_HZ     130u      /* Biphasic pulse rate (Hz). Typically 130 Hz. */
+#define CONFIG_STIM_RATE_MHZ         0u        /* Fine boot rate in mHz (500 = 0.5 Hz, 2500 = 2.5 Hz), 0.01 Hz..5 kHz;
+                                                  0: CONFIG_STIM_FREQUENCY_HZ. A restored plan still wins. */
+
+/* External trigger input (see trigger.h for the pin). Edge -> GPIOTE -> DPPI -> TIMER start and
+ * switch onset, so trigger-to-pulse latency is set by hardware, not by ISR latency. */
+#define TRIGGER_MODE                 0         // 1: each rising edge on TRIGGER_PIN starts a pulse/train
+                                               // 0: self-timed at CONFIG_STIM_FREQUENCY_HZ (or BLE)
+#define CONFIG_TRIGGER_TRAIN_PULSES  1u        /* Biphasic pulses per trigger edge, spaced by the stim period */
+
+#define SYNC_OUT_ENABLE              0         // 1: TTL sync-out during phase 1 + timestamped marker ring (sync.h)
+                                               // 0: no sync output, no markers
+
+#define STOCHASTIC_IPI_ENABLE        0         // 1: randomized inter-pulse intervals from pregenerated buffer (stochastic.h)
+                                               // 0: fixed period only
+#define CONFIG_STOCH_DIST            0u        /* Boot distribution: 0 fixed, 1 Poisson, 2 uniform jitter. Mean = CONFIG_STIM_FREQUENCY_HZ */
+#define CONFIG_STOCH_JITTER_PCT      20u       /* Uniform jitter: +/- percent of the mean interval */
+
+/* RTC-mode (no BLE) period clock. LFRC drifts with temperature, so it is calibrated against the
+ * HFXO periodically and the RTC period corrected from the measured LFCLK frequency. */
+#define CONFIG_RTC_LFCLK_SRC         0u        /* 0: LFRC (internal RC), 1: LFXO (32.768 kHz crystal; falls back to LFRC) */
+#define LFCLK_CAL_ENABLE             1         // 1: periodic LFCLK calibration/measurement in RTC mode (lfclk_cal.h)
+                                               // 0: nominal 32768 Hz assumed
+#define CONFIG_LFCLK_CAL_INTERVAL_S  30u       /* Seconds between calibrations */
+#define CONFIG_LFCLK_CAL_WINDOW_MS   250u      /* Minimum HF reference window per measurement */
+#define DUTY_CYCLE_ENABLE            0         // 1: RTC-mode trains cycled on/off; HFCLK and SPIM released while off (rtc_stim.h)
+                                               // 0: continuous stimulation
+#define CONFIG_DUTY_ON_S             30u       /* Train (on) time per cycle, seconds */
+#define CONFIG_DUTY_OFF_S            300u      /* Off time between trains, seconds. 0: continuous */
+#define CONFIG_DUTY_ON_UA            250u      /* Average supply current while on (measure at the plan's rate), uA */
+#define CONFIG_DUTY_OFF_UA           3u        /* Average supply current while off (System ON sleep, RTC running), uA */
+
+#define STIM_STORE_ENABLE            1         // 1: persist the last plan applied over BLE and restore it at boot (stim_store.h)
+                                               // 0: always boot with the CONFIG_STIM_* values above
+
+#define MULTICHANNEL_ENABLE          0         // 1: interleaved biphasic trains on the four HCSS outputs (sched.h), BLE builds only
+                                               // 0: single channel on the fixed CC0-CC3 timing
+
+#define DEADLINE_MONITOR_ENABLE      1         // 1: pulse-edge overrun counters, pulse watchdog and safe state on fatal error (deadline.h)
+                                               // 0: no monitoring; fatal errors use the kernel default
+
+#define ISR_CYCLES_ENABLE            0         // 1: DWT cycle counts of the stim hot paths against the budgets below (isr_cycles.h)
+                                               // 0: no instrumentation
+#define CONFIG_CYC_BUDGET_TIMER_US   20u       /* timer_handler per compare, including the DAC write */
+#define CONFIG_CYC_BUDGET_RTC_US     40u       /* rtc_handler per period, including HFCLK start and the DAC write */
+#define CONFIG_CYC_BUDGET_SPI_US     8u        /* spi_write_dac1, 2-byte blocking transfer plus CS hold */
+#define CONFIG_CYC_BUDGET_CL_US      30u       /* Closed-loop block handler: filter, estimator and compare arm (CLOSED_LOOP_ENABLE) */
+
+#define ENERGY_ACCOUNTING_ENABLE     0         // 1: per-subsystem active-time counters and a supply current estimate (energy.h);
+                                               //    also turns on the DWT hot-path counts it reads
+                                               // 0: no accounting
+/* Currents the estimate weights each counter with. Datasheet typicals; replace with values measured on the board. */
+#define CONFIG_ENERGY_CPU_UA         2700u     /* CPU running, uA */
+#define CONFIG_ENERGY_SLEEP_UA       3u        /* System ON idle with RTC running, uA */
+#define CONFIG_ENERGY_HFCLK_UA       250u      /* HFCLK running (on top of CPU), uA */
+#define CONFIG_ENERGY_SPI_UA         1100u     /* SPIM transfer in progress, uA */
+#define CONFIG_ENERGY_RADIO_EVENT_NC 6000u     /* Charge per advertising or connection event, nC */
+
+#define TELEMETRY_ENABLE             0         // 1: connectionless status broadcast over periodic advertising (telemetry.h);
+                                               //    BLE builds, merge prj_telemetry.conf
+                                               // 0: status only over the NUS connection
+#define CONFIG_TELEM_INTERVAL_MS     1000u     /* Periodic advertising interval, ms (7.5 ms to 81.9 s) */
+#define CONFIG_TELEM_EXT_INTERVAL_MS 2000u     /* Extended advertising interval scanners find the train from, ms */
+#define CONFIG_TELEM_UPDATE_MS       1000u     /* Payload rebuild period, ms (>= CONFIG_TELEM_INTERVAL_MS) */
+
+#define STIM_PLL_ENABLE              0         // 1: lock the stim period to a shared reference across units (stim_pll.h), BLE continuous engine
+                                               // 0: free-running period
+#define CONFIG_PLL_SOURCE            1u        /* Boot reference: 0 off, 1 wired sync-in edge on TRIGGER_PIN, 2 BLE reference train */
+#define CONFIG_PLL_MAX_PPM           1000u     /* Largest period correction, ppm; also bounds the phase slew rate */
+#define CONFIG_PLL_KP_SHIFT          2u        /* Proportional gain: 1/2^n of the phase error per pulse */
+#define CONFIG_PLL_KI_SHIFT          6u        /* Integral gain: 1/2^n of the phase error per pulse */
+#define CONFIG_PLL_LOCK_US           5u        /* Skew below which the loop counts as locked, us */
+
+#define CHARGE_LIMIT_ENABLE          1         // 1: plans checked against the safety envelope below at commit, pulse budget
+                                               //    enforced per pulse with a safe stop (charge_limit.h)
+                                               // 0: any plan is applied as received
+#define CONFIG_DAC_FULL_SCALE_UA     1000u     /* Output current at DAC code 0x0000/0xFFFF, uA. Set to the board's current source */
+#define CONFIG_LIMIT_AMPLITUDE_UA    1000u     /* Largest phase current, uA */
+#define CONFIG_LIMIT_PULSE_WIDTH_US  1000u     /* Longest phase, us */
+#define CONFIG_LIMIT_CHARGE_DENSITY_UC_CM2 30u /* Charge per phase over the electrode area, uC/cm^2 */
+#define CONFIG_ELECTRODE_AREA_UM2    1000000u  /* Geometric electrode area, um^2 (1 mm^2: 300 nC per phase at 30 uC/cm^2) */
+#define CONFIG_LIMIT_CHARGE_PER_S_UC 100u      /* Charge delivered in any one-second span (one phase per pulse), uC. Held
+                                                  across plan changes; a plan is accepted up to about 97% of it, since
+                                                  the pulse path counts 33/32 s (charge_limit.h) */
+
+#define SESSION_LOG_ENABLE           0         // 1: plan commits, faults and periodic counters logged to flash, read back over the
+                                               //    control channel (session_log.h); needs a session_log_partition
+                                               // 0: no log
+#define CONFIG_SLOG_COUNTERS_S       60u       /* Counter record period, s */
+#define CONFIG_SLOG_MIN_PAGE_S       60u       /* Shortest time between two page writes, s: bounds flash wear. Records
+                                                  arriving while both RAM pages are full are dropped and counted */
+#define CONFIG_SLOG_MAX_AGE_S        900u      /* A partly filled page is written once its first record is this old, s */
+
+#define CLOCK_POLICY_ENABLE          0         // 1: CPU clock set by policy around the stim hot paths, 128 or 64 MHz (clock_policy.h),
+                                               //    nRF5340 application core and nRF54L
+                                               // 0: CPU clock left as the kernel set it
+#define CONFIG_CLOCK_POLICY          2u        /* Boot policy: 0 high (128 MHz), 1 low (64 MHz), 2 boost (64 MHz, 128 MHz in the hot paths) */
+/* CPU currents the policy estimate weights busy time with. Datasheet typicals; replace with values measured on the board. */
+#define CONFIG_CLOCK_UA_HIGH         2700u     /* CPU running at 128 MHz, uA */
+#define CONFIG_CLOCK_UA_LOW          1600u     /* CPU running at 64 MHz, uA */
+
+#define STRESS_ENABLE                0         // 1: random rate/width/amplitude updates during stimulation, each pulse's edge timing
+                                               //    checked against the plan (stress.h); BLE continuous engine, bench use only
+                                               // 0: no stress runs
+#define CONFIG_STRESS_RATE_MIN_HZ    50u       /* Random rate range, Hz */
+#define CONFIG_STRESS_RATE_MAX_HZ    500u
+#define CONFIG_STRESS_PW_MIN_US      50u       /* Random pulse width range, us per phase */
+#define CONFIG_STRESS_PW_MAX_US      300u
+#define CONFIG_STRESS_TOL_US         10u       /* Edge timing error counted as a fault, us (ISR entry latency included) */
+
+#define CLOSED_LOOP_ENABLE           0         // 1: pulses at a target phase of a band of an analog input sampled by SAADC
+                                               //    (closed_loop.h); needs TRIGGER_MODE and CONFIG_NRFX_SAADC=y
+                                               // 0: open loop
+#define CONFIG_CL_SAMPLE_HZ          8000u     /* SAADC rate, Hz; 16 MHz / rate must be a whole number in 80..2047 */
+#define CONFIG_CL_DECIMATION         4u        /* Raw samples averaged per filter sample (2 kHz filter rate) */
+#define CONFIG_CL_BLOCK_SAMPLES      4u        /* Raw samples per EasyDMA block, a multiple of the decimation. One block (0.5 ms)
+                                                  is the floor of the decision latency; each costs one interrupt */
+#define CONFIG_CL_BAND_LO_DHZ        40u       /* Band, 0.1 Hz (4-8 Hz: theta) */
+#define CONFIG_CL_BAND_HI_DHZ        80u
+#define CONFIG_CL_TARGET_DEG         0u        /* Target phase: 0 peak, 90 falling zero crossing, 180 trough, 270 rising */
+#define CONFIG_CL_MIN_AMPLITUDE      20u       /* Band amplitude below which no pulse is given, SAADC codes (peak) */
+#define CONFIG_CL_REFRACTORY_MS      100u      /* Shortest time between two pulse targets, ms */
+#define CONFIG_CL_MIN_LEAD_US        100u      /* A target nearer than this to the end of the block that found it waits a cycle */
+#define CONFIG_CL_LATENCY_BUDGET_US  1000u     /* Crossing sample to compare armed; decisions over it are counted */
+
+#define FLPR_SEQ_ENABLE              0         // 1: pulses sequenced on the nRF54L15 FLPR (RISC-V) core from a shared-memory
+                                               //    plan mailbox (flpr_seq.h); BLE continuous engine, needs the Firmware/flpr image
+                                               //    Charge limits are checked at commit only, and the DAC words of one pulse
+                                               //    per CONFIG_FLPR_SEQ_WATCH_MS; no per-pulse budget (charge_limit.h)
+                                               // 0: pulses timed by the application core's stim TIMER
+#define CONFIG_FLPR_SEQ_LATE_NS      1000u     /* Edge started later than this after its time counts as late (FLPR telemetry) */
+#define CONFIG_FLPR_SEQ_WATCH_MS     500u      /* Heartbeat check; a stalled FLPR is halted and the switches made safe */
+#define CONFIG_FLPR_SEQ_BOOT_MS      100u      /* Wait at boot for the FLPR to take the first plan */
 
 #endif // CONFIG_H
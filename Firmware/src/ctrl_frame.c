@@ -0,0 +1,90 @@
+/*
+ * UART control frame parser and NUS bridge (ctrl_frame.h).
+ */
+#include <string.h>
+#include "ctrl_frame.h"
+
+void ctrl_frame_init(ctrl_frame_rx *rx, uint8_t *bridge, uint16_t bridge_size,
+                     ctrl_frame_fn on_frame, ctrl_frame_fn on_bridge, void *ctx)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->state = CTRL_IDLE;
+    rx->bridge = bridge;
+    rx->bridge_size = bridge_size;
+    rx->on_frame = on_frame;
+    rx->on_bridge = on_bridge;
+    rx->ctx = ctx;
+}
+
+void ctrl_frame_feed(ctrl_frame_rx *rx, const uint8_t *data, uint16_t len, uint32_t now_ms)
+{
+    if (rx->state != CTRL_IDLE && now_ms - rx->start_ms > CTRL_UART_TIMEOUT_MS) {
+        rx->state = CTRL_IDLE;      // stale partial frame
+        rx->dropped++;
+    }
+
+    for (uint16_t i = 0; i < len; ) {
+        uint8_t b = data[i];
+
+        switch (rx->state) {
+        case CTRL_LEN:
+            if (b == 0 || b > CMD_MAX_LEN) {
+                rx->state = CTRL_IDLE;
+                rx->dropped++;
+            } else {
+                rx->want = b;
+                rx->have = 0;
+                rx->state = CTRL_BODY;
+            }
+            i++;
+            continue;
+        case CTRL_BODY: {
+            uint16_t n = rx->want - rx->have;
+
+            if (n > len - i) {
+                n = len - i;
+            }
+            if (rx->have == 0 && n == rx->want) {
+                /* Whole frame in this span: parse it where the DMA put it */
+                rx->frames++;
+                rx->on_frame(rx->ctx, &data[i], rx->want);
+                rx->state = CTRL_IDLE;
+            } else {
+                memcpy(&rx->frame[rx->have], &data[i], n);
+                rx->have += n;
+                if (rx->have == rx->want) {
+                    rx->frames++;
+                    rx->on_frame(rx->ctx, rx->frame, rx->want);
+                    rx->state = CTRL_IDLE;
+                }
+            }
+            i += n;
+            continue;
+        }
+        case CTRL_IDLE:
+            if (b == CTRL_UART_SYNC && rx->bridge_len == 0) {
+                rx->state = CTRL_LEN;
+                rx->start_ms = now_ms;
+                i++;
+                continue;
+            }
+            break;
+        }
+
+        /* Not a control frame: bridge, flushing at line end or when full */
+        rx->bridge[rx->bridge_len++] = b;
+        i++;
+        if (rx->bridge_len >= rx->bridge_size || b == '\n' || b == '\r') {
+            rx->on_bridge(rx->ctx, rx->bridge, rx->bridge_len);
+            rx->bridge_len = 0;
+        }
+    }
+}
+
+void ctrl_frame_resync(ctrl_frame_rx *rx)
+{
+    if (rx->state != CTRL_IDLE) {
+        rx->state = CTRL_IDLE;
+        rx->dropped++;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef CTRL_FRAME_H
+#define CTRL_FRAME_H
+
+#include <stdint.h>
+
+/*
+ * The same commands (and legacy settings) are accepted on the NUS UART as framed packets:
+ * [CTRL_UART_SYNC][len u8][len bytes]. Replies to UART commands come back on the UART in the
+ * same framing. Bytes outside a frame are bridged to NUS as before; the sync byte is never
+ * valid text, so bridged ASCII is unaffected. The UART path does not need BLE: a bench host on
+ * the VCOM or CDC port can run every command with no central connected. Frames are parsed in
+ * place in the receive DMA buffers (BLE.h UART_RX_*) and a frame may follow the previous one
+ * back to back, at the full line rate.
+ *
+ * The receive side is plain C with no kernel or driver dependencies, so the parser BLE.c
+ * runs on the DMA slices is the one Tools/ctrl_frames.c checks on the host.
+ */
+#define CTRL_UART_SYNC      0xC7
+#define CTRL_UART_TIMEOUT_MS 100    // a frame not completed within this is dropped
+
+#define CMD_MAX_LEN 16
+
+/* Called with a complete frame payload (sync and length stripped), or with bridged bytes */
+typedef void (*ctrl_frame_fn)(void *ctx, const uint8_t *data, uint16_t len);
+
+typedef struct {
+    enum { CTRL_IDLE, CTRL_LEN, CTRL_BODY } state;
+    uint8_t frame[CMD_MAX_LEN];     // only for a frame split across two slices
+    uint8_t want;
+    uint8_t have;
+    uint32_t start_ms;
+    uint8_t *bridge;                // bytes not yet passed on to on_bridge
+    uint16_t bridge_size;
+    uint16_t bridge_len;
+    ctrl_frame_fn on_frame;
+    ctrl_frame_fn on_bridge;        // at line end or when bridge_size bytes are held
+    void *ctx;
+    uint32_t frames;
+    uint32_t dropped;               // bad lengths, frames not completed in time or cut by a gap
+} ctrl_frame_rx;
+
+void ctrl_frame_init(ctrl_frame_rx *rx, uint8_t *bridge, uint16_t bridge_size,
+                     ctrl_frame_fn on_frame, ctrl_frame_fn on_bridge, void *ctx);
+
+/**
+ * Parse one received span. A sync byte starts a frame only with no bridged line pending. A
+ * frame wholly inside the span is handed to on_frame in place; one split across spans is
+ * collected in rx->frame, and dropped if the span completing it comes more than
+ * CTRL_UART_TIMEOUT_MS after its sync byte.
+ */
+void ctrl_frame_feed(ctrl_frame_rx *rx, const uint8_t *data, uint16_t len, uint32_t now_ms);
+
+/**
+ * Received bytes were lost before the next span: a partial frame is dropped rather than
+ * completed with whatever follows the gap. Bridged text carries on.
+ */
+void ctrl_frame_resync(ctrl_frame_rx *rx);
+
+#endif /* CTRL_FRAME_H */
@@ -1,37 +1,936 @@
 #include <zephyr/types.h>
+#include <zephyr/kernel.h>
 #include <string.h>
+#if defined(CONFIG_BT)
+#include <bluetooth/services/nus.h>
+#endif
 #include "data.h"
+#include "BLE.h"
 #include "timer.h"
 #include "spi.h"
+#include "trigger.h"
+#include "rtc_stim.h"
+#include "sync.h"
+#include "stochastic.h"
+#include "stim_store.h"
+#include "boot_time.h"
+#include "sched.h"
+#include "deadline.h"
+#include "isr_cycles.h"
+#include "energy.h"
+#include "telemetry.h"
+#include "stim_pll.h"
+#include "charge_limit.h"
+#include "session_log.h"
+#include "clock_policy.h"
+#include "stress.h"
+#include "closed_loop.h"
+#include "flpr_seq.h"
+#include "config.h"
 
 stim_setting settings;
 uint8_t ble_received_data[BLE_DATA_BUFFER_SIZE];
 uint16_t ble_data_length;
 
-void process_received_data(stim_setting *settings, uint8_t *ble_received_data, uint16_t ble_data_length) {
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+/* Where replies to the command being processed go. Commands arrive from the NUS RX
+ * callback and from the UART control frames; cmd_lock serializes them. */
+typedef enum {
+    REPLY_NUS,
+    REPLY_UART,
+} reply_route;
+
+static K_MUTEX_DEFINE(cmd_lock);
+static reply_route route = REPLY_NUS;
+
+/* Send a reply frame to the connected central or the UART host. Returns 0 on success. */
+static int data_reply_to(reply_route to, const uint8_t *data, uint16_t len) {
+#if defined(CONFIG_BT)
+    if (to == REPLY_UART) {
+        return uart_ctrl_send(data, len);
+    }
+    return bt_nus_send(NULL, data, len);
+#else
+    ARG_UNUSED(to);
+    ARG_UNUSED(data);
+    ARG_UNUSED(len);
+    return -ENOTSUP;
+#endif
+}
+
+static int data_reply(const uint8_t *data, uint16_t len) {
+    return data_reply_to(route, data, len);
+}
+
+/* Largest reply frame the current link can carry */
+static uint16_t data_reply_max_len(reply_route to) {
+    if (to == REPLY_UART) {
+        return CMD_REPLY_MAX_LEN;
+    }
+#if defined(CONFIG_BT)
+    if (current_conn) {
+        return MIN(bt_nus_get_mtu(current_conn), CMD_REPLY_MAX_LEN);
+    }
+#endif
+    return 20;      // default ATT MTU payload
+}
+
+#if SYNC_OUT_ENABLE
+static struct k_work marker_dump_work;
+static uint32_t marker_dump_remaining;
+static reply_route marker_dump_route;
+
+/* Stream markers out of the ring in as few notifications as the MTU allows.
+ * Markers are only consumed once their frame has been accepted by the stack. */
+static void marker_dump_work_handler(struct k_work *work) {
+    static uint8_t frame[CMD_REPLY_MAX_LEN];
+    uint16_t per_frame = (data_reply_max_len(marker_dump_route) - 2) / sizeof(sync_marker);
+
+    while (marker_dump_remaining > 0) {
+        uint16_t n = sync_marker_peek((sync_marker *)&frame[2],
+                                      MIN(per_frame, marker_dump_remaining));
+        if (n == 0) {
+            break;
+        }
+        frame[0] = CMD_SYNC_MARKERS;
+        frame[1] = n;
+        if (data_reply_to(marker_dump_route, frame, 2 + n * sizeof(sync_marker))) {
+            printf("Marker dump aborted: send failed\n");
+            return;
+        }
+        sync_marker_consume(n);
+        marker_dump_remaining -= n;
+    }
+
+    frame[0] = CMD_SYNC_MARKERS;
+    frame[1] = 0;
+    put_u32(&frame[2], sync_marker_dropped());
+    put_u32(&frame[6], sync_pulse_count());
+    (void)data_reply_to(marker_dump_route, frame, 10);
+}
+#endif
+
+#if SESSION_LOG_ACTIVE
+static struct k_work log_dump_work;
+static uint32_t log_dump_seq;
+static uint16_t log_dump_remaining;
+static reply_route log_dump_route;
+
+/* Stream whole pages, header included, straight from flash. Runs on the system workqueue
+ * like the log writer, so a page cannot change under the read. */
+static void log_dump_work_handler(struct k_work *work) {
+    static uint8_t frame[CMD_REPLY_MAX_LEN];
+    uint16_t per_frame = data_reply_max_len(log_dump_route) - 8;
+    session_log_info info;
+    uint16_t sent = 0;
+
+    get_session_log_info(&info);
+    if (log_dump_seq < info.first_seq) {
+        log_dump_seq = info.first_seq;
+    }
+    for (; log_dump_remaining > 0 && log_dump_seq != 0 && log_dump_seq <= info.last_seq; log_dump_seq++) {
+        uint16_t offset = 0;
+        int length;
+
+        do {
+            length = session_log_read(log_dump_seq, offset, &frame[8], per_frame);
+            if (length < 0) {
+                break;      // overwritten meanwhile, or unreadable: skip the page
+            }
+            uint16_t n = MIN(per_frame, length - offset);
+            frame[0] = CMD_SESSION_LOG;
+            frame[1] = 1;
+            put_u32(&frame[2], log_dump_seq);
+            frame[6] = offset & 0xFF;
+            frame[7] = offset >> 8;
+            if (data_reply_to(log_dump_route, frame, 8 + n)) {
+                printf("Session log dump aborted: send failed\n");
+                return;
+            }
+            offset += n;
+        } while (offset < length);
+        if (length >= 0) {
+            sent++;
+            log_dump_remaining--;
+        }
+    }
+
+    frame[0] = CMD_SESSION_LOG;
+    frame[1] = 1;
+    put_u32(&frame[2], 0);
+    frame[6] = sent & 0xFF;
+    frame[7] = sent >> 8;
+    (void)data_reply_to(log_dump_route, frame, 8);
+}
+#endif
+
+static void process_command(const uint8_t *cmd, uint16_t len) {
+    switch (cmd[0]) {
+        case CMD_TRIGGER_CONFIG:
+            if (len != 4) {
+                break;
+            }
+#if TRIGGER_MODE
+            trigger_set_train_length(get_u16(&cmd[2]));
+            trigger_arm(cmd[1] != 0);
+            printf("Trigger %s\n", cmd[1] ? "armed" : "disarmed");
+#else
+            printf("Trigger command ignored: TRIGGER_MODE disabled\n");
+#endif
+            return;
+
+        case CMD_SYNC_MARKERS:
+            if (len != 3) {
+                break;
+            }
+#if SYNC_OUT_ENABLE
+            {
+                static bool work_ready;
+                if (!work_ready) {
+                    k_work_init(&marker_dump_work, marker_dump_work_handler);
+                    work_ready = true;
+                }
+                uint16_t max = get_u16(&cmd[1]);
+                marker_dump_remaining = max ? max : UINT32_MAX;
+                marker_dump_route = route;
+                k_work_submit(&marker_dump_work);
+            }
+#else
+            printf("Marker command ignored: SYNC_OUT_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_STOCHASTIC:
+            if (len != 5) {
+                break;
+            }
+#if STOCHASTIC_IPI_ENABLE
+            if (cmd[1] == STOCH_OFF) {
+                stochastic_stop();
+                timer_restore_period();
+                printf("Stochastic intervals off\n");
+            } else {
+                stochastic_start((stoch_dist)cmd[1], get_u16(&cmd[2]), cmd[4],
+                                 TIMER_MIN_PERIOD_US(timer_get_pulse_width_us()));
+            }
+#else
+            printf("Stochastic command ignored: STOCHASTIC_IPI_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_STIM_STORE:
+            if (len != 2) {
+                break;
+            }
+#if STIM_STORE_ACTIVE
+            if (cmd[1] == 1) {
+                (void)stim_store_clear();
+            } else {
+                stim_boot_info info;
+                uint8_t frame[7];
+                get_stim_boot_info(&info);
+                frame[0] = CMD_STIM_STORE;
+                frame[1] = info.source;
+                frame[2] = info.first_pulse_seen;
+                put_u32(&frame[3], info.boot_to_pulse_us);
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Stim store command ignored: STIM_STORE_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_BOOT_PHASES:
+            if (len != 1) {
+                break;
+            }
+            {
+                uint8_t frame[3 + BOOT_PHASE_COUNT * sizeof(uint32_t)];
+                frame[0] = CMD_BOOT_PHASES;
+                frame[1] = boot_within_budget();
+                frame[2] = BOOT_PHASE_COUNT;
+                for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+                    put_u32(&frame[3 + i * sizeof(uint32_t)], boot_phase_us(i));
+                }
+                (void)data_reply(frame, sizeof(frame));
+            }
+            return;
+
+        case CMD_CHANNEL_CONFIG:
+            if (len != 9) {
+                break;
+            }
+#if MULTICHANNEL_ACTIVE
+            {
+                sched_channel ch = {
+                    .enabled = cmd[2] != 0,
+                    .amplitude = get_u16(&cmd[3]),
+                    .pulse_width_us = get_u16(&cmd[5]),
+                    .frequency_hz = get_u16(&cmd[7]),
+                };
+                uint8_t frame[3] = { CMD_CHANNEL_CONFIG, cmd[1], 0 };
+                CLOCK_HOT_BEGIN(clk);
+                int err = sched_set_channel(cmd[1], &ch);
+                CLOCK_HOT_END(CLOCK_PATH_COMMIT, clk);
+#if SESSION_LOG_ACTIVE
+                if (err == 0) {
+                    session_log_plan(SLOG_PLAN_CHANNEL, cmd[1], ch.amplitude, ch.pulse_width_us,
+                                     ch.enabled ? ch.frequency_hz * 1000u : 0);
+                }
+#endif
+                frame[2] = (uint8_t)(int8_t)err;
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Channel command ignored: MULTICHANNEL_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_DEADLINE_STATS:
+            if (len != 1) {
+                break;
+            }
+#if DEADLINE_ACTIVE
+            {
+                deadline_stats st;
+                uint8_t frame[26];
+                get_deadline_stats(&st);
+                frame[0] = CMD_DEADLINE_STATS;
+                frame[1] = st.worst_edge;
+                put_u32(&frame[2], st.overruns);
+                put_u32(&frame[6], st.missed);
+                put_u32(&frame[10], st.worst_late_us);
+                put_u32(&frame[14], st.min_slack_us);
+                put_u32(&frame[18], st.wdt_resets);
+                put_u32(&frame[22], st.fatal_resets);
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Deadline command ignored: monitor not active in this mode\n");
+#endif
+            return;
+
+        case CMD_ISR_CYCLES:
+            if (len != 2) {
+                break;
+            }
+#if ISR_CYCLES_ENABLE
+            {
+                uint8_t frame[3 + ISR_PATH_COUNT * 5 * sizeof(uint32_t)];
+                uint8_t *p = &frame[3];
+                frame[0] = CMD_ISR_CYCLES;
+                frame[1] = isr_cycles_within_budget();
+                frame[2] = ISR_PATH_COUNT;
+                for (int i = 0; i < ISR_PATH_COUNT; i++) {
+                    isr_cycle_stats st;
+                    get_isr_cycle_stats(i, &st);
+                    put_u32(p, st.calls);
+                    put_u32(p + 4, st.avg_cycles);
+                    put_u32(p + 8, st.max_cycles);
+                    put_u32(p + 12, st.budget_cycles);
+                    put_u32(p + 16, st.over_budget);
+                    p += 5 * sizeof(uint32_t);
+                }
+                (void)data_reply(frame, sizeof(frame));
+                if (cmd[1] == 1) {
+                    isr_cycles_reset();
+                }
+            }
+#else
+            printf("ISR cycles command ignored: ISR_CYCLES_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_GET_SETTING:
+            if (len != 1) {
+                break;
+            }
+            {
+                uint8_t frame[19];
+                frame[0] = CMD_GET_SETTING;
+                frame[1] = settings.DAC_amplitude & 0xFF;
+                frame[2] = settings.DAC_amplitude >> 8;
+                frame[3] = settings.pulse_width & 0xFF;
+                frame[4] = settings.pulse_width >> 8;
+                frame[5] = settings.frequency & 0xFF;
+                frame[6] = settings.frequency >> 8;
+                put_u32(&frame[7], timer_get_pulse_width_us());
+                put_u32(&frame[11], timer_get_period_us());
+                put_u32(&frame[15], timer_get_rate_mhz());
+                (void)data_reply(frame, sizeof(frame));
+            }
+            return;
+
+        case CMD_ENERGY:
+            if (len != 2) {
+                break;
+            }
+#if ENERGY_ACCOUNTING_ENABLE
+            {
+                uint8_t frame[1 + 8 * sizeof(uint32_t)];
+                energy_stats st;
+                get_energy_stats(&st);
+                frame[0] = CMD_ENERGY;
+                put_u32(&frame[1], st.elapsed_ms);
+                put_u32(&frame[5], st.hfclk_on_ms);
+                put_u32(&frame[9], st.cpu_isr_us);
+                put_u32(&frame[13], st.cpu_thread_ms);
+                put_u32(&frame[17], st.cpu_idle_ms);
+                put_u32(&frame[21], st.spi_us);
+                put_u32(&frame[25], st.radio_events);
+                put_u32(&frame[29], st.est_avg_ua);
+                (void)data_reply(frame, sizeof(frame));
+                if (cmd[1] == 1) {
+                    energy_reset();
+                }
+            }
+#else
+            printf("Energy command ignored: ENERGY_ACCOUNTING_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_TELEMETRY:
+            if (len != 4) {
+                break;
+            }
+#if TELEMETRY_ACTIVE
+            {
+                uint8_t frame[2] = { CMD_TELEMETRY, 0 };
+                frame[1] = (uint8_t)(int8_t)telemetry_set(cmd[1] != 0, get_u16(&cmd[2]));
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Telemetry command ignored: TELEMETRY_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_PLL:
+            if (len < 2) {
+                break;
+            }
+#if STIM_PLL_ACTIVE
+            if (cmd[1] == 0 && len == 2) {
+                uint8_t frame[36] = { CMD_PLL, 0 };
+                stim_pll_stats st;
+                get_stim_pll_stats(&st);
+                frame[2] = (uint8_t)st.source;
+                frame[3] = st.locked;
+                put_u32(&frame[4], (uint32_t)st.skew_us);
+                put_u32(&frame[8], st.skew_max_us);
+                put_u32(&frame[12], st.skew_avg_us);
+                put_u32(&frame[16], (uint32_t)st.adj_ppm);
+                put_u32(&frame[20], st.ref_missing);
+                put_u32(&frame[24], (uint32_t)st.last_onset_us);
+                put_u32(&frame[28], (uint32_t)(st.last_onset_us >> 32));
+                put_u32(&frame[32], st.period_ns);
+                (void)data_reply(frame, sizeof(frame));
+                return;
+            }
+            if (cmd[1] == 1 && len == 2) {
+                uint8_t frame[10] = { CMD_PLL, 1 };
+                uint64_t now = stim_pll_now_us();
+                put_u32(&frame[2], (uint32_t)now);
+                put_u32(&frame[6], (uint32_t)(now >> 32));
+                (void)data_reply(frame, sizeof(frame));
+                return;
+            }
+            if (cmd[1] == 2 && len == 14) {
+                uint8_t frame[3] = { CMD_PLL, 2, 0 };
+                uint64_t onset = get_u32(&cmd[2]) | ((uint64_t)get_u32(&cmd[6]) << 32);
+                uint32_t period_ns = get_u32(&cmd[10]);
+                if (period_ns == 0) {
+                    frame[2] = (uint8_t)(int8_t)-EINVAL;
+                } else {
+                    stim_pll_set_reference(onset, period_ns);
+                }
+                (void)data_reply(frame, sizeof(frame));
+                return;
+            }
+            if (cmd[1] == 3 && len == 7) {
+                uint8_t frame[3] = { CMD_PLL, 3, 0 };
+                frame[2] = (uint8_t)(int8_t)stim_pll_set_source((stim_pll_source)cmd[2],
+                                                                (int32_t)get_u32(&cmd[3]));
+                (void)data_reply(frame, sizeof(frame));
+                return;
+            }
+            break;
+#else
+            printf("PLL command ignored: STIM_PLL_ENABLE disabled\n");
+            return;
+#endif
+
+        case CMD_SET_RATE:
+            if (len != 5) {
+                break;
+            }
+            {
+                uint8_t frame[2] = { CMD_SET_RATE, 0 };
+                uint32_t rate_mhz = get_u32(&cmd[1]);
+                int err;
+#if MULTICHANNEL_ACTIVE || TRIGGER_MODE
+                /* Per-channel plans are in Hz; trigger mode is paced from outside */
+                err = -ENOTSUP;
+                ARG_UNUSED(rate_mhz);
+#else
+                CLOCK_HOT_BEGIN(clk);
+                err = timer_plan_check(rate_mhz, (uint16_t)timer_get_pulse_width_us());
+#if CHARGE_LIMIT_ACTIVE
+                if (err == 0) {
+                    err = charge_limit_commit(settings.DAC_amplitude, timer_get_pulse_width_us(), rate_mhz);
+                    if (err == 0 && (err = update_stim_rate_mhz(rate_mhz)) != 0) {
+                        charge_limit_revert();
+                    }
+                }
+#else
+                if (err == 0) {
+                    err = update_stim_rate_mhz(rate_mhz);
+                }
+#endif
+                CLOCK_HOT_END(CLOCK_PATH_COMMIT, clk);
+                if (err == 0) {
+                    settings.frequency = (uint16_t)MIN((rate_mhz + 500u) / 1000u, UINT16_MAX);
+#if STIM_STORE_ACTIVE
+                    /* As commit_settings: the exact rate, not its rounding, is restored */
+                    stim_store_commit(&settings, rate_mhz);
+#endif
+#if SESSION_LOG_ACTIVE
+                    session_log_plan(SLOG_PLAN_RATE, 0, settings.DAC_amplitude, timer_get_pulse_width_us(), rate_mhz);
+#endif
+                }
+#endif
+                frame[1] = (uint8_t)(int8_t)err;
+                (void)data_reply(frame, sizeof(frame));
+            }
+            return;
+
+        case CMD_CHARGE_LIMIT:
+            if (len != 2) {
+                break;
+            }
+#if CHARGE_LIMIT_ACTIVE
+            {
+                uint8_t frame[41] = { CMD_CHARGE_LIMIT };
+                charge_limit_stats st;
+                get_charge_limit_stats(&st);
+                frame[1] = st.stopped;
+                frame[2] = st.last.reason;
+                frame[3] = st.last.channel;
+                frame[4] = st.last.stopped;
+                put_u32(&frame[5], st.faults);
+                put_u32(&frame[9], st.rejected);
+                put_u32(&frame[13], st.phase_charge_pc);
+                put_u32(&frame[17], st.pulses_per_s_max);
+                frame[21] = st.last.amplitude & 0xFF;
+                frame[22] = st.last.amplitude >> 8;
+                frame[23] = st.last.pulse_width_us & 0xFF;
+                frame[24] = st.last.pulse_width_us >> 8;
+                put_u32(&frame[25], st.last.rate_mhz);
+                put_u32(&frame[29], st.last.value);
+                put_u32(&frame[33], st.last.limit);
+                put_u32(&frame[37], st.last.uptime_ms);
+                (void)data_reply(frame, sizeof(frame));
+                if (cmd[1] == 1) {
+                    charge_limit_clear();
+                }
+            }
+#else
+            printf("Charge limit command ignored: CHARGE_LIMIT_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_SESSION_LOG:
+            if (len < 2 || (cmd[1] == 1 ? len != 8 : len != 2)) {
+                break;
+            }
+#if SESSION_LOG_ACTIVE
+            if (cmd[1] == 0) {
+                uint8_t frame[29] = { CMD_SESSION_LOG, 0 };
+                session_log_info info;
+                get_session_log_info(&info);
+                frame[2] = info.ready;
+                frame[3] = info.boot & 0xFF;
+                frame[4] = info.boot >> 8;
+                frame[5] = info.pages & 0xFF;
+                frame[6] = info.pages >> 8;
+                put_u32(&frame[7], info.first_seq);
+                put_u32(&frame[11], info.last_seq);
+                put_u32(&frame[15], info.pages_written);
+                put_u32(&frame[19], info.dropped);
+                put_u32(&frame[23], info.errors);
+                frame[27] = info.buffered & 0xFF;
+                frame[28] = info.buffered >> 8;
+                (void)data_reply(frame, sizeof(frame));
+            } else if (cmd[1] == 1) {
+                static bool work_ready;
+                if (!work_ready) {
+                    k_work_init(&log_dump_work, log_dump_work_handler);
+                    work_ready = true;
+                }
+                uint16_t max = get_u16(&cmd[6]);
+                log_dump_seq = get_u32(&cmd[2]);
+                log_dump_remaining = max ? max : UINT16_MAX;
+                log_dump_route = route;
+                k_work_submit(&log_dump_work);
+            } else {
+                uint8_t frame[3] = { CMD_SESSION_LOG, cmd[1], 0 };
+                frame[2] = (uint8_t)(int8_t)(cmd[1] == 2 ? session_log_flush() : -EINVAL);
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Session log command ignored: SESSION_LOG_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_CLOCK_POLICY:
+            if (len != 3) {
+                break;
+            }
+#if CLOCK_POLICY_ACTIVE
+            if (cmd[1] == 0 && cmd[2] < CLOCK_POLICY_COUNT) {
+                uint8_t frame[53] = { CMD_CLOCK_POLICY, 0, cmd[2] };
+                clock_policy_stats st;
+                get_clock_policy_stats(cmd[2], &st);
+                frame[3] = clock_policy_get() == cmd[2];
+                frame[4] = (uint8_t)clock_policy_mhz();
+                put_u32(&frame[5], st.time_ms);
+                put_u32(&frame[9], st.held_us);
+                put_u32(&frame[13], st.busy_ms);
+                put_u32(&frame[17], st.switches);
+                put_u32(&frame[21], st.switch_max_ns);
+                put_u32(&frame[25], st.est_cpu_ua);
+                for (int i = 0; i < CLOCK_PATH_COUNT; i++) {
+                    put_u32(&frame[29 + i * 12], st.path[i].calls);
+                    put_u32(&frame[33 + i * 12], st.path[i].avg_ns);
+                    put_u32(&frame[37 + i * 12], st.path[i].max_ns);
+                }
+                (void)data_reply(frame, sizeof(frame));
+            } else {
+                uint8_t frame[3] = { CMD_CLOCK_POLICY, cmd[1], 0 };
+                int err = -EINVAL;
+                if (cmd[1] == 1) {
+                    err = clock_policy_set(cmd[2]);
+                    if (err == 0) {
+                        printf("Clock policy %u: CPU at %lu MHz\n", cmd[2], clock_policy_mhz());
+                    }
+                } else if (cmd[1] == 2) {
+                    clock_policy_reset();
+                    err = 0;
+                }
+                frame[2] = (uint8_t)(int8_t)err;
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Clock policy command ignored: CLOCK_POLICY_ENABLE disabled\n");
+#endif
+            return;
+
+        case CMD_STRESS:
+            if (len < 2 || (cmd[1] == 1 ? len != 8 : len != 2)) {
+                break;
+            }
+#if STRESS_ACTIVE
+            if (cmd[1] == 0) {
+                uint8_t frame[51] = { CMD_STRESS, 0 };
+                stress_report r;
+                get_stress_report(&r);
+                frame[2] = r.running;
+                put_u32(&frame[3], r.updates);
+                put_u32(&frame[7], r.in_pulse);
+                put_u32(&frame[11], r.rejected);
+                put_u32(&frame[15], r.pulses);
+                put_u32(&frame[19], r.dropped);
+                put_u32(&frame[23], r.doubled);
+                put_u32(&frame[27], r.stretched);
+                put_u32(&frame[31], r.unbalanced);
+                put_u32(&frame[35], r.late);
+                put_u32(&frame[39], r.worst_err_ns);
+                put_u32(&frame[43], r.worst_update_err_ns);
+                put_u32(&frame[47], r.wrong_amplitude);
+                (void)data_reply(frame, sizeof(frame));
+            } else {
+                uint8_t frame[3] = { CMD_STRESS, cmd[1], 0 };
+                int err = -EINVAL;
+                if (cmd[1] == 1) {
+                    err = stress_start(get_u16(&cmd[2]), get_u32(&cmd[4]));
+                } else if (cmd[1] == 2) {
+                    stress_stop();
+                    err = 0;
+                }
+                frame[2] = (uint8_t)(int8_t)err;
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Stress command ignored: STRESS_ENABLE disabled or not the continuous engine\n");
+#endif
+            return;
+
+        case CMD_CLOSED_LOOP:
+            /* An unknown sub-opcode gets its -EINVAL reply whatever its length */
+            if (len < 2 || (cmd[1] <= 2 && len != (cmd[1] == 1 ? 10 : cmd[1] == 2 ? 3 : 2))) {
+                break;
+            }
+#if CLOSED_LOOP_ACTIVE
+            if (cmd[1] == 0) {
+                uint8_t frame[95] = { CMD_CLOSED_LOOP, 0 };
+                closed_loop_params p;
+                closed_loop_stats st;
+                get_closed_loop_params(&p);
+                get_closed_loop_stats(&st);
+                frame[2] = st.running;
+                put_u16(&frame[3], p.target_deg);
+                put_u16(&frame[5], p.band_lo_dhz);
+                put_u16(&frame[7], p.band_hi_dhz);
+                put_u16(&frame[9], p.min_amplitude);
+                const uint32_t fields[] = {
+                    st.blocks, st.resyncs, st.crossings, st.rejected, st.gated, st.deferred,
+                    st.scheduled, st.refreshed, st.missed, st.fired, st.evaluated,
+                    (uint32_t)st.err_mean_cdeg, st.abs_err_mean_cdeg, st.abs_err_max_cdeg,
+                    st.period_us, st.amplitude, st.latency_avg_us, st.latency_max_us,
+                    st.over_latency, st.block_max_us, st.load_ppm,
+                };
+                for (int i = 0; i < ARRAY_SIZE(fields); i++) {
+                    put_u32(&frame[11 + 4 * i], fields[i]);
+                }
+                (void)data_reply(frame, sizeof(frame));
+            } else {
+                uint8_t frame[3] = { CMD_CLOSED_LOOP, cmd[1], 0 };
+                int err = -EINVAL;
+                if (cmd[1] == 1) {
+                    closed_loop_params p = {
+                        .target_deg = get_u16(&cmd[2]),
+                        .band_lo_dhz = get_u16(&cmd[4]),
+                        .band_hi_dhz = get_u16(&cmd[6]),
+                        .min_amplitude = get_u16(&cmd[8]),
+                    };
+                    err = closed_loop_configure(&p);
+                } else if (cmd[1] == 2 && cmd[2] == 1) {
+                    err = closed_loop_start();
+                } else if (cmd[1] == 2 && cmd[2] == 0) {
+                    closed_loop_stop();
+                    err = 0;
+                }
+                frame[2] = (uint8_t)(int8_t)err;
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("Closed-loop command ignored: CLOSED_LOOP_ENABLE disabled or not trigger mode\n");
+#endif
+            return;
+
+        case CMD_FLPR:
+            if (len != 1) {
+                break;
+            }
+#if FLPR_SEQ_ACTIVE
+            {
+                uint8_t frame[38] = { CMD_FLPR };
+                flpr_seq_stats st;
+                get_flpr_seq_stats(&st);
+                frame[1] = st.state;
+                const uint32_t fields[] = {
+                    st.pulses, st.late_edges, st.worst_late_ns, st.plans_sent, st.plans_applied,
+                    st.plans_rejected, st.plans_unsent, st.stalls, st.wrong_amplitude,
+                };
+                for (int i = 0; i < ARRAY_SIZE(fields); i++) {
+                    put_u32(&frame[2 + 4 * i], fields[i]);
+                }
+                (void)data_reply(frame, sizeof(frame));
+            }
+#else
+            printf("FLPR command ignored: FLPR_SEQ_ENABLE disabled or not an nRF54L BLE build\n");
+#endif
+            return;
+
+        default:
+            printf("Unknown command 0x%02X\n", cmd[0]);
+            return;
+    }
+    printf("Command 0x%02X: bad length %u\n", cmd[0], len);
+}
+
+#if !MULTICHANNEL_ACTIVE
+/* Width and rate of a plan timer_plan_check() passed. Trigger mode checks each against the
+ * other as it stands, so a longer period goes in before a wider pulse and a narrower pulse
+ * before a shorter period. */
+static int plan_timing_apply(uint16_t pw, bool set_pw, uint32_t rate_mhz, bool set_rate)
+{
+    uint16_t old_pw = (uint16_t)timer_get_pulse_width_us();
+    bool rate_first = set_rate && rate_mhz <= timer_get_rate_mhz();
+    int err = 0;
+
+    if (rate_first) {
+        err = update_stim_rate_mhz(rate_mhz);
+    }
+    if (err == 0 && set_pw) {
+        update_pulse_width(pw);
+    }
+    if (err == 0 && set_rate && !rate_first) {
+        err = update_stim_rate_mhz(rate_mhz);
+        if (err != 0 && set_pw) {
+            update_pulse_width(old_pw);
+        }
+    }
+    return err;
+}
+
+#if CHARGE_LIMIT_ACTIVE
+/* A commit ends a charge-limit safe stop: start the engine it stopped again */
+static int engine_resume(uint32_t rate_mhz)
+{
+#if TRIGGER_MODE
+    ARG_UNUSED(rate_mhz);
+    trigger_arm(true);
+    return 0;
+#elif defined(CONFIG_BT)
+    return update_stim_rate_mhz(rate_mhz);
+#else
+    ARG_UNUSED(rate_mhz);
+    rtc_stim_resume();
+    return 0;
+#endif
+}
+#endif
+#endif
+
+/* Check and apply a legacy setting; the plan-commit hot path (clock_policy.h). Nothing of a
+ * plan that is refused is applied or stored. */
+static void commit_settings(stim_setting *settings, const stim_setting *received) {
+#if MULTICHANNEL_ACTIVE
+    /* Legacy setting drives channel 0 of the multichannel plan; sched_set_channel checks it */
+    sched_channel ch0 = {
+        .enabled = true,
+        .amplitude = received->DAC_amplitude,
+        .pulse_width_us = received->pulse_width,
+        .frequency_hz = received->frequency,
+    };
+    if (sched_set_channel(0, &ch0) == 0) {
+        *settings = *received;
+#if STIM_STORE_ACTIVE
+        stim_store_commit(settings, settings->frequency * 1000u);
+#endif
+#if SESSION_LOG_ACTIVE
+        session_log_plan(SLOG_PLAN_SETTING, 0, ch0.amplitude, ch0.pulse_width_us, ch0.frequency_hz * 1000u);
+#endif
+    }
+#else
+    /* As the engine will run it: a zero field keeps the running value */
+    uint16_t pw = received->pulse_width ? received->pulse_width : (uint16_t)timer_get_pulse_width_us();
+    uint32_t rate_mhz = received->frequency ? received->frequency * 1000u : timer_get_rate_mhz();
+    int err;
+
+    if (received->frequency == 0) {
+        printf("Warning: Received frequency is 0 Hz, rate not updated\n");
+    }
+    if (received->pulse_width == 0) {
+        printf("Warning: Received pulse width is 0 us, pulse width not updated\n");
+    }
+    if (timer_plan_check(rate_mhz, pw) != 0) {
+        printf("Settings rejected: %lu mHz does not fit a %u us pulse\n", rate_mhz, pw);
+        return;
+    }
+#if CHARGE_LIMIT_ACTIVE
+    charge_limit_stats guard;
+
+    get_charge_limit_stats(&guard);
+    bool was_stopped = guard.stopped;
+
+    if (charge_limit_commit(received->DAC_amplitude, pw, rate_mhz) != 0) {
+        printf("Settings rejected: outside the charge limits\n");
+        return;
+    }
+#endif
+#if FLPR_SEQ_ACTIVE
+    /* One plan to the FLPR, not one per field */
+    flpr_seq_hold();
+#endif
+    err = plan_timing_apply(pw, received->pulse_width > 0, rate_mhz, received->frequency > 0);
+#if CHARGE_LIMIT_ACTIVE
+    if (err == 0 && was_stopped) {
+        err = engine_resume(rate_mhz);
+    }
+#endif
+    if (err == 0) {
+        update_dac_amplitude(received->DAC_amplitude);
+    }
+#if CHARGE_LIMIT_ACTIVE
+    if (err != 0) {
+        /* The limiter must not hold a plan the engine is not running. Before the release, so
+         * the FLPR's plan carries the word it puts back. */
+        charge_limit_revert();
+    }
+#endif
+#if FLPR_SEQ_ACTIVE
+    flpr_seq_release();
+#endif
+    if (err != 0) {
+        printf("Settings rejected: the engine refused %lu mHz (%d)\n", rate_mhz, err);
+        return;
+    }
+    *settings = *received;
+#if STIM_STORE_ACTIVE
+    /* Fully applied plan becomes the one restored after a reset */
+    stim_store_commit(settings, rate_mhz);
+#endif
+#if SESSION_LOG_ACTIVE
+    session_log_plan(SLOG_PLAN_SETTING, 0, settings->DAC_amplitude, timer_get_pulse_width_us(),
+                     timer_get_rate_mhz());
+#endif
+#endif /* MULTICHANNEL_ACTIVE */
+}
+
+static void apply_received_data(stim_setting *settings, const uint8_t *ble_received_data, uint16_t ble_data_length) {
+    if (ble_data_length > 0 && ble_data_length != sizeof(stim_setting)) {
+        process_command(ble_received_data, ble_data_length);
+        return;
+    }
     if (ble_data_length == sizeof(stim_setting)) {
-        memcpy(settings, ble_received_data, sizeof(stim_setting));
-        // settings = (stim_setting *)ble_received_data;
+        stim_setting received;
+        memcpy(&received, ble_received_data, sizeof(stim_setting));
         // Process the settings as needed
         // For example, you can print them or use them in your application logic
         printf("Received settings:\n");
-        printf("DAC Amplitude: %u\n", settings->DAC_amplitude);
-        printf("Pulse Width: %u us\n", settings->pulse_width);
-        printf("Frequency: %u Hz\n", settings->frequency);
-        if (settings->frequency > 0) {
-            update_stim_frequency(settings->frequency);
-        } else {
-            printf("Warning: Received frequency is 0 Hz, timer not updated\n");
-        }
-        if (settings->pulse_width > 0) {
-            update_pulse_width(settings->pulse_width);
-        } else {
-            printf("Warning: Received pulse width is 0 us, pulse width not updated\n");
-        }
-        update_dac1_amplitude(settings->DAC_amplitude);
-        update_dac2_amplitude(settings->DAC_amplitude);
+        printf("DAC Amplitude: %u\n", received.DAC_amplitude);
+        printf("Pulse Width: %u us\n", received.pulse_width);
+        printf("Frequency: %u Hz\n", received.frequency);
+        CLOCK_HOT_BEGIN(clk);
+        commit_settings(settings, &received);
+        CLOCK_HOT_END(CLOCK_PATH_COMMIT, clk);
     } else {
         printf("Received data length mismatch: expected %zu, got %u\n",
                sizeof(stim_setting), ble_data_length);
     }
-}
\ No newline at end of file
+}
+
+void process_received_data(stim_setting *settings, uint8_t *ble_received_data, uint16_t ble_data_length) {
+    k_mutex_lock(&cmd_lock, K_FOREVER);
+    route = REPLY_NUS;
+    apply_received_data(settings, ble_received_data, ble_data_length);
+    k_mutex_unlock(&cmd_lock);
+}
+
+void process_uart_command(const uint8_t *data, uint16_t len) {
+    k_mutex_lock(&cmd_lock, K_FOREVER);
+    route = REPLY_UART;
+    apply_received_data(&settings, data, len);
+    route = REPLY_NUS;
+    k_mutex_unlock(&cmd_lock);
+}
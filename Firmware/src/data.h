@@ -1,6 +1,7 @@
 #ifndef DATA_H
 #define DATA_H
 #include <zephyr/types.h>
+#include "ctrl_frame.h"
 
 typedef struct{
     uint16_t DAC_amplitude;     //binary
@@ -8,10 +9,102 @@ typedef struct{
     uint16_t frequency;         // Hz
 } stim_setting;
 
-#define BLE_DATA_BUFFER_SIZE (sizeof(stim_setting)) 
+/*
+ * Control commands. A write of exactly sizeof(stim_setting) bytes is always a legacy
+ * stim_setting; any other length is [opcode][payload]. Command frames must therefore
+ * never be sizeof(stim_setting) bytes long. Multi-byte fields are little-endian.
+ */
+#define CMD_TRIGGER_CONFIG  0x10    // [0x10][armed u8][train_pulses u16]  (4 bytes)
+#define CMD_SYNC_MARKERS    0x11    // [0x11][max_markers u16]  (3 bytes; 0 = all)
+                                    // reply: [0x11][n u8][n x sync_marker] ... then
+                                    //        [0x11][0][dropped u32][pulses u32] as end of dump
+#define CMD_STOCHASTIC      0x12    // [0x12][dist u8][mean_rate_hz u16][jitter_pct u8]  (5 bytes; dist 0 = fixed)
+#define CMD_STIM_STORE      0x13    // [0x13][op u8]  (2 bytes) op 0: boot info, op 1: erase stored plan
+                                    // reply: [0x13][source u8][first_pulse_seen u8][boot_to_pulse_us u32]
+#define CMD_BOOT_PHASES     0x14    // [0x14]  (1 byte)
+                                    // reply: [0x14][within_budget u8][n u8][n x phase_us u32], boot_phase order, 0 = not reached
+#define CMD_CHANNEL_CONFIG  0x15    // [0x15][ch u8][enable u8][amplitude u16][pulse_width_us u16][frequency_hz u16]  (9 bytes)
+                                    // reply: [0x15][ch u8][err i8]  (0 = plan applied at next cycle,
+                                    // -EPERM = outside the charge limits)
+#define CMD_DEADLINE_STATS  0x16    // [0x16]  (1 byte)
+                                    // reply: [0x16][worst_edge u8][overruns u32][missed u32][worst_late_us u32]
+                                    //        [min_slack_us u32][wdt_resets u32][fatal_resets u32]
+#define CMD_ISR_CYCLES      0x17    // [0x17][op u8]  (2 bytes) op 0: read, op 1: read and reset
+                                    // reply: [0x17][within_budget u8][n u8] then per isr_path:
+                                    //        [calls u32][avg u32][max u32][budget u32][over_budget u32] (CPU cycles)
+#define CMD_GET_SETTING     0x18    // [0x18]  (1 byte)
+                                    // reply: [0x18][amplitude u16][pulse_width u16][frequency u16]
+                                    //        [engine_pulse_width_us u32][engine_period_us u32][engine_rate_mhz u32]
+#define CMD_ENERGY          0x19    // [0x19][op u8]  (2 bytes) op 0: read, op 1: read and reset
+                                    // reply: [0x19][elapsed_ms u32][hfclk_on_ms u32][cpu_isr_us u32][cpu_thread_ms u32]
+                                    //        [cpu_idle_ms u32][spi_us u32][radio_events u32][est_avg_ua u32]
+#define CMD_TELEMETRY       0x1A    // [0x1A][enable u8][update_ms u16]  (4 bytes; update_ms 0 = unchanged)
+                                    // reply: [0x1A][err i8]
+#define CMD_PLL             0x1B    // stimulation PLL (STIM_PLL_ENABLE), 64-bit values as [lo u32][hi u32]:
+                                    // [0x1B][0]  (2 bytes) status
+                                    //   reply: [0x1B][0][source u8][locked u8][skew_us i32][skew_max_us u32][skew_avg_us u32]
+                                    //          [adj_ppm i32][ref_missing u32][last_onset_us u64][period_ns u32]
+                                    // [0x1B][1]  (2 bytes) time ping; reply: [0x1B][1][now_us u64]
+                                    // [0x1B][2][onset_us u64][period_ns u32]  (14 bytes) BLE reference train,
+                                    //   in this device's timebase; reply: [0x1B][2][err i8]
+                                    // [0x1B][3][source u8][phase_offset_us i32]  (7 bytes) select reference;
+                                    //   reply: [0x1B][3][err i8]
+#define CMD_SET_RATE        0x1C    // [0x1C][rate_mhz u32]  (5 bytes) fine rate, 10 (0.01 Hz) .. 5000000 (5 kHz)
+                                    // reply: [0x1C][err i8]  (-ERANGE: outside the engine's range or too fast
+                                    // for the pulse width, -EPERM: outside the charge limits). Not stored;
+                                    // settings.frequency reads the rounded Hz.
+#define CMD_CHARGE_LIMIT    0x1D    // [0x1D][op u8]  (2 bytes) op 0: read, op 1: read, then clear the fault record and counters
+                                    // reply: [0x1D][stopped u8][reason u8][channel u8][fault_stopped u8][faults u32]
+                                    //        [rejected u32][phase_charge_pc u32][pulses_per_s_max u32][amplitude u16]
+                                    //        [pulse_width_us u16][rate_mhz u32][value u32][limit u32][uptime_ms u32]
+                                    // Last fault fields describe the plan at fault; reason 0 = none (charge_limit.h).
+                                    // A legacy setting outside the limits is dropped without being applied or stored.
+#define CMD_SESSION_LOG     0x1E    // flash session log (SESSION_LOG_ENABLE, page format in session_log.h):
+                                    // [0x1E][0]  (2 bytes) info; reply: [0x1E][0][ready u8][boot u16][pages u16]
+                                    //   [first_seq u32][last_seq u32][pages_written u32][dropped u32][errors u32][buffered u16]
+                                    // [0x1E][1][from_seq u32][max_pages u16]  (8 bytes; max_pages 0 = all) read pages
+                                    //   from_seq on, oldest first, as frames [0x1E][1][seq u32][offset u16][page bytes],
+                                    //   ending with [0x1E][1][0 u32][pages_sent u16]
+                                    // [0x1E][2]  (2 bytes) write the records buffered so far now; reply: [0x1E][2][err i8]
+#define CMD_CLOCK_POLICY    0x1F    // CPU clock policy (CLOCK_POLICY_ENABLE, clock_policy.h), 3 bytes each:
+                                    // [0x1F][0][policy u8] counters of one policy (0 high, 1 low, 2 boost)
+                                    //   reply: [0x1F][0][policy u8][in_effect u8][cpu_mhz u8][time_ms u32][held_us u32]
+                                    //   [busy_ms u32][switches u32][switch_max_ns u32][est_cpu_ua u32][edge_calls u32]
+                                    //   [edge_avg_ns u32][edge_max_ns u32][commit_calls u32][commit_avg_ns u32][commit_max_ns u32]
+                                    // [0x1F][1][policy u8] select; reply: [0x1F][1][err i8]
+                                    // [0x1F][2][0] restart every policy's counters; reply: [0x1F][2][0]
+#define CMD_STRESS          0x20    // parameter-update stress run (STRESS_ENABLE, stress.h):
+                                    // [0x20][0]  (2 bytes) report; reply: [0x20][0][running u8][updates u32][in_pulse u32]
+                                    //   [rejected u32][pulses u32][dropped u32][doubled u32][stretched u32][unbalanced u32]
+                                    //   [late u32][worst_err_ns u32][worst_update_err_ns u32][wrong_amplitude u32]
+                                    // [0x20][1][duration_s u16][interval_us u32]  (8 bytes; duration 0 = until stopped)
+                                    //   start; reply: [0x20][1][err i8]
+                                    // [0x20][2]  (2 bytes) stop and restore the starting plan; reply: [0x20][2][0]
+#define CMD_CLOSED_LOOP     0x21    // phase-locked closed loop (CLOSED_LOOP_ENABLE, closed_loop.h):
+                                    // [0x21][0]  (2 bytes) report; reply: [0x21][0][running u8][target_deg u16][band_lo_dhz u16]
+                                    //   [band_hi_dhz u16][min_amplitude u16][blocks u32][resyncs u32][crossings u32][rejected u32]
+                                    //   [gated u32][deferred u32][scheduled u32][refreshed u32][missed u32][fired u32]
+                                    //   [evaluated u32][err_mean_cdeg i32][abs_err_mean_cdeg u32][abs_err_max_cdeg u32]
+                                    //   [period_us u32][amplitude u32][latency_avg_us u32][latency_max_us u32]
+                                    //   [over_latency u32][block_max_us u32][load_ppm u32]
+                                    // [0x21][1][target_deg u16][band_lo_dhz u16][band_hi_dhz u16][min_amplitude u16]
+                                    //   (10 bytes) parameters, restarting a running loop; reply: [0x21][1][err i8]
+                                    // [0x21][2][run u8]  (3 bytes) start (1, counters zeroed) or stop (0); reply: [0x21][2][err i8]
+                                    // any other sub-opcode or run value: reply [0x21][op][-EINVAL]
+#define CMD_FLPR            0x22    // FLPR sequencer (FLPR_SEQ_ENABLE, flpr_seq.h): [0x22]  (1 byte) report;
+                                    //   reply: [0x22][state u8][pulses u32][late_edges u32][worst_late_ns u32]
+                                    //   [plans_sent u32][plans_applied u32][plans_rejected u32][plans_unsent u32][stalls u32]
+                                    //   [wrong_amplitude u32]
+
+/* The same commands are accepted framed on the NUS UART (ctrl_frame.h) */
+
+#define CMD_REPLY_MAX_LEN 244       // largest notification payload with data length extension
+#define BLE_DATA_BUFFER_SIZE CMD_MAX_LEN
 extern uint8_t ble_received_data[];
 extern uint16_t ble_data_length;
 extern stim_setting settings;
 
 void process_received_data(stim_setting *settings, uint8_t *ble_received_data, uint16_t ble_data_length);
+/** One complete UART control frame payload (sync and length stripped). */
+void process_uart_command(const uint8_t *data, uint16_t len);
 #endif // DATA_H
\ No newline at end of file
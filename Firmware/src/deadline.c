@@ -0,0 +1,185 @@
+/*
+ * Pulse deadline monitor. Each compare edge's work (switch GPIO plus a blocking DAC write)
+ * must finish before the next compare is due, otherwise that phase is stretched and the
+ * pulse is no longer charge balanced. The end of every edge is checked against the next
+ * compare, the edge order is checked for skipped compares, and a hardware watchdog fed once
+ * per completed pulse catches a stalled engine. Watchdog timeouts and fatal errors drive the
+ * switches to the safe state before the chip resets.
+ */
+#include <nrfx_timer.h>
+#include <nrfx_wdt.h>
+#include <zephyr/kernel.h>
+#include <zephyr/fatal.h>
+#include <zephyr/sys/reboot.h>
+#include "deadline.h"
+#include "stim_pins.h"
+#include "timer.h"
+#include "config.h"
+
+#if DEADLINE_MONITOR_ENABLE
+
+/* The instance deadline.h picks has to be compiled in: prj*.conf (nRF5340), nrf54l.conf (nRF54L15) */
+#if defined(CONFIG_SOC_SERIES_NRF54LX) && !defined(CONFIG_NRFX_WDT31)
+#error "DEADLINE_MONITOR_ENABLE on the nRF54L needs CONFIG_NRFX_WDT31: add -DEXTRA_CONF_FILE=nrf54l.conf"
+#elif !defined(CONFIG_SOC_SERIES_NRF54LX) && !defined(CONFIG_NRFX_WDT0)
+#error "DEADLINE_MONITOR_ENABLE needs CONFIG_NRFX_WDT0"
+#endif
+
+#define DEADLINE_RETAINED_MAGIC 0x444C4D31u    // "DLM1"
+
+/* Survives the watchdog and fatal-error resets (not power-on) */
+static __noinit struct {
+    uint32_t magic;
+    uint32_t wdt_resets;
+    uint32_t fatal_resets;
+} retained;
+
+static void retained_check(void)
+{
+    if (retained.magic != DEADLINE_RETAINED_MAGIC) {
+        retained.magic = DEADLINE_RETAINED_MAGIC;
+        retained.wdt_resets = 0;
+        retained.fatal_resets = 0;
+    }
+}
+
+/* Replaces the default handler (CONFIG_RESET_ON_FATAL_ERROR=n): open every switch first,
+ * then reset so the stored plan restarts stimulation cleanly. */
+void k_sys_fatal_error_handler(unsigned int reason, const struct arch_esf *esf)
+{
+    ARG_UNUSED(reason);
+    ARG_UNUSED(esf);
+
+#if FLPR_SEQ_ACTIVE
+    /* Else the FLPR drives the switches again at its next edge */
+    flpr_seq_halt();
+#endif
+    stim_pins_safe();
+    retained_check();
+    retained.fatal_resets++;
+    sys_reboot(SYS_REBOOT_COLD);
+}
+
+#endif /* DEADLINE_MONITOR_ENABLE */
+
+#if DEADLINE_ACTIVE
+
+static const nrfx_wdt_t wdt = NRFX_WDT_INSTANCE(DEADLINE_WDT_INST_IDX);
+static nrfx_wdt_channel_id wdt_ch;
+static bool wdt_running;
+
+/* Compare due after each edge's work; -1 if the timer is not running toward one
+ * (RTC mode: the timer starts after edge 0 and stops at edge 3) */
+#if defined(CONFIG_BT)
+static const int8_t next_cc[4] = { 1, 2, 3, 0 };
+#else
+static const int8_t next_cc[4] = { -1, 2, 3, -1 };
+#endif
+
+static uint8_t expected_edge;
+static bool synced;
+
+static uint32_t overruns;
+static uint32_t missed;
+static uint32_t worst_late_ticks;
+static uint32_t min_slack_ticks = UINT32_MAX;
+static uint8_t worst_edge;
+
+/* Runs two 32 kHz cycles before the watchdog reset */
+static void wdt_handler(nrf_wdt_event_t event_type, uint32_t requests, void *p_context)
+{
+    ARG_UNUSED(event_type);
+    ARG_UNUSED(requests);
+    ARG_UNUSED(p_context);
+
+    stim_pins_safe();
+    retained_check();
+    retained.wdt_resets++;
+}
+
+void deadline_resync(void)
+{
+    synced = false;
+}
+
+void deadline_feed(void)
+{
+    if (wdt_running) {
+        nrfx_wdt_channel_feed(&wdt, wdt_ch);
+    }
+}
+
+void deadline_edge_done(uint8_t edge)
+{
+    nrfx_timer_t const *t = timer_stim_instance();
+    int8_t cc = next_cc[edge];
+
+    if (synced && edge != expected_edge) {
+        missed += (edge - expected_edge) & 3u;
+    }
+    expected_edge = (edge + 1) & 3u;
+    synced = true;
+
+    if (cc >= 0) {
+        uint32_t now = nrfx_timer_capture(t, DEADLINE_CC);
+        uint32_t due = nrf_timer_cc_get(t->p_reg, (nrf_timer_cc_channel_t)cc);
+
+        if (nrf_timer_event_check(t->p_reg, nrf_timer_compare_event_get(cc))) {
+            /* Next compare already fired. CC0 clears the timer in BLE mode, in which case
+             * "now" is already the time past it. */
+            uint32_t late = now >= due ? now - due : now;
+            overruns++;
+            if (late >= worst_late_ticks) {
+                worst_late_ticks = late;
+                worst_edge = edge;
+            }
+        } else if (due > now && due - now < min_slack_ticks) {
+            min_slack_ticks = due - now;
+        }
+    }
+
+    if (edge == 3 && wdt_running) {
+        nrfx_wdt_channel_feed(&wdt, wdt_ch);
+    }
+}
+
+int deadline_init(void)
+{
+    nrfx_wdt_config_t config = NRFX_WDT_DEFAULT_CONFIG;
+
+    retained_check();
+    if (retained.wdt_resets || retained.fatal_resets) {
+        printf("Deadline: %lu watchdog / %lu fatal-error resets since power-on\n",
+               retained.wdt_resets, retained.fatal_resets);
+    }
+
+    config.reload_value = DEADLINE_WDT_MS;
+    if (nrfx_wdt_init(&wdt, &config, wdt_handler, NULL) != NRFX_SUCCESS ||
+        nrfx_wdt_channel_alloc(&wdt, &wdt_ch) != NRFX_SUCCESS) {
+        printf("Deadline: watchdog init failed\n");
+        return -EIO;
+    }
+    nrfx_wdt_enable(&wdt);
+    wdt_running = true;
+    printf("Deadline monitor on (watchdog %u ms)\n", DEADLINE_WDT_MS);
+    return 0;
+}
+
+void get_deadline_stats(deadline_stats *stats)
+{
+    /* Tick rate at the stim TIMER's current prescaler (slow rates may leave 16 MHz) */
+    uint64_t tick_hz = timer_stim_tick_hz();
+    unsigned int key = irq_lock();
+
+    stats->overruns = overruns;
+    stats->missed = missed;
+    stats->worst_late_us = (uint32_t)(worst_late_ticks * 1000000ull / tick_hz);
+    stats->min_slack_us = min_slack_ticks == UINT32_MAX ? UINT32_MAX :
+                          (uint32_t)(min_slack_ticks * 1000000ull / tick_hz);
+    stats->worst_edge = worst_edge;
+    irq_unlock(key);
+    stats->wdt_resets = retained.wdt_resets;
+    stats->fatal_resets = retained.fatal_resets;
+}
+
+#endif /* DEADLINE_ACTIVE */
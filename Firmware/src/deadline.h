@@ -0,0 +1,71 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <nrfx_timer.h>
+#include "stochastic.h"
+#include "sched.h"
+#include "flpr_seq.h"
+#include "config.h"
+
+/* Edge checks and the watchdog cover the fixed CC0-CC3 engine (BLE continuous and RTC one-shot).
+ * Trigger mode has no guaranteed pulse rate to feed a watchdog from, the multichannel plan
+ * reports its own late edges (sched_stats) and the FLPR sequencer its own, with a heartbeat
+ * check in place of the watchdog (flpr_seq.h). The fatal-error safe state applies to every mode. */
+#if DEADLINE_MONITOR_ENABLE && !TRIGGER_MODE && !MULTICHANNEL_ACTIVE && !FLPR_SEQ_ACTIVE
+#define DEADLINE_ACTIVE 1
+#else
+#define DEADLINE_ACTIVE 0
+#endif
+
+/* Stim TIMER channel used to capture "now" at the end of each edge's work. CC4 is taken by
+ * MEASURE_TIMER and CC5 is only used by trigger mode, which has no deadline checks. */
+#define DEADLINE_CC NRF_TIMER_CC_CHANNEL5
+
+/* Watchdog timeout: longer than the slowest pulse interval (1 Hz, or STOCH_MAX_MEAN_MULT times
+ * that with stochastic intervals), since it is fed once per completed biphasic pulse. */
+#if STOCHASTIC_IPI_ENABLE
+#define DEADLINE_WDT_MS (1000u * STOCH_MAX_MEAN_MULT + 1000u)
+#else
+#define DEADLINE_WDT_MS 2000u
+#endif
+
+#if defined(CONFIG_SOC_SERIES_NRF54LX)
+#define DEADLINE_WDT_INST_IDX 31
+#else
+#define DEADLINE_WDT_INST_IDX 0
+#endif
+
+typedef struct {
+    uint32_t overruns;          // edge work still running when the next compare was due
+    uint32_t missed;            // compares skipped in the CC0-CC1-CC2-CC3 order
+    uint32_t worst_late_us;     // largest overrun past the next compare
+    uint32_t min_slack_us;      // smallest margin to the next compare (UINT32_MAX: none measured)
+    uint8_t worst_edge;         // edge (0-3) whose work overran by worst_late_us
+    uint32_t wdt_resets;        // watchdog timeouts since power-on (retained across resets)
+    uint32_t fatal_resets;      // fatal errors since power-on (retained across resets)
+} deadline_stats;
+
+/**
+ * Start the pulse watchdog. Call once stimulation is running; from then on every completed
+ * biphasic pulse feeds it, and a stall longer than DEADLINE_WDT_MS drives the switches to
+ * the safe state (stim_pins_safe) and resets the chip.
+ */
+int deadline_init(void);
+
+/**
+ * End of the work for compare edge 0-3. ISR context. Checks the edge order and how much of
+ * the time to the next compare is left; edge 3 feeds the watchdog.
+ */
+void deadline_edge_done(uint8_t edge);
+
+/** The stim TIMER was cleared or re-timed: the next edge restarts the order check. */
+void deadline_resync(void);
+
+/** Feed the watchdog without a pulse: RTC wakes during a duty-cycle off period. ISR safe. */
+void deadline_feed(void);
+
+void get_deadline_stats(deadline_stats *stats);
+
+#endif /* DEADLINE_H */
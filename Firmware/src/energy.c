@@ -0,0 +1,200 @@
+/*
+ * Energy accounting. Every counter is either a hardware/kernel total read on demand or a
+ * timestamp taken at a state change the firmware makes anyway, so nothing here runs
+ * periodically or adds work to the pulse path beyond the DWT counts already in isr_cycles.
+ * Counters can be read on the shell ("energy") or over BLE/UART with CMD_ENERGY.
+ */
+#include <zephyr/kernel.h>
+#include <hal/nrf_clock.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+#include "energy.h"
+#include "isr_cycles.h"
+#include "config.h"
+
+#if ENERGY_ACCOUNTING_ENABLE
+
+static struct {
+    int64_t last;           // k_uptime_ticks() at the last sample
+    bool on;
+    int64_t on_ticks;
+} hf;
+
+static struct {
+    energy_radio_state state;
+    uint32_t interval_us;
+    int64_t since;          // k_uptime_ticks() when the state was entered
+    uint32_t events;        // events of the states already left
+} radio;
+
+/* Values at the last reset. Totals owned by other modules are never cleared here. */
+static struct {
+    int64_t ticks;
+    uint64_t isr_cycles;
+    uint64_t spi_cycles;
+    uint64_t thread_cycles;
+    uint64_t idle_cycles;
+} base;
+
+static uint32_t cpu_mhz;
+
+static uint64_t stim_isr_cycles(void)
+{
+    return isr_cycles_total(ISR_PATH_TIMER) + isr_cycles_total(ISR_PATH_RTC);
+}
+
+static void runtime_cycles(uint64_t *thread, uint64_t *idle)
+{
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+    k_thread_runtime_stats_t rt;
+
+    k_thread_runtime_stats_all_get(&rt);
+    *thread = rt.total_cycles;
+    *idle = rt.idle_cycles;
+#else
+    *thread = 0;
+    *idle = 0;
+#endif
+}
+
+static uint32_t radio_events_at(int64_t now)
+{
+    uint32_t n = radio.events;
+
+    if (radio.state != ENERGY_RADIO_IDLE && radio.interval_us != 0) {
+        n += (uint32_t)(k_ticks_to_us_floor64(now - radio.since) / radio.interval_us);
+    }
+    return n;
+}
+
+void energy_hfclk_sample(void)
+{
+    unsigned int key = irq_lock();
+    int64_t now = k_uptime_ticks();
+
+    if (hf.on) {
+        hf.on_ticks += now - hf.last;
+    }
+    hf.last = now;
+    hf.on = (NRF_CLOCK_S->HFCLKSTAT & CLOCK_HFCLKSTAT_STATE_Msk) != 0;
+    irq_unlock(key);
+}
+
+void energy_radio_set(energy_radio_state state, uint32_t interval_us)
+{
+    unsigned int key = irq_lock();
+    int64_t now = k_uptime_ticks();
+
+    radio.events = radio_events_at(now);
+    radio.state = state;
+    radio.interval_us = interval_us;
+    radio.since = now;
+    irq_unlock(key);
+}
+
+void energy_reset(void)
+{
+    uint64_t thread;
+    uint64_t idle;
+
+    runtime_cycles(&thread, &idle);
+    energy_hfclk_sample();
+
+    unsigned int key = irq_lock();
+
+    base.ticks = k_uptime_ticks();
+    base.isr_cycles = stim_isr_cycles();
+    base.spi_cycles = isr_cycles_total(ISR_PATH_SPI_DAC);
+    base.thread_cycles = thread;
+    base.idle_cycles = idle;
+    hf.on_ticks = 0;
+    radio.events = 0;
+    radio.since = base.ticks;
+    irq_unlock(key);
+}
+
+void energy_init(void)
+{
+    cpu_mhz = SystemCoreClock / 1000000u;
+    energy_reset();
+}
+
+void get_energy_stats(energy_stats *stats)
+{
+    uint64_t thread;
+    uint64_t idle;
+
+    runtime_cycles(&thread, &idle);
+    energy_hfclk_sample();
+
+    unsigned int key = irq_lock();
+    int64_t now = k_uptime_ticks();
+    uint64_t elapsed_us = k_ticks_to_us_floor64(now - base.ticks);
+    uint64_t hf_us = k_ticks_to_us_floor64(hf.on_ticks);
+    uint64_t isr_us = (stim_isr_cycles() - base.isr_cycles) / cpu_mhz;
+    uint64_t spi_us = (isr_cycles_total(ISR_PATH_SPI_DAC) - base.spi_cycles) / cpu_mhz;
+    uint32_t events = radio_events_at(now);
+
+    irq_unlock(key);
+
+    uint64_t thread_us = k_cyc_to_us_floor64(thread - base.thread_cycles);
+    uint64_t idle_us = k_cyc_to_us_floor64(idle - base.idle_cycles);
+
+    stats->elapsed_ms = (uint32_t)(elapsed_us / 1000u);
+    stats->hfclk_on_ms = (uint32_t)(hf_us / 1000u);
+    stats->cpu_isr_us = (uint32_t)isr_us;
+    stats->cpu_thread_ms = (uint32_t)(thread_us / 1000u);
+    stats->cpu_idle_ms = (uint32_t)(idle_us / 1000u);
+    stats->spi_us = (uint32_t)spi_us;
+    stats->radio_events = events;
+
+    /* Charge in uA*us; 1 nC = 1000 uA*us */
+    uint64_t busy_us = MIN(thread_us + isr_us, elapsed_us);
+    uint64_t charge = busy_us * CONFIG_ENERGY_CPU_UA +
+                      (elapsed_us - busy_us) * CONFIG_ENERGY_SLEEP_UA +
+                      hf_us * CONFIG_ENERGY_HFCLK_UA +
+                      spi_us * CONFIG_ENERGY_SPI_UA +
+                      (uint64_t)events * CONFIG_ENERGY_RADIO_EVENT_NC * 1000u;
+
+    stats->est_avg_ua = elapsed_us ? (uint32_t)(charge / elapsed_us) : 0;
+}
+
+#if defined(CONFIG_SHELL)
+static int cmd_energy_show(const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+    energy_stats st;
+
+    get_energy_stats(&st);
+    shell_print(sh, "elapsed      %u ms", st.elapsed_ms);
+    shell_print(sh, "HFCLK on     %u ms", st.hfclk_on_ms);
+    shell_print(sh, "CPU stim ISR %u us", st.cpu_isr_us);
+    shell_print(sh, "CPU threads  %u ms", st.cpu_thread_ms);
+    shell_print(sh, "CPU idle     %u ms", st.cpu_idle_ms);
+    shell_print(sh, "SPI          %u us", st.spi_us);
+    shell_print(sh, "radio events %u (estimated)", st.radio_events);
+    shell_print(sh, "avg current  %u uA (estimated)", st.est_avg_ua);
+    return 0;
+}
+
+static int cmd_energy_reset(const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    energy_reset();
+    shell_print(sh, "energy counters reset");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(energy_cmds,
+    SHELL_CMD(show, NULL, "Print the active-time counters and the current estimate", cmd_energy_show),
+    SHELL_CMD(reset, NULL, "Restart the counters from now", cmd_energy_reset),
+    SHELL_SUBCMD_SET_END
+);
+SHELL_CMD_REGISTER(energy, &energy_cmds, "Energy accounting", cmd_energy_show);
+#endif /* CONFIG_SHELL */
+
+#endif /* ENERGY_ACCOUNTING_ENABLE */
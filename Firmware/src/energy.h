@@ -0,0 +1,53 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/*
+ * Active-time counters per subsystem, so the prj_*.conf variants can be compared from the
+ * firmware's own view of its power behavior instead of by guesswork:
+ *  - HFCLK on time: sampled at every HFCLK start/stop this firmware makes and at each read
+ *  - CPU: stim ISR time from the DWT totals (isr_cycles.h); thread and idle time from the
+ *    kernel's runtime stats (CONFIG_SCHED_THREAD_USAGE_ALL). Zephyr charges an ISR to the
+ *    thread it interrupted, so stim ISRs taken from idle count as idle there; busy time for
+ *    the estimate is thread time plus stim ISR time.
+ *  - SPI: DAC transfer time (spi_write_dac1), DWT
+ *  - Radio: events estimated from the time spent advertising and connected and the
+ *    interval of each. On the nRF5340 the radio runs on the network core, so the application
+ *    core never sees the events themselves.
+ * The current estimate weights each counter by the CONFIG_ENERGY_* currents in config.h.
+ */
+typedef struct {
+    uint32_t elapsed_ms;        // since boot or the last reset
+    uint32_t hfclk_on_ms;
+    uint32_t cpu_isr_us;        // timer_handler + rtc_handler
+    uint32_t cpu_thread_ms;     // non-idle threads (0 without CONFIG_SCHED_THREAD_USAGE_ALL)
+    uint32_t cpu_idle_ms;
+    uint32_t spi_us;
+    uint32_t radio_events;      // estimated advertising + connection events
+    uint32_t est_avg_ua;        // estimated average supply current
+} energy_stats;
+
+typedef enum {
+    ENERGY_RADIO_IDLE = 0,
+    ENERGY_RADIO_ADV,
+    ENERGY_RADIO_CONN,
+} energy_radio_state;
+
+/** Take the baseline and the first HFCLK sample. Call after isr_cycles_init(). */
+void energy_init(void);
+
+/** Record the HFCLK state now. Call right after starting or stopping HFCLK. ISR safe. */
+void energy_hfclk_sample(void);
+
+/** Radio activity changed (advertising started, connected, parameters updated, disconnected). */
+void energy_radio_set(energy_radio_state state, uint32_t interval_us);
+
+void get_energy_stats(energy_stats *stats);
+
+/** Restart every counter from now. */
+void energy_reset(void);
+
+#endif /* ENERGY_H */
@@ -0,0 +1,128 @@
+#ifndef FLPR_MBOX_H
+#define FLPR_MBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "seq_core.h"
+
+/*
+ * Shared-memory mailbox between the application core (flpr_seq.c) and the FLPR sequencer
+ * (flpr/src/main.c). One writer per field group:
+ *  app -> FLPR: the hardware description (written once, before magic) and the committed plan
+ *  FLPR -> app: state, heartbeat and telemetry
+ * The plan and the telemetry are each guarded by a sequence counter (odd while the writer is
+ * inside); a reader copies and retries if the counter moved, so neither side ever waits on
+ * the other and the FLPR never sees half a plan.
+ *
+ * Start-up: the application zeroes the mailbox before the VPR launcher starts the FLPR
+ * (PRE_KERNEL_1), so a plan left in RAM by the previous boot is never run. The FLPR then
+ * reports READY and waits for magic; from there it follows plan_seq.
+ */
+#define FLPR_MBOX_MAGIC     0x51455346u    // "FSEQ"
+#define FLPR_MBOX_VERSION   2u
+#define FLPR_MBOX_PORTS     3u             // GPIO ports P0-P2
+
+typedef enum {
+    FLPR_STATE_OFF = 0,         // not started (mailbox as zeroed by the app)
+    FLPR_STATE_READY,           // booted, waiting for magic
+    FLPR_STATE_RUNNING,         // sequencing the plan
+    FLPR_STATE_FAULT,           // version mismatch or no valid first plan; switches idle
+} flpr_state;
+
+typedef struct {
+    uint32_t clr[SEQ_EDGE_COUNT][FLPR_MBOX_PORTS];  // OUTCLR per edge and port, written before
+    uint32_t set[SEQ_EDGE_COUNT][FLPR_MBOX_PORTS];  // OUTSET (break-before-make, stim_pins.h)
+    uint32_t dac_cs_pin;
+    uint32_t sck_pin, mosi_pin, miso_pin;
+    uint32_t spi_hz;
+} flpr_mbox_hw;
+
+typedef struct {
+    uint32_t tick_hz;           // sequencer TIMER rate
+    uint32_t pulses;            // completed biphasic pulses
+    uint32_t late_edges;        // edges started more than CONFIG_FLPR_SEQ_LATE_NS after their time
+    uint32_t worst_late_ticks;
+    uint32_t applied_seq;       // plan_seq of the last plan read
+    uint32_t plans_applied;     // plans taken into effect, the first included
+    uint32_t plans_rejected;    // plans seq_commit refused; the previous one kept running
+    uint32_t pulse_seq;         // plan_seq of the plan the last completed pulse ran under
+    uint32_t pulse_phase1;      // DAC words that pulse clocked out
+    uint32_t pulse_phase2;
+} flpr_mbox_telemetry;
+
+typedef struct {
+    uint32_t magic;             // app: last, once hw, version and the first plan are in
+    uint32_t version;
+    flpr_mbox_hw hw;
+    uint32_t plan_seq;
+    seq_plan plan;
+
+    uint32_t state;             // FLPR: flpr_state
+    uint32_t heartbeat;         // FLPR: advanced on every pass of its wait loop
+    uint32_t telem_seq;
+    flpr_mbox_telemetry telem;
+} flpr_mbox;
+
+#define FLPR_MBOX_WORDS(s) (sizeof(s) / sizeof(uint32_t))
+
+/* Both sides and the host build with GCC: dmb on the M33, fence on the RISC-V */
+#define FLPR_MBOX_BARRIER() __sync_synchronize()
+
+/** Single writer: publish words under *seq. */
+static inline void flpr_mbox_write(volatile uint32_t *seq, volatile uint32_t *dst, const void *src, size_t words)
+{
+    const uint32_t *s = src;
+
+    *seq = *seq + 1u;
+    FLPR_MBOX_BARRIER();
+    for (size_t i = 0; i < words; i++) {
+        dst[i] = s[i];
+    }
+    FLPR_MBOX_BARRIER();
+    *seq = *seq + 1u;
+}
+
+/** Copy words published under *seq. false if the writer was inside; try again. */
+static inline bool flpr_mbox_read(const volatile uint32_t *seq, const volatile uint32_t *src, void *dst,
+                                  size_t words, uint32_t *seq_out)
+{
+    uint32_t *d = dst;
+    uint32_t before = *seq;
+
+    if (before & 1u) {
+        return false;
+    }
+    FLPR_MBOX_BARRIER();
+    for (size_t i = 0; i < words; i++) {
+        d[i] = src[i];
+    }
+    FLPR_MBOX_BARRIER();
+    if (seq_out) {
+        *seq_out = before;
+    }
+    return *seq == before;
+}
+
+#if defined(__ZEPHYR__)
+#include <zephyr/devicetree.h>
+
+/*
+ * Mailbox RAM: the "flpr_mbox" node of flpr.overlay (application) and flpr/app.overlay
+ * (FLPR), the top 4 KB of the FLPR's SRAM, which the FLPR image leaves out of its own.
+ */
+#if DT_NODE_EXISTS(DT_NODELABEL(flpr_mbox))
+#define FLPR_MBOX_ADDR DT_REG_ADDR(DT_NODELABEL(flpr_mbox))
+#else
+#define FLPR_MBOX_ADDR 0x2003F000u
+#endif
+#define FLPR_MBOX ((volatile flpr_mbox *)FLPR_MBOX_ADDR)
+
+/* Peripherals the FLPR owns while it sequences; the application core leaves them alone.
+ * SPIM00 is the instance with dedicated pins on P2, where the DAC bus is. */
+#define FLPR_SEQ_TIMER NRF_TIMER21
+#define FLPR_SEQ_SPIM  NRF_SPIM00
+#define FLPR_SEQ_TICK_HZ 16000000u     // TIMER21 at prescaler 0
+#endif
+
+#endif /* FLPR_MBOX_H */
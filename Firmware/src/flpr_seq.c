@@ -0,0 +1,260 @@
+/*
+ * Application side of the FLPR sequencer (flpr_seq.h): the plan the update_* calls build,
+ * the mailbox writes, and the heartbeat check on the system workqueue. Nothing here runs on
+ * the pulse path; the application core only writes a plan and reads counters.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <hal/nrf_vpr.h>
+#include "flpr_seq.h"
+#include "flpr_mbox.h"
+#include "seq_core.h"
+#include "stim_pins.h"
+#include "spi.h"
+#include "timer.h"
+#include "config.h"
+
+#if FLPR_SEQ_ACTIVE
+
+#define FLPR_SEQ_VPR      NRF_VPR00
+#define FLPR_SEQ_SPI_HZ   2000000u      // as spi_init
+#define TELEM_READ_TRIES  8             // a halted FLPR can leave the counter odd
+#define SENT_PLANS        4             // sent plans a reported pulse is looked up in
+
+static volatile flpr_mbox *const mbox = FLPR_MBOX;
+static K_MUTEX_DEFINE(plan_lock);
+static struct k_work_delayable watch_work;
+static uint32_t last_heartbeat;
+
+/* Plan as the update_* calls leave it; sent whole. The amplitude is not kept here: every
+ * plan carries the committed DAC word (spi.c), the one the other engines latch. */
+static seq_plan staged = {
+    .rate_mhz = 1000000000u / DEFAULT_STIM_PERIOD,
+    .pulse_width_us = DEFAULT_PULSE_WIDTH,
+    .gap_us = SWITCH_PERIOD,
+};
+static struct {
+    uint32_t seq;               // plan_seq once written; 0 for an empty slot
+    uint16_t amplitude;
+} sent[SENT_PLANS];
+static uint32_t sent_count;
+static bool started;            // flpr_seq_init done: updates go to the mailbox
+static uint32_t hold_depth;
+static flpr_seq_stats stats;    // application-side counters
+
+/* Before the VPR launcher (POST_KERNEL) starts the FLPR: nothing of the previous boot is run */
+static int flpr_mbox_reset(void)
+{
+    volatile uint32_t *w = (volatile uint32_t *)mbox;
+
+    for (size_t i = 0; i < FLPR_MBOX_WORDS(flpr_mbox); i++) {
+        w[i] = 0;
+    }
+    return 0;
+}
+SYS_INIT(flpr_mbox_reset, PRE_KERNEL_1, 0);
+
+/* Same masks the continuous engine's stim_pins_* calls write, per edge */
+static void hw_fill(flpr_mbox_hw *hw)
+{
+    for (uint32_t p = 0; p < FLPR_MBOX_PORTS; p++) {
+        hw->clr[SEQ_EDGE_ONSET][p] = STIM_ONSET_CLR(p);
+        hw->set[SEQ_EDGE_ONSET][p] = STIM_ONSET_SET(p);
+        hw->clr[SEQ_EDGE_INTERPHASE][p] = STIM_INTERPHASE_CLR(p);
+        hw->set[SEQ_EDGE_INTERPHASE][p] = STIM_INTERPHASE_SET(p);
+        hw->clr[SEQ_EDGE_PHASE2][p] = STIM_PHASE2_CLR(p);
+        hw->set[SEQ_EDGE_PHASE2][p] = STIM_PHASE2_SET(p);
+        hw->clr[SEQ_EDGE_END][p] = STIM_IDLE_CLR(p);
+        hw->set[SEQ_EDGE_END][p] = STIM_IDLE_SET(p);
+    }
+    /* Both phases on DAC1, as the continuous engine writes them */
+    hw->dac_cs_pin = DAC1_CS_PIN;
+    hw->sck_pin = SCK_PIN;
+    hw->mosi_pin = MOSI_PIN;
+    hw->miso_pin = MISO_PIN;
+    hw->spi_hz = FLPR_SEQ_SPI_HZ;
+}
+
+/* plan_lock held */
+static void plan_send(void)
+{
+    if (!started || hold_depth > 0) {
+        return;
+    }
+    staged.amplitude = dac_amplitude_get();
+    if (seq_plan_check(&staged, FLPR_SEQ_TICK_HZ) != 0) {
+        /* Left staged: the next update may make it fit (width first, then a slower rate) */
+        stats.plans_unsent++;
+        printf("FLPR plan not sent: %lu us pulses do not fit %lu mHz\n",
+               staged.pulse_width_us, staged.rate_mhz);
+        return;
+    }
+    flpr_mbox_write(&mbox->plan_seq, (volatile uint32_t *)&mbox->plan, &staged,
+                    FLPR_MBOX_WORDS(seq_plan));
+    sent[sent_count % SENT_PLANS].seq = mbox->plan_seq;
+    sent[sent_count % SENT_PLANS].amplitude = (uint16_t)staged.amplitude;
+    sent_count++;
+    stats.plans_sent++;
+}
+
+static bool telem_read(flpr_mbox_telemetry *t)
+{
+    for (int i = 0; i < TELEM_READ_TRIES; i++) {
+        if (flpr_mbox_read(&mbox->telem_seq, (const volatile uint32_t *)&mbox->telem, t,
+                           FLPR_MBOX_WORDS(*t), NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The last pulse's words: phase 2 the mirror of phase 1, and phase 1 the amplitude sent with
+ * the plan the pulse ran under, when that plan is among the last few sent */
+static bool pulse_words_ok(const flpr_mbox_telemetry *t)
+{
+    bool ok = t->pulse_phase2 == DAC_MIRROR(t->pulse_phase1);
+
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    for (int i = 0; i < SENT_PLANS; i++) {
+        if (sent[i].seq != 0 && sent[i].seq == t->pulse_seq && t->pulse_phase1 != sent[i].amplitude) {
+            ok = false;
+        }
+    }
+    k_mutex_unlock(&plan_lock);
+    return ok;
+}
+
+static void watch_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    uint32_t heartbeat = mbox->heartbeat;
+    uint32_t state = mbox->state;
+    flpr_mbox_telemetry t;
+
+    if (state == FLPR_STATE_RUNNING && telem_read(&t) && t.pulses != 0 && !pulse_words_ok(&t)) {
+        /* Not rescheduled either: a pulse left at another current than the one committed */
+        flpr_seq_halt();
+        stim_pins_safe();
+        stats.wrong_amplitude++;
+        printf("FLPR sequencer sent 0x%04lX/0x%04lX under plan %lu, committed 0x%04X: halted, switches safe\n",
+               t.pulse_phase1, t.pulse_phase2, t.pulse_seq, dac_amplitude_get());
+        return;
+    }
+    if (heartbeat == last_heartbeat || state == FLPR_STATE_FAULT) {
+        /* Not rescheduled: the switches stay safe until the next reset */
+        flpr_seq_halt();
+        stim_pins_safe();
+        stats.stalls++;
+        printf("FLPR sequencer %s: halted, switches safe\n",
+               state == FLPR_STATE_FAULT ? "fault" : "stalled");
+        return;
+    }
+    last_heartbeat = heartbeat;
+    k_work_schedule(&watch_work, K_MSEC(CONFIG_FLPR_SEQ_WATCH_MS));
+}
+
+int flpr_seq_init(void)
+{
+    flpr_mbox_hw hw;
+    volatile uint32_t *dst = (volatile uint32_t *)&mbox->hw;
+    const uint32_t *src = (const uint32_t *)&hw;
+
+    hw_fill(&hw);
+    for (size_t i = 0; i < FLPR_MBOX_WORDS(hw); i++) {
+        dst[i] = src[i];
+    }
+    mbox->version = FLPR_MBOX_VERSION;
+
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    started = true;
+    plan_send();
+    k_mutex_unlock(&plan_lock);
+
+    FLPR_MBOX_BARRIER();
+    mbox->magic = FLPR_MBOX_MAGIC;
+
+    for (uint32_t ms = 0; ms < CONFIG_FLPR_SEQ_BOOT_MS && mbox->state != FLPR_STATE_RUNNING; ms++) {
+        k_msleep(1);
+    }
+    last_heartbeat = mbox->heartbeat;
+    k_work_init_delayable(&watch_work, watch_handler);
+    k_work_schedule(&watch_work, K_MSEC(CONFIG_FLPR_SEQ_WATCH_MS));
+
+    if (mbox->state != FLPR_STATE_RUNNING) {
+        printf("FLPR sequencer not running (state %lu)\n", (uint32_t)mbox->state);
+        return -ETIMEDOUT;
+    }
+    printf("FLPR sequencer running: %lu mHz, %lu us, amplitude 0x%04lX\n",
+           staged.rate_mhz, staged.pulse_width_us, staged.amplitude);
+    return 0;
+}
+
+void flpr_seq_set_rate(uint32_t rate_mhz)
+{
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    staged.rate_mhz = rate_mhz;
+    plan_send();
+    k_mutex_unlock(&plan_lock);
+}
+
+void flpr_seq_set_pulse_width(uint32_t pulse_width_us)
+{
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    staged.pulse_width_us = pulse_width_us;
+    plan_send();
+    k_mutex_unlock(&plan_lock);
+}
+
+void flpr_seq_send_amplitude(void)
+{
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    plan_send();
+    k_mutex_unlock(&plan_lock);
+}
+
+void flpr_seq_hold(void)
+{
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    hold_depth++;
+    k_mutex_unlock(&plan_lock);
+}
+
+void flpr_seq_release(void)
+{
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    if (hold_depth > 0 && --hold_depth == 0) {
+        plan_send();
+    }
+    k_mutex_unlock(&plan_lock);
+}
+
+uint32_t flpr_seq_pulse_count(void)
+{
+    flpr_mbox_telemetry t = { 0 };
+
+    (void)telem_read(&t);
+    return t.pulses;
+}
+
+void flpr_seq_halt(void)
+{
+    nrf_vpr_cpurun_set(FLPR_SEQ_VPR, false);
+}
+
+void get_flpr_seq_stats(flpr_seq_stats *out)
+{
+    flpr_mbox_telemetry t = { 0 };
+
+    (void)telem_read(&t);
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    *out = stats;
+    k_mutex_unlock(&plan_lock);
+    out->state = (uint8_t)mbox->state;
+    out->pulses = t.pulses;
+    out->late_edges = t.late_edges;
+    out->worst_late_ns = t.tick_hz ? (uint32_t)((uint64_t)t.worst_late_ticks * 1000000000u / t.tick_hz) : 0;
+    out->plans_applied = t.plans_applied;
+    out->plans_rejected = t.plans_rejected;
+}
+
+#endif /* FLPR_SEQ_ACTIVE */
@@ -0,0 +1,77 @@
+#ifndef FLPR_SEQ_H
+#define FLPR_SEQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "sched.h"
+#include "stress.h"
+
+/* Replaces the BLE continuous engine on the nRF54L15 only (the FLPR is a VPR of the nRF54L
+ * series). The fixed-interval plan is the only one it runs: trigger, multichannel and
+ * stochastic plans, the period lock, sync-out and the stress run all hang off the
+ * application core's stim TIMER. */
+#if FLPR_SEQ_ENABLE && defined(CONFIG_SOC_SERIES_NRF54LX) && defined(CONFIG_BT) && !TRIGGER_MODE && \
+    !MULTICHANNEL_ACTIVE && !STOCHASTIC_IPI_ENABLE && !STIM_PLL_ACTIVE && !STRESS_ACTIVE && \
+    !SYNC_OUT_ENABLE
+#define FLPR_SEQ_ACTIVE 1
+#else
+#define FLPR_SEQ_ACTIVE 0
+#endif
+
+/*
+ * Pulse sequencer on the FLPR coprocessor. The FLPR image (Firmware/flpr) runs seq_core.h
+ * in a polling loop on its own TIMER and drives the switch pins and the DAC SPIM itself, so
+ * pulse timing does not depend on anything the application core does: BLE, flash and
+ * control traffic only change when a new plan is read, never when an edge happens.
+ *
+ * The application core keeps the control side. update_stim_rate_mhz, update_pulse_width and
+ * update_dac_amplitude check and hold the plan as before and hand it to the mailbox
+ * (flpr_mbox.h); the FLPR takes a new plan at the next pulse boundary, so a pulse is never
+ * split between two plans. Every plan carries the committed DAC word of spi.c, the one the
+ * other engines latch at their onsets, so a setting gives the same current on every engine.
+ * The charge limits are checked at commit as before; there is no per-pulse budget, since the
+ * FLPR runs exactly the committed plan.
+ *
+ * Supervision: the FLPR advances a heartbeat on every pass of its wait loop. One unchanged
+ * for CONFIG_FLPR_SEQ_WATCH_MS, or an FLPR in FAULT, halts the FLPR and drives the switches
+ * to the safe state; the fatal-error handler halts it before its own safe state. The FLPR
+ * also reports the DAC words of its last pulse and the plan it ran under: words other than
+ * that plan's amplitude and its mirror halt it the same way. This samples one pulse per
+ * check, it does not see every pulse.
+ */
+typedef struct {
+    uint8_t state;              // flpr_state (flpr_mbox.h)
+    uint32_t pulses;
+    uint32_t late_edges;        // edges started more than CONFIG_FLPR_SEQ_LATE_NS late
+    uint32_t worst_late_ns;
+    uint32_t plans_sent;        // plans written to the mailbox
+    uint32_t plans_applied;     // taken into effect by the FLPR, the first included
+    uint32_t plans_rejected;    // refused by the FLPR (the previous plan kept running)
+    uint32_t plans_unsent;      // updates left staged: the pulse did not fit the period
+    uint32_t stalls;            // FLPR halted by the supervision
+    uint32_t wrong_amplitude;   // ... for a pulse sent at another amplitude than its plan's
+} flpr_seq_stats;
+
+/** Hand the staged plan to the FLPR and wait for it to run. Call after timer_init() and the boot plan's update_* calls. */
+int flpr_seq_init(void);
+
+/** Plan fields, from the update_* calls. Each sends the plan unless held. */
+void flpr_seq_set_rate(uint32_t rate_mhz);
+void flpr_seq_set_pulse_width(uint32_t pulse_width_us);
+/** The committed DAC words changed (update_dac_amplitude): send them with the plan. */
+void flpr_seq_send_amplitude(void);
+
+/** Hold, then send once: several fields of one setting reach the FLPR as one plan. Thread context. */
+void flpr_seq_hold(void);
+void flpr_seq_release(void);
+
+/** Completed pulses, as counted by the FLPR. */
+uint32_t flpr_seq_pulse_count(void);
+
+/** Stop the FLPR core. Register write only, usable from fault context. */
+void flpr_seq_halt(void);
+
+void get_flpr_seq_stats(flpr_seq_stats *stats);
+
+#endif /* FLPR_SEQ_H */
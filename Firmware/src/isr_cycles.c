@@ -0,0 +1,135 @@
+/*
+ * Hot-path cycle accounting. Each instrumented path records its DWT cycle delta on exit;
+ * counts are kept per path with the worst case and the number of calls over budget, and can
+ * be read on the console (main loop) or over BLE with CMD_ISR_CYCLES.
+ */
+#include <zephyr/kernel.h>
+#include "isr_cycles.h"
+#include "timer.h"
+#include "config.h"
+
+#if ISR_CYCLES_ACTIVE
+
+static const char *const path_name[ISR_PATH_COUNT] = {
+    [ISR_PATH_TIMER] = "timer_handler",
+    [ISR_PATH_RTC] = "rtc_handler",
+    [ISR_PATH_SPI_DAC] = "spi_write_dac1",
+    [ISR_PATH_CLOSED_LOOP] = "closed_loop",
+};
+
+static const uint32_t path_budget_us[ISR_PATH_COUNT] = {
+    [ISR_PATH_TIMER] = CONFIG_CYC_BUDGET_TIMER_US,
+    [ISR_PATH_RTC] = CONFIG_CYC_BUDGET_RTC_US,
+    [ISR_PATH_SPI_DAC] = CONFIG_CYC_BUDGET_SPI_US,
+    [ISR_PATH_CLOSED_LOOP] = CONFIG_CYC_BUDGET_CL_US,
+};
+
+static struct {
+    uint32_t calls;
+    uint32_t last;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t budget;
+    uint32_t over;
+    uint64_t total;         // never reset (energy accounting)
+} paths[ISR_PATH_COUNT];
+
+static uint32_t cpu_mhz;
+
+int isr_cycles_init(void)
+{
+    int err = z_arm_dwt_init();
+
+    if (err) {
+        printf("ISR cycles: no DWT (%d)\n", err);
+        return err;
+    }
+    z_arm_dwt_init_cycle_counter();
+    cpu_mhz = SystemCoreClock / 1000000u;
+    for (int i = 0; i < ISR_PATH_COUNT; i++) {
+        paths[i].budget = path_budget_us[i] * cpu_mhz;
+    }
+    return 0;
+}
+
+void isr_cycles_record(isr_path path, uint32_t cycles)
+{
+    unsigned int key = irq_lock();
+
+    paths[path].calls++;
+    paths[path].last = cycles;
+    paths[path].sum += cycles;
+    paths[path].total += cycles;
+    if (cycles > paths[path].max) {
+        paths[path].max = cycles;
+    }
+    if (cycles > paths[path].budget) {
+        paths[path].over++;
+    }
+    irq_unlock(key);
+}
+
+void get_isr_cycle_stats(isr_path path, isr_cycle_stats *stats)
+{
+    unsigned int key = irq_lock();
+
+    stats->calls = paths[path].calls;
+    stats->last_cycles = paths[path].last;
+    stats->max_cycles = paths[path].max;
+    stats->avg_cycles = paths[path].calls ? (uint32_t)(paths[path].sum / paths[path].calls) : 0;
+    stats->budget_cycles = paths[path].budget;
+    stats->over_budget = paths[path].over;
+    irq_unlock(key);
+}
+
+uint64_t isr_cycles_total(isr_path path)
+{
+    unsigned int key = irq_lock();
+    uint64_t total = paths[path].total;
+
+    irq_unlock(key);
+    return total;
+}
+
+bool isr_cycles_within_budget(void)
+{
+    for (int i = 0; i < ISR_PATH_COUNT; i++) {
+        if (paths[i].over) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void isr_cycles_reset(void)
+{
+    unsigned int key = irq_lock();
+
+    for (int i = 0; i < ISR_PATH_COUNT; i++) {
+        paths[i].calls = 0;
+        paths[i].last = 0;
+        paths[i].max = 0;
+        paths[i].sum = 0;
+        paths[i].over = 0;
+    }
+    irq_unlock(key);
+}
+
+void isr_cycles_report(void)
+{
+    isr_cycle_stats st;
+
+    printf("ISR cycles (%s timer engine)\n", timer_engine_name());
+    for (int i = 0; i < ISR_PATH_COUNT; i++) {
+        get_isr_cycle_stats(i, &st);
+        if (st.calls == 0) {
+            continue;
+        }
+        printf("  %-16s calls %lu avg %lu max %lu budget %lu cycles (%lu us), over %lu\n",
+               path_name[i], st.calls, st.avg_cycles, st.max_cycles, st.budget_cycles,
+               st.budget_cycles / cpu_mhz, st.over_budget);
+    }
+    printf("ISR cycles %s budget\n", isr_cycles_within_budget() ? "within" : "OVER");
+}
+
+#endif /* ISR_CYCLES_ACTIVE */
@@ -0,0 +1,73 @@
+#ifndef ISR_CYCLES_H
+#define ISR_CYCLES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/*
+ * CPU cycle counts for the stimulation hot paths, taken with the Cortex-M DWT cycle counter
+ * on the target itself, so a change to any of them shows up as a number against a budget
+ * (CONFIG_CYC_BUDGET_*_US) instead of as a stretched pulse on the scope.
+ * timer_handler and rtc_handler counts include the spi_write_dac1 call they make.
+ *
+ * The gate is a run on hardware: `chronos_ctl.py cycles` exits 1 once any path has gone over
+ * its budget. There is no native_sim/qemu build of these paths: their cost is the SPIM
+ * transfer, the CS hold and the peripheral register accesses, which a mocked nrfx would not
+ * time. The hardware-free parts of the engines are checked on the host instead
+ * (Tools/seq_trace.c, rtc_drift.c, cl_replay.c).
+ */
+typedef enum {
+    ISR_PATH_TIMER = 0,     // timer_handler, one compare event
+    ISR_PATH_RTC,           // rtc_handler, one period (RTC mode)
+    ISR_PATH_SPI_DAC,       // spi_write_dac1, CS to CS
+    ISR_PATH_CLOSED_LOOP,   // closed-loop SAADC block handler (closed_loop.h)
+    ISR_PATH_COUNT
+} isr_path;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t last_cycles;
+    uint32_t max_cycles;
+    uint32_t avg_cycles;
+    uint32_t budget_cycles;
+    uint32_t over_budget;   // calls that took longer than budget_cycles
+} isr_cycle_stats;
+
+/* Energy accounting (energy.h) and the closed loop's load figure read the per-path totals,
+ * so they need the counts too */
+#if ISR_CYCLES_ENABLE || ENERGY_ACCOUNTING_ENABLE || CLOSED_LOOP_ENABLE
+#define ISR_CYCLES_ACTIVE 1
+#else
+#define ISR_CYCLES_ACTIVE 0
+#endif
+
+#if ISR_CYCLES_ACTIVE
+#include <zephyr/arch/arm/cortex_m/dwt.h>
+#define ISR_CYC_BEGIN(var)      uint32_t var = z_arm_dwt_get_cycles()
+#define ISR_CYC_END(path, var)  isr_cycles_record((path), z_arm_dwt_get_cycles() - (var))
+#else
+#define ISR_CYC_BEGIN(var)
+#define ISR_CYC_END(path, var)
+#endif
+
+/** Start the DWT cycle counter and convert the budgets to CPU cycles. Call before stimulation starts. */
+int isr_cycles_init(void);
+
+/** Add one call of a path. ISR safe. */
+void isr_cycles_record(isr_path path, uint32_t cycles);
+
+void get_isr_cycle_stats(isr_path path, isr_cycle_stats *stats);
+
+/** All cycles recorded on a path since isr_cycles_init() (not cleared by isr_cycles_reset). */
+uint64_t isr_cycles_total(isr_path path);
+
+/** False once any path has had a call over its budget. */
+bool isr_cycles_within_budget(void);
+
+void isr_cycles_reset(void);
+
+/** Print one line per path and the budget verdict. */
+void isr_cycles_report(void);
+
+#endif /* ISR_CYCLES_H */
@@ -0,0 +1,252 @@
+/*
+ * LFCLK calibration for RTC-mode stimulation. The LFRC is trimmed with the CLOCK CAL task and
+ * its true frequency measured against the HFXO by capturing the 16 MHz measurement timer on
+ * the RTC compare event itself, so the measurement includes nothing but the two clocks.
+ * Everything runs as a polled state machine on the system workqueue; the stimulation ISR only
+ * records one snapshot per pulse while a measurement is armed.
+ */
+#include <nrfx_timer.h>
+#include <nrfx_rtc.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_clock.h>
+#include <zephyr/kernel.h>
+#include "lfclk_cal.h"
+#include "rtc_stim.h"
+#include "timer.h"
+#include "energy.h"
+#include "config.h"
+
+#if LFCLK_CAL_ACTIVE
+
+#define CAL_POLL_MS      5      // HFXO start / CAL done polling
+#define CAL_STEP_TIMEOUT 200    // polls before a clock step is declared failed (~1 s)
+#define CAL_SNAP_POLL_MS 50     // snapshot polling while the window fills
+
+typedef enum {
+    CAL_IDLE,
+    CAL_HFXO_WAIT,
+    CAL_RC_WAIT,
+    CAL_SNAP_FIRST,
+    CAL_SNAP_WINDOW,
+} cal_state;
+
+static struct k_work_delayable cal_work;
+static cal_state state;
+static uint32_t polls;
+static uint8_t dppi_ch;
+static bool meas_owned;         // measurement timer enabled only for calibration
+static uint32_t hf_hz;
+
+static uint32_t snap_seq;
+static uint32_t snap_lf;
+static uint32_t snap_hf;
+
+static lfclk_cal_stats stats;
+
+static void hfxo_request(void)
+{
+    NRF_CLOCK_S->HFCLKSRC = (CLOCK_HFCLKSRC_SRC_HFXO << CLOCK_HFCLKSRC_SRC_Pos);
+    NRF_CLOCK_S->TASKS_HFCLKSTART = 1;
+}
+
+static bool hfxo_running(void)
+{
+    uint32_t stat = NRF_CLOCK_S->HFCLKSTAT;
+    return (stat & CLOCK_HFCLKSTAT_STATE_Msk) &&
+           ((stat & CLOCK_HFCLKSTAT_SRC_Msk) >> CLOCK_HFCLKSTAT_SRC_Pos) == CLOCK_HFCLKSTAT_SRC_HFXO;
+}
+
+/* Back to the clock init_clock() selects; the RTC ISR keeps it running for each pulse */
+static void hfxo_release(void)
+{
+    NRF_CLOCK_S->HFCLKSRC = (CLOCK_HFCLKSRC_SRC_HFINT << CLOCK_HFCLKSRC_SRC_Pos);
+    NRF_CLOCK_S->TASKS_HFCLKSTART = 1;
+}
+
+static void cal_finish(bool ok)
+{
+    rtc_stim_cal_arm(false);
+    nrfx_gppi_channels_disable(BIT(dppi_ch));
+    if (meas_owned) {
+        nrfx_timer_disable(timer_measurement_instance());
+    }
+    hfxo_release();
+    if (!ok) {
+        stats.failures++;
+    }
+    state = CAL_IDLE;
+    k_work_reschedule(&cal_work, K_SECONDS(CONFIG_LFCLK_CAL_INTERVAL_S));
+}
+
+static void cal_apply(uint32_t d_lf, uint32_t d_hf)
+{
+    uint32_t mhz = lfclk_cal_mhz(d_lf, d_hf, hf_hz);
+    int32_t ppm = lfclk_cal_ppm(mhz);
+
+    if (ppm > LFCLK_CAL_MAX_PPM || ppm < -LFCLK_CAL_MAX_PPM) {
+        printf("LFCLK cal: %ld ppm out of range, discarded\n", (long)ppm);
+        cal_finish(false);
+        return;
+    }
+    rtc_stim_set_lfclk_mhz(mhz);
+    stats.lfclk_mhz = mhz;
+    stats.ppm = ppm;
+    stats.count++;
+    cal_finish(true);
+}
+
+static void cal_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    uint32_t lf;
+    uint32_t hf;
+    uint32_t seq;
+
+#if DUTY_CYCLE_ACTIVE
+    /* Between trains there are no compares to measure against and HFCLK is released:
+     * drop any measurement in progress (not a failure) and try again after the interval */
+    if (rtc_stim_duty_off()) {
+        if (state == CAL_IDLE) {
+            k_work_reschedule(&cal_work, K_SECONDS(CONFIG_LFCLK_CAL_INTERVAL_S));
+        } else {
+            cal_finish(true);
+            NRF_CLOCK_S->TASKS_HFCLKSTOP = 1;
+#if ENERGY_ACCOUNTING_ENABLE
+            energy_hfclk_sample();
+#endif
+        }
+        return;
+    }
+#endif
+
+    switch (state) {
+        case CAL_IDLE:
+            hfxo_request();
+            polls = 0;
+            state = CAL_HFXO_WAIT;
+            k_work_reschedule(&cal_work, K_MSEC(CAL_POLL_MS));
+            return;
+
+        case CAL_HFXO_WAIT:
+            if (!hfxo_running()) {
+                if (++polls >= CAL_STEP_TIMEOUT) {
+                    printf("LFCLK cal: HFXO did not start\n");
+                    cal_finish(false);
+                } else {
+                    k_work_reschedule(&cal_work, K_MSEC(CAL_POLL_MS));
+                }
+                return;
+            }
+            polls = 0;
+            if (rtc_stim_get_lfclk() == RTC_LFCLK_LFRC) {
+                NRF_CLOCK_S->EVENTS_DONE = 0;
+                NRF_CLOCK_S->TASKS_CAL = 1;
+                state = CAL_RC_WAIT;
+                k_work_reschedule(&cal_work, K_MSEC(CAL_POLL_MS));
+                return;
+            }
+            /* LFXO: no trim, measure only */
+            break;
+
+        case CAL_RC_WAIT:
+            if (NRF_CLOCK_S->EVENTS_DONE == 0) {
+                if (++polls >= CAL_STEP_TIMEOUT) {
+                    printf("LFCLK cal: RC calibration timed out\n");
+                    cal_finish(false);
+                } else {
+                    k_work_reschedule(&cal_work, K_MSEC(CAL_POLL_MS));
+                }
+                return;
+            }
+            NRF_CLOCK_S->EVENTS_DONE = 0;
+            break;
+
+        case CAL_SNAP_FIRST:
+            seq = rtc_stim_cal_snapshot(&lf, &hf);
+            if (seq - snap_seq < 2) {
+                if (++polls * CAL_SNAP_POLL_MS >= LFCLK_CAL_WINDOW_MAX_MS) {
+                    cal_finish(false);
+                } else {
+                    k_work_reschedule(&cal_work, K_MSEC(CAL_SNAP_POLL_MS));
+                }
+                return;
+            }
+            /* Skip the compare that may have raced the arming; from here on both values
+             * belong to the same edge */
+            snap_seq = seq;
+            snap_lf = lf;
+            snap_hf = hf;
+            polls = 0;
+            state = CAL_SNAP_WINDOW;
+            k_work_reschedule(&cal_work, K_MSEC(CONFIG_LFCLK_CAL_WINDOW_MS));
+            return;
+
+        case CAL_SNAP_WINDOW:
+            seq = rtc_stim_cal_snapshot(&lf, &hf);
+            if (seq == snap_seq ||
+                (uint64_t)(hf - snap_hf) * 1000u < (uint64_t)hf_hz * CONFIG_LFCLK_CAL_WINDOW_MS) {
+                if (++polls * CAL_SNAP_POLL_MS >= LFCLK_CAL_WINDOW_MAX_MS) {
+                    cal_finish(false);
+                } else {
+                    k_work_reschedule(&cal_work, K_MSEC(CAL_SNAP_POLL_MS));
+                }
+                return;
+            }
+            cal_apply(lf - snap_lf, hf - snap_hf);
+            return;
+    }
+
+    /* Reference is stable (and the RC trimmed): start the HF/LF measurement */
+    if (!nrfx_timer_is_enabled(meas)) {
+        nrfx_timer_enable(meas);
+    }
+    snap_seq = rtc_stim_cal_snapshot(&lf, &hf);
+    nrfx_gppi_channels_enable(BIT(dppi_ch));
+    rtc_stim_cal_arm(true);
+    polls = 0;
+    state = CAL_SNAP_FIRST;
+    k_work_reschedule(&cal_work, K_MSEC(CAL_SNAP_POLL_MS));
+}
+
+int lfclk_cal_start(void)
+{
+    nrfx_timer_t const *meas = timer_measurement_instance();
+
+    meas_owned = !nrfx_timer_is_enabled(meas);
+    if (meas_owned) {
+        measurement_timer_init();
+        nrfx_timer_disable(meas);
+    }
+    hf_hz = NRF_TIMER_BASE_FREQUENCY_GET(meas->p_reg);
+
+    if (nrfx_gppi_channel_alloc(&dppi_ch) != NRFX_SUCCESS) {
+        printf("LFCLK cal: no DPPI channel\n");
+        return -ENOMEM;
+    }
+    nrfx_gppi_channel_endpoints_setup(dppi_ch,
+        nrfx_rtc_event_address_get(rtc_stim_instance(), NRF_RTC_EVENT_COMPARE_0),
+        nrfx_timer_capture_task_address_get(meas, RTC_STIM_CAL_MEAS_CC));
+
+    stats.lfclk_mhz = rtc_stim_get_lfclk_mhz();
+    state = CAL_IDLE;
+    k_work_init_delayable(&cal_work, cal_work_handler);
+    k_work_schedule(&cal_work, K_NO_WAIT);
+    printf("LFCLK calibration every %u s (%s)\n", CONFIG_LFCLK_CAL_INTERVAL_S,
+           rtc_stim_get_lfclk() == RTC_LFCLK_LFXO ? "LFXO" : "LFRC");
+    return 0;
+}
+
+void lfclk_cal_trigger(void)
+{
+    if (state == CAL_IDLE) {
+        k_work_reschedule(&cal_work, K_NO_WAIT);
+    }
+}
+
+void get_lfclk_cal_stats(lfclk_cal_stats *out)
+{
+    *out = stats;
+}
+
+#endif /* LFCLK_CAL_ACTIVE */
@@ -0,0 +1,57 @@
+#ifndef LFCLK_CAL_H
+#define LFCLK_CAL_H
+
+#include <stdint.h>
+#include "rtc_period.h"
+#include "config.h"
+
+/* Calibration only applies to the RTC engine; with BLE the radio stack owns the HFXO */
+#if LFCLK_CAL_ENABLE && !defined(CONFIG_BT) && !TRIGGER_MODE
+#define LFCLK_CAL_ACTIVE 1
+#else
+#define LFCLK_CAL_ACTIVE 0
+#endif
+
+/* Measurements further than this from nominal are treated as glitches and discarded */
+#define LFCLK_CAL_MAX_PPM 50000
+/* A measurement whose window has not closed this long after arming fails (e.g. a period
+ * longer than half of it: two compares are needed before the window starts) */
+#define LFCLK_CAL_WINDOW_MAX_MS 5000
+
+/** LFCLK frequency (mHz) from d_lf scheduled LF ticks that spanned d_hf ticks of an hf_hz reference. */
+static inline uint32_t lfclk_cal_mhz(uint32_t d_lf, uint32_t d_hf, uint32_t hf_hz)
+{
+    return (uint32_t)((uint64_t)d_lf * hf_hz * 1000u / d_hf);
+}
+
+/** Offset of a measured LFCLK frequency from 32768 Hz, ppm. */
+static inline int32_t lfclk_cal_ppm(uint32_t mhz)
+{
+    return (int32_t)(((int64_t)mhz - LFCLK_FREQ_HZ * 1000) * 1000000 / (LFCLK_FREQ_HZ * 1000));
+}
+
+typedef struct {
+    uint32_t lfclk_mhz;       // last measured LFCLK frequency, mHz
+    int32_t ppm;              // last measured offset from 32768 Hz
+    uint32_t count;           // successful calibrations since boot
+    uint32_t failures;        // HFXO/CAL timeouts, no pulses in window, or out-of-range results
+} lfclk_cal_stats;
+
+/**
+ * Start periodic LFCLK calibration. Every CONFIG_LFCLK_CAL_INTERVAL_S seconds, from a
+ * workqueue (never blocking the stimulation ISR):
+ *  1. HFXO is started as the reference (16 MHz measurement timer then runs from it)
+ *  2. LFRC only: the CLOCK CAL task trims the RC oscillator
+ *  3. RTC COMPARE0 is routed by DPPI to a measurement timer capture, and the HF ticks across
+ *     at least CONFIG_LFCLK_CAL_WINDOW_MS of stimulation periods give the true LFCLK frequency
+ *  4. the RTC period is recomputed from it (rtc_stim_set_lfclk_mhz) and HFINT restored
+ * Call after rtc_stim_init().
+ */
+int lfclk_cal_start(void);
+
+/** Run one calibration now (e.g. after a temperature change). */
+void lfclk_cal_trigger(void);
+
+void get_lfclk_cal_stats(lfclk_cal_stats *stats);
+
+#endif /* LFCLK_CAL_H */
@@ -28,8 +28,27 @@ Notes:
 //Chronos engine imports 
 #include "BLE.h"  //BLE engine
 #include "spi.h" //SPI to howland current source
+#include "stim_pins.h" //Switch/DAC CS pin map
 #include "timer.h"  //Handles interrupt timing of stimulation
 #include "rtc_stim.h"   //handles IRQ routines for stimulation
+#include "trigger.h"    //external trigger input (TRIGGER_MODE)
+#include "closed_loop.h" //phase-locked pulses from an analog input (CLOSED_LOOP_ENABLE)
+#include "sync.h"       //TTL sync-out and event markers (SYNC_OUT_ENABLE)
+#include "stochastic.h" //randomized inter-pulse intervals (STOCHASTIC_IPI_ENABLE)
+#include "lfclk_cal.h"  //RTC-mode LFCLK calibration against HFXO (LFCLK_CAL_ENABLE)
+#include "stim_store.h" //last-good stim plan in flash (STIM_STORE_ENABLE)
+#include "boot_time.h"  //boot-phase timestamps and boot-to-stimulation budget
+#include "deadline.h"   //pulse-edge overruns, pulse watchdog, fatal-error safe state (DEADLINE_MONITOR_ENABLE)
+#include "isr_cycles.h" //hot-path cycle counts against budgets (ISR_CYCLES_ENABLE)
+#include "energy.h"     //per-subsystem active-time counters (ENERGY_ACCOUNTING_ENABLE)
+#include "telemetry.h"  //connectionless status over periodic advertising (TELEMETRY_ENABLE)
+#include "stim_pll.h"   //period locked to another unit or a host reference (STIM_PLL_ENABLE)
+#include "charge_limit.h" //charge safety envelope and per-pulse budget (CHARGE_LIMIT_ENABLE)
+#include "session_log.h" //plan, fault and counter records in flash (SESSION_LOG_ENABLE)
+#include "sched.h"      //multichannel interleaved plan (MULTICHANNEL_ENABLE)
+#include "clock_policy.h" //CPU clock around the stim hot paths (CLOCK_POLICY_ENABLE)
+#include "flpr_seq.h"   //pulse sequencer on the FLPR coprocessor (FLPR_SEQ_ENABLE)
+#include "data.h"
 #include "config.h"   //Set compilation settings. Look here for CONFIG_BT
 
 //Add UART Driver only if BLE is active. Note, UART is *virtual*, but still requires pin definitions. 
@@ -45,6 +64,7 @@ static void init_clock();   //Turn on stimulation timing engine
 BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.connected        = connected,
 	.disconnected     = disconnected,
+	.le_param_updated = le_param_updated,
 	.recycled         = recycled_cb,
 #ifdef CONFIG_BT_NUS_SECURITY_ENABLED
 	.security_changed = security_changed,
@@ -61,90 +81,221 @@ static void init_pins(void) {
     Mapping can be done by incrementing over pin count (ie if core 1 has 16 pins, pin 18 corresponds to core 2, pin 2), but this is unclear.
     Using the pin map operation explicitly declares core and pin location.
     */
-    // Configure P2.5 as output (DAC1 CS)
-    nrf_gpio_cfg_output(NRF_GPIO_PIN_MAP(2, 5));
-    nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(2, 5));  // Set high (inactive)
-    
-    // Configure P2.10 as output (DAC2 CS)
-    nrf_gpio_cfg_output(NRF_GPIO_PIN_MAP(2, 10));
-    nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(2, 10));  // Set high (inactive)
-    
-    // Switch GPIOs (DAC1/2 -> switch): all 0 at init
-    //HCSS1
-    nrf_gpio_cfg_output(NRF_GPIO_PIN_MAP(2, 7));
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(2, 7)); //set low (inactive)
-    //HCSS2
-    nrf_gpio_cfg_output(NRF_GPIO_PIN_MAP(2, 9));
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(2, 9)); //set low (inactive)
-    //HCSS3
-    nrf_gpio_cfg_output(NRF_GPIO_PIN_MAP(2, 8));
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(2, 8));
-    //HCSS4
-    nrf_gpio_cfg_output(NRF_GPIO_PIN_MAP(2, 0));
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(2, 0));
+    stim_pins_init();  // DAC CS high, switch idle, HCSS low (pin map: stim_pins.h)
 }
 
-int main(void)
-{
-    //Begin with system initialization
-    init_clock();
-    init_pins();
-    spi_init();
-    timer_init();
-    update_pulse_width(CONFIG_PULSE_WIDTH_US);
-    update_dac1_amplitude(CONFIG_STIM_AMPLITUDE);
-    update_dac2_amplitude(CONFIG_STIM_AMPLITUDE);
+#if defined(CONFIG_BT)
+/*
+ * Deferred communications bring-up. main() arms stimulation first and then hands
+ * BLE and USB/UART start-up to this queue, so neither bt_enable() nor the UART DTR
+ * wait can delay the first pulse. BLE is brought up before the UART because the
+ * DTR wait may last indefinitely; it is polled, so it never holds the queue. A failure here
+ * leaves stimulation running.
+ *
+ * The same queue runs the commands (BLE.c): NUS writes as they arrive and, once the UART is up,
+ * control frames and the UART-to-NUS bridge per received span, instead of on a dedicated thread
+ * or in the BT RX thread. It is the only thread the application adds; the stack covers
+ * bt_enable() and the deepest command.
+ */
+#define COMMS_WORKQ_STACK_SIZE 2048
+#define COMMS_WORKQ_PRIORITY   PRIORITY    // preemptible, below the BT host threads
 
-    //If needing bluetooth set in config files
-    #if defined(CONFIG_BT)
-        update_stim_frequency(CONFIG_STIM_FREQUENCY_HZ);
-        measurement_timer_init();
-        int blink_status = 0;
-        int err = 0;
-        uint32_t experiment_counter = 0;
+K_THREAD_STACK_DEFINE(comms_workq_stack, COMMS_WORKQ_STACK_SIZE);
+struct k_work_q comms_workq;
+static struct k_work ble_start_work;
+static struct k_work_delayable uart_start_work;
+
+static void ble_start_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+	int err;
 
-        configure_gpio();
-        err = uart_init();
-        if (err) {
-            error();
-        }
-    #endif
-    #if defined(CONFIG_BT)
 	if (IS_ENABLED(CONFIG_BT_NUS_SECURITY_ENABLED)) {
 		err = bt_conn_auth_cb_register(&conn_auth_callbacks);
 		if (err) {
 			LOG_ERR("Failed to register authorization callbacks. (err: %d)", err);
-			return 0;
+			return;
 		}
 
 		err = bt_conn_auth_info_cb_register(&conn_auth_info_callbacks);
 		if (err) {
 			LOG_ERR("Failed to register authorization info callbacks. (err: %d)", err);
-			return 0;
+			return;
 		}
 	}
 
 	err = bt_enable(NULL);
 	if (err) {
-		error();
+		LOG_ERR("Bluetooth init failed (err %d); stimulation continues", err);
+		return;
 	}
 
 	LOG_INF("Bluetooth initialized");
 
-	k_sem_give(&ble_init_ok);
-
 	if (IS_ENABLED(CONFIG_SETTINGS)) {
 		settings_load();
 	}
+	boot_mark(BOOT_PHASE_BT_READY);
 
 	err = bt_nus_init(&nus_cb);
 	if (err) {
 		LOG_ERR("Failed to initialize UART service (err: %d)", err);
-		return 0;
+		return;
 	}
 
 	k_work_init(&adv_work, adv_work_handler);
 	advertising_start();
+	boot_mark(BOOT_PHASE_ADV);
+#if TELEMETRY_ACTIVE
+	(void)telemetry_start();
+#endif
+}
+
+static void uart_start_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+	int err = uart_init();
+
+	if (err == -EAGAIN) {
+		k_work_reschedule_for_queue(&comms_workq, &uart_start_work, K_MSEC(100));
+		return;
+	}
+	if (err) {
+		LOG_ERR("UART init failed (err %d); stimulation continues", err);
+		return;
+	}
+	boot_mark(BOOT_PHASE_UART_READY);
+	boot_report();
+}
+
+static void comms_start(void)
+{
+	struct k_work_queue_config cfg = {
+		.name = "comms_workq",
+	};
+
+	k_work_queue_init(&comms_workq);
+	k_work_queue_start(&comms_workq, comms_workq_stack,
+			   K_THREAD_STACK_SIZEOF(comms_workq_stack), COMMS_WORKQ_PRIORITY, &cfg);
+	k_work_init(&ble_start_work, ble_start_work_handler);
+	k_work_init_delayable(&uart_start_work, uart_start_work_handler);
+	k_work_submit_to_queue(&comms_workq, &ble_start_work);
+	k_work_schedule_for_queue(&comms_workq, &uart_start_work, K_NO_WAIT);
+}
+#endif /* CONFIG_BT */
+
+int main(void)
+{
+    //Begin with system initialization
+    boot_mark(BOOT_PHASE_MAIN);
+    init_clock();
+    init_pins();
+#if !FLPR_SEQ_ACTIVE
+    spi_init();     //FLPR sequencer: the FLPR owns the DAC SPIM
+#endif
+    boot_mark(BOOT_PHASE_CLOCK);
+#if ISR_CYCLES_ACTIVE
+    isr_cycles_init();
+#endif
+#if ENERGY_ACCOUNTING_ENABLE
+    energy_init();
+#endif
+#if CLOCK_POLICY_ACTIVE
+    //After the cycle counters above, which convert at the boot clock
+    clock_policy_init();
+#endif
+
+    //Boot plan: last plan committed over BLE if one is stored, else the compile-time values.
+    //Restored before the timer starts so a reset never changes the therapy.
+    const stim_setting default_setting = {
+        .DAC_amplitude = CONFIG_STIM_AMPLITUDE,
+        .pulse_width = CONFIG_PULSE_WIDTH_US,
+        .frequency = CONFIG_STIM_FREQUENCY_HZ,
+    };
+    const uint32_t default_rate_mhz = CONFIG_STIM_RATE_MHZ ? CONFIG_STIM_RATE_MHZ : CONFIG_STIM_FREQUENCY_HZ * 1000u;
+    stim_setting boot_setting = default_setting;
+    uint32_t boot_rate_mhz = default_rate_mhz;
+    stim_boot_source boot_source = STIM_BOOT_DEFAULTS;
+#if SESSION_LOG_ACTIVE
+    //RAM only here; the partition is scanned from the system workqueue after the first pulse
+    session_log_init();
+#endif
+#if STIM_STORE_ACTIVE
+    if (stim_store_load(&boot_setting, &boot_rate_mhz) == STIM_BOOT_RESTORED) {
+        boot_source = STIM_BOOT_RESTORED;
+    }
+#endif
+#if CHARGE_LIMIT_ACTIVE
+    //A stored plan outside the current limits (tightened since it was stored) is not run;
+    //the defaults are checked at build time.
+    if (charge_limit_commit(boot_setting.DAC_amplitude, boot_setting.pulse_width, boot_rate_mhz) != 0) {
+        boot_setting = default_setting;
+        boot_rate_mhz = default_rate_mhz;
+        boot_source = STIM_BOOT_DEFAULTS;
+        (void)charge_limit_commit(boot_setting.DAC_amplitude, boot_setting.pulse_width, boot_rate_mhz);
+    }
+#endif
+    settings = boot_setting;
+#if SESSION_LOG_ACTIVE
+    session_log_boot(boot_source);
+    session_log_plan(SLOG_PLAN_BOOT, 0, boot_setting.DAC_amplitude, boot_setting.pulse_width, boot_rate_mhz);
+#else
+    ARG_UNUSED(boot_source);
+#endif
+    boot_mark(BOOT_PHASE_PLAN);
+
+    timer_init();
+    update_pulse_width(boot_setting.pulse_width);
+    update_dac_amplitude(boot_setting.DAC_amplitude);
+
+    //If needing bluetooth set in config files
+    #if defined(CONFIG_BT)
+#if MULTICHANNEL_ACTIVE
+        {
+            sched_channel ch0 = {
+                .enabled = true,
+                .amplitude = boot_setting.DAC_amplitude,
+                .pulse_width_us = boot_setting.pulse_width,
+                .frequency_hz = boot_setting.frequency,
+            };
+            sched_init(&ch0);
+        }
+#else
+        update_stim_rate_mhz(boot_rate_mhz);
+#endif
+#if FLPR_SEQ_ACTIVE
+        //Boot plan is staged by the update calls above; the FLPR starts pulsing from here
+        flpr_seq_init();
+#endif
+        measurement_timer_init();
+#if TRIGGER_MODE
+        trigger_init();
+#endif
+#if CLOSED_LOOP_ACTIVE
+        closed_loop_init();
+#endif
+#if SYNC_OUT_ENABLE
+        sync_init();
+#endif
+#if STIM_PLL_ACTIVE
+        stim_pll_init();
+#endif
+#if STOCHASTIC_IPI_ENABLE
+        if (CONFIG_STOCH_DIST != STOCH_OFF) {
+            stochastic_start(CONFIG_STOCH_DIST, boot_setting.frequency, CONFIG_STOCH_JITTER_PCT,
+                             TIMER_MIN_PERIOD_US(boot_setting.pulse_width));
+        }
+#endif
+        int blink_status = 0;
+        uint32_t experiment_counter = 0;
+
+        //Stimulation is running; bring up LEDs now and BLE/UART on the comms queue
+        boot_mark(BOOT_PHASE_STIM_ARMED);
+#if DEADLINE_ACTIVE
+        deadline_init();
+#endif
+        configure_gpio();
+        comms_start();
 	for (;;) {
 		dk_set_led(RUN_STATUS_LED, (++blink_status) % 2);
 		k_msleep(10000);
@@ -163,22 +314,92 @@ int main(void)
 				my_error_data.event1_max,
 				my_error_data.event2_max,
 				my_error_data.event3_max);
+#if TRIGGER_MODE
+			{
+				trigger_stats my_trigger_stats;
+				get_trigger_stats(&my_trigger_stats);
+				printf("Triggers: %lu latency min: %lu max: %lu avg: %lu ticks\n",
+					my_trigger_stats.triggers,
+					my_trigger_stats.latency_min,
+					my_trigger_stats.latency_max,
+					my_trigger_stats.triggers ? (my_trigger_stats.latency_sum / my_trigger_stats.triggers) : 0);
+			}
+#endif
+#if DEADLINE_ACTIVE
+			{
+				deadline_stats my_deadline_stats;
+				get_deadline_stats(&my_deadline_stats);
+				printf("Deadline overruns: %lu (worst %lu us, edge %u) missed: %lu min slack: %lu us\n",
+					my_deadline_stats.overruns,
+					my_deadline_stats.worst_late_us,
+					my_deadline_stats.worst_edge,
+					my_deadline_stats.missed,
+					my_deadline_stats.min_slack_us);
+			}
+#endif
 		}
+#if ISR_CYCLES_ENABLE
+		isr_cycles_report();
+#endif
 	}
+    #elif TRIGGER_MODE
+        /* No BLE, externally triggered: CPU only wakes for phase 2 and DAC preload */
+        if (MEASURE_TIMER == 1 || CLOSED_LOOP_ACTIVE) {
+            measurement_timer_init();
+        }
+        update_stim_rate_mhz(boot_rate_mhz);
+        trigger_init();
+#if CLOSED_LOOP_ACTIVE
+        closed_loop_init();
+#endif
+        boot_mark(BOOT_PHASE_STIM_ARMED);
+#if SYNC_OUT_ENABLE
+        sync_init();
+#endif
+        LOG_INF("Trigger-driven stimulation, %u pulse(s) per edge (no BLE)", CONFIG_TRIGGER_TRAIN_PULSES);
+        for (;;) {
+            k_sleep(K_FOREVER);
+        }
     #else
         /* RTC low-power: no BLE; RTC wakes every stim period, timer runs one biphasic burst */
         rtc_stim_start_lfclk();
-        rtc_stim_init(CONFIG_STIM_FREQUENCY_HZ);
-        LOG_INF("RTC-driven stimulation at %u Hz (no BLE)", CONFIG_STIM_FREQUENCY_HZ);
+#if SYNC_OUT_ENABLE
+        sync_init();
+#endif
+#if STOCHASTIC_IPI_ENABLE
+        if (CONFIG_STOCH_DIST != STOCH_OFF) {
+            stochastic_start(CONFIG_STOCH_DIST, boot_setting.frequency, CONFIG_STOCH_JITTER_PCT,
+                             TIMER_MIN_PERIOD_US(boot_setting.pulse_width));
+        }
+#endif
+        rtc_stim_init(boot_rate_mhz);
+        boot_mark(BOOT_PHASE_STIM_ARMED);
+#if DEADLINE_ACTIVE
+        deadline_init();
+#endif
+#if LFCLK_CAL_ACTIVE
+        lfclk_cal_start();
+#endif
+        LOG_INF("RTC-driven stimulation at %u.%03u Hz (no BLE)", boot_rate_mhz / 1000u, boot_rate_mhz % 1000u);
+#if DUTY_CYCLE_ACTIVE
+        LOG_INF("Duty cycle: %u s on, %u s off", CONFIG_DUTY_ON_S, CONFIG_DUTY_OFF_S);
+        for (;;) {
+            rtc_duty_stats duty;
+
+            k_sleep(K_SECONDS(CONFIG_DUTY_ON_S + CONFIG_DUTY_OFF_S));
+            get_rtc_duty_stats(&duty);
+            LOG_INF("Duty: %u cycles, %u pulses, on %u ms (%u uAh), off %u ms (%u uAh), avg %u uA",
+                    duty.cycles, duty.pulses, duty.on_ms, duty.on_uah, duty.off_ms, duty.off_uah,
+                    duty.avg_ua);
+        }
+#else
         for (;;) {
             k_sleep(K_FOREVER);
         }
+#endif
     #endif /* CONFIG_BT */
     }
 
-    K_THREAD_DEFINE(ble_write_thread_id, STACKSIZE, ble_write_thread, NULL, NULL,
-            NULL, PRIORITY, 0, 0);
-
     static void init_clock() {
         // select the clock source: HFINT (high frequency internal oscillator) or HFXO (external 32 MHz crystal)
         NRF_CLOCK_S->HFCLKSRC = (CLOCK_HFCLKSRC_SRC_HFINT << CLOCK_HFCLKSRC_SRC_Pos);
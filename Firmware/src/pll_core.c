@@ -0,0 +1,106 @@
+/*
+ * Stim period PLL loop (pll_core.h). Per pulse: one 64-bit multiply and divide for the error
+ * in ticks, the PI update and the lock detector.
+ */
+#include "pll_core.h"
+
+void pll_core_reset(pll_core *p)
+{
+    p->integ = 0;
+    p->dither = 0;
+    p->adj = 0;
+    p->lock_run = 0;
+    p->locked = false;
+}
+
+void pll_core_resync(pll_core *p, uint32_t period_ticks, uint32_t tick_hz)
+{
+    p->nominal_ticks = period_ticks;
+    p->tick_khz = tick_hz / 1000u;
+    p->max_adj = (int64_t)(((uint64_t)period_ticks << PLL_FRAC_BITS) * CONFIG_PLL_MAX_PPM / 1000000u);
+    pll_core_reset(p);
+}
+
+int64_t pll_phase_fold(int64_t err_ns, uint64_t period_ns)
+{
+    int64_t r = err_ns % (int64_t)period_ns;
+
+    if (r > (int64_t)(period_ns / 2u)) {
+        r -= (int64_t)period_ns;
+    } else if (r <= -(int64_t)(period_ns / 2u)) {
+        r += (int64_t)period_ns;
+    }
+    return r;
+}
+
+static void lock_update(pll_core *p, int64_t err_ns)
+{
+    /* Folded to half a period, which can exceed 32 bits of ns below ~0.25 Hz */
+    if (err_ns > INT32_MAX) {
+        err_ns = INT32_MAX;
+    } else if (err_ns < INT32_MIN + 1) {
+        err_ns = INT32_MIN + 1;
+    }
+    uint32_t mag = (uint32_t)(err_ns < 0 ? -err_ns : err_ns);
+
+    p->skew_ns = (int32_t)err_ns;
+    p->skew_avg_ns += ((int32_t)(mag - p->skew_avg_ns)) / 16;
+    if (mag < CONFIG_PLL_LOCK_US * 1000u) {
+        if (!p->locked && ++p->lock_run >= STIM_PLL_LOCK_COUNT) {
+            p->locked = true;
+            p->skew_max_ns = 0;
+        }
+    } else if (mag > 4u * CONFIG_PLL_LOCK_US * 1000u) {
+        p->locked = false;
+        p->lock_run = 0;
+    }
+    if (p->locked && mag > p->skew_max_ns) {
+        p->skew_max_ns = mag;
+    }
+}
+
+/* Nominal plus correction, the fraction carried to the next period */
+static uint32_t next_period(pll_core *p)
+{
+    int64_t period = ((int64_t)p->nominal_ticks << PLL_FRAC_BITS) + p->adj + p->dither;
+
+    p->dither = (uint32_t)period & ((1u << PLL_FRAC_BITS) - 1u);
+    return (uint32_t)(period >> PLL_FRAC_BITS);
+}
+
+/* PI on the phase error; positive error (late) shortens the period still running */
+uint32_t pll_core_update(pll_core *p, int64_t err_ns)
+{
+    lock_update(p, err_ns);
+
+    if (err_ns > PLL_ERR_MAX_NS) {
+        err_ns = PLL_ERR_MAX_NS;
+    } else if (err_ns < -PLL_ERR_MAX_NS) {
+        err_ns = -PLL_ERR_MAX_NS;
+    }
+    int64_t e = err_ns * p->tick_khz * (1 << PLL_FRAC_BITS) / 1000000;
+    int64_t i_next = p->integ + (e >> CONFIG_PLL_KI_SHIFT);
+    int64_t adj = -((e >> CONFIG_PLL_KP_SHIFT) + i_next);
+
+    /* Anti-windup: hold the integrator while the output is clamped */
+    if (adj > p->max_adj) {
+        adj = p->max_adj;
+    } else if (adj < -p->max_adj) {
+        adj = -p->max_adj;
+    } else {
+        p->integ = i_next;
+    }
+    p->adj = adj;
+    return next_period(p);
+}
+
+uint32_t pll_core_hold(pll_core *p)
+{
+    return next_period(p);
+}
+
+int32_t pll_core_adj_ppm(const pll_core *p)
+{
+    return p->nominal_ticks ?
+        (int32_t)(p->adj * 1000000 / ((int64_t)p->nominal_ticks << PLL_FRAC_BITS)) : 0;
+}
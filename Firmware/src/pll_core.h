@@ -0,0 +1,60 @@
+#ifndef PLL_CORE_H
+#define PLL_CORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/*
+ * Loop of the stim period PLL (stim_pll.c): phase fold, lock detector and the PI filter that
+ * trims the next CC0. Plain C with no kernel or driver dependencies, so the loop stim_pll.c
+ * runs at the end of each pulse is the one Tools/pll_sim.c runs on the host.
+ *
+ * Phase errors are own onset minus reference in ns, positive when late. Corrections are in
+ * stim TIMER ticks with PLL_FRAC_BITS fractional bits; the fraction of the corrected period
+ * is carried to the next one, so a correction finer than a tick still applies on average.
+ */
+
+#define PLL_FRAC_BITS 16
+
+/* Errors beyond this only slew at the clamp anyway; bounds the 64-bit tick conversion */
+#define PLL_ERR_MAX_NS 1000000000
+
+#define STIM_PLL_LOCK_COUNT 16
+
+typedef struct {
+    uint32_t nominal_ticks;     // CC0 from update_stim_frequency()
+    uint32_t tick_khz;          // stim TIMER rate at the prescaler update_stim_rate_mhz() chose
+    int64_t max_adj;            // CONFIG_PLL_MAX_PPM of nominal_ticks, fractional ticks
+    int64_t integ;              // integral term, fractional ticks
+    uint32_t dither;            // fractional tick carried to the next period
+    int64_t adj;                // correction applied, fractional ticks
+    int32_t skew_ns;
+    uint32_t skew_max_ns;
+    uint32_t skew_avg_ns;
+    uint32_t lock_run;
+    bool locked;
+} pll_core;
+
+/** New nominal period: the loop restarts from no correction. Zero the struct before the first call. */
+void pll_core_resync(pll_core *p, uint32_t period_ticks, uint32_t tick_hz);
+
+/** Restart the loop (new reference) keeping the nominal period. */
+void pll_core_reset(pll_core *p);
+
+/** Distance to the nearest reference edge, in (-period/2, period/2]. */
+int64_t pll_phase_fold(int64_t err_ns, uint64_t period_ns);
+
+/** One phase measurement: updates the lock detector and returns the next CC0, whole ticks. */
+uint32_t pll_core_update(pll_core *p, int64_t err_ns);
+
+/**
+ * No fresh reference: the next CC0 with the correction held. The engine rewrites CC0 at each
+ * COMPARE0 when its period has a fraction, so a held correction has to be written again.
+ */
+uint32_t pll_core_hold(pll_core *p);
+
+/** Correction now applied, ppm of the nominal period. */
+int32_t pll_core_adj_ppm(const pll_core *p);
+
+#endif /* PLL_CORE_H */
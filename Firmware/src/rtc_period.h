@@ -0,0 +1,36 @@
+#ifndef RTC_PERIOD_H
+#define RTC_PERIOD_H
+
+#include <stdint.h>
+
+/*
+ * Period arithmetic of the RTC engine (rtc_stim.c), free of Zephyr and nrfx so the host
+ * drift simulation (Tools/rtc_drift.c) runs the same code as the device.
+ */
+
+#define LFCLK_FREQ_HZ 32768u
+
+/* Period -> whole + Q16 fractional LF ticks at lfclk_mhz (the measured LFCLK rate).
+ * ns * mHz stays below 2^64 up to STIM_RATE_MIN_MHZ; the remainder is < 10^12, so the
+ * fraction is taken from it separately rather than shifting the whole product. */
+static inline void rtc_period_split(uint64_t period_ns, uint32_t lfclk_mhz, uint32_t *whole, uint32_t *frac)
+{
+	uint64_t prod = period_ns * lfclk_mhz;
+
+	*whole = (uint32_t)(prod / 1000000000000ull);
+	*frac = (uint32_t)(((prod % 1000000000000ull) << 16) / 1000000000000ull);
+	if (*whole == 0) {
+		*whole = 1;
+	}
+}
+
+/* Next period in whole ticks; dithering the fractional part keeps the mean rate exact */
+static inline uint32_t rtc_period_dither(uint32_t whole, uint32_t frac, uint32_t *acc)
+{
+	*acc += frac;
+	uint32_t ticks = whole + (*acc >> 16);
+	*acc &= 0xFFFFu;
+	return ticks;
+}
+
+#endif /* RTC_PERIOD_H */
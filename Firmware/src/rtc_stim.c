@@ -6,23 +6,180 @@
 #include <hal/nrf_rtc.h>
 #include <hal/nrf_clock.h>
 #include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
 #include "rtc_stim.h"
 #include "timer.h"
+#include "stochastic.h"
+#include "isr_cycles.h"
+#include "deadline.h"
+#include "spi.h"
+#include "energy.h"
+#include "charge_limit.h"
+#include "clock_policy.h"
 #include "config.h"
 
 #define RTC_STIM_INST_IDX 0
-#define LFCLK_FREQ_HZ 32768u
-/* RTC prescaler 0: one tick = 1/32768 s */
+/* RTC prescaler 0: one tick = 1/32768 s. Kept for every rate: periods past the 24-bit counter
+ * are armed in steps (rtc_arm) instead of coarsening every period with a prescaler. */
 #define RTC_PRESCALER 0
 
+/* Bound on LFXO start-up before falling back to LFRC (~1 s in 1 ms steps) */
+#define LFXO_START_TIMEOUT_MS 1000
+
 static nrfx_rtc_t rtc_inst = NRFX_RTC_INSTANCE(RTC_STIM_INST_IDX);
-static uint32_t rtc_period_ticks;
+static uint64_t rtc_period_ns;
+static uint32_t rtc_period_ticks;	/* whole LFCLK ticks per period */
+static uint32_t rtc_period_frac;	/* fractional ticks per period, Q16 */
+static uint32_t rtc_frac_acc;		/* fractional tick accumulator, Q16 */
+static uint32_t lfclk_mhz = LFCLK_FREQ_HZ * 1000u;	/* LFCLK frequency in mHz (measured) */
+static rtc_lfclk_src lfclk_src = RTC_LFCLK_LFRC;
+
+/* Calibration snapshot: LF ticks scheduled up to the last COMPARE0, and the measurement
+ * timer value DPPI latched at that same compare (see lfclk_cal.c). */
+static uint32_t lf_ticks_total;
+static volatile bool cal_snap_armed;
+static uint32_t cal_snap_lf;
+static uint32_t cal_snap_hf;
+static atomic_t cal_snap_seq;
+
+/* Longest single compare. Longer periods (and duty-cycle off time) are armed in steps: the
+ * watchdog is fed on each intermediate wake, otherwise half the 24-bit counter. */
+#if DEADLINE_ACTIVE
+#define RTC_STEP_MAX (LFCLK_FREQ_HZ * DEADLINE_WDT_MS / 2000u)
+#else
+#define RTC_STEP_MAX (1u << 23)
+#endif
+
+static volatile uint32_t rtc_wait_left;	/* ticks of the running period not yet armed */
+
+#if DUTY_CYCLE_ACTIVE
+
+static uint32_t duty_on_ticks;		/* on/off lengths at the current (measured) LFCLK rate */
+static uint32_t duty_off_ticks;
+static uint32_t duty_on_elapsed;	/* ticks into the current train */
+static uint32_t duty_off_left;		/* off ticks not yet armed */
+static volatile bool duty_off;		/* compares count down the off period, no pulses */
+static bool duty_released;		/* HFCLK stopped and SPIM disabled */
+static uint64_t duty_on_total;
+static uint64_t duty_off_total;
+static uint32_t duty_cycles;
+static uint32_t duty_pulses;
+static uint32_t duty_off_wakes;
+#endif
+
+/* Period at the current (measured) LFCLK rate (rtc_period.h) */
+static void rtc_period_compute(void)
+{
+	uint32_t whole;
+	uint32_t frac;
+
+	rtc_period_split(rtc_period_ns, lfclk_mhz, &whole, &frac);
+
+	unsigned int key = irq_lock();
+
+	rtc_period_ticks = whole;
+	rtc_period_frac = frac;
+#if DUTY_CYCLE_ACTIVE
+	duty_on_ticks = (uint32_t)((uint64_t)CONFIG_DUTY_ON_S * lfclk_mhz / 1000u);
+	duty_off_ticks = (uint32_t)((uint64_t)CONFIG_DUTY_OFF_S * lfclk_mhz / 1000u);
+#endif
+	irq_unlock(key);
+}
+
+static inline uint32_t rtc_next_period_ticks(void)
+{
+	return rtc_period_dither(rtc_period_ticks, rtc_period_frac, &rtc_frac_acc);
+}
+
+/* Arm the next compare; anything past RTC_STEP_MAX is armed from rtc_wait_compare() */
+static void rtc_arm(uint32_t ticks)
+{
+	uint32_t step = MIN(ticks, RTC_STEP_MAX);
+
+	rtc_wait_left = ticks - step;
+	(void)nrfx_rtc_cc_set(&rtc_inst, 0, step, true);
+}
+
+/* Intermediate wake of a long period: no pulse, only the next step */
+static void rtc_wait_compare(void)
+{
+#if DEADLINE_ACTIVE
+	deadline_feed();
+#endif
+	rtc_arm(rtc_wait_left);
+}
+
+#if DUTY_CYCLE_ACTIVE
+/* Off period compare: no pulse. The first one comes a period after the last pulse of the
+ * train, so the TIMER burst is long over and HFCLK/SPIM can be released. The off time is
+ * armed in steps; once it is all armed the next compare starts the next train. */
+static void duty_off_compare(void)
+{
+	if (!duty_released) {
+		spi_suspend();
+		NRF_CLOCK_S->TASKS_HFCLKSTOP = 1;
+		duty_released = true;
+#if ENERGY_ACCOUNTING_ENABLE
+		energy_hfclk_sample();
+#endif
+	}
+#if DEADLINE_ACTIVE
+	deadline_feed();
+#endif
+	uint32_t step = MIN(duty_off_left, RTC_STEP_MAX);
+
+	duty_off_left -= step;
+	duty_off_total += step;
+	duty_off_wakes++;
+	lf_ticks_total += step;
+	if (duty_off_left == 0) {
+		duty_off = false;
+		duty_cycles++;
+	}
+	(void)nrfx_rtc_cc_set(&rtc_inst, 0, step, true);
+}
+
+/* After each pulse: the train ends once the period just armed completes the on time */
+static inline void duty_on_pulse(uint32_t next_ticks)
+{
+	duty_pulses++;
+	duty_on_total += next_ticks;
+	duty_on_elapsed += next_ticks;
+	if (duty_on_elapsed >= duty_on_ticks && duty_off_ticks != 0) {
+		duty_on_elapsed = 0;
+		duty_off_left = duty_off_ticks;
+		duty_off = true;
+	}
+}
+#endif
 
 static void rtc_handler(nrfx_rtc_int_type_t int_type)
 {
 	if (int_type != NRFX_RTC_INT_COMPARE0) {
 		return;
 	}
+	if (rtc_wait_left != 0) {
+		rtc_wait_compare();
+		return;
+	}
+#if DUTY_CYCLE_ACTIVE
+	if (duty_off) {
+		duty_off_compare();
+		return;
+	}
+#endif
+	/* The words timer_do_event0 and the COMPARE2 of this shot send */
+	uint16_t dac_code = timer_dac_latch();
+#if CHARGE_LIMIT_ACTIVE
+	/* Safe stop: no shot and no re-arm, the RTC stays quiet until rtc_stim_resume() */
+	if (!charge_limit_pulse_ok(dac_code)) {
+		return;
+	}
+#else
+	ARG_UNUSED(dac_code);
+#endif
+	CLOCK_HOT_BEGIN(clk);
+	ISR_CYC_BEGIN(cyc);
 
 	/* Ensure HFCLK is running for SPI and TIMER */
 	NRF_CLOCK_S->TASKS_HFCLKSTART = 1;
@@ -30,38 +187,160 @@ static void rtc_handler(nrfx_rtc_int_type_t int_type)
 		/* spin */
 	}
 	NRF_CLOCK_S->EVENTS_HFCLKSTARTED = 0;
+#if DUTY_CYCLE_ACTIVE
+	if (duty_released) {
+		spi_resume();
+		duty_released = false;
+#if ENERGY_ACCOUNTING_ENABLE
+		energy_hfclk_sample();
+#endif
+	}
+#endif
 
 	/* Start of pulse: same as timer COMPARE0 (GPIO + DAC1 SPI) */
 	timer_do_event0();
 	/* Run one biphasic period via TIMER (COMPARE1/2/3); timer disables itself after COMPARE3 */
 	timer_start_one_shot_biphasic();
 
+	if (cal_snap_armed) {
+		cal_snap_lf = lf_ticks_total;
+		cal_snap_hf = nrfx_timer_capture_get(timer_measurement_instance(), RTC_STIM_CAL_MEAS_CC);
+		atomic_inc(&cal_snap_seq);
+	}
+
 	/* nrfx disables compare channel after event; re-arm for next period (counter was cleared by SHORT) */
-	(void)nrfx_rtc_cc_set(&rtc_inst, 0, rtc_period_ticks, true);
+	uint32_t next_ticks;
+#if STOCHASTIC_IPI_ENABLE
+	next_ticks = stochastic_active() ? stochastic_next_ticks() : rtc_next_period_ticks();
+#else
+	next_ticks = rtc_next_period_ticks();
+#endif
+	lf_ticks_total += next_ticks;
+	rtc_arm(next_ticks);
+#if DUTY_CYCLE_ACTIVE
+	duty_on_pulse(next_ticks);
+#endif
+	ISR_CYC_END(ISR_PATH_RTC, cyc);
+	CLOCK_HOT_END(CLOCK_PATH_EDGE, clk);
 }
 
 void rtc_stim_start_lfclk(void)
 {
-	NRF_CLOCK_S->LFCLKSRC = (CLOCK_LFCLKSRC_SRC_LFRC << CLOCK_LFCLKSRC_SRC_Pos);
+	if (rtc_stim_select_lfclk(CONFIG_RTC_LFCLK_SRC) != 0) {
+		(void)rtc_stim_select_lfclk(RTC_LFCLK_LFRC);
+	}
+}
+
+int rtc_stim_select_lfclk(rtc_lfclk_src src)
+{
+	uint32_t reg = (src == RTC_LFCLK_LFXO) ? CLOCK_LFCLKSRC_SRC_LFXO : CLOCK_LFCLKSRC_SRC_LFRC;
+
+	/* Switching source needs the clock stopped; the RTC simply pauses meanwhile */
+	NRF_CLOCK_S->TASKS_LFCLKSTOP = 1;
+	NRF_CLOCK_S->EVENTS_LFCLKSTARTED = 0;
+	NRF_CLOCK_S->LFCLKSRC = (reg << CLOCK_LFCLKSRC_SRC_Pos);
 	NRF_CLOCK_S->TASKS_LFCLKSTART = 1;
-	while (NRF_CLOCK_S->EVENTS_LFCLKSTARTED == 0) {
-		/* spin */
+	if (src == RTC_LFCLK_LFXO) {
+		/* A missing crystal never starts; do not hang boot on it */
+		for (int ms = 0; NRF_CLOCK_S->EVENTS_LFCLKSTARTED == 0; ms++) {
+			if (ms >= LFXO_START_TIMEOUT_MS) {
+				return -ETIMEDOUT;
+			}
+			k_busy_wait(1000);
+		}
+	} else {
+		while (NRF_CLOCK_S->EVENTS_LFCLKSTARTED == 0) {
+			/* spin */
+		}
 	}
 	NRF_CLOCK_S->EVENTS_LFCLKSTARTED = 0;
+	lfclk_src = src;
+	/* New source: forget any correction measured on the old one */
+	rtc_stim_set_lfclk_mhz(LFCLK_FREQ_HZ * 1000u);
+	return 0;
 }
 
-void rtc_stim_init(uint16_t frequency_hz)
+rtc_lfclk_src rtc_stim_get_lfclk(void)
 {
-	if (frequency_hz == 0) {
-		return;
+	return lfclk_src;
+}
+
+void rtc_stim_set_lfclk_mhz(uint32_t mhz)
+{
+	lfclk_mhz = mhz;
+	if (rtc_period_ns != 0) {
+		rtc_period_compute();
 	}
-	/* Period in us; RTC ticks at 32768 Hz → period_ticks = period_us * 32768 / 1e6 */
-	uint32_t period_us = 1000000u / frequency_hz;
-	uint32_t period_ticks = (uint32_t)((uint64_t)period_us * LFCLK_FREQ_HZ / 1000000u);
-	if (period_ticks == 0) {
-		period_ticks = 1;
+}
+
+uint32_t rtc_stim_get_lfclk_mhz(void)
+{
+	return lfclk_mhz;
+}
+
+nrfx_rtc_t const *rtc_stim_instance(void)
+{
+	return &rtc_inst;
+}
+
+void rtc_stim_cal_arm(bool enable)
+{
+	cal_snap_armed = enable;
+}
+
+uint32_t rtc_stim_cal_snapshot(uint32_t *lf_ticks, uint32_t *hf_ticks)
+{
+	unsigned int key = irq_lock();
+	uint32_t seq = atomic_get(&cal_snap_seq);
+
+	*lf_ticks = cal_snap_lf;
+	*hf_ticks = cal_snap_hf;
+	irq_unlock(key);
+	return seq;
+}
+
+#if DUTY_CYCLE_ACTIVE
+bool rtc_stim_duty_off(void)
+{
+	return duty_off || duty_released;
+}
+
+void get_rtc_duty_stats(rtc_duty_stats *stats)
+{
+	unsigned int key = irq_lock();
+	uint64_t on_ticks = duty_on_total;
+	uint64_t off_ticks = duty_off_total;
+
+	stats->cycles = duty_cycles;
+	stats->pulses = duty_pulses;
+	stats->off_wakes = duty_off_wakes;
+	irq_unlock(key);
+
+	/* ticks -> ms at the measured LFCLK rate (mHz) */
+	uint64_t on_ms = on_ticks * 1000000u / lfclk_mhz;
+	uint64_t off_ms = off_ticks * 1000000u / lfclk_mhz;
+
+	stats->on_ms = (uint32_t)on_ms;
+	stats->off_ms = (uint32_t)off_ms;
+	/* uA * ms -> uAh: / 3600000 */
+	stats->on_uah = (uint32_t)(on_ms * CONFIG_DUTY_ON_UA / 3600000u);
+	stats->off_uah = (uint32_t)(off_ms * CONFIG_DUTY_OFF_UA / 3600000u);
+	stats->avg_ua = (on_ms + off_ms) == 0 ? 0 :
+		(uint32_t)((on_ms * CONFIG_DUTY_ON_UA + off_ms * CONFIG_DUTY_OFF_UA) / (on_ms + off_ms));
+}
+#endif
+
+void rtc_stim_init(uint32_t rate_mhz)
+{
+	if (rate_mhz < STIM_RATE_MIN_MHZ || rate_mhz > STIM_RATE_MAX_MHZ) {
+		return;
 	}
-	rtc_period_ticks = period_ticks;
+	/* Period in ns; RTC ticks at the (calibrated) LFCLK rate, fractional part dithered */
+	rtc_period_ns = STIM_RATE_TO_PERIOD_NS(rate_mhz);
+	rtc_frac_acc = 0;
+	rtc_period_compute();
+	uint32_t period_ticks = rtc_next_period_ticks();
+	lf_ticks_total = period_ticks;
 
 	nrfx_rtc_config_t config = NRFX_RTC_DEFAULT_CONFIG;
 	config.prescaler = RTC_PRESCALER;
@@ -71,13 +350,17 @@ void rtc_stim_init(uint16_t frequency_hz)
 	}
 	nrfx_rtc_tick_enable(&rtc_inst, false);
 	nrfx_rtc_overflow_enable(&rtc_inst, false);
-	/* Set compare channel 0 and enable interrupt */
-	err = nrfx_rtc_cc_set(&rtc_inst, 0, period_ticks, true);
-	if (err != NRFX_SUCCESS) {
-		return;
-	}
+	/* Set compare channel 0 and enable interrupt (first step of a long period) */
+	rtc_arm(period_ticks);
 	/* Clear on compare so period repeats every period_ticks (nRF53: RTC_SHORTS_COMPARE0_CLEAR_Msk) */
 	rtc_inst.p_reg->SHORTS = RTC_SHORTS_COMPARE0_CLEAR_Msk;
 	nrf_rtc_task_trigger(rtc_inst.p_reg, NRF_RTC_TASK_CLEAR);
 	nrfx_rtc_enable(&rtc_inst);
 }
+
+void rtc_stim_resume(void)
+{
+	/* No compare is armed, so the handler cannot run meanwhile; a full period to the next pulse */
+	nrf_rtc_task_trigger(rtc_inst.p_reg, NRF_RTC_TASK_CLEAR);
+	rtc_arm(rtc_next_period_ticks());
+}
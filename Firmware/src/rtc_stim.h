@@ -2,17 +2,86 @@
 #define RTC_STIM_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <nrfx_rtc.h>
+#include "rtc_period.h"
+#include "config.h"
 
-/** Start LFCLK (32.768 kHz) for RTC. Call before rtc_stim_init. */
+/* On/off trains ride on the RTC engine only */
+#if DUTY_CYCLE_ENABLE && !defined(CONFIG_BT) && !TRIGGER_MODE
+#define DUTY_CYCLE_ACTIVE 1
+#else
+#define DUTY_CYCLE_ACTIVE 0
+#endif
+
+/* Measurement timer channel latched by DPPI on RTC COMPARE0 during LFCLK calibration */
+#define RTC_STIM_CAL_MEAS_CC NRF_TIMER_CC_CHANNEL4
+
+typedef enum {
+	RTC_LFCLK_LFRC = 0,	/* internal RC: no crystal, drifts with temperature unless calibrated */
+	RTC_LFCLK_LFXO = 1,	/* 32.768 kHz crystal */
+} rtc_lfclk_src;
+
+/** Start LFCLK (32.768 kHz) for RTC from CONFIG_RTC_LFCLK_SRC, falling back to LFRC. Call before rtc_stim_init. */
 void rtc_stim_start_lfclk(void);
 
+/** Switch LFCLK source at runtime. Returns -ETIMEDOUT if the LFXO does not start. */
+int rtc_stim_select_lfclk(rtc_lfclk_src src);
+rtc_lfclk_src rtc_stim_get_lfclk(void);
+
+/**
+ * Measured LFCLK frequency in mHz (nominal 32768000). The RTC period is recomputed
+ * from it, with the fractional tick dithered across periods so the mean rate is exact.
+ */
+void rtc_stim_set_lfclk_mhz(uint32_t mhz);
+uint32_t rtc_stim_get_lfclk_mhz(void);
+
+/** RTC instance, for DPPI wiring of COMPARE0 (lfclk_cal.c). */
+nrfx_rtc_t const *rtc_stim_instance(void);
+
+/**
+ * Calibration snapshots: while armed, each COMPARE0 records the LF ticks scheduled up to
+ * that compare and the measurement timer value latched on RTC_STIM_CAL_MEAS_CC.
+ * Returns a sequence number that increments per snapshot.
+ */
+void rtc_stim_cal_arm(bool enable);
+uint32_t rtc_stim_cal_snapshot(uint32_t *lf_ticks, uint32_t *hf_ticks);
+
 /**
  * Initialize RTC for stimulation period.
- * RTC runs from LFCLK; compare event fires every (1/frequency_hz) seconds.
+ * RTC runs from LFCLK; compare event fires every (1000/rate_mhz) seconds.
  * On each compare: HFCLK is ensured, event0 (DAC1) runs, then timer one-shot
- * runs for the biphasic phases.
- * @param frequency_hz Stimulation rate in Hz (e.g. 130).
+ * runs for the biphasic phases. Periods longer than one compare step wake
+ * without a pulse in between (feeding the watchdog) until the period is up.
+ * @param rate_mhz Stimulation rate in mHz (e.g. 130000 for 130 Hz, 10 for 0.01 Hz),
+ *                 STIM_RATE_MIN_MHZ..STIM_RATE_MAX_MHZ.
+ */
+void rtc_stim_init(uint32_t rate_mhz);
+
+/** Start the periods again after a charge-limit safe stop left the RTC unarmed. */
+void rtc_stim_resume(void);
+
+/*
+ * Duty cycle (DUTY_CYCLE_ACTIVE): CONFIG_DUTY_ON_S of pulses, then CONFIG_DUTY_OFF_S with no
+ * pulse at all. While off, the RTC compares only count down to the next train: HFCLK is
+ * stopped, SPIM disabled and the stim TIMER idle, so the chip stays in System ON sleep on
+ * LFCLK alone. (System OFF would stop the RTC, and with it the wake-up at the next train.)
+ * Time is accounted per phase, and charge is estimated from CONFIG_DUTY_ON_UA/OFF_UA.
  */
-void rtc_stim_init(uint16_t frequency_hz);
+typedef struct {
+	uint32_t cycles;		/* completed on/off cycles */
+	uint32_t pulses;		/* pulses delivered in on periods */
+	uint32_t on_ms;			/* time in on periods */
+	uint32_t off_ms;		/* time in off periods */
+	uint32_t off_wakes;		/* RTC wakes while off (off steps are bounded by the watchdog) */
+	uint32_t on_uah;		/* estimated charge drawn while on, uAh */
+	uint32_t off_uah;		/* estimated charge drawn while off, uAh */
+	uint32_t avg_ua;		/* estimated average current over both phases, uA */
+} rtc_duty_stats;
+
+/** True during an off period (the LFCLK calibration waits for the next train). */
+bool rtc_stim_duty_off(void);
+
+void get_rtc_duty_stats(rtc_duty_stats *stats);
 
 #endif /* RTC_STIM_H */
@@ -0,0 +1,349 @@
+/*
+ * Multichannel interleaved stimulation. Each enabled channel runs its own biphasic train;
+ * all trains share the DACs and the drive/shunt switches, and the HCSS output selects the
+ * channel. The plan compiler merges the trains over one repeat cycle, delays any pulse that
+ * would overlap the previous one, and emits a flat list of edges. The ISR executes one edge
+ * word per compare, so adding channels adds edges but never per-edge work.
+ */
+#include <nrfx_timer.h>
+#include <hal/nrf_gpio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+#include <string.h>
+#include "sched.h"
+#include "timer.h"
+#include "spi.h"
+#include "boot_time.h"
+#include "charge_limit.h"
+#include "config.h"
+
+#if MULTICHANNEL_ACTIVE
+
+#if TRIGGER_MODE || STOCHASTIC_IPI_ENABLE || SYNC_OUT_ENABLE
+#error "MULTICHANNEL_ENABLE owns every stim TIMER compare; disable TRIGGER_MODE, STOCHASTIC_IPI_ENABLE and SYNC_OUT_ENABLE"
+#endif
+
+/* One edge word: ticks to the next edge | action | channel */
+#define EDGE_ONSET       0u     // phase 1: drive, HCSS on, DAC phase 1 code
+#define EDGE_INTERPHASE  1u     // shunt
+#define EDGE_PHASE2      2u     // phase 2: drive, DAC phase 2 code
+#define EDGE_END         3u     // shunt, HCSS off
+#define EDGE_DELTA_MASK  0x0FFFFFFFu
+#define EDGE_ACTION_POS  28
+#define EDGE_CH_POS      30
+#define EDGE_WORD(action, ch) (((uint32_t)(action) << EDGE_ACTION_POS) | ((uint32_t)(ch) << EDGE_CH_POS))
+#define EDGE_DELTA(e)    ((e) & EDGE_DELTA_MASK)
+#define EDGE_ACTION(e)   (((e) >> EDGE_ACTION_POS) & 0x3u)
+#define EDGE_CH(e)       ((e) >> EDGE_CH_POS)
+
+/* First edge after an idle start */
+#define SCHED_START_US 100u
+/* How long a reconfiguration waits for the ISR to take over the previous pending plan */
+#define SCHED_SWAP_TIMEOUT_MS 2000
+
+typedef struct {
+    uint16_t n_edges;
+    uint32_t edges[SCHED_MAX_EDGES];
+    uint8_t phase1_code[SCHED_MAX_CHANNELS][DAC_TX_LEN];
+    uint8_t phase2_code[SCHED_MAX_CHANNELS][DAC_TX_LEN];
+} sched_plan;
+
+static const uint32_t hcss_pins[SCHED_MAX_CHANNELS] = STIM_PIN_HCSS_LIST;
+
+static sched_plan plans[2];
+static sched_plan *volatile active;     // owned by the ISR while the timer runs
+static sched_plan *volatile pending;    // taken by the ISR at the next cycle boundary
+static uint16_t edge_idx;
+static uint32_t next_cc;
+
+static sched_channel channels[SCHED_MAX_CHANNELS];
+static sched_stats stats;
+static atomic_t late_edges;
+static K_MUTEX_DEFINE(plan_lock);
+
+static uint32_t gcd_u32(uint32_t a, uint32_t b)
+{
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static void dac_codes(uint16_t amplitude, uint8_t *phase1, uint8_t *phase2)
+{
+    /* Same encoding as update_dac_amplitude() */
+    uint16_t opposite = DAC_MIRROR(amplitude);
+
+    phase1[0] = (amplitude >> 8) & 0xFF;
+    phase1[1] = amplitude & 0xFF;
+    phase2[0] = (opposite >> 8) & 0xFF;
+    phase2[1] = opposite & 0xFF;
+}
+
+static int channel_check(const sched_channel *c)
+{
+    if (!c->enabled) {
+        return 0;
+    }
+    if (c->frequency_hz == 0 || c->pulse_width_us < SCHED_GUARD_US ||
+        1000000u / c->frequency_hz < 2u * c->pulse_width_us + SWITCH_PERIOD + SCHED_GUARD_US) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Merge all trains over one cycle into an edge list. Thread context. */
+static int plan_compile(sched_plan *p, const sched_channel *chs, sched_stats *st)
+{
+    nrfx_timer_t const *t = timer_stim_instance();
+    uint32_t tick_hz = NRF_TIMER_BASE_FREQUENCY_GET(t->p_reg);
+    uint32_t g = 0;
+    uint32_t total = 0;
+    uint32_t n[SCHED_MAX_CHANNELS] = {0};
+    uint32_t k[SCHED_MAX_CHANNELS] = {0};
+    uint32_t pw[SCHED_MAX_CHANNELS];
+    uint32_t gap = nrfx_timer_us_to_ticks(t, SWITCH_PERIOD);
+    uint32_t guard = nrfx_timer_us_to_ticks(t, SCHED_GUARD_US);
+
+    memset(st->max_shift_us, 0, sizeof(st->max_shift_us));
+    for (int c = 0; c < SCHED_MAX_CHANNELS; c++) {
+        if (chs[c].enabled) {
+            g = gcd_u32(g, chs[c].frequency_hz);
+        }
+    }
+    p->n_edges = 0;
+    if (g == 0) {
+        st->cycle_us = 0;
+        st->pulses = 0;
+        return 0;   // all channels off
+    }
+    for (int c = 0; c < SCHED_MAX_CHANNELS; c++) {
+        if (chs[c].enabled) {
+            n[c] = chs[c].frequency_hz / g;
+            total += n[c];
+            pw[c] = nrfx_timer_us_to_ticks(t, chs[c].pulse_width_us);
+            dac_codes(chs[c].amplitude, p->phase1_code[c], p->phase2_code[c]);
+        }
+    }
+    if (total > SCHED_MAX_PULSES) {
+        return -E2BIG;
+    }
+
+    /* All trains repeat every 1/g s: n[c] pulses of channel c, nominally evenly spaced */
+    uint32_t cycle = tick_hz / g;
+    uint32_t first = 0;
+    uint32_t prev_end = 0;
+    uint32_t prev_edge = 0;
+    uint16_t e = 0;
+
+    for (uint32_t i = 0; i < total; i++) {
+        int pick = -1;
+        uint32_t nominal = UINT32_MAX;
+        for (int c = 0; c < SCHED_MAX_CHANNELS; c++) {
+            if (k[c] < n[c]) {
+                uint32_t on = (uint32_t)((uint64_t)k[c] * cycle / n[c]);
+                if (on < nominal) {
+                    nominal = on;
+                    pick = c;
+                }
+            }
+        }
+        uint32_t start = nominal;
+        if (i == 0) {
+            first = start;
+        } else if (start < prev_end + guard) {
+            start = prev_end + guard;     // shared DACs: never overlap, keep ISR spacing
+        }
+        uint16_t shift_us = (uint16_t)MIN((uint64_t)(start - nominal) * 1000000u / tick_hz, UINT16_MAX);
+        st->max_shift_us[pick] = MAX(st->max_shift_us[pick], shift_us);
+
+        uint32_t at[4] = {
+            start,
+            start + pw[pick],
+            start + pw[pick] + gap,
+            start + 2 * pw[pick] + gap,
+        };
+        for (int a = 0; a < 4; a++) {
+            if (e > 0) {
+                p->edges[e - 1] |= at[a] - prev_edge;
+            }
+            p->edges[e++] = EDGE_WORD(a, pick);
+            prev_edge = at[a];
+        }
+        prev_end = at[3];
+        k[pick]++;
+    }
+    /* Wrap: the first pulse of the next cycle must also clear the last one */
+    if (prev_end + guard > cycle + first) {
+        return -ERANGE;
+    }
+    p->edges[e - 1] |= cycle + first - prev_edge;
+    p->n_edges = e;
+    st->cycle_us = 1000000u / g;
+    st->pulses = (uint16_t)total;
+    return 0;
+}
+
+static void switches_idle(void)
+{
+    stim_pins_idle();
+    for (int c = 0; c < SCHED_MAX_CHANNELS; c++) {
+        nrf_gpio_pin_clear(hcss_pins[c]);
+    }
+}
+
+static void sched_timer_start(sched_plan *p)
+{
+    nrfx_timer_t const *t = timer_stim_instance();
+
+    nrfx_timer_disable(t);
+    nrfx_timer_clear(t);
+    edge_idx = 0;
+    active = p;
+    next_cc = nrfx_timer_us_to_ticks(t, SCHED_START_US);
+    nrfx_timer_compare(t, NRF_TIMER_CC_CHANNEL0, next_cc, true);
+    nrfx_timer_enable(t);
+}
+
+void sched_on_edge(void)
+{
+    nrfx_timer_t const *t = timer_stim_instance();
+    sched_plan *p = active;
+
+    for (;;) {
+        uint32_t e = p->edges[edge_idx];
+        uint32_t ch = EDGE_CH(e);
+
+        switch (EDGE_ACTION(e)) {
+            case EDGE_ONSET:
+                nrf_gpio_pin_set(hcss_pins[ch]);     // electrode still shunted, drive off
+                stim_pins_phase1();
+                spi_write_dac1(p->phase1_code[ch], dac1_buf_rx);
+                boot_mark(BOOT_PHASE_FIRST_PULSE);
+                break;
+            case EDGE_INTERPHASE:
+                stim_pins_interphase();
+                break;
+            case EDGE_PHASE2:
+                stim_pins_phase2();
+                spi_write_dac1(p->phase2_code[ch], dac2_buf_rx);
+                break;
+            case EDGE_END:
+                stim_pins_idle();
+                nrf_gpio_pin_clear(hcss_pins[ch]);
+                timer_pulse_done();
+                break;
+        }
+
+        next_cc += EDGE_DELTA(e);
+        if (++edge_idx == p->n_edges) {
+            edge_idx = 0;
+            if (pending) {
+                p = pending;
+                active = p;
+                pending = NULL;
+                if (p->n_edges == 0) {
+                    nrfx_timer_disable(t);
+                    return;
+                }
+            }
+        }
+        nrf_timer_cc_set(t->p_reg, NRF_TIMER_CC_CHANNEL0, next_cc);
+        if ((int32_t)(next_cc - nrfx_timer_capture(t, NRF_TIMER_CC_CHANNEL5)) >= SCHED_MIN_LEAD_TICKS) {
+            return;
+        }
+        /* Too close to arm: wait it out here and drop the compare it raises */
+        atomic_inc(&late_edges);
+        while ((int32_t)(next_cc - nrfx_timer_capture(t, NRF_TIMER_CC_CHANNEL5)) > 0) {
+        }
+        nrf_timer_event_clear(t->p_reg, NRF_TIMER_EVENT_COMPARE0);
+    }
+}
+
+int sched_set_channel(uint8_t ch, const sched_channel *cfg)
+{
+    sched_channel next[SCHED_MAX_CHANNELS];
+    sched_stats next_stats;
+    int err;
+
+    if (ch >= SCHED_MAX_CHANNELS) {
+        return -EINVAL;
+    }
+    err = channel_check(cfg);
+    if (err) {
+        return err;
+    }
+#if CHARGE_LIMIT_ACTIVE
+    if (cfg->enabled) {
+        err = charge_limit_check(cfg->amplitude, cfg->pulse_width_us, cfg->frequency_hz * 1000u, ch);
+        if (err) {
+            printf("Channel %u rejected: outside the charge limits\n", ch);
+            return err;
+        }
+    }
+#endif
+
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    /* The spare buffer is free once the ISR has taken the last pending plan */
+    for (int ms = 0; pending; ms++) {
+        if (ms >= SCHED_SWAP_TIMEOUT_MS) {
+            k_mutex_unlock(&plan_lock);
+            return -EBUSY;
+        }
+        k_sleep(K_MSEC(1));
+    }
+    sched_plan *spare = (active == &plans[0]) ? &plans[1] : &plans[0];
+
+    memcpy(next, channels, sizeof(next));
+    next[ch] = *cfg;
+    next_stats = stats;
+    err = plan_compile(spare, next, &next_stats);
+    if (err) {
+        k_mutex_unlock(&plan_lock);
+        printf("Channel %u rejected (%d): plan does not fit\n", ch, err);
+        return err;
+    }
+    memcpy(channels, next, sizeof(channels));
+    next_stats.plans_applied++;
+    stats = next_stats;
+
+    if (active == NULL || active->n_edges == 0 || !nrfx_timer_is_enabled(timer_stim_instance())) {
+        switches_idle();
+        if (spare->n_edges > 0) {
+            sched_timer_start(spare);
+        } else {
+            active = spare;
+        }
+    } else {
+        pending = spare;
+    }
+    k_mutex_unlock(&plan_lock);
+
+    printf("Plan: %u pulses per %lu us cycle, channel %u %s\n", stats.pulses, stats.cycle_us,
+           ch, cfg->enabled ? "on" : "off");
+    return 0;
+}
+
+void sched_get_channel(uint8_t ch, sched_channel *cfg)
+{
+    if (ch < SCHED_MAX_CHANNELS) {
+        *cfg = channels[ch];
+    }
+}
+
+int sched_init(const sched_channel *ch0)
+{
+    switches_idle();
+    return sched_set_channel(0, ch0);
+}
+
+void get_sched_stats(sched_stats *out)
+{
+    *out = stats;
+    out->late_edges = atomic_get(&late_edges);
+}
+
+#endif /* MULTICHANNEL_ACTIVE */
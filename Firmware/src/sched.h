@@ -0,0 +1,70 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stim_pins.h"
+#include "config.h"
+
+/* The RTC engine fires one fixed one-shot per wake, so the scheduler is BLE-build only */
+#if MULTICHANNEL_ENABLE && defined(CONFIG_BT)
+#define MULTICHANNEL_ACTIVE 1
+#else
+#define MULTICHANNEL_ACTIVE 0
+#endif
+
+/* One stimulation channel per HCSS switch output (stim_pins.h, hcss-gpios order) */
+#define SCHED_MAX_CHANNELS STIM_PIN_HCSS_COUNT
+
+/* Pulses per plan cycle (all channels). Four edges per pulse, one word per edge. */
+#define SCHED_MAX_PULSES 256
+#define SCHED_MAX_EDGES  (4 * SCHED_MAX_PULSES)
+
+/* Minimum spacing between one pulse's end and the next pulse's onset, and the shortest
+ * phase: covers one edge ISR including the blocking DAC write. */
+#define SCHED_GUARD_US 30u
+
+/* Edges closer than this to "now" are run back-to-back in the same ISR instead of armed */
+#define SCHED_MIN_LEAD_TICKS 16
+
+typedef struct {
+    bool enabled;
+    uint16_t amplitude;       // DAC code for phase 1; phase 2 uses the opposite code
+    uint16_t pulse_width_us;  // per phase
+    uint16_t frequency_hz;
+} sched_channel;
+
+typedef struct {
+    uint32_t cycle_us;        // plan repeats exactly every cycle_us (1 s / gcd of channel rates)
+    uint16_t pulses;          // pulses per cycle, all channels
+    uint16_t max_shift_us[SCHED_MAX_CHANNELS];  // largest onset delay applied to avoid overlap
+    uint32_t late_edges;      // edges that were run late (ISR overrun, back-to-back)
+    uint32_t plans_applied;
+} sched_stats;
+
+/**
+ * Start the scheduler on the stim TIMER with channel 0 configured and the others off.
+ * The TIMER free-runs; one compare (CC0) is armed per edge, and each edge is one
+ * precompiled word, so ISR work per edge does not depend on the number of channels.
+ * Call after timer_init() and spi_init().
+ */
+int sched_init(const sched_channel *ch0);
+
+/**
+ * Configure one channel and recompile the plan. Pulses of all channels are merged in
+ * time order; a pulse that would overlap the previous one (shared DACs) is delayed to
+ * start SCHED_GUARD_US after it. Returns -E2BIG if the cycle needs more than
+ * SCHED_MAX_PULSES pulses, -ERANGE if the channels cannot fit without overlap, -EPERM if
+ * the channel is outside the charge limits (charge_limit.h), and -EINVAL for bad parameters.
+ * On error the running plan is unchanged.
+ * The new plan takes over at the next cycle boundary.
+ */
+int sched_set_channel(uint8_t ch, const sched_channel *cfg);
+void sched_get_channel(uint8_t ch, sched_channel *cfg);
+
+/** TIMER COMPARE0 in multichannel mode. ISR context. */
+void sched_on_edge(void);
+
+void get_sched_stats(sched_stats *stats);
+
+#endif /* SCHED_H */
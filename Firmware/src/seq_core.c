@@ -0,0 +1,155 @@
+/*
+ * Pulse sequencer (seq_core.h). Per edge: a few additions; the divisions are all in
+ * seq_commit, never between the edges of a pulse.
+ */
+#include <string.h>
+#include "seq_core.h"
+
+typedef struct {
+    uint32_t period_ticks;
+    uint32_t period_frac;
+    uint32_t width_ticks;
+    uint32_t gap_ticks;
+} seq_timing;
+
+static int plan_timing(const seq_plan *plan, uint32_t tick_hz, seq_timing *t)
+{
+    if (tick_hz == 0 || plan->rate_mhz == 0 || plan->pulse_width_us == 0 || plan->amplitude > UINT16_MAX) {
+        return -1;
+    }
+
+    /* As update_stim_rate_mhz: period in ns, then whole + Q16 fractional ticks */
+    uint64_t period_ns = 1000000000000ull / plan->rate_mhz;
+
+    if (period_ns > UINT64_MAX / tick_hz) {
+        return -1;
+    }
+    uint64_t prod = period_ns * tick_hz;
+    uint64_t ticks = prod / 1000000000u;
+
+    t->width_ticks = (uint32_t)((uint64_t)plan->pulse_width_us * tick_hz / 1000000u);
+    t->gap_ticks = (uint32_t)((uint64_t)plan->gap_us * tick_hz / 1000000u);
+    if (ticks >= INT32_MAX || t->width_ticks == 0 ||
+        2ull * t->width_ticks + t->gap_ticks >= ticks) {
+        return -1;
+    }
+    t->period_ticks = (uint32_t)ticks;
+    t->period_frac = (uint32_t)(((prod % 1000000000u) << 16) / 1000000000u);
+    return 0;
+}
+
+/* Returns true if the period changed */
+static bool apply(seq_core *seq, const seq_plan *plan, const seq_timing *t)
+{
+    bool moved = t->period_ticks != seq->period_ticks || t->period_frac != seq->period_frac;
+
+    seq->plan = *plan;
+    seq->period_ticks = t->period_ticks;
+    seq->period_frac = t->period_frac;
+    seq->width_ticks = t->width_ticks;
+    seq->gap_ticks = t->gap_ticks;
+    seq->dac_phase1 = (uint16_t)plan->amplitude;
+    /* Most negative mirrors to most positive */
+    seq->dac_phase2 = plan->amplitude ? (uint16_t)(0x10000u - plan->amplitude) : 0xFFFFu;
+    if (moved) {
+        seq->frac_acc = 0;
+    }
+    seq->applied++;
+    return moved;
+}
+
+int seq_plan_check(const seq_plan *plan, uint32_t tick_hz)
+{
+    seq_timing t;
+
+    return plan_timing(plan, tick_hz, &t);
+}
+
+int seq_init(seq_core *seq, uint32_t tick_hz, const seq_plan *plan, uint32_t start)
+{
+    seq_timing t;
+
+    if (plan_timing(plan, tick_hz, &t) != 0) {
+        return -1;
+    }
+    memset(seq, 0, sizeof(*seq));
+    seq->tick_hz = tick_hz;
+    (void)apply(seq, plan, &t);
+    seq->onset = start;
+    seq->next = (seq_edge){ SEQ_EDGE_ONSET, start, seq->dac_phase1 };
+    return 0;
+}
+
+int seq_commit(seq_core *seq, const seq_plan *plan, uint32_t earliest)
+{
+    seq_timing t;
+
+    if (plan_timing(plan, seq->tick_hz, &t) != 0) {
+        return -1;
+    }
+    if (seq->next.kind != SEQ_EDGE_ONSET) {
+        seq->staged = *plan;
+        seq->staged_valid = true;
+        return 0;
+    }
+
+    seq->staged_valid = false;
+    if (apply(seq, plan, &t)) {
+        /* A new rate counts from the last onset, as if it had been in effect then */
+        uint32_t at = seq->have_prev ? seq->prev_onset + seq->period_ticks : seq->onset;
+
+        if ((int32_t)(at - earliest) < 0) {
+            at = earliest;
+        }
+        seq->onset = at;
+    }
+    seq->next = (seq_edge){ SEQ_EDGE_ONSET, seq->onset, seq->dac_phase1 };
+    return 1;
+}
+
+void seq_advance(seq_core *seq)
+{
+    switch (seq->next.kind) {
+    case SEQ_EDGE_ONSET:
+        seq->next = (seq_edge){ SEQ_EDGE_INTERPHASE, seq->onset + seq->width_ticks, 0 };
+        break;
+
+    case SEQ_EDGE_INTERPHASE:
+        seq->next = (seq_edge){ SEQ_EDGE_PHASE2, seq->onset + seq->width_ticks + seq->gap_ticks,
+                                seq->dac_phase2 };
+        break;
+
+    case SEQ_EDGE_PHASE2:
+        seq->next = (seq_edge){ SEQ_EDGE_END, seq->onset + 2u * seq->width_ticks + seq->gap_ticks, 0 };
+        break;
+
+    default: {
+        uint32_t end = seq->next.at;
+
+        seq->pulses++;
+        seq->have_prev = true;
+        seq->prev_onset = seq->onset;
+        if (seq->staged_valid) {
+            seq_timing t;
+
+            /* Checked when it was staged */
+            (void)plan_timing(&seq->staged, seq->tick_hz, &t);
+            (void)apply(seq, &seq->staged, &t);
+            seq->staged_valid = false;
+        }
+
+        /* Fractional period: one extra tick often enough that the mean rate is exact */
+        seq->frac_acc += seq->period_frac;
+        uint32_t at = seq->onset + seq->period_ticks + (seq->frac_acc >> 16);
+        seq->frac_acc &= 0xFFFFu;
+
+        /* The pulse just ended was longer than the new period: the next one a gap after it */
+        if ((int32_t)(at - (end + seq->gap_ticks)) < 0) {
+            at = end + seq->gap_ticks;
+        }
+        seq->onset = at;
+        seq->next = (seq_edge){ SEQ_EDGE_ONSET, at, seq->dac_phase1 };
+        break;
+    }
+    }
+}
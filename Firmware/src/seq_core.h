@@ -0,0 +1,85 @@
+#ifndef SEQ_CORE_H
+#define SEQ_CORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Biphasic pulse sequencer: turns a committed plan into the timed edges of the pulse train.
+ * Plain C with no kernel or driver dependencies, so the code the FLPR runs (flpr/src/main.c)
+ * is the code Tools/seq_trace.c runs on the host.
+ *
+ * The edges are those of the application core's continuous engine (timer.c): onset at the
+ * start of each period, interphase a pulse width later, phase 2 an interphase gap after
+ * that, and the end of the pulse a second pulse width on. The period is whole ticks plus a
+ * Q16 fraction dithered across periods, computed as update_stim_rate_mhz does, so the mean
+ * rate is exact and both engines time a plan alike.
+ *
+ * Times are ticks of the sequencer's timer, modulo 2^32, compared as int32: a period has to
+ * stay under 2^31 ticks (134 s at 16 MHz).
+ */
+
+typedef struct {
+    uint32_t rate_mhz;          // pulse rate, mHz
+    uint32_t pulse_width_us;    // each phase
+    uint32_t gap_us;            // interphase gap (SWITCH_PERIOD)
+    uint32_t amplitude;         // phase 1 DAC code; phase 2 is its mirror (spi.h DAC_MIRROR)
+} seq_plan;
+
+typedef enum {
+    SEQ_EDGE_ONSET = 0,         // shunts off, drive on, DAC to the phase 1 code
+    SEQ_EDGE_INTERPHASE,        // drive off, shunts on
+    SEQ_EDGE_PHASE2,            // shunts off, drive on, DAC to the phase 2 code
+    SEQ_EDGE_END,               // idle until the next onset; one pulse done
+    SEQ_EDGE_COUNT
+} seq_edge_kind;
+
+typedef struct {
+    seq_edge_kind kind;
+    uint32_t at;                // ticks
+    uint16_t dac_code;          // ONSET and PHASE2
+} seq_edge;
+
+typedef struct {
+    uint32_t tick_hz;
+    seq_plan plan;                      // in effect
+    seq_plan staged;                    // committed mid-pulse, taken at the end of the pulse
+    bool staged_valid;
+    uint32_t period_ticks;              // whole ticks
+    uint32_t period_frac;               // Q16
+    uint32_t frac_acc;
+    uint32_t width_ticks, gap_ticks;
+    uint16_t dac_phase1, dac_phase2;
+    uint32_t onset;                     // current (or next) onset
+    bool have_prev;
+    uint32_t prev_onset;                // onset of the last completed pulse
+    seq_edge next;
+    uint32_t pulses;                    // completed pulses
+    uint32_t applied;                   // plans taken into effect, the first included
+} seq_core;
+
+/** 0 if the plan can be sequenced at tick_hz: the pulse fits the period and the period 2^31 ticks; else -1. */
+int seq_plan_check(const seq_plan *plan, uint32_t tick_hz);
+
+/** Reset to a plan with the first onset at start. -1 (nothing changed) for a plan seq_plan_check refuses. */
+int seq_init(seq_core *seq, uint32_t tick_hz, const seq_plan *plan, uint32_t start);
+
+/**
+ * Commit a plan. Between pulses (the next edge is an onset) it is taken at once and the
+ * next onset moves to one new period after the last, but not before earliest; within a
+ * pulse it is staged and taken when the pulse ends, so a pulse never mixes two plans.
+ * Returns 1 if the next edge moved, 0 if staged, -1 for a plan seq_plan_check refuses (the
+ * running plan and any staged one are kept).
+ */
+int seq_commit(seq_core *seq, const seq_plan *plan, uint32_t earliest);
+
+/** Next edge due. */
+static inline seq_edge seq_peek(const seq_core *seq)
+{
+    return seq->next;
+}
+
+/** The edge seq_peek returned is done: move to the one after it. */
+void seq_advance(seq_core *seq);
+
+#endif /* SEQ_CORE_H */
@@ -0,0 +1,365 @@
+/*
+ * Session log in flash. Two RAM pages: records go into one while the other, once full, is
+ * written out by the system workqueue. The write is split into steps (invalidate, records in
+ * SLOG_WRITE_CHUNK pieces, header) polled every millisecond; a step only runs in the gap just
+ * after a pulse, or once no pulse has completed for a whole period. On RRAM (no explicit erase)
+ * a page is invalidated by zeroing its header instead of erasing it.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/sys/util.h>
+#include <string.h>
+#include "session_log.h"
+#include "timer.h"
+#include "deadline.h"
+#include "charge_limit.h"
+#include "config.h"
+
+#if SESSION_LOG_ENABLE && !SESSION_LOG_ACTIVE
+#error "SESSION_LOG_ENABLE needs a session_log_partition fixed partition (devicetree or Partition Manager)"
+#endif
+
+#if SESSION_LOG_ACTIVE
+
+BUILD_ASSERT(CONFIG_SLOG_MIN_PAGE_S <= CONFIG_SLOG_MAX_AGE_S, "pages age out faster than they may be written");
+
+#define SLOG_POLL         K_MSEC(1)
+/* First scan once the boot-to-first-pulse window is over */
+#define SLOG_SCAN_DELAY   K_SECONDS(1)
+
+/* Shared with the appenders, under irq_lock */
+static uint8_t pages[2][SLOG_PAGE_SIZE] __aligned(4);
+static uint8_t fill;                // page collecting records
+static uint16_t fill_used;
+static int64_t fill_since;          // uptime of the first record in it, ms
+static bool flush_pending;          // pages[fill ^ 1] waits for or is in the flash write
+static bool flush_force;
+static uint32_t dropped;
+static bool initialized;
+
+/* System workqueue only */
+static const struct flash_area *fa;
+static bool ready;
+static slog_ring ring;
+static uint32_t pages_written;
+static uint32_t errors;
+static int64_t last_write_ms;
+static uint32_t gap_pulse;
+static int64_t gap_since;
+
+static struct k_work_delayable write_work;
+static struct k_work_delayable counters_work;
+
+/* Locked: the filled page becomes the one to write, appends continue in the other */
+static void page_hand_over(void)
+{
+    ((slog_page_header *)pages[fill])->used = fill_used;
+    fill ^= 1;
+    fill_used = 0;
+    flush_pending = true;
+}
+
+static void slog_append(uint8_t type, const void *payload, uint8_t len)
+{
+    slog_record_header h = { .type = type, .len = len };
+    uint16_t need = sizeof(h) + len;
+    bool kick = false;
+
+    if (!initialized) {
+        return;
+    }
+
+    unsigned int key = irq_lock();
+
+    if (fill_used + need > SLOG_PAGE_PAYLOAD) {
+        if (flush_pending) {
+            dropped++;
+            irq_unlock(key);
+            return;
+        }
+        page_hand_over();
+        kick = true;
+    }
+    uint8_t *p = &pages[fill][sizeof(slog_page_header) + fill_used];
+
+    h.uptime_ms = k_uptime_get_32();
+    memcpy(p, &h, sizeof(h));
+    memcpy(p + sizeof(h), payload, len);
+    if (fill_used == 0) {
+        fill_since = k_uptime_get();
+    }
+    fill_used += need;
+    irq_unlock(key);
+    if (kick && ready) {
+        k_work_reschedule(&write_work, K_NO_WAIT);
+    }
+}
+
+static int fa_read(void *ctx, uint32_t off, void *buf, uint32_t len)
+{
+    return flash_area_read(ctx, off, buf, len);
+}
+
+static int fa_write(void *ctx, uint32_t off, const void *data, uint32_t len)
+{
+    return flash_area_write(ctx, off, data, len);
+}
+
+static int fa_erase(void *ctx, uint32_t off, uint32_t len)
+{
+    return flash_area_erase(ctx, off, len);
+}
+
+/* Find the newest valid page; writing resumes after it. Uses the spare RAM page, which
+ * session_log_init() left reserved (flush_pending). */
+static int log_scan(void)
+{
+    int err = flash_area_open(FIXED_PARTITION_ID(session_log_partition), &fa);
+
+    if (err) {
+        return err;
+    }
+
+    const struct device *dev = flash_area_get_device(fa);
+    struct flash_pages_info info;
+    size_t wbs = flash_get_write_block_size(dev);
+
+    if (flash_get_page_info_by_offs(dev, fa->fa_off, &info) != 0 || SLOG_PAGE_SIZE % info.size != 0 ||
+        SLOG_ALIGN % wbs != 0) {
+        return -ENOTSUP;
+    }
+
+    /* On RRAM (no explicit erase) a slot is invalidated by zeroing its header */
+    bool explicit_erase = (flash_params_get_erase_cap(flash_get_parameters(dev)) & FLASH_ERASE_C_EXPLICIT) != 0;
+    slog_flash flash = {
+        .read = fa_read,
+        .write = fa_write,
+        .erase = explicit_erase ? fa_erase : NULL,
+        .ctx = (void *)fa,
+    };
+    uint16_t n_pages = (uint16_t)MIN(fa->fa_size / SLOG_PAGE_SIZE, UINT16_MAX);
+
+    if (n_pages < 2) {
+        return -ENOSPC;
+    }
+    slog_ring_scan(&ring, &flash, n_pages, pages[fill ^ 1]);
+    return 0;
+}
+
+/* True in the gap just after a pulse (the count moved since the previous poll), or once no
+ * pulse has completed for a period: stimulation stopped, between trains or waiting on a trigger. */
+static bool in_pulse_gap(int64_t now)
+{
+    uint32_t n = timer_pulse_count();
+
+    if (n != gap_pulse) {
+        gap_pulse = n;
+        gap_since = now;
+        return true;
+    }
+    return now - gap_since > timer_get_period_us() / 1000u + 1;
+}
+
+static void page_done(void)
+{
+    unsigned int key = irq_lock();
+
+    flush_pending = false;
+    irq_unlock(key);
+    last_write_ms = k_uptime_get();
+}
+
+static void write_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    int64_t now = k_uptime_get();
+
+    if (!ready) {
+        int err = log_scan();
+        unsigned int key = irq_lock();
+
+        flush_pending = false;
+        irq_unlock(key);
+        if (err) {
+            printf("Session log disabled: partition unusable (err %d)\n", err);
+            return;
+        }
+        printf("Session log: %u pages, boot %u, pages %lu..%lu in flash\n",
+               ring.n_pages, ring.boot, ring.first_seq, ring.last_seq);
+        last_write_ms = now - CONFIG_SLOG_MIN_PAGE_S * 1000ll;
+        ready = true;
+    }
+
+    if (ring.step == SLOG_STEP_IDLE) {
+        unsigned int key = irq_lock();
+
+        if (!flush_pending && fill_used > 0 &&
+            (flush_force || now - fill_since >= CONFIG_SLOG_MAX_AGE_S * 1000ll)) {
+            page_hand_over();
+        }
+        bool pending = flush_pending;
+        int64_t age_due = (fill_used ? fill_since : now) + CONFIG_SLOG_MAX_AGE_S * 1000ll;
+
+        irq_unlock(key);
+        if (!pending) {
+            flush_force = false;
+            k_work_reschedule(&write_work, K_MSEC(MAX(age_due - now, 1)));
+            return;
+        }
+
+        /* Write rate bound: the page (and any flush request) waits out the interval */
+        int64_t wait = last_write_ms + CONFIG_SLOG_MIN_PAGE_S * 1000ll - now;
+
+        if (!flush_force && wait > 0) {
+            k_work_reschedule(&write_work, K_MSEC(wait));
+            return;
+        }
+        flush_force = false;
+        slog_ring_begin(&ring, pages[fill ^ 1]);
+        gap_pulse = timer_pulse_count();
+        gap_since = now;
+    }
+
+    if (in_pulse_gap(now)) {
+        if (slog_ring_step(&ring) != 0) {
+            errors++;
+        } else if (ring.step == SLOG_STEP_IDLE) {
+            pages_written++;
+        }
+        if (ring.step == SLOG_STEP_IDLE) {
+            page_done();
+        }
+    }
+    k_work_reschedule(&write_work, ring.step == SLOG_STEP_IDLE ? K_NO_WAIT : SLOG_POLL);
+}
+
+static void counters_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    slog_counters c = { .pulse = timer_pulse_count() };
+
+#if DEADLINE_ACTIVE
+    deadline_stats ds;
+
+    get_deadline_stats(&ds);
+    c.overruns = ds.overruns;
+    c.missed = ds.missed;
+#endif
+#if CHARGE_LIMIT_ACTIVE
+    charge_limit_stats cs;
+
+    get_charge_limit_stats(&cs);
+    c.charge_faults = cs.faults;
+#endif
+    slog_append(SLOG_REC_COUNTERS, &c, sizeof(c));
+    k_work_reschedule(&counters_work, K_SECONDS(CONFIG_SLOG_COUNTERS_S));
+}
+
+int session_log_init(void)
+{
+    if (initialized) {
+        return -EALREADY;
+    }
+    k_work_init_delayable(&write_work, write_work_handler);
+    k_work_init_delayable(&counters_work, counters_work_handler);
+    flush_pending = true;       // spare page lent to log_scan()
+    initialized = true;
+    k_work_reschedule(&write_work, SLOG_SCAN_DELAY);
+    k_work_reschedule(&counters_work, K_SECONDS(CONFIG_SLOG_COUNTERS_S));
+    return 0;
+}
+
+void session_log_boot(uint8_t plan_source)
+{
+    slog_boot b = { .plan_source = plan_source };
+
+#if DEADLINE_ACTIVE
+    deadline_stats ds;
+
+    get_deadline_stats(&ds);
+    b.wdt_resets = ds.wdt_resets;
+    b.fatal_resets = ds.fatal_resets;
+#endif
+    slog_append(SLOG_REC_BOOT, &b, sizeof(b));
+}
+
+void session_log_plan(slog_plan_origin origin, uint8_t channel, uint16_t amplitude,
+                      uint16_t pulse_width_us, uint32_t rate_mhz)
+{
+    slog_plan p = {
+        .pulse = timer_pulse_count(),
+        .origin = origin,
+        .channel = channel,
+        .amplitude = amplitude,
+        .pulse_width_us = pulse_width_us,
+        .rate_mhz = rate_mhz,
+    };
+
+    slog_append(SLOG_REC_PLAN, &p, sizeof(p));
+}
+
+void session_log_fault(slog_fault_source source, uint8_t reason, uint32_t value, uint32_t limit)
+{
+    slog_fault f = {
+        .pulse = timer_pulse_count(),
+        .source = source,
+        .reason = reason,
+        .value = value,
+        .limit = limit,
+    };
+
+    slog_append(SLOG_REC_FAULT, &f, sizeof(f));
+}
+
+int session_log_flush(void)
+{
+    if (!initialized) {
+        return -ENODEV;
+    }
+    flush_force = true;
+    if (ready && ring.step == SLOG_STEP_IDLE) {
+        k_work_reschedule(&write_work, K_NO_WAIT);
+    }
+    return 0;
+}
+
+int session_log_read(uint32_t seq, uint16_t offset, uint8_t *buf, uint16_t len)
+{
+    slog_page_header h;
+    int index = ready ? slog_ring_locate(&ring, seq) : -ENOENT;
+
+    if (index < 0) {
+        return index;
+    }
+    if (flash_area_read(fa, (off_t)index * SLOG_PAGE_SIZE, &h, sizeof(h)) != 0 || h.magic != SLOG_MAGIC ||
+        h.seq != seq || h.used > SLOG_PAGE_PAYLOAD) {
+        return -ENOENT;
+    }
+
+    uint16_t length = sizeof(h) + h.used;
+
+    if (offset < length && len > 0 &&
+        flash_area_read(fa, (off_t)index * SLOG_PAGE_SIZE + offset, buf, MIN(len, length - offset)) != 0) {
+        return -EIO;
+    }
+    return length;
+}
+
+void get_session_log_info(session_log_info *info)
+{
+    unsigned int key = irq_lock();
+
+    info->ready = ready;
+    info->boot = ring.boot;
+    info->pages = ring.n_pages;
+    info->first_seq = ring.first_seq;
+    info->last_seq = ring.last_seq;
+    info->pages_written = pages_written;
+    info->dropped = dropped;
+    info->errors = errors;
+    info->buffered = fill_used;
+    irq_unlock(key);
+}
+
+#endif /* SESSION_LOG_ACTIVE */
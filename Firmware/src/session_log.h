@@ -0,0 +1,127 @@
+#ifndef SESSION_LOG_H
+#define SESSION_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/toolchain.h>
+#include <zephyr/storage/flash_map.h>
+#include "slog_core.h"
+#include "config.h"
+
+/* Needs a fixed flash partition labelled session_log_partition (devicetree, or a Partition
+ * Manager partition of that name) next to the settings storage */
+#if SESSION_LOG_ENABLE && FIXED_PARTITION_EXISTS(session_log_partition)
+#define SESSION_LOG_ACTIVE 1
+#else
+#define SESSION_LOG_ACTIVE 0
+#endif
+
+/*
+ * Session log: what the device was told to do and what happened, kept in flash across resets.
+ * Records (plan commits, safety faults, periodic counters) are appended to a RAM page; a full
+ * page is written as one unit to a ring of erase pages in session_log_partition, at most one
+ * page every CONFIG_SLOG_MIN_PAGE_S. Nothing on the stim path touches flash: appends are a
+ * memcpy under irq_lock, and the write runs on the system workqueue in small chunks, each
+ * started right after a pulse has ended so the CPU stall of a flash write falls in the
+ * inter-pulse gap.
+ *
+ * Power loss: a page is invalidated first, then its records are written, then its header
+ * (magic, sequence number, CRC-32 over header and records) last (slog_core.h). A page cut
+ * short anywhere fails the header check and is skipped; the boot scan resumes after the
+ * newest valid page. At most the page in flight and the records still in RAM are lost.
+ *
+ * Page layout, little-endian: slog_page_header, then `used` bytes of records. Each record is
+ * a slog_record_header followed by `len` payload bytes (the slog_* structs below; readers skip
+ * types and trailing fields they do not know).
+ */
+typedef enum {
+    SLOG_REC_BOOT = 1,          // slog_boot
+    SLOG_REC_PLAN = 2,          // slog_plan
+    SLOG_REC_FAULT = 3,         // slog_fault
+    SLOG_REC_COUNTERS = 4,      // slog_counters
+} slog_record_type;
+
+typedef struct __packed {
+    uint8_t type;               // slog_record_type
+    uint8_t len;                // payload bytes that follow
+    uint32_t uptime_ms;
+} slog_record_header;
+
+typedef struct __packed {
+    uint8_t plan_source;        // stim_boot_source (0 defaults, 1 restored from flash)
+    uint32_t wdt_resets;        // deadline monitor, since power-on
+    uint32_t fatal_resets;
+} slog_boot;
+
+typedef enum {
+    SLOG_PLAN_BOOT = 0,         // plan the device started with
+    SLOG_PLAN_SETTING = 1,      // legacy stim_setting
+    SLOG_PLAN_RATE = 2,         // CMD_SET_RATE
+    SLOG_PLAN_CHANNEL = 3,      // CMD_CHANNEL_CONFIG
+} slog_plan_origin;
+
+typedef struct __packed {
+    uint32_t pulse;             // timer_pulse_count() when the plan took effect
+    uint8_t origin;             // slog_plan_origin
+    uint8_t channel;            // multichannel channel, 0 otherwise
+    uint16_t amplitude;         // DAC code
+    uint16_t pulse_width_us;
+    uint32_t rate_mhz;          // 0: channel disabled
+} slog_plan;
+
+typedef enum {
+    SLOG_FAULT_CHARGE_REJECT = 1,   // plan refused at commit (reason: charge_fault)
+    SLOG_FAULT_CHARGE_STOP = 2,     // safe stop while running (reason: charge_fault)
+} slog_fault_source;
+
+typedef struct __packed {
+    uint32_t pulse;
+    uint8_t source;             // slog_fault_source
+    uint8_t reason;
+    uint32_t value;             // in the unit of the reason
+    uint32_t limit;
+} slog_fault;
+
+typedef struct __packed {
+    uint32_t pulse;             // completed pulses since boot
+    uint32_t overruns;          // deadline monitor (0 without it)
+    uint32_t missed;
+    uint32_t charge_faults;     // charge limiter safe stops (0 without it)
+} slog_counters;
+
+typedef struct {
+    bool ready;                 // partition scanned, pages are being written
+    uint16_t boot;              // this boot's count
+    uint16_t pages;             // ring size
+    uint32_t first_seq;         // oldest page still in flash (0: none)
+    uint32_t last_seq;          // newest page written (0: none)
+    uint32_t pages_written;     // since boot
+    uint32_t dropped;           // records lost to a full RAM buffer (write rate bound) since boot
+    uint32_t errors;            // failed flash operations since boot
+    uint16_t buffered;          // record bytes waiting in RAM
+} session_log_info;
+
+/** Start the log: the partition is scanned and written from the system workqueue. Call once at boot. */
+int session_log_init(void);
+
+/* Append a record; thread context, never blocks. Records arriving while both RAM pages are
+ * full (flash write rate bound reached) are dropped and counted. */
+void session_log_boot(uint8_t plan_source);
+void session_log_plan(slog_plan_origin origin, uint8_t channel, uint16_t amplitude,
+                      uint16_t pulse_width_us, uint32_t rate_mhz);
+void session_log_fault(slog_fault_source source, uint8_t reason, uint32_t value, uint32_t limit);
+
+/** Write the records collected so far now, as a partial page, ignoring CONFIG_SLOG_MIN_PAGE_S once. */
+int session_log_flush(void);
+
+/**
+ * Read part of the page with sequence number seq: header and records, at most
+ * sizeof(slog_page_header) + used bytes. Returns the page length (0 <= offset < length;
+ * bytes read = MIN(len, length - offset)) or -ENOENT if that page is no longer (or not yet)
+ * in flash. System workqueue context, like the writer.
+ */
+int session_log_read(uint32_t seq, uint16_t offset, uint8_t *buf, uint16_t len);
+
+void get_session_log_info(session_log_info *info);
+
+#endif /* SESSION_LOG_H */
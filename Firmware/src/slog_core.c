@@ -0,0 +1,177 @@
+/*
+ * Session log page ring (slog_core.h). The ring state only moves when a whole page has been
+ * written: a slot is the next one to write until its header is in flash.
+ */
+#include <errno.h>
+#include <string.h>
+#include "slog_core.h"
+
+_Static_assert(sizeof(slog_page_header) == 16 && SLOG_WRITE_CHUNK % SLOG_ALIGN == 0 &&
+               SLOG_PAGE_SIZE % SLOG_ALIGN == 0, "session log writes are 16-byte aligned");
+
+uint32_t slog_crc32(uint32_t crc, const void *data, size_t len)
+{
+    /* Reflected 0xEDB88320, a nibble at a time */
+    static const uint32_t table[16] = {
+        0x00000000u, 0x1DB71064u, 0x3B6E20C8u, 0x26D930ACu, 0x76DC4190u, 0x6B6B51F4u,
+        0x4DB26158u, 0x5005713Cu, 0xEDB88320u, 0xF00F9344u, 0xD6D6A3E8u, 0xCB61B38Cu,
+        0x9B64C2B0u, 0x86D3D2D4u, 0xA00AE278u, 0xBDBDF21Cu,
+    };
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 4) ^ table[(crc ^ p[i]) & 0x0Fu];
+        crc = (crc >> 4) ^ table[(crc ^ (p[i] >> 4)) & 0x0Fu];
+    }
+    return ~crc;
+}
+
+static uint32_t page_crc(const uint8_t *buf)
+{
+    const slog_page_header *h = (const slog_page_header *)buf;
+
+    return slog_crc32(slog_crc32(0, buf, offsetof(slog_page_header, crc)), buf + sizeof(*h), h->used);
+}
+
+static bool header_plausible(const slog_page_header *h)
+{
+    return h->magic == SLOG_MAGIC && h->used <= SLOG_PAGE_PAYLOAD && h->seq != 0;
+}
+
+bool slog_page_valid(const uint8_t *buf)
+{
+    const slog_page_header *h = (const slog_page_header *)buf;
+
+    return header_plausible(h) && page_crc(buf) == h->crc;
+}
+
+static uint32_t slot_offset(uint16_t index)
+{
+    return (uint32_t)index * SLOG_PAGE_SIZE;
+}
+
+void slog_ring_scan(slog_ring *r, const slog_flash *flash, uint16_t n_pages, uint8_t *buf)
+{
+    const slog_page_header *h = (const slog_page_header *)buf;
+    uint16_t newest_boot = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->flash = *flash;
+    r->n_pages = n_pages;
+    r->next_seq = 1;
+    for (uint16_t i = 0; i < n_pages; i++) {
+        int err = flash->read(flash->ctx, slot_offset(i), buf, sizeof(*h));
+
+        if (err == 0 && header_plausible(h)) {
+            err = flash->read(flash->ctx, slot_offset(i) + sizeof(*h), buf + sizeof(*h), h->used);
+        }
+        if (err || !slog_page_valid(buf)) {
+            continue;       // unreadable slots are skipped like torn ones
+        }
+        if (r->first_seq == 0 || h->seq < r->first_seq) {
+            r->first_seq = h->seq;
+        }
+        if (h->seq > r->last_seq) {
+            r->last_seq = h->seq;
+            r->last_index = i;
+            newest_boot = h->boot;
+        }
+    }
+    if (r->last_seq) {
+        r->next_seq = r->last_seq + 1;
+        r->next_index = (r->last_index + 1) % n_pages;
+    }
+    r->boot = newest_boot + 1;
+}
+
+void slog_ring_begin(slog_ring *r, uint8_t *page)
+{
+    r->page = page;
+    r->step = SLOG_STEP_INVALIDATE;
+}
+
+/* The slot is spent either way: a failed one is not retried */
+static void page_done(slog_ring *r)
+{
+    r->step = SLOG_STEP_IDLE;
+    r->next_index = (r->next_index + 1) % r->n_pages;
+}
+
+int slog_ring_step(slog_ring *r)
+{
+    slog_page_header *h = (slog_page_header *)r->page;
+    uint32_t base = slot_offset(r->next_index);
+    uint16_t end = (uint16_t)((sizeof(*h) + h->used + SLOG_ALIGN - 1) / SLOG_ALIGN * SLOG_ALIGN);
+    int err = 0;
+
+    switch (r->step) {
+    case SLOG_STEP_INVALIDATE:
+        memset(r->page + sizeof(*h) + h->used, 0xFF, end - sizeof(*h) - h->used);
+        if (r->flash.erase) {
+            err = r->flash.erase(r->flash.ctx, base, SLOG_PAGE_SIZE);
+        } else {
+            static const uint8_t zero[sizeof(slog_page_header)];
+
+            err = r->flash.write(r->flash.ctx, base, zero, sizeof(zero));
+        }
+        r->step = SLOG_STEP_RECORDS;
+        r->step_off = sizeof(*h);
+        break;
+
+    case SLOG_STEP_RECORDS: {
+        uint16_t left = end - r->step_off;
+        uint16_t n = left < SLOG_WRITE_CHUNK ? left : SLOG_WRITE_CHUNK;
+
+        if (n) {
+            err = r->flash.write(r->flash.ctx, base + r->step_off, r->page + r->step_off, n);
+            r->step_off += n;
+        }
+        if (r->step_off >= end) {
+            r->step = SLOG_STEP_HEADER;
+        }
+        break;
+    }
+
+    case SLOG_STEP_HEADER:
+        h->magic = SLOG_MAGIC;
+        h->seq = r->next_seq;
+        h->boot = r->boot;
+        h->crc = page_crc(r->page);
+        err = r->flash.write(r->flash.ctx, base, r->page, sizeof(*h));
+        if (err == 0) {
+            r->last_seq = r->next_seq++;
+            r->last_index = r->next_index;
+            if (r->first_seq == 0) {
+                r->first_seq = r->last_seq;
+            } else if (r->last_seq - r->first_seq >= r->n_pages) {
+                r->first_seq = r->last_seq - r->n_pages + 1;    // the oldest page was overwritten
+            }
+        }
+        page_done(r);
+        return err;
+
+    default:
+        r->step = SLOG_STEP_IDLE;
+        return 0;
+    }
+    if (err) {
+        page_done(r);
+    }
+    return err;
+}
+
+int slog_ring_locate(const slog_ring *r, uint32_t seq)
+{
+    if (r->last_seq == 0 || seq < r->first_seq || seq > r->last_seq) {
+        return -ENOENT;
+    }
+
+    uint16_t index = (uint16_t)((r->last_index + r->n_pages - (r->last_seq - seq) % r->n_pages) % r->n_pages);
+
+    /* The page may have been invalidated for rewriting since the scan */
+    if (r->step != SLOG_STEP_IDLE && index == r->next_index) {
+        return -ENOENT;
+    }
+    return index;
+}
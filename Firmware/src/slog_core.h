@@ -0,0 +1,89 @@
+#ifndef SLOG_CORE_H
+#define SLOG_CORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Page ring of the session log (session_log.h): page format, the order a page is written in
+ * and the boot scan that finds where writing resumes. Plain C with no kernel or driver
+ * dependencies, so the ring session_log.c writes is the one Tools/slog_power.c cuts the power
+ * on at random points on the host.
+ *
+ * A page is written in steps: invalidate the slot (erase it, or zero its header where there
+ * is no explicit erase), records in SLOG_WRITE_CHUNK pieces, header last. The header carries
+ * the CRC over itself and the records, so a page cut short at any step fails the check.
+ */
+#define SLOG_PAGE_SIZE    4096u
+#define SLOG_MAGIC        0x31474C53u     // "SLG1"
+#define SLOG_WRITE_CHUNK  64u             // bytes per flash write step (multiple of the 16-byte header)
+#define SLOG_ALIGN        16u             // write granularity; pages are padded with 0xFF to it
+
+typedef struct {
+    uint32_t magic;             // SLOG_MAGIC
+    uint32_t seq;               // page sequence number, from 1, never reused
+    uint16_t boot;              // boot count the page was written in
+    uint16_t used;              // record bytes after the header
+    uint32_t crc;               // CRC-32 (IEEE) over the first 12 header bytes and the records
+} slog_page_header;
+
+#define SLOG_PAGE_PAYLOAD (SLOG_PAGE_SIZE - sizeof(slog_page_header))
+
+/* Partition access, offsets from its start; each returns 0 or a negative errno */
+typedef struct {
+    int (*read)(void *ctx, uint32_t off, void *buf, uint32_t len);
+    int (*write)(void *ctx, uint32_t off, const void *data, uint32_t len);
+    int (*erase)(void *ctx, uint32_t off, uint32_t len);    // NULL: no explicit erase (RRAM)
+    void *ctx;
+} slog_flash;
+
+typedef enum {
+    SLOG_STEP_IDLE,
+    SLOG_STEP_INVALIDATE,
+    SLOG_STEP_RECORDS,
+    SLOG_STEP_HEADER,
+} slog_step;
+
+typedef struct {
+    slog_flash flash;
+    uint16_t n_pages;           // ring size
+    uint16_t boot;              // this boot's count: the newest page's plus one
+    uint16_t next_index;        // slot the next page goes to
+    uint16_t last_index;
+    uint32_t next_seq;
+    uint32_t first_seq;         // oldest page still in flash (0: none)
+    uint32_t last_seq;          // newest page written (0: none)
+    slog_step step;
+    uint16_t step_off;
+    uint8_t *page;              // page being written, SLOG_PAGE_SIZE bytes
+} slog_ring;
+
+/** CRC-32 (IEEE), continuing from crc; 0 to start. Same as Zephyr's crc32_ieee_update(). */
+uint32_t slog_crc32(uint32_t crc, const void *data, size_t len);
+
+/** buf holds a header and its `used` record bytes: true if the header is plausible and the CRC matches. */
+bool slog_page_valid(const uint8_t *buf);
+
+/**
+ * Boot scan of n_pages slots: the oldest and newest valid pages, the slot and sequence number
+ * writing resumes at and this boot's count. buf (SLOG_PAGE_SIZE) is scratch.
+ */
+void slog_ring_scan(slog_ring *r, const slog_flash *flash, uint16_t n_pages, uint8_t *buf);
+
+/**
+ * Start writing page (header `used` set, records after it) to the next slot. The buffer is
+ * padded and sealed in place, so it stays untouched until the step is back to idle.
+ */
+void slog_ring_begin(slog_ring *r, uint8_t *page);
+
+/**
+ * One flash operation of the page in progress. The step is back to idle once the page is in
+ * flash or an operation failed (the error is returned and the slot is skipped).
+ */
+int slog_ring_step(slog_ring *r);
+
+/** Slot holding page seq, or -ENOENT if it is no longer (or not yet) in flash or being rewritten. */
+int slog_ring_locate(const slog_ring *r, uint32_t seq);
+
+#endif /* SLOG_CORE_H */
@@ -4,35 +4,64 @@
 #include <hal/nrf_gpio.h>
 #include <string.h>
 #include "spi.h"
+#include "isr_cycles.h"
+#include "flpr_seq.h"
+#include "trigger.h"
 #include "config.h"
 
 static nrfx_spim_t spim_inst = NRFX_SPIM_INSTANCE(SPIM_INST_IDX);
 static void spim_handler(nrfx_spim_evt_t const * p_event, void * p_context);
-uint8_t dac1_buf_tx[DAC_TX_LEN] = {0x52, 0x53};
-uint8_t dac2_buf_tx[DAC_TX_LEN] = {0x54, 0x55};
+/* Committed amplitude as the words the engines send: phase 1 and its phase 2 mirror. Written
+ * together with interrupts locked and copied together at a pulse onset (dac_words_get). */
+static uint8_t dac1_buf_tx[DAC_TX_LEN] = {CONFIG_STIM_AMPLITUDE >> 8, CONFIG_STIM_AMPLITUDE & 0xFF};
+static uint8_t dac2_buf_tx[DAC_TX_LEN] = {DAC_MIRROR(CONFIG_STIM_AMPLITUDE) >> 8,
+                                          DAC_MIRROR(CONFIG_STIM_AMPLITUDE) & 0xFF};
 uint8_t dac1_buf_rx[DAC_RX_LEN];
 uint8_t dac2_buf_rx[DAC_RX_LEN];
-void update_dac1_amplitude(uint16_t amplitude) {
+static volatile uint16_t dac1_last_code;
+
+void dac_words_set(uint16_t amplitude) {
+    uint16_t opposite_amplitude = DAC_MIRROR(amplitude);
+    unsigned int key = irq_lock();
+
     dac1_buf_tx[0] = (amplitude >> 8) & 0xFF;  // MSB
     dac1_buf_tx[1] = amplitude & 0xFF;         // LSB
+    dac2_buf_tx[0] = (opposite_amplitude >> 8) & 0xFF;
+    dac2_buf_tx[1] = opposite_amplitude & 0xFF;
+    irq_unlock(key);
+}
+
+void dac_words_get(uint8_t *phase1, uint8_t *phase2) {
+    unsigned int key = irq_lock();
 
-    printf("DAC1 amplitude updated to %u (0x%02X 0x%02X)\n",
-           amplitude, dac1_buf_tx[0], dac1_buf_tx[1]);
+    memcpy(phase1, dac1_buf_tx, DAC_TX_LEN);
+    memcpy(phase2, dac2_buf_tx, DAC_TX_LEN);
+    irq_unlock(key);
 }
 
-void update_dac2_amplitude(uint16_t amplitude) {
-    uint16_t opposite_amplitude;
-    if (amplitude == 0x0000) {
-        opposite_amplitude = 0xFFFF;  // Most negative → Most positive
-    } else {
-        opposite_amplitude = (uint16_t)(0x10000UL - amplitude);
-    }
+uint16_t dac_amplitude_get(void) {
+    unsigned int key = irq_lock();
+    uint16_t amplitude = ((uint16_t)dac1_buf_tx[0] << 8) | dac1_buf_tx[1];
+
+    irq_unlock(key);
+    return amplitude;
+}
 
-    dac2_buf_tx[0] = (opposite_amplitude >> 8) & 0xFF;  // MSB
-    dac2_buf_tx[1] = opposite_amplitude & 0xFF;         // LSB
+uint16_t spi_dac1_last_code(void) {
+    return dac1_last_code;
+}
 
-    printf("DAC2 amplitude updated to opposite of %u: %u (0x%02X 0x%02X)\n",
-           amplitude, opposite_amplitude, dac2_buf_tx[0], dac2_buf_tx[1]);
+void update_dac_amplitude(uint16_t amplitude) {
+    dac_words_set(amplitude);
+    printf("DAC amplitude updated to %u (0x%04X), phase 2 0x%04X\n",
+           amplitude, amplitude, DAC_MIRROR(amplitude));
+#if FLPR_SEQ_ACTIVE
+    flpr_seq_send_amplitude();
+#endif
+#if TRIGGER_MODE
+    /* The onset of the next train is hardware-driven from the word already in DAC1 */
+    trigger_dac_preload();
+#endif
 }
 
 void cs_select(uint32_t pin_number) {
@@ -44,17 +73,21 @@ void cs_deselect(uint32_t pin_number) {
 }
 
 void spi_write_dac1(uint8_t *tx_data, uint8_t *rx_data) {
+    ISR_CYC_BEGIN(cyc);
     cs_select(DAC1_CS_PIN);
     memset(rx_data, 0, DAC_RX_LEN);
     nrfx_spim_xfer_desc_t xfer_desc = NRFX_SPIM_XFER_TRX(tx_data, DAC_TX_LEN, rx_data, DAC_RX_LEN);
     nrfx_err_t err = nrfx_spim_xfer(&spim_inst, &xfer_desc, 0);
     if (err != NRFX_SUCCESS) {
         printf("SPI ERROR\n");
+    } else {
+        dac1_last_code = ((uint16_t)tx_data[0] << 8) | tx_data[1];
     }
     for (volatile uint32_t i = 0; i < SPI_CS_HOLD_DELAY_LOOPS; i++) {
         (void)i;
     }
     cs_deselect(DAC1_CS_PIN);
+    ISR_CYC_END(ISR_PATH_SPI_DAC, cyc);
 }
 
 void spi_write_dac2(uint8_t *tx_data, uint8_t *rx_data) {
@@ -88,6 +121,15 @@ void spi_init(){
     }
 }
 
+/* Duty-cycle off periods: disabled SPIM draws nothing; the driver state is kept for resume */
+void spi_suspend(void) {
+    nrf_spim_disable(spim_inst.p_reg);
+}
+
+void spi_resume(void) {
+    nrf_spim_enable(spim_inst.p_reg);
+}
+
 static void spim_handler(nrfx_spim_evt_t const * p_event, void * p_context){
     if ((p_event->type == NRFX_SPIM_EVENT_DONE)&& (SPI_VERBOSE == 1)){
         printf("Message received: %02X\n", p_event->xfer_desc.p_rx_buffer);
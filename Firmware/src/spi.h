@@ -3,9 +3,10 @@
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <hal/nrf_gpio.h>
+#include "stim_pins.h"
 
-#define DAC1_CS_PIN NRF_GPIO_PIN_MAP(2, 5)  // P2.05
-#define DAC2_CS_PIN NRF_GPIO_PIN_MAP(2, 10)  // P2.10
+#define DAC1_CS_PIN STIM_PIN_DAC1_CS  // P2.05 (stim_pins.h)
+#define DAC2_CS_PIN STIM_PIN_DAC2_CS  // P2.10
 #define DAC_TX_LEN			2   //2bytes
 #define DAC_RX_LEN			2
 
@@ -19,11 +20,30 @@ void cs_deselect(uint32_t pin_number);
 void spi_write_dac1(uint8_t *tx_data, uint8_t *rx_data);
 void spi_write_dac2(uint8_t *tx_data, uint8_t *rx_data);
 void spi_init();
-void update_dac1_amplitude(uint16_t amplitude);
-void update_dac2_amplitude(uint16_t amplitude);
+void spi_suspend(void);
+void spi_resume(void);
+
+/* Phase 2 word of a phase 1 amplitude: its mirror about zero; 0 (most negative) gives 0xFFFF */
+#define DAC_MIRROR(amplitude) ((amplitude) ? (uint16_t)(0x10000UL - (amplitude)) : (uint16_t)0xFFFF)
+
+/**
+ * New committed amplitude for every engine: the words the TIMER, RTC and trigger engines send
+ * from their next pulse onset, the FLPR sequencer's plan and, in trigger mode, the DAC1
+ * preload of the next train. Thread context.
+ */
+void update_dac_amplitude(uint16_t amplitude);
+
+/** Both committed words only, no log or hand-off. ISR safe. */
+void dac_words_set(uint16_t amplitude);
+
+/** Copy the committed phase 1 and phase 2 words as one pair. ISR safe. */
+void dac_words_get(uint8_t *phase1, uint8_t *phase2);
+
+uint16_t dac_amplitude_get(void);
+
+/** Last word spi_write_dac1() clocked out: what DAC1 holds now. */
+uint16_t spi_dac1_last_code(void);
 
 extern uint8_t dac1_buf_rx[DAC_RX_LEN];
-extern uint8_t dac1_buf_tx[DAC_TX_LEN];
 extern uint8_t dac2_buf_rx[DAC_RX_LEN];
-extern uint8_t dac2_buf_tx[DAC_TX_LEN];
 #endif
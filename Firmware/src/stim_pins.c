@@ -0,0 +1,38 @@
+#include <zephyr/kernel.h>
+#include <hal/nrf_gpio.h>
+#include "stim_pins.h"
+
+static const uint32_t hcss_pins[STIM_PIN_HCSS_COUNT] = STIM_PIN_HCSS_LIST;
+
+static void stim_pin_output(uint32_t pin, bool high)
+{
+#if defined(CONFIG_SOC_NRF5340_CPUAPP)
+    /* The network core GPIO forwarder assigns P1.00/P1.01 at boot; claiming the pins
+     * here, before they are driven, is enough. Nothing else rewrites MCUSEL. */
+    nrf_gpio_pin_control_select(pin, NRF_GPIO_PIN_SEL_APP);
+#endif
+    if (high) {
+        nrf_gpio_pin_set(pin);
+    } else {
+        nrf_gpio_pin_clear(pin);
+    }
+    nrf_gpio_cfg_output(pin);
+}
+
+void stim_pins_init(void)
+{
+    // DAC chip selects high (inactive)
+    stim_pin_output(STIM_PIN_DAC1_CS, true);
+    stim_pin_output(STIM_PIN_DAC2_CS, true);
+
+    // Switch: drive and phase-2 select off, electrode shunted
+    stim_pin_output(STIM_PIN_DRIVE, false);
+    stim_pin_output(STIM_PIN_PHASE2, false);
+    stim_pin_output(STIM_PIN_SHUNT_A, true);
+    stim_pin_output(STIM_PIN_SHUNT_B, true);
+
+    // HCSS channel switches low (inactive)
+    for (int i = 0; i < STIM_PIN_HCSS_COUNT; i++) {
+        stim_pin_output(hcss_pins[i], false);
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef STIM_PINS_H
+#define STIM_PINS_H
+
+#include <stdint.h>
+#include <zephyr/devicetree.h>
+#include <soc.h>
+#include <hal/nrf_gpio.h>
+
+/*
+ * Stimulator pin map. Pins come from the "chronos,stim-pins" devicetree node (app.overlay)
+ * when present, otherwise from the defaults below. Each phase transition is a fixed set of
+ * per-port OUTCLR/OUTSET writes folded at compile time, so the ISRs do no pin decoding.
+ */
+#define STIM_PINS_NODE DT_NODELABEL(stim_pins)
+
+#if DT_NODE_EXISTS(STIM_PINS_NODE)
+#define STIM_PIN_DRIVE    NRF_DT_GPIOS_TO_PSEL(STIM_PINS_NODE, drive_gpios)
+#define STIM_PIN_SHUNT_A  NRF_DT_GPIOS_TO_PSEL_BY_IDX(STIM_PINS_NODE, shunt_gpios, 0)
+#define STIM_PIN_SHUNT_B  NRF_DT_GPIOS_TO_PSEL_BY_IDX(STIM_PINS_NODE, shunt_gpios, 1)
+#define STIM_PIN_PHASE2   NRF_DT_GPIOS_TO_PSEL(STIM_PINS_NODE, phase2_gpios)
+#define STIM_PIN_DAC1_CS  NRF_DT_GPIOS_TO_PSEL_BY_IDX(STIM_PINS_NODE, dac_cs_gpios, 0)
+#define STIM_PIN_DAC2_CS  NRF_DT_GPIOS_TO_PSEL_BY_IDX(STIM_PINS_NODE, dac_cs_gpios, 1)
+#define STIM_PIN_HCSS(i)  NRF_DT_GPIOS_TO_PSEL_BY_IDX(STIM_PINS_NODE, hcss_gpios, i)
+#else
+#define STIM_PIN_DRIVE    NRF_GPIO_PIN_MAP(1, 3)
+#define STIM_PIN_SHUNT_A  NRF_GPIO_PIN_MAP(1, 0)
+#define STIM_PIN_SHUNT_B  NRF_GPIO_PIN_MAP(1, 1)
+#define STIM_PIN_PHASE2   NRF_GPIO_PIN_MAP(0, 13)
+#define STIM_PIN_DAC1_CS  NRF_GPIO_PIN_MAP(2, 5)
+#define STIM_PIN_DAC2_CS  NRF_GPIO_PIN_MAP(2, 10)
+#define STIM_PIN_HCSS_0  NRF_GPIO_PIN_MAP(2, 7)
+#define STIM_PIN_HCSS_1  NRF_GPIO_PIN_MAP(2, 9)
+#define STIM_PIN_HCSS_2  NRF_GPIO_PIN_MAP(2, 8)
+#define STIM_PIN_HCSS_3  NRF_GPIO_PIN_MAP(2, 0)
+#define STIM_PIN_HCSS(i) STIM_PIN_HCSS_##i
+#endif
+
+#define STIM_PIN_HCSS_COUNT 4
+#define STIM_PIN_HCSS_LIST { STIM_PIN_HCSS(0), STIM_PIN_HCSS(1), STIM_PIN_HCSS(2), STIM_PIN_HCSS(3) }
+
+/* Bit for pin on GPIO port, 0 if the pin is on another port */
+#define STIM_PIN_BIT(port, pin) \
+    (NRF_PIN_NUMBER_TO_PORT(pin) == (port) ? (1u << NRF_PIN_NUMBER_TO_PIN(pin)) : 0u)
+
+#define STIM_SHUNT_MASK(port) (STIM_PIN_BIT(port, STIM_PIN_SHUNT_A) | STIM_PIN_BIT(port, STIM_PIN_SHUNT_B))
+#define STIM_DRIVE_MASK(port) STIM_PIN_BIT(port, STIM_PIN_DRIVE)
+#define STIM_PHASE2_MASK(port) STIM_PIN_BIT(port, STIM_PIN_PHASE2)
+#define STIM_HCSS_MASK(port) (STIM_PIN_BIT(port, STIM_PIN_HCSS(0)) | STIM_PIN_BIT(port, STIM_PIN_HCSS(1)) | \
+                              STIM_PIN_BIT(port, STIM_PIN_HCSS(2)) | STIM_PIN_BIT(port, STIM_PIN_HCSS(3)))
+
+/*
+ * Per-phase masks. Clears are written before sets on every port so drive and shunt are
+ * never on together (break-before-make).
+ *   onset:      shunts off, phase-2 select off, drive on
+ *   interphase: drive off, shunts on
+ *   phase 2:    shunts off, drive on (phase-2 select is not driven)
+ *   idle:       drive and phase-2 select off, shunts on
+ */
+#define STIM_ONSET_CLR(port)      (STIM_SHUNT_MASK(port) | STIM_PHASE2_MASK(port))
+#define STIM_ONSET_SET(port)      STIM_DRIVE_MASK(port)
+#define STIM_INTERPHASE_CLR(port) STIM_DRIVE_MASK(port)
+#define STIM_INTERPHASE_SET(port) STIM_SHUNT_MASK(port)
+#define STIM_PHASE2_CLR(port)     STIM_SHUNT_MASK(port)
+#define STIM_PHASE2_SET(port)     STIM_DRIVE_MASK(port)
+#define STIM_IDLE_CLR(port)       (STIM_DRIVE_MASK(port) | STIM_PHASE2_MASK(port))
+#define STIM_IDLE_SET(port)       STIM_SHUNT_MASK(port)
+#define STIM_SELECT_OFF_CLR(port) STIM_PHASE2_MASK(port)
+#define STIM_SELECT_OFF_SET(port) 0u
+#define STIM_SAFE_CLR(port)       (STIM_IDLE_CLR(port) | STIM_HCSS_MASK(port))
+#define STIM_SAFE_SET(port)       STIM_IDLE_SET(port)
+
+#if defined(NRF_P2)
+#define STIM_PORT_COUNT 3
+#else
+#define STIM_PORT_COUNT 2
+#endif
+
+static inline NRF_GPIO_Type *stim_port_reg(uint32_t port)
+{
+    switch (port) {
+        case 0:  return NRF_P0;
+        case 1:  return NRF_P1;
+#if defined(NRF_P2)
+        default: return NRF_P2;
+#else
+        default: return NRF_P1;
+#endif
+    }
+}
+
+/* With constant masks the unused ports drop out and each phase is two to four stores */
+static inline __attribute__((always_inline))
+void stim_pins_write(uint32_t clr0, uint32_t clr1, uint32_t clr2,
+                     uint32_t set0, uint32_t set1, uint32_t set2)
+{
+    if (clr0) { nrf_gpio_port_out_clear(stim_port_reg(0), clr0); }
+    if (clr1) { nrf_gpio_port_out_clear(stim_port_reg(1), clr1); }
+    if (STIM_PORT_COUNT > 2 && clr2) { nrf_gpio_port_out_clear(stim_port_reg(2), clr2); }
+    if (set0) { nrf_gpio_port_out_set(stim_port_reg(0), set0); }
+    if (set1) { nrf_gpio_port_out_set(stim_port_reg(1), set1); }
+    if (STIM_PORT_COUNT > 2 && set2) { nrf_gpio_port_out_set(stim_port_reg(2), set2); }
+}
+
+#define STIM_PINS_APPLY(phase) \
+    stim_pins_write(STIM_##phase##_CLR(0), STIM_##phase##_CLR(1), STIM_##phase##_CLR(2), \
+                    STIM_##phase##_SET(0), STIM_##phase##_SET(1), STIM_##phase##_SET(2))
+
+/* Phase 1 onset: 1.00=0, 1.01=0, 0.13=0, then 1.03=1 (default map) */
+static inline void stim_pins_phase1(void)    { STIM_PINS_APPLY(ONSET); }
+/* Interphase gap: 1.03=0, then 1.00=1, 1.01=1 */
+static inline void stim_pins_interphase(void) { STIM_PINS_APPLY(INTERPHASE); }
+/* Phase 2: 1.00=0, 1.01=0, then 1.03=1 */
+static inline void stim_pins_phase2(void)    { STIM_PINS_APPLY(PHASE2); }
+/* Between pulses: 1.03=0, 0.13=0, then 1.00=1, 1.01=1 */
+static inline void stim_pins_idle(void)      { STIM_PINS_APPLY(IDLE); }
+/* Phase-2 select only (trigger mode: GPIOTE owns drive and shunts) */
+static inline void stim_pins_phase2_select_off(void) { STIM_PINS_APPLY(SELECT_OFF); }
+/* Safe state: idle plus every HCSS switch open. Register writes only, usable from fault context */
+static inline void stim_pins_safe(void)      { STIM_PINS_APPLY(SAFE); }
+
+/**
+ * Configure the switch, HCSS and DAC CS pins as outputs in their idle state.
+ * On nRF5340 this also hands the pins to the application core once (the network core
+ * forwarder claims P1.00/P1.01 at boot), so no ISR has to re-select them.
+ */
+void stim_pins_init(void);
+
+#endif /* STIM_PINS_H */
@@ -0,0 +1,238 @@
+/*
+ * Cross-device stimulation sync: a software PLL on the stim period. Both the reference edge
+ * and the own pulse onset are latched into the free-running measurement timer by DPPI, so the
+ * phase detector is exact to one measurement tick whatever the ISR latency. At the end of
+ * each pulse (COMPARE3) the phase error drives a PI loop whose output trims the next CC0;
+ * the correction is bounded to CONFIG_PLL_MAX_PPM so the stimulation rate never visibly jumps.
+ */
+#include <nrfx_gpiote.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_gpio.h>
+#include <zephyr/kernel.h>
+#include "stim_pll.h"
+#include "pll_core.h"
+#include "timer.h"
+#include "trigger.h"
+#include "config.h"
+
+#if STIM_PLL_ACTIVE
+
+/* Shared with sync.c; a capture task is a single register write, so no ownership needed */
+#define MEAS_CC_NOW NRF_TIMER_CC_CHANNEL5
+
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(TRIGGER_GPIOTE_INST_IDX);
+
+static uint8_t ch_ref;
+static uint32_t meas_ticks_per_us;
+static uint64_t timebase_last;  // last extended measurement timer value
+
+static stim_pll_source source;
+static int64_t offset_ns;
+static pll_core loop;           // pll_core.h; nominal period, PI state and lock detector
+static uint32_t last_ref;       // CC2 at the previous pulse, for freshness
+static uint64_t ref_onset_ns;   // BLE reference train
+static uint32_t ref_period_ns;
+
+static struct {
+    uint32_t ref_missing;
+    uint64_t last_onset;        // extended measurement ticks
+} st;
+
+/* Extend a 32-bit capture to 64 bits; only forward steps advance the base (see sync.c) */
+static uint64_t timebase_extend(uint32_t lo)
+{
+    unsigned int key = irq_lock();
+    int32_t delta = (int32_t)(lo - (uint32_t)timebase_last);
+    uint64_t ts = timebase_last + delta;
+    if (delta > 0) {
+        timebase_last = ts;
+    }
+    irq_unlock(key);
+    return ts;
+}
+
+static uint64_t meas_to_ns(uint64_t ticks)
+{
+    return ticks * 1000u / meas_ticks_per_us;
+}
+
+static void loop_reset(void)
+{
+    pll_core_reset(&loop);
+    last_ref = nrfx_timer_capture_get(timer_measurement_instance(), STIM_PLL_CC_REF);
+}
+
+void stim_pll_on_pulse(void)
+{
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    uint32_t onset = nrfx_timer_capture_get(meas, STIM_PLL_CC_ONSET);
+    int64_t err_ns;
+
+    st.last_onset = timebase_extend(onset);
+    if (source == STIM_PLL_OFF || loop.nominal_ticks == 0) {
+        return;
+    }
+
+    if (source == STIM_PLL_WIRE) {
+        uint32_t ref = nrfx_timer_capture_get(meas, STIM_PLL_CC_REF);
+        /* No edge since the last pulse: keep the current correction (holdover) */
+        if (ref == last_ref) {
+            st.ref_missing++;
+            nrf_timer_cc_set(timer_stim_instance()->p_reg, NRF_TIMER_CC_CHANNEL0,
+                             pll_core_hold(&loop));
+            return;
+        }
+        last_ref = ref;
+        err_ns = (int64_t)(int32_t)(onset - ref) * 1000 / meas_ticks_per_us;
+        err_ns = pll_phase_fold(err_ns - offset_ns, timer_get_period_ns());
+    } else {
+        if (ref_period_ns == 0) {
+            return;
+        }
+        err_ns = (int64_t)(meas_to_ns(st.last_onset) - ref_onset_ns);
+        err_ns = pll_phase_fold(err_ns - offset_ns, ref_period_ns);
+    }
+
+    nrf_timer_cc_set(timer_stim_instance()->p_reg, NRF_TIMER_CC_CHANNEL0,
+                     pll_core_update(&loop, err_ns));
+}
+
+void stim_pll_resync(uint32_t period_ticks)
+{
+    unsigned int key = irq_lock();
+
+    pll_core_resync(&loop, period_ticks, timer_stim_tick_hz());
+    last_ref = nrfx_timer_capture_get(timer_measurement_instance(), STIM_PLL_CC_REF);
+    irq_unlock(key);
+}
+
+int stim_pll_set_source(stim_pll_source new_source, int32_t phase_offset_us)
+{
+    if (new_source > STIM_PLL_BLE) {
+        return -EINVAL;
+    }
+    unsigned int key = irq_lock();
+
+    source = new_source;
+    offset_ns = (int64_t)phase_offset_us * 1000;
+    ref_period_ns = 0;
+    loop_reset();
+    if (loop.nominal_ticks != 0) {
+        nrf_timer_cc_set(timer_stim_instance()->p_reg, NRF_TIMER_CC_CHANNEL0, loop.nominal_ticks);
+    }
+    irq_unlock(key);
+
+    if (new_source == STIM_PLL_WIRE) {
+        nrfx_gppi_channels_enable(BIT(ch_ref));
+    } else {
+        nrfx_gppi_channels_disable(BIT(ch_ref));
+    }
+    return 0;
+}
+
+void stim_pll_set_reference(uint64_t onset_us, uint32_t period_ns)
+{
+    unsigned int key = irq_lock();
+
+    ref_onset_ns = onset_us * 1000u;
+    ref_period_ns = period_ns;
+    irq_unlock(key);
+}
+
+uint64_t stim_pll_now_us(void)
+{
+    unsigned int key = irq_lock();
+    uint32_t lo = nrfx_timer_capture(timer_measurement_instance(), MEAS_CC_NOW);
+    uint64_t ts = timebase_extend(lo);
+
+    irq_unlock(key);
+    return ts / meas_ticks_per_us;
+}
+
+void get_stim_pll_stats(stim_pll_stats *stats)
+{
+    unsigned int key = irq_lock();
+
+    stats->source = source;
+    stats->locked = loop.locked;
+    stats->skew_us = loop.skew_ns / 1000;
+    stats->skew_max_us = loop.skew_max_ns / 1000u;
+    stats->skew_avg_us = loop.skew_avg_ns / 1000u;
+    stats->adj_ppm = pll_core_adj_ppm(&loop);
+    stats->ref_missing = st.ref_missing;
+    stats->last_onset_us = st.last_onset / meas_ticks_per_us;
+    stats->period_ns = (uint32_t)MIN(timer_get_period_ns(), UINT32_MAX);
+    irq_unlock(key);
+}
+
+static int ref_pin_init(void)
+{
+    uint8_t ch;
+
+    if (!nrfx_gpiote_init_check(&gpiote)) {
+        if (nrfx_gpiote_init(&gpiote, NRFX_GPIOTE_DEFAULT_CONFIG_IRQ_PRIORITY) != NRFX_SUCCESS) {
+            return -EIO;
+        }
+    }
+    if (nrfx_gpiote_channel_alloc(&gpiote, &ch) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    static const nrf_gpio_pin_pull_t pull = NRF_GPIO_PIN_PULLDOWN;
+    nrfx_gpiote_trigger_config_t trig_cfg = {
+        .trigger = NRFX_GPIOTE_TRIGGER_LOTOHI,
+        .p_in_channel = &ch,
+    };
+    nrfx_gpiote_input_pin_config_t in_cfg = {
+        .p_pull_config = &pull,
+        .p_trigger_config = &trig_cfg,
+        .p_handler_config = NULL,   // event only, no interrupt
+    };
+    if (nrfx_gpiote_input_configure(&gpiote, TRIGGER_PIN, &in_cfg) != NRFX_SUCCESS) {
+        return -EIO;
+    }
+    nrfx_gpiote_trigger_enable(&gpiote, TRIGGER_PIN, false);
+    return 0;
+}
+
+int stim_pll_init(void)
+{
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    int err;
+
+    meas_ticks_per_us = NRF_TIMER_BASE_FREQUENCY_GET(meas->p_reg) / 1000000u;
+
+    err = ref_pin_init();
+    if (err) {
+        printf("PLL: GPIOTE setup failed (%d)\n", err);
+        return err;
+    }
+    if (nrfx_gppi_channel_alloc(&ch_ref) != NRFX_SUCCESS) {
+        printf("PLL: out of DPPI channels\n");
+        return -ENOMEM;
+    }
+    nrfx_gppi_channel_endpoints_setup(ch_ref,
+        nrfx_gpiote_in_event_address_get(&gpiote, TRIGGER_PIN),
+        nrfx_timer_capture_task_address_get(meas, STIM_PLL_CC_REF));
+
+#if !SYNC_OUT_ENABLE
+    uint8_t ch_onset;
+    if (nrfx_gppi_channel_alloc(&ch_onset) != NRFX_SUCCESS) {
+        printf("PLL: out of DPPI channels\n");
+        return -ENOMEM;
+    }
+    nrfx_gppi_channel_endpoints_setup(ch_onset,
+        nrfx_timer_compare_event_address_get(timer_stim_instance(), NRF_TIMER_CC_CHANNEL0),
+        nrfx_timer_capture_task_address_get(meas, STIM_PLL_CC_ONSET));
+    nrfx_gppi_channels_enable(BIT(ch_onset));
+#endif
+
+    (void)timebase_extend(nrfx_timer_capture(meas, MEAS_CC_NOW));
+    err = stim_pll_set_source(CONFIG_PLL_SOURCE, 0);
+    printf("PLL: reference %s, max correction %u ppm\n",
+           source == STIM_PLL_WIRE ? "sync-in" : source == STIM_PLL_BLE ? "BLE" : "off",
+           CONFIG_PLL_MAX_PPM);
+    return err;
+}
+
+#endif /* STIM_PLL_ACTIVE */
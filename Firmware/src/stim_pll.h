@@ -0,0 +1,77 @@
+#ifndef STIM_PLL_H
+#define STIM_PLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stochastic.h"
+#include "sched.h"
+#include "pll_core.h"
+#include "config.h"
+
+/* Disciplines the fixed CC0 period of the BLE continuous engine. Trigger mode is timed from
+ * outside already, and stochastic or multichannel plans have no single period to lock. The
+ * RTC engine is not covered: its period only moves in whole 30.5 us LFCLK ticks. */
+#if STIM_PLL_ENABLE && defined(CONFIG_BT) && !TRIGGER_MODE && !MULTICHANNEL_ACTIVE && \
+    !STOCHASTIC_IPI_ENABLE
+#define STIM_PLL_ACTIVE 1
+#else
+#define STIM_PLL_ACTIVE 0
+#endif
+
+/* Measurement timer channels (trigger latency channels, free outside trigger mode): CC2 latched
+ * by DPPI on the sync-in edge, CC3 on the stim TIMER's COMPARE0 (own pulse onset). An event
+ * publishes to one DPPI channel only, so with sync-out the onset latch of sync.c (CC1) is used. */
+#define STIM_PLL_CC_REF   NRF_TIMER_CC_CHANNEL2
+#if SYNC_OUT_ENABLE
+#define STIM_PLL_CC_ONSET NRF_TIMER_CC_CHANNEL1
+#else
+#define STIM_PLL_CC_ONSET NRF_TIMER_CC_CHANNEL3
+#endif
+
+/*
+ * Reference for the loop:
+ *  WIRE: rising edges on TRIGGER_PIN at the stimulation rate, e.g. another unit's SYNC_OUT
+ *        (its phase 1 onset). Edge and own onset are both latched by hardware.
+ *  BLE:  a reference train (onset + period) given in this device's own timebase over the
+ *        control channel. A host maps every unit's clock onto its own by timestamp exchange
+ *        (CMD_PLL op 1) and hands each follower the leader's train (Tools/chronos_ctl.py sync).
+ */
+typedef enum {
+    STIM_PLL_OFF = 0,           // free running at the nominal period
+    STIM_PLL_WIRE = 1,
+    STIM_PLL_BLE = 2,
+} stim_pll_source;
+
+typedef struct {
+    stim_pll_source source;
+    bool locked;                // |skew| under CONFIG_PLL_LOCK_US for STIM_PLL_LOCK_COUNT pulses
+    int32_t skew_us;            // last own onset minus reference (minus the phase offset)
+    uint32_t skew_max_us;       // largest |skew| since lock was gained
+    uint32_t skew_avg_us;       // running average of |skew|
+    int32_t adj_ppm;            // period correction now applied
+    uint32_t ref_missing;       // pulses without a fresh wired reference edge (holdover)
+    uint64_t last_onset_us;     // own last onset, device timebase
+    uint32_t period_ns;         // nominal period
+} stim_pll_stats;
+
+/** Wire TRIGGER_PIN and COMPARE0 to the measurement timer captures. Call after measurement_timer_init(). */
+int stim_pll_init(void);
+
+/** End of each pulse (COMPARE3), ISR context: measure the phase and write the next CC0. */
+void stim_pll_on_pulse(void);
+
+/** The period was reloaded (update_stim_frequency): new nominal, loop state restarts. */
+void stim_pll_resync(uint32_t period_ticks);
+
+/** Select the reference. phase_offset_us shifts this unit's pulses relative to it. */
+int stim_pll_set_source(stim_pll_source source, int32_t phase_offset_us);
+
+/** BLE reference: leader onset in this device's timebase (us) and the leader period (ns). */
+void stim_pll_set_reference(uint64_t onset_us, uint32_t period_ns);
+
+/** Device timebase now, us (the measurement timer, extended to 64 bits). */
+uint64_t stim_pll_now_us(void);
+
+void get_stim_pll_stats(stim_pll_stats *stats);
+
+#endif /* STIM_PLL_H */
@@ -0,0 +1,148 @@
+/*
+ * Last-good stimulation plan in flash. A plan applied over BLE is written through the
+ * settings subsystem (wear-levelled ZMS/NVS backend) and restored at boot before the
+ * stimulation timer starts, so a brownout or watchdog reset resumes the same therapy
+ * instead of falling back to the compile-time defaults.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <string.h>
+#include "stim_store.h"
+#include "timer.h"
+#include "boot_time.h"
+#include "config.h"
+
+#if STIM_STORE_ACTIVE
+
+typedef struct {
+    uint8_t version;
+    uint8_t reserved;
+    stim_setting setting;
+    uint32_t rate_mhz;
+} stim_store_record;
+
+static stim_store_record loaded;
+static bool loaded_valid;
+static stim_store_record committed;     // last plan known to be in flash
+static stim_store_record pending;
+static struct k_work save_work;
+static bool work_ready;
+static stim_boot_source boot_source;
+
+/* As the engine would take it: sub-Hz rates too */
+static bool plan_valid(const stim_setting *s, uint32_t rate_mhz)
+{
+    return s->pulse_width > 0 && timer_plan_check(rate_mhz, s->pulse_width) == 0;
+}
+
+static int stim_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    const char *next;
+
+    if (!settings_name_steq(name, "plan", &next) || next) {
+        return -ENOENT;
+    }
+    if (len != sizeof(loaded)) {
+        return -EINVAL;     // older/newer layout: ignore, defaults apply
+    }
+    if (read_cb(cb_arg, &loaded, sizeof(loaded)) != sizeof(loaded)) {
+        return -EIO;
+    }
+    loaded_valid = loaded.version == STIM_STORE_VERSION && plan_valid(&loaded.setting, loaded.rate_mhz);
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(stim, "stim", NULL, stim_settings_set, NULL, NULL);
+
+static void save_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    stim_store_record rec;
+    unsigned int key = irq_lock();
+
+    rec = pending;
+    irq_unlock(key);
+    if (memcmp(&rec, &committed, sizeof(committed)) == 0) {
+        return;
+    }
+    int err = settings_save_one(STIM_STORE_KEY, &rec, sizeof(rec));
+    if (err) {
+        printf("Stim plan save failed (%d)\n", err);
+        return;
+    }
+    committed = rec;
+    printf("Stim plan saved: %u us, %lu mHz, amplitude 0x%04X\n",
+           committed.setting.pulse_width, committed.rate_mhz, committed.setting.DAC_amplitude);
+}
+
+static void stim_store_work_init(void)
+{
+    if (!work_ready) {
+        k_work_init(&save_work, save_work_handler);
+        work_ready = true;
+    }
+}
+
+/* Both records compare whole, padding included */
+static void record_fill(stim_store_record *rec, const stim_setting *setting, uint32_t rate_mhz)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->version = STIM_STORE_VERSION;
+    rec->setting = *setting;
+    rec->rate_mhz = rate_mhz;
+}
+
+stim_boot_source stim_store_load(stim_setting *setting, uint32_t *rate_mhz)
+{
+    stim_store_work_init();
+    record_fill(&committed, setting, *rate_mhz);
+    boot_source = STIM_BOOT_DEFAULTS;
+
+    int err = settings_subsys_init();
+    if (err) {
+        printf("Stim plan: settings init failed (%d), using defaults\n", err);
+        return boot_source;
+    }
+    (void)settings_load_subtree("stim");
+    if (loaded_valid) {
+        *setting = loaded.setting;
+        *rate_mhz = loaded.rate_mhz;
+        record_fill(&committed, &loaded.setting, loaded.rate_mhz);
+        boot_source = STIM_BOOT_RESTORED;
+    }
+    return boot_source;
+}
+
+void stim_store_commit(const stim_setting *setting, uint32_t rate_mhz)
+{
+    stim_store_record rec;
+
+    if (!plan_valid(setting, rate_mhz)) {
+        return;
+    }
+    record_fill(&rec, setting, rate_mhz);
+    stim_store_work_init();
+    unsigned int key = irq_lock();
+    pending = rec;
+    irq_unlock(key);
+    k_work_submit(&save_work);
+}
+
+int stim_store_clear(void)
+{
+    int err = settings_delete(STIM_STORE_KEY);
+    if (!err) {
+        memset(&committed, 0, sizeof(committed));
+        printf("Stim plan cleared; defaults apply at next boot\n");
+    }
+    return err;
+}
+
+void get_stim_boot_info(stim_boot_info *info)
+{
+    info->source = boot_source;
+    info->boot_to_pulse_us = boot_phase_us(BOOT_PHASE_FIRST_PULSE);
+    info->first_pulse_seen = info->boot_to_pulse_us != 0;
+}
+
+#endif /* STIM_STORE_ACTIVE */
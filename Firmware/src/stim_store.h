@@ -0,0 +1,51 @@
+#ifndef STIM_STORE_H
+#define STIM_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "data.h"
+#include "config.h"
+
+/* Needs the settings subsystem (ZMS/NVS backend) from the project configuration */
+#if STIM_STORE_ENABLE && defined(CONFIG_SETTINGS)
+#define STIM_STORE_ACTIVE 1
+#else
+#define STIM_STORE_ACTIVE 0
+#endif
+
+/* Settings key of the last committed stimulation plan, and its record layout version */
+#define STIM_STORE_KEY     "stim/plan"
+#define STIM_STORE_VERSION 2        // 2: rate in mHz next to the setting
+
+typedef enum {
+    STIM_BOOT_DEFAULTS = 0,     // compile-time CONFIG_STIM_* values (nothing stored, or record invalid)
+    STIM_BOOT_RESTORED = 1,     // last committed plan restored from flash
+} stim_boot_source;
+
+typedef struct {
+    stim_boot_source source;
+    bool first_pulse_seen;
+    uint32_t boot_to_pulse_us;  // kernel start to phase 1 onset of the first pulse
+} stim_boot_info;
+
+/**
+ * Replace *setting and *rate_mhz with the stored plan if a valid one exists. The rate is the
+ * one the plan ran at, sub-Hz and fractional rates included; setting->frequency is its
+ * rounding. Only the settings subtree of the plan is loaded, so this is fast enough to run
+ * before timer start and long before bt_enable(). Returns the source actually used.
+ */
+stim_boot_source stim_store_load(stim_setting *setting, uint32_t *rate_mhz);
+
+/**
+ * Persist a plan that has just been applied, with the rate it runs at (CMD_SET_RATE's mHz,
+ * or frequency * 1000). Identical plans are not rewritten (flash wear); the write itself is
+ * deferred to the system workqueue.
+ */
+void stim_store_commit(const stim_setting *setting, uint32_t rate_mhz);
+
+/** Erase the stored plan; the next boot uses the compile-time defaults. */
+int stim_store_clear(void);
+
+void get_stim_boot_info(stim_boot_info *info);
+
+#endif /* STIM_STORE_H */
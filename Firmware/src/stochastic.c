@@ -0,0 +1,174 @@
+/*
+ * Stochastic inter-pulse intervals. Intervals are drawn from the hardware entropy
+ * source, shaped to the requested distribution and converted to period-clock ticks
+ * on the system workqueue. The stimulation ISR pops one precomputed word per pulse,
+ * so randomized protocols cost the same ISR time as a fixed rate.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/entropy.h>
+#include <zephyr/sys/atomic.h>
+#include <math.h>
+#include <nrfx_timer.h>
+#include "stochastic.h"
+#include "timer.h"
+#include "rtc_stim.h"
+#include "config.h"
+
+#if STOCHASTIC_IPI_ENABLE
+
+/* Which clock the engine's period register counts */
+#if defined(CONFIG_BT) || TRIGGER_MODE
+#define STOCH_TICK_HZ()     timer_stim_tick_hz()
+#define STOCH_MAX_TICKS     UINT32_MAX
+#else
+#define STOCH_TICK_HZ()     LFCLK_FREQ_HZ
+#define STOCH_MAX_TICKS     0xFFFFFFu   // 24-bit RTC compare
+#endif
+
+#define ENTROPY_BATCH 16    // 32-bit words per entropy driver call
+
+static const struct device *const entropy_dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_entropy));
+
+static uint32_t ticks_buf[STOCH_BUF_LEN];
+static atomic_t buf_head;       // written by refill work only
+static atomic_t buf_tail;       // written by ISR only
+static atomic_t active;
+static atomic_t underruns;
+static struct k_work refill_work;
+static bool work_ready;
+
+static stoch_dist dist;
+static uint32_t mean_ticks;
+static uint32_t min_ticks;
+static uint32_t max_ticks;
+static uint8_t jitter;
+
+static uint32_t draw_interval(uint32_t r)
+{
+    uint64_t t;
+
+    if (dist == STOCH_POISSON) {
+        /* u in (0, 1], 24 random bits, never 0 */
+        float u = (float)((r >> 8) + 1u) / 16777216.0f;
+        t = (uint64_t)(-logf(u) * (float)mean_ticks);
+    } else {
+        uint32_t span = (uint32_t)((uint64_t)mean_ticks * jitter * 2u / 100u);
+        t = (uint64_t)mean_ticks - span / 2u + (((uint64_t)r * (span + 1u)) >> 32);
+    }
+    if (t < min_ticks) {
+        t = min_ticks;
+    } else if (t > max_ticks) {
+        t = max_ticks;
+    }
+    return (uint32_t)t;
+}
+
+static void refill_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+    uint32_t rnd[ENTROPY_BATCH];
+
+    while (atomic_get(&active) &&
+           (uint32_t)(atomic_get(&buf_head) - atomic_get(&buf_tail)) < STOCH_BUF_LEN) {
+        if (entropy_get_entropy(entropy_dev, (uint8_t *)rnd, sizeof(rnd))) {
+            printf("Stochastic: entropy read failed\n");
+            return;
+        }
+        for (int i = 0; i < ENTROPY_BATCH; i++) {
+            uint32_t head = atomic_get(&buf_head);
+            if (head - (uint32_t)atomic_get(&buf_tail) >= STOCH_BUF_LEN) {
+                break;
+            }
+            ticks_buf[head & (STOCH_BUF_LEN - 1)] = draw_interval(rnd[i]);
+            atomic_set(&buf_head, head + 1);
+        }
+    }
+}
+
+int stochastic_start(stoch_dist new_dist, uint16_t mean_rate_hz, uint8_t jitter_pct,
+                     uint32_t min_interval_us)
+{
+    if (new_dist == STOCH_OFF) {
+        stochastic_stop();
+        return 0;
+    }
+    if (mean_rate_hz == 0 || jitter_pct > 100 || new_dist > STOCH_JITTER) {
+        printf("Stochastic: invalid parameters\n");
+        return -EINVAL;
+    }
+    if (!device_is_ready(entropy_dev)) {
+        printf("Stochastic: entropy source not ready\n");
+        return -ENODEV;
+    }
+    if (!work_ready) {
+        k_work_init(&refill_work, refill_work_handler);
+        work_ready = true;
+    }
+
+    /* Quiesce the ISR and the refill work before touching the buffer */
+    atomic_set(&active, 0);
+    struct k_work_sync sync;
+    k_work_cancel_sync(&refill_work, &sync);
+
+    uint32_t tick_hz = STOCH_TICK_HZ();
+    dist = new_dist;
+    jitter = jitter_pct;
+    mean_ticks = tick_hz / mean_rate_hz;
+    min_ticks = (uint32_t)((uint64_t)min_interval_us * tick_hz / 1000000u);
+    max_ticks = (uint32_t)MIN((uint64_t)mean_ticks * STOCH_MAX_MEAN_MULT, STOCH_MAX_TICKS);
+    if (min_ticks > mean_ticks) {
+        printf("Stochastic: mean rate %u Hz too high for pulse width\n", mean_rate_hz);
+        return -EINVAL;
+    }
+    atomic_set(&buf_head, 0);
+    atomic_set(&buf_tail, 0);
+    atomic_set(&underruns, 0);
+
+    /* Prefill synchronously so the first pulses are already random */
+    atomic_set(&active, 1);
+    refill_work_handler(&refill_work);
+
+    printf("Stochastic intervals: %s, mean %u Hz (%lu ticks), jitter %u%%\n",
+           dist == STOCH_POISSON ? "poisson" : "uniform jitter",
+           mean_rate_hz, mean_ticks, jitter_pct);
+    return 0;
+}
+
+void stochastic_stop(void)
+{
+    atomic_set(&active, 0);
+    if (work_ready) {
+        k_work_cancel(&refill_work);
+    }
+}
+
+bool stochastic_active(void)
+{
+    return atomic_get(&active) != 0;
+}
+
+uint32_t stochastic_next_ticks(void)
+{
+    uint32_t tail = atomic_get(&buf_tail);
+    uint32_t level = (uint32_t)atomic_get(&buf_head) - tail;
+
+    if (level == 0) {
+        atomic_inc(&underruns);
+        return mean_ticks;
+    }
+    uint32_t ticks = ticks_buf[tail & (STOCH_BUF_LEN - 1)];
+    atomic_set(&buf_tail, tail + 1);
+    if (level == STOCH_LOW_WATER) {
+        k_work_submit(&refill_work);
+    }
+    return ticks;
+}
+
+uint32_t stochastic_underruns(void)
+{
+    return atomic_get(&underruns);
+}
+
+#endif /* STOCHASTIC_IPI_ENABLE */
@@ -0,0 +1,42 @@
+#ifndef STOCHASTIC_H
+#define STOCHASTIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Pregenerated interval buffer (power of two). Refilled from the workqueue
+ * when fewer than STOCH_LOW_WATER intervals remain. */
+#define STOCH_BUF_LEN    128
+#define STOCH_LOW_WATER  (STOCH_BUF_LEN / 2)
+
+/* Exponential tail is truncated at this multiple of the mean interval */
+#define STOCH_MAX_MEAN_MULT 8
+
+typedef enum {
+    STOCH_OFF = 0,          // fixed period
+    STOCH_POISSON = 1,      // exponential inter-pulse intervals (Poisson process)
+    STOCH_JITTER = 2,       // uniform in mean * [1 - jitter, 1 + jitter]
+} stoch_dist;
+
+/**
+ * Start randomized inter-pulse intervals. Intervals are drawn from the hardware
+ * entropy source in thread context and stored as period-clock ticks, so the
+ * engine only pops one word per pulse.
+ * @param dist          distribution
+ * @param mean_rate_hz  mean pulse rate
+ * @param jitter_pct    STOCH_JITTER only: +/- percentage of the mean interval (0-100)
+ * @param min_interval_us  shortest allowed interval (must fit one biphasic pulse)
+ * @return 0 on success, negative errno on bad arguments or entropy failure
+ */
+int stochastic_start(stoch_dist dist, uint16_t mean_rate_hz, uint8_t jitter_pct,
+                     uint32_t min_interval_us);
+void stochastic_stop(void);
+bool stochastic_active(void);
+
+/** Next interval in period-clock ticks (TIMER or RTC). ISR context, O(1). */
+uint32_t stochastic_next_ticks(void);
+
+/** Intervals the engine needed while the buffer was empty (mean used instead). */
+uint32_t stochastic_underruns(void);
+
+#endif /* STOCHASTIC_H */
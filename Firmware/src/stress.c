@@ -0,0 +1,275 @@
+/*
+ * Parameter-update stress run: random plan updates from comms_workq while the continuous
+ * engine runs, and a per-pulse check of the edge timestamps and DAC words against the plan.
+ * The checker (stress_core.c) runs in the compare ISR on measurement-TIMER ticks only; plans
+ * are converted to ticks when they change and the worst errors to ns when they are read.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/random/random.h>
+#include <nrfx_timer.h>
+#include <string.h>
+#include <stdlib.h>
+#include "stress.h"
+#include "stress_core.h"
+#include "timer.h"
+#include "spi.h"
+#include "BLE.h"
+#include "charge_limit.h"
+#include "config.h"
+
+#if STRESS_ACTIVE
+
+BUILD_ASSERT(CONFIG_STRESS_RATE_MIN_HZ > 0 && CONFIG_STRESS_RATE_MIN_HZ <= CONFIG_STRESS_RATE_MAX_HZ &&
+             CONFIG_STRESS_PW_MIN_US > 0 && CONFIG_STRESS_PW_MIN_US <= CONFIG_STRESS_PW_MAX_US,
+             "CONFIG_STRESS_* ranges");
+
+static stress_checker chk;          // ISR owned; the plan calls take irq_lock
+static uint32_t meas_hz;
+
+static uint32_t rejected;
+static volatile bool running;
+static int64_t end_ms;
+static uint32_t mean_us;
+static struct k_timer inject_timer;
+static struct k_work inject_work;
+static bool initialized;
+static K_MUTEX_DEFINE(inject_lock);    // an update in flight finishes before the plan is restored
+
+/* Plan at the start, restored at the end */
+static struct {
+    uint32_t rate_mhz;
+    uint16_t pw_us;
+    uint16_t amplitude;
+} saved;
+
+static uint32_t ticks_to_ns(uint32_t ticks)
+{
+    return (uint32_t)MIN((uint64_t)ticks * 1000000000u / meas_hz, UINT32_MAX);
+}
+
+static uint32_t meas_now(void)
+{
+    return nrfx_timer_capture(timer_measurement_instance(), STRESS_MEAS_CC);
+}
+
+static void plan_load(stress_plan *p)
+{
+    p->period = (uint32_t)(timer_get_period_ns() * meas_hz / 1000000000u);
+    p->pw = (uint32_t)((uint64_t)timer_get_pulse_width_us() * meas_hz / 1000000u);
+    p->amplitude = dac_amplitude_get();
+}
+
+void stress_edge(uint8_t edge)
+{
+    if (!running) {
+        return;
+    }
+    /* Phase 1 is clocked out after edge 0 and phase 2 after edge 2: at edges 1 and 3 the
+     * last DAC1 word is the one this pulse sent */
+    stress_core_edge(&chk, edge, meas_now(), spi_dac1_last_code());
+}
+
+void stress_plan_update(bool restart)
+{
+    if (!running) {
+        return;
+    }
+
+    stress_plan p;
+
+    plan_load(&p);
+
+    unsigned int key = irq_lock();
+
+    stress_core_plan(&chk, &p, restart, meas_now());
+    irq_unlock(key);
+}
+
+static void amplitude_coming(uint16_t amplitude, bool coming)
+{
+    unsigned int key = irq_lock();
+
+    if (coming) {
+        stress_core_amplitude_coming(&chk, amplitude);
+    } else {
+        stress_core_amplitude_cancel(&chk);
+    }
+    irq_unlock(key);
+}
+
+static uint32_t rand_range(uint32_t lo, uint32_t hi)
+{
+    return lo + sys_rand32_get() % (hi - lo + 1u);
+}
+
+/* One random update through the control-channel path; false if refused */
+static bool inject_one(void)
+{
+    uint16_t amplitude = dac_amplitude_get();
+    uint16_t pw = (uint16_t)timer_get_pulse_width_us();
+    uint32_t rate_mhz = timer_get_rate_mhz();
+
+    switch (sys_rand32_get() % 3u) {
+        case 0:
+            rate_mhz = rand_range(CONFIG_STRESS_RATE_MIN_HZ, CONFIG_STRESS_RATE_MAX_HZ) * 1000u;
+            break;
+        case 1:
+            pw = (uint16_t)rand_range(CONFIG_STRESS_PW_MIN_US, CONFIG_STRESS_PW_MAX_US);
+            break;
+        default:
+            /* No larger than the starting amplitude, on the same side of mid-scale */
+            amplitude = (saved.amplitude >= 0x8000u)
+                      ? (uint16_t)rand_range(0x8000u, saved.amplitude)
+                      : (uint16_t)rand_range(saved.amplitude, 0x8000u);
+            break;
+    }
+    if (timer_plan_check(rate_mhz, pw) != 0) {
+        return false;
+    }
+    /* The limiter writes the words as it commits, ahead of the plan that carries them */
+    amplitude_coming(amplitude, true);
+#if CHARGE_LIMIT_ACTIVE
+    if (charge_limit_commit(amplitude, pw, rate_mhz) != 0) {
+        amplitude_coming(amplitude, false);
+        return false;
+    }
+#endif
+    if (rate_mhz != timer_get_rate_mhz()) {
+        if (update_stim_rate_mhz(rate_mhz) != 0) {
+#if CHARGE_LIMIT_ACTIVE
+            charge_limit_revert();
+#endif
+            amplitude_coming(amplitude, false);
+            return false;
+        }
+    } else if (pw != timer_get_pulse_width_us()) {
+        update_pulse_width(pw);
+    } else {
+        update_dac_amplitude(amplitude);
+        stress_plan_update(false);
+    }
+    return true;
+}
+
+static void plan_restore(void)
+{
+#if CHARGE_LIMIT_ACTIVE
+    (void)charge_limit_commit(saved.amplitude, saved.pw_us, saved.rate_mhz);
+#endif
+    /* Width first: the saved rate was valid for the saved width */
+    update_pulse_width(saved.pw_us);
+    (void)update_stim_rate_mhz(saved.rate_mhz);
+    update_dac_amplitude(saved.amplitude);
+}
+
+static void report_print(void)
+{
+    stress_report r;
+
+    get_stress_report(&r);
+    printf("Stress: %lu updates (%lu in a pulse, %lu refused), %lu pulses checked\n",
+           r.updates, r.in_pulse, r.rejected, r.pulses);
+    printf("Stress: dropped %lu doubled %lu stretched %lu unbalanced %lu late %lu wrong amplitude %lu\n",
+           r.dropped, r.doubled, r.stretched, r.unbalanced, r.late, r.wrong_amplitude);
+    printf("Stress: worst error %lu ns, worst update-induced error %lu ns\n",
+           r.worst_err_ns, r.worst_update_err_ns);
+}
+
+static void inject_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    if (end_ms != 0 && k_uptime_get() >= end_ms) {
+        stress_stop();
+        return;
+    }
+    k_mutex_lock(&inject_lock, K_FOREVER);
+    if (!running) {
+        k_mutex_unlock(&inject_lock);
+        return;
+    }
+    if (!inject_one()) {
+        rejected++;
+    }
+    k_mutex_unlock(&inject_lock);
+    k_timer_start(&inject_timer, K_USEC(rand_range(mean_us / 2u, mean_us + mean_us / 2u)), K_NO_WAIT);
+}
+
+static void inject_timer_handler(struct k_timer *timer)
+{
+    ARG_UNUSED(timer);
+    k_work_submit_to_queue(&comms_workq, &inject_work);
+}
+
+int stress_start(uint16_t duration_s, uint32_t interval_us)
+{
+    if (running) {
+        return -EBUSY;
+    }
+    if (interval_us < 1000u) {
+        return -EINVAL;
+    }
+    if (!initialized) {
+        k_timer_init(&inject_timer, inject_timer_handler, NULL);
+        k_work_init(&inject_work, inject_work_handler);
+        initialized = true;
+    }
+    meas_hz = NRF_TIMER_BASE_FREQUENCY_GET(timer_measurement_instance()->p_reg);
+    saved.rate_mhz = timer_get_rate_mhz();
+    saved.pw_us = (uint16_t)timer_get_pulse_width_us();
+    saved.amplitude = dac_amplitude_get();
+    mean_us = interval_us;
+    end_ms = duration_s ? k_uptime_get() + duration_s * 1000ll : 0;
+
+    stress_plan p;
+
+    plan_load(&p);
+
+    unsigned int key = irq_lock();
+
+    stress_core_start(&chk, &p, (uint32_t)((uint64_t)CONFIG_STRESS_TOL_US * meas_hz / 1000000u),
+                      (uint32_t)((uint64_t)SWITCH_PERIOD * meas_hz / 1000000u));
+    rejected = 0;
+    running = true;
+    irq_unlock(key);
+    printf("Stress: %u s, an update every %lu us on average\n", duration_s, interval_us);
+    k_timer_start(&inject_timer, K_USEC(interval_us), K_NO_WAIT);
+    return 0;
+}
+
+void stress_stop(void)
+{
+    k_mutex_lock(&inject_lock, K_FOREVER);
+    if (!running) {
+        k_mutex_unlock(&inject_lock);
+        return;
+    }
+    k_timer_stop(&inject_timer);
+    running = false;
+    plan_restore();
+    k_mutex_unlock(&inject_lock);
+    report_print();
+}
+
+void get_stress_report(stress_report *report)
+{
+    unsigned int key = irq_lock();
+    stress_counts n = chk.n;
+
+    report->running = running;
+    irq_unlock(key);
+    report->updates = n.updates;
+    report->in_pulse = n.in_pulse;
+    report->rejected = rejected;
+    report->pulses = n.pulses;
+    report->dropped = n.dropped;
+    report->doubled = n.doubled;
+    report->stretched = n.stretched;
+    report->unbalanced = n.unbalanced;
+    report->late = n.late;
+    report->wrong_amplitude = n.wrong_amplitude;
+    report->worst_err_ns = ticks_to_ns(n.worst_err);
+    report->worst_update_err_ns = ticks_to_ns(n.worst_update_err);
+}
+
+#endif /* STRESS_ACTIVE */
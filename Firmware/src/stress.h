@@ -0,0 +1,88 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "sched.h"
+#include "stim_pll.h"
+
+/* The continuous BLE engine, fixed intervals: the checker predicts every edge from the plan */
+#if STRESS_ENABLE && defined(CONFIG_BT) && !TRIGGER_MODE && !MULTICHANNEL_ACTIVE && \
+    !STOCHASTIC_IPI_ENABLE && !STIM_PLL_ACTIVE
+#define STRESS_ACTIVE 1
+#else
+#define STRESS_ACTIVE 0
+#endif
+
+/* Measurement TIMER channel the edge timestamps are latched on (CC4 is RTC-mode only) */
+#define STRESS_MEAS_CC NRF_TIMER_CC_CHANNEL4
+
+/*
+ * Parameter-update stress run. While running, an injector on comms_workq applies a random
+ * rate, pulse width or amplitude every CONFIG_STRESS_INTERVAL_US on average (uniform in
+ * 0.5..1.5 of the mean, so updates land at every phase of the pulse), through the same
+ * update_* calls and charge limiter commit as a control-channel command. The plan in
+ * effect at the start is restored at the end.
+ *
+ * Every pulse edge is timestamped on the measurement TIMER right after the switch pins are
+ * driven, and each biphasic pulse is checked against the plan:
+ *  - dropped: an onset more than half a period late, or an onset before the previous pulse
+ *    finished its four edges
+ *  - doubled: an onset early by more than the tolerance, or a phase edge out of order
+ *    (e.g. a restarted timer repeating CC1-CC3)
+ *  - stretched: phase 1, the interphase gap or phase 2 off by more than the tolerance
+ *    (either way)
+ *  - unbalanced: phase 1 and phase 2 widths differ by more than the tolerance
+ *  - late: an onset later than the tolerance but not by half a period; the next onset is still
+ *    due one period after this one was
+ *  - wrong amplitude: the word clocked out to the DAC in phase 1 (spi_dac1_last_code) is not
+ *    the amplitude of the plan, or phase 2's is not its mirror
+ * A rate update restarts the period (update_stim_rate_mhz clears the TIMER), so the onset
+ * after one is expected one new period after the restart. The continuous engine makes rate and
+ * width updates in the gap between pulses and masks CC1-CC3 until the onset after a restart,
+ * so neither is counted as a fault; in the other engines a pulse an update lands in may
+ * match the old or the new plan. An amplitude reaches the DAC words (charge limiter commit)
+ * just before the plan that carries it, so a pulse in between may send either. Errors on such pulses and on the first pulse after an
+ * update are "update-induced"; the worst of them and the worst of all the others are kept
+ * separately. The tolerance is CONFIG_STRESS_TOL_US; ISR entry latency is part of what is
+ * measured, as the switch pins are driven from the ISR. The checker is stress_core.c, which
+ * Tools/stress_sim.c runs against a simulated engine on the host.
+ */
+typedef struct {
+    bool running;
+    uint32_t updates;           // applied
+    uint32_t in_pulse;          // of which landed between an onset and its last edge
+    uint32_t rejected;          // random plans the charge limiter or the period bound refused
+    uint32_t pulses;            // pulses checked
+    uint32_t dropped;
+    uint32_t doubled;
+    uint32_t stretched;
+    uint32_t unbalanced;
+    uint32_t late;
+    uint32_t wrong_amplitude;
+    uint32_t worst_err_ns;          // worst timing error of pulses no update touched
+    uint32_t worst_update_err_ns;   // worst update-induced timing error
+} stress_report;
+
+/**
+ * Start a run of duration_s seconds (0: until stress_stop) with updates every interval_us
+ * on average. Returns -EBUSY while one is running, -EINVAL for an interval under 1 ms.
+ */
+int stress_start(uint16_t duration_s, uint32_t interval_us);
+
+/** End the run now and restore the plan it started with. */
+void stress_stop(void);
+
+/** Pulse edge 0-3 of the continuous engine, after the pins are driven. ISR context. */
+void stress_edge(uint8_t edge);
+
+/**
+ * The engine took a new plan: restart is true when the period restarted (rate update).
+ * Call after the TIMER is running again. Thread context.
+ */
+void stress_plan_update(bool restart);
+
+void get_stress_report(stress_report *report);
+
+#endif /* STRESS_H */
@@ -0,0 +1,181 @@
+/*
+ * Stress run per-pulse checker (stress_core.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "stress_core.h"
+
+static uint32_t max_u32(uint32_t a, uint32_t b)
+{
+    return a > b ? a : b;
+}
+
+/* Phase-2 word of amplitude a, as spi.h DAC_MIRROR */
+static uint16_t dac_mirror(uint16_t a)
+{
+    return a ? (uint16_t)(0x10000u - a) : 0xFFFFu;
+}
+
+static void worst(stress_checker *c, bool update, uint32_t err)
+{
+    if (update) {
+        c->n.worst_update_err = max_u32(c->n.worst_update_err, err);
+    } else {
+        c->n.worst_err = max_u32(c->n.worst_err, err);
+    }
+}
+
+/* Error of a measured width against the plan(s) the pulse may follow */
+static uint32_t width_err(uint32_t measured, uint32_t expected, uint32_t alt, bool either)
+{
+    uint32_t e = (uint32_t)abs((int32_t)(measured - expected));
+
+    if (either) {
+        uint32_t e_alt = (uint32_t)abs((int32_t)(measured - alt));
+
+        e = e_alt < e ? e_alt : e;
+    }
+    return e;
+}
+
+void stress_core_start(stress_checker *c, const stress_plan *plan, uint32_t tol, uint32_t gap)
+{
+    memset(c, 0, sizeof(*c));
+    c->plan = *plan;
+    c->plan.epoch = 0;
+    c->prev_plan = c->plan;
+    c->tol = tol;
+    c->gap = gap;
+}
+
+void stress_core_amplitude_coming(stress_checker *c, uint16_t amplitude)
+{
+    c->amp_next = amplitude;
+    c->amp_coming = true;
+}
+
+void stress_core_amplitude_cancel(stress_checker *c)
+{
+    c->amp_coming = false;
+}
+
+void stress_core_plan(stress_checker *c, const stress_plan *p, bool restart, uint32_t now)
+{
+    c->prev_plan = c->plan;
+    c->plan = *p;
+    c->plan.epoch = c->prev_plan.epoch + 1;
+    c->amp_coming = false;
+    if (restart) {
+        c->w.restart = true;
+        c->w.t_restart = now;
+    }
+    c->w.update_pending = true;
+    c->n.updates++;
+    if (c->w.synced && c->w.next != 0) {
+        c->n.in_pulse++;
+    }
+}
+
+/* Counts the onset at now against the one before; returns when it was due */
+static uint32_t onset_check(stress_checker *c, uint32_t now)
+{
+    uint32_t expected = c->w.restart ? (c->w.t_restart - c->w.t_ref) + c->plan.period : c->plan.period;
+    int32_t err = (int32_t)((now - c->w.t_ref) - expected);
+    uint32_t mag = (uint32_t)abs(err);
+
+    if (err < -(int32_t)c->tol) {
+        c->n.doubled++;
+    } else if (err > (int32_t)(c->plan.period / 2)) {
+        c->n.dropped++;
+    } else if (err > (int32_t)c->tol) {
+        c->n.late++;
+        /* The TIMER kept its period: the next onset is due one period after this one was */
+        now -= (uint32_t)err;
+    }
+    worst(c, c->w.update_pending, mag);
+    return now;
+}
+
+/* Phase 1 may send the amplitude of the plan the pulse started under, of a plan taken since,
+ * or one on its way: the words change just before the plan that carries them */
+static bool amplitude_ok(const stress_checker *c, uint16_t code)
+{
+    const stress_plan *at_onset = (c->w.epoch == c->prev_plan.epoch) ? &c->prev_plan : &c->plan;
+
+    return code == at_onset->amplitude || code == c->plan.amplitude ||
+           (c->amp_coming && code == c->amp_next);
+}
+
+static void pulse_check(stress_checker *c, uint16_t phase2_code)
+{
+    bool either = c->w.epoch != c->plan.epoch;
+    bool update = either || c->w.after_update;
+    uint32_t alt = (c->w.epoch == c->prev_plan.epoch) ? c->prev_plan.pw : c->plan.pw;
+    uint32_t p1 = c->w.t[1] - c->w.t[0];
+    uint32_t p2 = c->w.t[3] - c->w.t[2];
+    uint32_t e1 = width_err(p1, c->plan.pw, alt, either);
+    uint32_t eg = (uint32_t)abs((int32_t)((c->w.t[2] - c->w.t[1]) - c->gap));
+    uint32_t e2 = width_err(p2, c->plan.pw, alt, either);
+    uint32_t e = max_u32(max_u32(e1, e2), eg);
+
+    c->n.pulses++;
+    if (e > c->tol) {
+        c->n.stretched++;
+    }
+    if ((uint32_t)abs((int32_t)(p1 - p2)) > c->tol) {
+        c->n.unbalanced++;
+    }
+    /* Both words are latched at the onset: phase 2 is always phase 1's mirror */
+    if (!c->w.code_ok || phase2_code != dac_mirror(c->w.code)) {
+        c->n.wrong_amplitude++;
+    }
+    worst(c, update, e);
+}
+
+void stress_core_edge(stress_checker *c, uint8_t edge, uint32_t now, uint16_t dac_code)
+{
+    if (edge != c->w.next && c->w.synced) {
+        if (edge == 0) {
+            c->n.dropped++;         // previous pulse never finished
+        } else {
+            c->n.doubled++;         // phase edge without its onset
+            c->w.synced = false;    // wait for the next onset
+            c->w.next = 0;
+            return;
+        }
+    }
+    switch (edge) {
+        case 0:
+            c->w.t_ref = c->w.synced ? onset_check(c, now) : now;
+            c->w.synced = true;
+            c->w.t[0] = now;
+            c->w.epoch = c->plan.epoch;
+            c->w.after_update = c->w.update_pending;
+            c->w.update_pending = false;
+            c->w.restart = false;
+            c->w.next = 1;
+            break;
+        case 1:
+        case 2:
+            if (!c->w.synced) {
+                return;
+            }
+            if (edge == 1) {
+                c->w.code = dac_code;
+                c->w.code_ok = amplitude_ok(c, dac_code);
+            }
+            c->w.t[edge] = now;
+            c->w.next = edge + 1;
+            break;
+        case 3:
+            if (!c->w.synced) {
+                return;
+            }
+            c->w.t[3] = now;
+            pulse_check(c, dac_code);
+            c->w.next = 0;
+            break;
+        default:
+            break;
+    }
+}
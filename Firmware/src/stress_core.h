@@ -0,0 +1,82 @@
+#ifndef STRESS_CORE_H
+#define STRESS_CORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Per-pulse check of the parameter-update stress run (stress.h): the four edge timestamps and
+ * the two DAC words of each biphasic pulse against the plan in effect, with updates landing at
+ * any phase of a pulse. Plain C with no kernel or driver dependencies, so the checker stress.c
+ * runs in the compare ISR is the one Tools/stress_sim.c drives from a simulated engine on the
+ * host.
+ *
+ * Times are measurement-TIMER ticks, modulo 2^32. The caller serializes the calls: stress.c
+ * makes the edge call from the ISR and the others with interrupts locked.
+ */
+
+/* Plan in measurement-TIMER ticks */
+typedef struct {
+    uint32_t period;
+    uint32_t pw;
+    uint16_t amplitude;         // phase-1 DAC word; phase 2 sends its mirror (spi.h DAC_MIRROR)
+    uint32_t epoch;             // set by stress_core_plan()
+} stress_plan;
+
+typedef struct {
+    uint32_t updates;
+    uint32_t in_pulse;          // updates that landed between an onset and its last edge
+    uint32_t pulses;
+    uint32_t dropped;
+    uint32_t doubled;
+    uint32_t stretched;
+    uint32_t unbalanced;
+    uint32_t late;
+    uint32_t wrong_amplitude;   // pulses whose words were not the plan's amplitude and its mirror
+    uint32_t worst_err;         // ticks, pulses no update touched
+    uint32_t worst_update_err;  // ticks, update-induced
+} stress_counts;
+
+typedef struct {
+    stress_plan plan;
+    stress_plan prev_plan;
+    uint32_t tol;
+    uint32_t gap;               // interphase gap (SWITCH_PERIOD)
+    bool amp_coming;            // an amplitude is on its way to the DAC words
+    uint16_t amp_next;
+    struct {
+        bool synced;            // an onset seen since the start
+        uint8_t next;           // edge expected next
+        uint32_t t[4];
+        uint32_t t_ref;         // where this onset was due: a late one does not move the next
+        uint32_t epoch;         // plan epoch at the onset
+        uint16_t code;          // phase-1 word sent
+        bool code_ok;
+        bool after_update;      // this pulse follows an update
+        bool update_pending;    // an update since the onset
+        bool restart;           // ... which restarted the period at t_restart
+        uint32_t t_restart;
+    } w;
+    stress_counts n;
+} stress_checker;
+
+/** Start checking against plan, with tol and the interphase gap in ticks. Clears the counts. */
+void stress_core_start(stress_checker *c, const stress_plan *plan, uint32_t tol, uint32_t gap);
+
+/**
+ * A new amplitude is about to be written to the DAC words, ahead of its stress_core_plan():
+ * pulses in between may already send it. Cleared by the next plan, or by cancel if refused.
+ */
+void stress_core_amplitude_coming(stress_checker *c, uint16_t amplitude);
+void stress_core_amplitude_cancel(stress_checker *c);
+
+/** The engine took plan p; restart: the period restarted at now (rate update). */
+void stress_core_plan(stress_checker *c, const stress_plan *p, bool restart, uint32_t now);
+
+/**
+ * Pulse edge 0-3 at now. dac_code is the word last clocked out to the DAC: phase 1's at
+ * edge 1, phase 2's at edge 3; ignored at the other edges.
+ */
+void stress_core_edge(stress_checker *c, uint8_t edge, uint32_t now, uint16_t dac_code);
+
+#endif /* STRESS_CORE_H */
@@ -0,0 +1,213 @@
+/*
+ * TTL sync-out and stimulation event markers for electrophysiology alignment.
+ * The sync edge is produced by DPPI from the same TIMER compare event that starts phase 1,
+ * and the same event latches the free-running measurement timer, so each marker timestamp
+ * is exact to one measurement tick regardless of ISR latency.
+ */
+#include <nrfx_gpiote.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_gpio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include "sync.h"
+#include "timer.h"
+#include "trigger.h"
+#include "config.h"
+
+#if SYNC_OUT_ENABLE
+
+/* Measurement timer channels: CC1 latched by DPPI at phase 1, CC5 for software reads */
+#define MEAS_CC_MARKER NRF_TIMER_CC_CHANNEL1
+#define MEAS_CC_NOW    NRF_TIMER_CC_CHANNEL5
+
+/* The 32-bit measurement timer wraps every ~268 s at 16 MHz; refresh well within half of that */
+#define TIMEBASE_REFRESH_S 60
+
+/* Timestamps are hardware-latched whenever the stim TIMER starts phase 1 */
+#if defined(CONFIG_BT) || TRIGGER_MODE
+#define SYNC_HW_TIMESTAMP 1
+#else
+#define SYNC_HW_TIMESTAMP 0
+#endif
+
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(TRIGGER_GPIOTE_INST_IDX);
+
+static sync_marker ring[SYNC_MARKER_RING_LEN];
+static atomic_t ring_head;      // written by ISR only
+static atomic_t ring_tail;      // written by reader only
+static atomic_t ring_dropped;
+static uint32_t pulse_index;
+
+#if SYNC_HW_TIMESTAMP
+static uint32_t meas_ticks_per_us;
+static uint64_t timebase_last;  // last extended measurement timer value
+
+/* Extend a 32-bit capture to 64 bits. Captures may arrive slightly out of order
+ * (a deferred marker ISR after a refresh), so only forward steps advance the base. */
+static uint64_t timebase_extend(uint32_t lo)
+{
+    unsigned int key = irq_lock();
+    int32_t delta = (int32_t)(lo - (uint32_t)timebase_last);
+    uint64_t ts = timebase_last + delta;
+    if (delta > 0) {
+        timebase_last = ts;
+    }
+    irq_unlock(key);
+    return ts;
+}
+
+static void timebase_refresh(struct k_timer *timer)
+{
+    ARG_UNUSED(timer);
+    (void)timebase_extend(nrfx_timer_capture(timer_measurement_instance(), MEAS_CC_NOW));
+}
+
+K_TIMER_DEFINE(timebase_timer, timebase_refresh, NULL);
+#endif
+
+static int sync_pin_init(void)
+{
+    uint8_t ch;
+
+    if (!nrfx_gpiote_init_check(&gpiote)) {
+        if (nrfx_gpiote_init(&gpiote, NRFX_GPIOTE_DEFAULT_CONFIG_IRQ_PRIORITY) != NRFX_SUCCESS) {
+            return -EIO;
+        }
+    }
+    if (nrfx_gpiote_channel_alloc(&gpiote, &ch) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    nrfx_gpiote_output_config_t out_cfg = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+    nrfx_gpiote_task_config_t task_cfg = {
+        .task_ch = ch,
+        .polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+        .init_val = NRF_GPIOTE_INITIAL_VALUE_LOW,
+    };
+    if (nrfx_gpiote_output_configure(&gpiote, SYNC_OUT_PIN, &out_cfg, &task_cfg) != NRFX_SUCCESS) {
+        return -EIO;
+    }
+    nrfx_gpiote_out_task_enable(&gpiote, SYNC_OUT_PIN);
+    return 0;
+}
+
+int sync_init(void)
+{
+    nrfx_timer_t const *stim = timer_stim_instance();
+    uint32_t set_task;
+    uint32_t clr_task;
+    int err;
+
+    err = sync_pin_init();
+    if (err) {
+        printf("Sync: GPIOTE setup failed (%d)\n", err);
+        return err;
+    }
+    set_task = nrfx_gpiote_set_task_address_get(&gpiote, SYNC_OUT_PIN);
+    clr_task = nrfx_gpiote_clr_task_address_get(&gpiote, SYNC_OUT_PIN);
+
+#if SYNC_HW_TIMESTAMP
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    if (!nrfx_timer_is_enabled(meas)) {
+        measurement_timer_init();
+    }
+    meas_ticks_per_us = NRF_TIMER_BASE_FREQUENCY_GET(meas->p_reg) / 1000000u;
+    uint32_t capture_task = nrfx_timer_capture_task_address_get(meas, MEAS_CC_MARKER);
+#endif
+
+#if TRIGGER_MODE
+    /* COMPARE0/1 already publish to the trigger channels; subscribe to them */
+    nrfx_gppi_fork_endpoint_setup(trigger_onset_channel(), set_task);
+    nrfx_gppi_fork_endpoint_setup(trigger_onset_channel(), capture_task);
+    nrfx_gppi_fork_endpoint_setup(trigger_shunt_channel(), clr_task);
+#else
+    uint8_t ch_high;
+    uint8_t ch_low;
+    if (nrfx_gppi_channel_alloc(&ch_low) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    nrfx_gppi_channel_endpoints_setup(ch_low,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL1), clr_task);
+    nrfx_gppi_channels_enable(BIT(ch_low));
+#if defined(CONFIG_BT)
+    if (nrfx_gppi_channel_alloc(&ch_high) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    nrfx_gppi_channel_endpoints_setup(ch_high,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL0), set_task);
+    nrfx_gppi_fork_endpoint_setup(ch_high, capture_task);
+    nrfx_gppi_channels_enable(BIT(ch_high));
+#else
+    ARG_UNUSED(ch_high);
+#endif
+#endif
+
+#if SYNC_HW_TIMESTAMP
+    k_timer_start(&timebase_timer, K_SECONDS(TIMEBASE_REFRESH_S), K_SECONDS(TIMEBASE_REFRESH_S));
+#endif
+    printf("Sync out on P%d.%02d, %u marker ring\n",
+           (SYNC_OUT_PIN >> 5), (SYNC_OUT_PIN & 0x1F), SYNC_MARKER_RING_LEN);
+    return 0;
+}
+
+void sync_out_onset(void)
+{
+    nrfx_gpiote_set_task_trigger(&gpiote, SYNC_OUT_PIN);
+}
+
+void sync_out_abort(void)
+{
+    nrfx_gpiote_clr_task_trigger(&gpiote, SYNC_OUT_PIN);
+}
+
+void sync_marker_log(void)
+{
+    uint32_t head = atomic_get(&ring_head);
+    uint64_t ts_ns;
+
+#if SYNC_HW_TIMESTAMP
+    uint32_t lo = nrfx_timer_capture_get(timer_measurement_instance(), MEAS_CC_MARKER);
+    ts_ns = timebase_extend(lo) * 1000u / meas_ticks_per_us;
+#else
+    ts_ns = k_cyc_to_ns_floor64(k_cycle_get_64());
+#endif
+
+    if (head - (uint32_t)atomic_get(&ring_tail) >= SYNC_MARKER_RING_LEN) {
+        atomic_inc(&ring_dropped);
+    } else {
+        sync_marker *m = &ring[head & (SYNC_MARKER_RING_LEN - 1)];
+        m->pulse_index = pulse_index;
+        m->timestamp_ns = ts_ns;
+        atomic_set(&ring_head, head + 1);
+    }
+    pulse_index++;
+}
+
+uint16_t sync_marker_peek(sync_marker *out, uint16_t max)
+{
+    uint32_t tail = atomic_get(&ring_tail);
+    uint32_t avail = (uint32_t)atomic_get(&ring_head) - tail;
+    uint16_t n = MIN(avail, max);
+
+    for (uint16_t i = 0; i < n; i++) {
+        out[i] = ring[(tail + i) & (SYNC_MARKER_RING_LEN - 1)];
+    }
+    return n;
+}
+
+void sync_marker_consume(uint16_t n)
+{
+    atomic_add(&ring_tail, n);
+}
+
+uint32_t sync_marker_dropped(void)
+{
+    return atomic_get(&ring_dropped);
+}
+
+uint32_t sync_pulse_count(void)
+{
+    return pulse_index;
+}
+
+#endif /* SYNC_OUT_ENABLE */
@@ -0,0 +1,51 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stdint.h>
+#include <zephyr/toolchain.h>
+#include <hal/nrf_gpio.h>
+
+/* TTL sync-out to the recording system: high for the duration of phase 1 of every pulse */
+#define SYNC_OUT_PIN NRF_GPIO_PIN_MAP(1, 5)
+
+/* Marker ring depth (power of two). 12 bytes per marker. */
+#define SYNC_MARKER_RING_LEN 256
+
+/* One stimulation event marker, as sent over BLE */
+typedef struct __packed {
+    uint32_t pulse_index;     // pulses since boot, starting at 0
+    uint64_t timestamp_ns;    // phase 1 onset, ns since timebase start
+} sync_marker;
+
+/**
+ * Configure SYNC_OUT_PIN as a GPIOTE task pin and route it through DPPI:
+ *  phase 1 compare event -> sync high, measurement timer capture
+ *  COMPARE1 (end of phase 1) -> sync low
+ * In RTC mode phase 1 is started by software, so the rising edge is set from
+ * timer_do_event0() instead. Call after timer_init() (and trigger_init() in TRIGGER_MODE).
+ */
+int sync_init(void);
+
+/** RTC mode only: rising sync edge, issued next to the phase 1 switch write. */
+void sync_out_onset(void);
+
+/**
+ * Sync low now: a pulse stopped after its onset (charge limiter safe stop) has no COMPARE1
+ * to clear it. The pin is GPIOTE-owned, so through its CLR task. ISR safe.
+ */
+void sync_out_abort(void);
+
+/** Append a marker for the pulse that just started. ISR context, O(1). */
+void sync_marker_log(void);
+
+/** Copy up to max markers from the ring without removing them. Returns count copied. */
+uint16_t sync_marker_peek(sync_marker *out, uint16_t max);
+
+/** Drop n markers previously returned by sync_marker_peek(). */
+void sync_marker_consume(uint16_t n);
+
+/** Markers lost because the ring was full, and pulses logged in total. */
+uint32_t sync_marker_dropped(void);
+uint32_t sync_pulse_count(void);
+
+#endif /* SYNC_H */
@@ -0,0 +1,199 @@
+/*
+ * Broadcast telemetry over periodic advertising. The payload is rebuilt from counters other
+ * modules already keep, on the system workqueue, and handed to the controller, which then
+ * repeats it on every periodic event without waking the application core.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/gap.h>
+#include <zephyr/sys/byteorder.h>
+#include "telemetry.h"
+#include "BLE.h"
+#include "data.h"
+#include "timer.h"
+#include "deadline.h"
+#include "stim_store.h"
+#include "sched.h"
+#include "charge_limit.h"
+#include "config.h"
+
+#if TELEMETRY_ACTIVE
+
+#if !defined(CONFIG_BT_PER_ADV)
+#error "TELEMETRY_ENABLE needs periodic advertising: merge prj_telemetry.conf"
+#endif
+
+/* Periodic interval in 1.25 ms units, extended advertising interval in 0.625 ms units */
+#define TELEM_PER_INT (CONFIG_TELEM_INTERVAL_MS * 4u / 5u)
+#define TELEM_EXT_INT (CONFIG_TELEM_EXT_INTERVAL_MS * 8u / 5u)
+
+static struct bt_le_ext_adv *adv;
+static struct k_work_delayable update_work;
+static uint16_t update_ms = CONFIG_TELEM_UPDATE_MS;
+static bool running;
+static telem_payload payload;
+static uint32_t last_pulses;
+
+static const struct bt_data ext_ad[] = {
+    BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
+};
+
+static const struct bt_data per_ad[] = {
+    BT_DATA(BT_DATA_MANUFACTURER_DATA, &payload, sizeof(payload)),
+};
+
+static void payload_build(void)
+{
+    uint32_t pulses = timer_pulse_count();
+    uint32_t overruns = 0;
+    uint32_t resets = 0;
+    uint8_t flags = 0;
+
+    if (pulses != last_pulses) {
+        flags |= TELEM_FLAG_RUNNING;
+    }
+    last_pulses = pulses;
+    if (current_conn) {
+        flags |= TELEM_FLAG_CONNECTED;
+    }
+#if DEADLINE_ACTIVE
+    deadline_stats dl;
+
+    get_deadline_stats(&dl);
+    overruns = dl.overruns + dl.missed;
+    resets = dl.wdt_resets + dl.fatal_resets;
+    if (overruns) {
+        flags |= TELEM_FLAG_OVERRUN;
+    }
+    if (resets) {
+        flags |= TELEM_FLAG_RESET;
+    }
+#endif
+#if STIM_STORE_ACTIVE
+    stim_boot_info boot;
+
+    get_stim_boot_info(&boot);
+    if (boot.source == STIM_BOOT_RESTORED) {
+        flags |= TELEM_FLAG_RESTORED;
+    }
+#endif
+#if TRIGGER_MODE
+    flags |= TELEM_FLAG_TRIGGER;
+#endif
+#if MULTICHANNEL_ACTIVE
+    flags |= TELEM_FLAG_MULTICH;
+#endif
+#if CHARGE_LIMIT_ACTIVE
+    charge_limit_stats cl;
+
+    get_charge_limit_stats(&cl);
+    if (cl.stopped) {
+        flags |= TELEM_FLAG_LIMIT;
+    }
+#endif
+
+    payload.company_id = sys_cpu_to_le16(TELEM_COMPANY_ID);
+    payload.version = TELEM_VERSION;
+    payload.seq++;
+    payload.flags = flags;
+    payload.amplitude = sys_cpu_to_le16(settings.DAC_amplitude);
+    payload.pulse_width_us = sys_cpu_to_le16(settings.pulse_width);
+    payload.frequency_hz = sys_cpu_to_le16(settings.frequency);
+    payload.pulses = sys_cpu_to_le32(pulses);
+    payload.uptime_s = sys_cpu_to_le32((uint32_t)(k_uptime_get() / 1000));
+    payload.overruns = sys_cpu_to_le16(MIN(overruns, UINT16_MAX));
+    payload.resets = MIN(resets, UINT8_MAX);
+}
+
+static void update_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    if (!running) {
+        return;
+    }
+    payload_build();
+    int err = bt_le_per_adv_set_data(adv, per_ad, ARRAY_SIZE(per_ad));
+
+    if (err) {
+        printf("Telemetry: payload update failed (err %d)\n", err);
+    }
+    k_work_reschedule(&update_work, K_MSEC(update_ms));
+}
+
+static int telemetry_run(void)
+{
+    int err;
+
+    payload_build();
+    err = bt_le_per_adv_set_data(adv, per_ad, ARRAY_SIZE(per_ad));
+    if (!err) {
+        err = bt_le_ext_adv_start(adv, BT_LE_EXT_ADV_START_DEFAULT);
+    }
+    if (!err) {
+        err = bt_le_per_adv_start(adv);
+    }
+    if (err) {
+        printf("Telemetry: start failed (err %d)\n", err);
+        return err;
+    }
+    running = true;
+    k_work_reschedule(&update_work, K_MSEC(update_ms));
+    return 0;
+}
+
+int telemetry_start(void)
+{
+    int err;
+
+    k_work_init_delayable(&update_work, update_work_handler);
+    err = bt_le_ext_adv_create(BT_LE_ADV_PARAM(BT_LE_ADV_OPT_EXT_ADV, TELEM_EXT_INT,
+                                               TELEM_EXT_INT, NULL), NULL, &adv);
+    if (err) {
+        printf("Telemetry: no advertising set (err %d)\n", err);
+        return err;
+    }
+    err = bt_le_ext_adv_set_data(adv, ext_ad, ARRAY_SIZE(ext_ad), NULL, 0);
+    if (!err) {
+        err = bt_le_per_adv_set_param(adv, BT_LE_PER_ADV_PARAM(TELEM_PER_INT, TELEM_PER_INT,
+                                                               BT_LE_PER_ADV_OPT_NONE));
+    }
+    if (err) {
+        printf("Telemetry: advertising set config failed (err %d)\n", err);
+        return err;
+    }
+    err = telemetry_run();
+    if (!err) {
+        printf("Telemetry: periodic advertising every %u ms, payload update every %u ms\n",
+               CONFIG_TELEM_INTERVAL_MS, update_ms);
+    }
+    return err;
+}
+
+int telemetry_set(bool enable, uint16_t new_update_ms)
+{
+    if (new_update_ms != 0) {
+        if (new_update_ms < CONFIG_TELEM_INTERVAL_MS) {
+            return -EINVAL;
+        }
+        update_ms = new_update_ms;
+    }
+    if (adv == NULL) {
+        return -ENODEV;
+    }
+    if (enable == running) {
+        if (running) {
+            k_work_reschedule(&update_work, K_MSEC(update_ms));
+        }
+        return 0;
+    }
+    if (enable) {
+        return telemetry_run();
+    }
+    running = false;
+    k_work_cancel_delayable(&update_work);
+    (void)bt_le_per_adv_stop(adv);
+    return bt_le_ext_adv_stop(adv);
+}
+
+#endif /* TELEMETRY_ACTIVE */
@@ -0,0 +1,63 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/toolchain.h>
+#include <zephyr/sys/util.h>
+#include "config.h"
+
+/* Periodic advertising needs the host; the BLE build also needs prj_telemetry.conf merged in */
+#if TELEMETRY_ENABLE && defined(CONFIG_BT)
+#define TELEMETRY_ACTIVE 1
+#else
+#define TELEMETRY_ACTIVE 0
+#endif
+
+/*
+ * Connectionless status. A second advertising set runs beside the connectable NUS
+ * advertising: non-connectable extended advertising carrying the device name, with a
+ * periodic advertising train whose manufacturer-specific data is a telem_payload. One scanner
+ * synced to each device's train can watch a whole rack without connecting to any of them.
+ *
+ * Current cost: one periodic event every CONFIG_TELEM_INTERVAL_MS plus one extended
+ * advertising event every CONFIG_TELEM_EXT_INTERVAL_MS (each roughly
+ * CONFIG_ENERGY_RADIO_EVENT_NC). The payload is rebuilt every CONFIG_TELEM_UPDATE_MS.
+ */
+#define TELEM_COMPANY_ID 0xFFFFu    // no assigned company identifier (Bluetooth SIG test value)
+#define TELEM_VERSION    1u
+
+#define TELEM_FLAG_RUNNING   BIT(0)   // pulses were delivered since the previous update
+#define TELEM_FLAG_CONNECTED BIT(1)   // a central holds the NUS connection
+#define TELEM_FLAG_OVERRUN   BIT(2)   // deadline monitor saw an edge overrun or a missed compare
+#define TELEM_FLAG_RESET     BIT(3)   // watchdog or fatal-error reset since power-on
+#define TELEM_FLAG_RESTORED  BIT(4)   // plan restored from flash at boot (not the defaults)
+#define TELEM_FLAG_TRIGGER   BIT(5)   // trigger mode build
+#define TELEM_FLAG_MULTICH   BIT(6)   // multichannel build
+#define TELEM_FLAG_LIMIT     BIT(7)   // charge limiter holds a safe stop
+
+/* Little-endian, 24 bytes */
+typedef struct __packed {
+    uint16_t company_id;        // TELEM_COMPANY_ID
+    uint8_t version;            // TELEM_VERSION
+    uint8_t seq;                // increments per payload update
+    uint8_t flags;              // TELEM_FLAG_*
+    uint16_t amplitude;         // applied setting (channel 0 in multichannel builds)
+    uint16_t pulse_width_us;
+    uint16_t frequency_hz;
+    uint32_t pulses;            // completed biphasic pulses since boot
+    uint32_t uptime_s;
+    uint16_t overruns;          // deadline overruns + missed compares, saturating
+    uint8_t resets;             // watchdog + fatal-error resets since power-on, saturating
+} telem_payload;
+
+/** Create the advertising set and start the periodic train. Call once BLE is up. */
+int telemetry_start(void);
+
+/**
+ * Turn the broadcast on or off and set the payload update period in ms (0 keeps the current
+ * one). Returns -EINVAL for periods under CONFIG_TELEM_INTERVAL_MS.
+ */
+int telemetry_set(bool enable, uint16_t update_ms);
+
+#endif /* TELEMETRY_H */
@@ -4,33 +4,29 @@
 #include <hal/nrf_gpio.h>
 #include "timer.h"
 #include "spi.h"
+#include "trigger.h"
+#include "sync.h"
+#include "stochastic.h"
+#include "boot_time.h"
+#include "stim_pins.h"
+#include "deadline.h"
+#include "isr_cycles.h"
+#include "sched.h"
+#include "stim_pll.h"
+#include "charge_limit.h"
+#include "clock_policy.h"
+#include "stress.h"
+#include "flpr_seq.h"
 #include "config.h"
 
-#if defined(CONFIG_SOC_NRF5340_CPUAPP)
-/* Re-apply P1.00/P1.01 MCUSEL to App before each use; network/pinctrl can overwrite. */
-static void p1_mcu_select_app_sync(void)
-{
-#if defined(NRF_P1)
-	NRF_GPIO_Type *p1 = NRF_P1;
-#elif defined(NRF_GPIO1)
-	NRF_GPIO_Type *p1 = NRF_GPIO1;
-#else
-#error "Need NRF_P1 or NRF_GPIO1 for P1 MCUSEL"
-#endif
-	uint32_t msk = 3u << 16;
-	uint32_t app = 1u << 16;
-	uint32_t c0 = p1->PIN_CNF[0] & ~msk;
-	uint32_t c1 = p1->PIN_CNF[1] & ~msk;
-	p1->PIN_CNF[0] = c0 | app;
-	p1->PIN_CNF[1] = c1 | app;
-}
-#endif
+static uint32_t timer_freq_hz = 0;      // stim TIMER tick rate at the current prescaler
 
-static uint32_t timer_freq_hz = 0;  
+/* TIMER PRESCALER field: f = base / 2^n */
+#define TIMER_PRESCALER_MAX 9u
+#if MEASURE_TIMER
 static uint32_t main_event_time = 0;
-static uint32_t event1_time = 0;
-static uint32_t event2_time = 0;
-static uint32_t event3_time = 0;
+static uint32_t prev_main_event_time = 0;
+#endif
 
 static atomic_t counter;            // test variable to record how many times the timer handler has been called 
 static atomic_t error;
@@ -39,13 +35,63 @@ static atomic_t event2_error_max;
 static atomic_t event3_error_max;
 static atomic_t event0_error_counter;
 static atomic_t event0_error_max;
-static uint32_t prev_main_event_time = 0;
+static atomic_t pulse_count;         // completed biphasic pulses
 static nrfx_timer_t measurement_timer = NRFX_TIMER_INSTANCE(1); // Use a separate timer for measurements
 static nrfx_timer_t timer_inst = NRFX_TIMER_INSTANCE(TIMER_INST_IDX);; // Timer instance for the main timer
 static uint32_t current_period_us = DEFAULT_STIM_PERIOD;
+static uint64_t current_period_ns = DEFAULT_STIM_PERIOD * 1000ull;
+static uint32_t current_rate_mhz = 1000000000u / DEFAULT_STIM_PERIOD;
+static uint32_t current_period_ticks;   // CC0 of the BLE engine, whole ticks
+static uint32_t current_period_frac;    // fractional tick, Q16, dithered at COMPARE0
+static uint32_t period_frac_acc;
 static uint32_t current_pulse_width_us = DEFAULT_PULSE_WIDTH;
+/* DAC words of the pulse running, latched from the committed amplitude at its onset so both
+ * phases use one amplitude. In RAM, not const: SPIM EasyDMA cannot read flash. */
+static uint8_t dac_phase1_tx[DAC_TX_LEN];
+static uint8_t dac_phase2_tx[DAC_TX_LEN];
 static void timer_handler(nrf_timer_event_t event_type, void * p_context);
 
+uint16_t timer_dac_latch(void) {
+    dac_words_get(dac_phase1_tx, dac_phase2_tx);
+    return ((uint16_t)dac_phase1_tx[0] << 8) | dac_phase1_tx[1];
+}
+
+#if TRIGGER_MODE
+void timer_dac_preload(void) {
+    (void)timer_dac_latch();
+    spi_write_dac1(dac_phase1_tx, dac1_buf_rx);
+}
+#endif
+
+nrfx_timer_t const *timer_stim_instance(void) {
+    return &timer_inst;
+}
+
+nrfx_timer_t const *timer_measurement_instance(void) {
+    return &measurement_timer;
+}
+
+#if TRIGGER_MODE
+/* Trigger-mode compare layout: onset on CC0 one tick after START, phases relative to it,
+ * period on CC5 (clears the timer so the next pulse of a train lands on CC0 again).
+ * CC1 has no interrupt: the end of phase 1 is done entirely by DPPI. */
+static void trigger_compare_setup(uint32_t pulse_width_us, uint32_t period_us)
+{
+    uint32_t onset = TRIGGER_ONSET_TICKS;
+    uint32_t e1 = onset + nrfx_timer_us_to_ticks(&timer_inst, pulse_width_us);
+    uint32_t e2 = onset + nrfx_timer_us_to_ticks(&timer_inst, pulse_width_us + SWITCH_PERIOD);
+    uint32_t e3 = onset + nrfx_timer_us_to_ticks(&timer_inst, 2 * pulse_width_us + SWITCH_PERIOD);
+
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL0, onset, true);
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, e1, false);
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL2, e2, true);
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL3, e3, true);
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL5,
+        nrfx_timer_us_to_ticks(&timer_inst, period_us),
+        NRF_TIMER_SHORT_COMPARE5_CLEAR_MASK, false);
+}
+#endif
+
 void get_error_data(error_data *data) {
     data->event1_max = atomic_get(&event1_error_max);
     data->event2_max = atomic_get(&event2_error_max);
@@ -56,34 +102,193 @@ void get_error_data(error_data *data) {
     data->mycounter = atomic_get(&counter);
 }
 
+/* Phase edges on CC1-CC3, in ticks at the current prescaler. Returns the CC1 ticks. */
+static uint32_t phase_compare_setup(uint32_t pulse_width_us)
+{
+    // Calculate new positions for channels 1 and 3
+    // Channel 1: pulse_width after channel 0 (end of first pulse)
+    uint32_t channel1_ticks = nrfx_timer_us_to_ticks(&timer_inst, pulse_width_us);
+    
+    // Channel 2 stays at its current position
+    uint32_t channel2_us = pulse_width_us + SWITCH_PERIOD;
+    uint32_t channel2_ticks = nrfx_timer_us_to_ticks(&timer_inst, channel2_us);
+    
+    // Channel 3: pulse_width after channel 2 (end of second pulse)
+    uint32_t channel3_us = channel2_us + pulse_width_us;
+    uint32_t channel3_ticks = nrfx_timer_us_to_ticks(&timer_inst, channel3_us);
+    
+    // Update the compare values
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, channel1_ticks, true);
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL3, channel3_ticks, true);
+    
+    // Also need to make sure channel 2 is still at the right position
+    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL2, channel2_ticks, true);
+    
+    return channel1_ticks;
+}
+
+#if defined(CONFIG_BT)
+#define PULSE_GAP_POLL_US 5u
+
+/* Continuous engine: a pulse runs from its onset to its COMPARE3. A restart clears the TIMER,
+ * so CC1-CC3 come before the next CC0 and would replay the phase edges without a phase 1;
+ * they are masked until that onset. */
+static volatile bool pulse_open;
+static volatile bool phase_edges_masked;
+
+/* Returns with IRQs locked in the gap between two pulses, so an update never moves the edges
+ * of the pulse running. Gives up after one pulse length: a stop can leave a pulse open. */
+static unsigned int timer_lock_between_pulses(uint32_t pulse_width_us)
+{
+    uint32_t wait_us = 2u * pulse_width_us + SWITCH_PERIOD;
+
+    for (;;) {
+        unsigned int key = irq_lock();
+        if (!pulse_open || wait_us == 0u) {
+            return key;
+        }
+        irq_unlock(key);
+        k_busy_wait(PULSE_GAP_POLL_US);
+        wait_us = wait_us > PULSE_GAP_POLL_US ? wait_us - PULSE_GAP_POLL_US : 0u;
+    }
+}
+#endif
+
+/* Smallest prescaler at which the period fits the 32-bit TIMER: the finest resolution. Only
+ * very long periods (or a 128 MHz TIMER) ever leave prescaler 0. */
+static uint32_t timer_prescaler_for(uint64_t period_ns)
+{
+    uint32_t base = NRF_TIMER_BASE_FREQUENCY_GET(timer_inst.p_reg);
+    uint32_t prescaler = 0;
+
+    while (prescaler < TIMER_PRESCALER_MAX &&
+           period_ns * (base >> prescaler) / 1000000000u > UINT32_MAX) {
+        prescaler++;
+    }
+    return prescaler;
+}
+
+/* Slowest rate the engine can time. In the BLE engine the pulse watchdog is fed once per
+ * pulse, so the period has to stay clear of its timeout; the RTC engine feeds it between
+ * the wraps of a long period. */
+static uint32_t timer_rate_min_mhz(void)
+{
+#if DEADLINE_ACTIVE && defined(CONFIG_BT)
+    return MAX(STIM_RATE_MIN_MHZ, 1000000u / (DEADLINE_WDT_MS - 500u) + 1u);
+#else
+    return STIM_RATE_MIN_MHZ;
+#endif
+}
+
+int timer_plan_check(uint32_t rate_mhz, uint16_t pulse_width_us) {
+    if (rate_mhz < timer_rate_min_mhz() || rate_mhz > STIM_RATE_MAX_MHZ ||
+        STIM_RATE_TO_PERIOD_NS(rate_mhz) < TIMER_MIN_PERIOD_US(pulse_width_us) * 1000ull) {
+        return -ERANGE;
+    }
+    return 0;
+}
+
 void update_stim_frequency(uint16_t frequency_hz) {
     if (frequency_hz == 0) {
         printf("Invalid frequency: 0 Hz\n");
         return;
     }
-    
-    // Calculate period in microseconds from frequency in Hz
-    uint32_t period_us = 1000000 / frequency_hz;
-    current_period_us = period_us;
-    
-    // Convert to timer ticks
-    uint32_t period_ticks = nrfx_timer_us_to_ticks(&timer_inst, period_us);
+    (void)update_stim_rate_mhz(frequency_hz * 1000u);
+}
+
+int update_stim_rate_mhz(uint32_t rate_mhz) {
+    if (rate_mhz < timer_rate_min_mhz() || rate_mhz > STIM_RATE_MAX_MHZ) {
+        printf("Invalid rate: %lu mHz (%lu..%u mHz)\n", rate_mhz, timer_rate_min_mhz(),
+               STIM_RATE_MAX_MHZ);
+        return -ERANGE;
+    }
+#if TRIGGER_MODE
+    /* CC5 would clear the timer before CC3 and restart the pulse it cuts */
+    if (STIM_RATE_TO_PERIOD_NS(rate_mhz) < TIMER_MIN_PERIOD_US(current_pulse_width_us) * 1000ull) {
+        printf("Invalid train period: %lu mHz is shorter than a %lu us pulse\n", rate_mhz,
+               current_pulse_width_us);
+        return -ERANGE;
+    }
+#endif
+
+    // Period in ns from the rate in mHz; us kept for the engines that schedule in us
+    uint64_t period_ns = STIM_RATE_TO_PERIOD_NS(rate_mhz);
+    current_rate_mhz = rate_mhz;
+    current_period_ns = period_ns;
+    current_period_us = (uint32_t)((period_ns + 500u) / 1000u);
+
+#if MULTICHANNEL_ACTIVE
+    /* Timer is owned by the multichannel plan (sched_set_channel) */
+    return 0;
+#endif
+
+#if TRIGGER_MODE
+    /* Only the spacing of pulses within a triggered train; never start the timer here */
+    trigger_compare_setup(current_pulse_width_us, current_period_us);
+    printf("Trigger train period updated to %lu us (%lu mHz)\n", current_period_us, rate_mhz);
+    return 0;
+#endif
+
+#if FLPR_SEQ_ACTIVE
+    /* The FLPR times the pulses; the stim TIMER stays stopped */
+    flpr_seq_set_rate(rate_mhz);
+    printf("Timer rate updated to %lu mHz (period: %llu ns, FLPR sequencer)\n", rate_mhz, period_ns);
+    return 0;
+#endif
 
     //LEE ADDING CODE *************************************************************************************************************************
     //Clear the TIMER to stop missing compare events
+#if defined(CONFIG_BT)
+    unsigned int gap_key = timer_lock_between_pulses(current_pulse_width_us);
+#endif
     nrfx_timer_disable(&timer_inst);
     nrfx_timer_clear(&timer_inst);
+#if defined(CONFIG_BT)
+    /* An onset raised but not yet handled is dropped: the new period starts at the clear */
+    for (uint8_t cc = NRF_TIMER_CC_CHANNEL0; cc <= NRF_TIMER_CC_CHANNEL3; cc++) {
+        nrf_timer_event_clear(timer_inst.p_reg, nrf_timer_compare_event_get(cc));
+    }
+    pulse_open = false;
+    phase_edges_masked = true;
+    irq_unlock(gap_key);
+#endif
+#if DEADLINE_ACTIVE
+    deadline_resync();
+#endif
     //LEE DONE ADDING CODE*************************************************************************************************************************
 
+    // Tick rate for this period; phase edges move with it
+    uint32_t prescaler = timer_prescaler_for(period_ns);
+    if (prescaler != nrf_timer_prescaler_get(timer_inst.p_reg)) {
+        nrf_timer_prescaler_set(timer_inst.p_reg, prescaler);
+        timer_freq_hz = NRF_TIMER_BASE_FREQUENCY_GET(timer_inst.p_reg) >> prescaler;
+        phase_compare_setup(current_pulse_width_us);
+    }
+
+    // Convert to whole + Q16 fractional ticks; COMPARE0 dithers the fraction
+    uint64_t prod = period_ns * timer_freq_hz;
+    uint32_t period_ticks = (uint32_t)(prod / 1000000000u);
+    unsigned int key = irq_lock();
+    current_period_ticks = period_ticks;
+    current_period_frac = (uint32_t)(((prod % 1000000000u) << 16) / 1000000000u);
+    period_frac_acc = 0;
+    irq_unlock(key);
+
     // Update channel 0 compare value
     // Note: We keep the SHORT to clear on compare to maintain periodic operation
     nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL0, period_ticks, 
         NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
+#if STIM_PLL_ACTIVE
+    stim_pll_resync(period_ticks);
+#endif
 
     //LEE STILL ADDING CODE*************************************************************************************************************************
     //Start the timer again
     nrfx_timer_enable(&timer_inst);
     //LEE DONE ADDING CODE*************************************************************************************************************************
+#if STRESS_ACTIVE
+    stress_plan_update(true);
+#endif
 
     // Also update the measurement timer expectations if needed
     if (MEASURE_TIMER == 1) {
@@ -97,8 +302,50 @@ void update_stim_frequency(uint16_t frequency_hz) {
         atomic_set(&event3_error_max,0);
     }
     
-    printf("Timer frequency updated to %u Hz (period: %lu us, ticks: %lu)\n", 
-           frequency_hz, period_us, period_ticks);
+    printf("Timer rate updated to %lu mHz (period: %llu ns, ticks: %lu + %lu/65536, prescaler %lu)\n",
+           rate_mhz, period_ns, period_ticks, current_period_frac, prescaler);
+    return 0;
+}
+
+void timer_restore_period(void) {
+#if TRIGGER_MODE
+    uint32_t period_ticks = nrfx_timer_us_to_ticks(&timer_inst, current_period_us);
+    nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL5, period_ticks);
+#else
+    nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, current_period_ticks);
+#endif
+}
+
+uint32_t timer_get_rate_mhz(void) {
+    return current_rate_mhz;
+}
+
+uint64_t timer_get_period_ns(void) {
+    return current_period_ns;
+}
+
+uint32_t timer_stim_tick_hz(void) {
+    return timer_freq_hz;
+}
+
+uint32_t timer_get_pulse_width_us(void) {
+    return current_pulse_width_us;
+}
+
+uint32_t timer_get_period_us(void) {
+    return current_period_us;
+}
+
+uint32_t timer_pulse_count(void) {
+#if FLPR_SEQ_ACTIVE
+    return flpr_seq_pulse_count();
+#else
+    return (uint32_t)atomic_get(&pulse_count);
+#endif
+}
+
+void timer_pulse_done(void) {
+    atomic_inc(&pulse_count);
 }
 
 void update_pulse_width(uint16_t pulse_width_us) {
@@ -107,27 +354,47 @@ void update_pulse_width(uint16_t pulse_width_us) {
         return;
     }
     
+#if TRIGGER_MODE
+    if (current_period_us < TIMER_MIN_PERIOD_US(pulse_width_us)) {
+        printf("Invalid pulse width: %u us does not fit the %lu us train period\n", pulse_width_us,
+               current_period_us);
+        return;
+    }
+#endif
+#if defined(CONFIG_BT)
+    uint32_t running_width_us = current_pulse_width_us;
+#endif
     current_pulse_width_us = pulse_width_us;
+
+#if TRIGGER_MODE
+    trigger_compare_setup(pulse_width_us, current_period_us);
+    printf("Pulse width updated to %u us (trigger mode)\n", pulse_width_us);
+    return;
+#elif MULTICHANNEL_ACTIVE
+    return;
+#elif FLPR_SEQ_ACTIVE
+    flpr_seq_set_pulse_width(pulse_width_us);
+    printf("Pulse width updated to %u us (FLPR sequencer)\n", pulse_width_us);
+    return;
+#endif
     
-    // Calculate new positions for channels 1 and 3
-    // Channel 1: pulse_width after channel 0 (end of first pulse)
-    uint32_t channel1_ticks = nrfx_timer_us_to_ticks(&timer_inst, pulse_width_us);
-    
-    // Channel 2 stays at its current position
     uint32_t channel2_us = pulse_width_us + SWITCH_PERIOD;
-    uint32_t channel2_ticks = nrfx_timer_us_to_ticks(&timer_inst, channel2_us);
-    
-    // Channel 3: pulse_width after channel 2 (end of second pulse)
     uint32_t channel3_us = channel2_us + pulse_width_us;
-    uint32_t channel3_ticks = nrfx_timer_us_to_ticks(&timer_inst, channel3_us);
-    
-    // Update the compare values
-    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, channel1_ticks, true);
-    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL3, channel3_ticks, true);
-    
-    // Also need to make sure channel 2 is still at the right position
-    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL2, channel2_ticks, true);
-    
+#if DEADLINE_ACTIVE
+    deadline_resync();
+#endif
+#if defined(CONFIG_BT)
+    /* Between pulses: rewritten mid-pulse, a CC below the count would lose its edge */
+    unsigned int gap_key = timer_lock_between_pulses(running_width_us);
+    uint32_t channel1_ticks = phase_compare_setup(pulse_width_us);
+    irq_unlock(gap_key);
+#else
+    uint32_t channel1_ticks = phase_compare_setup(pulse_width_us);
+#endif
+#if STRESS_ACTIVE
+    stress_plan_update(false);
+#endif
+
     printf("Pulse width updated to %u us (ticks: %lu)\n", pulse_width_us, channel1_ticks);
     printf("Channel 1 at %u us, Channel 2 at %lu us, Channel 3 at %lu us\n", 
            pulse_width_us, channel2_us, channel3_us);
@@ -150,7 +417,21 @@ void timer_init(void)
         printf("Timer initialization failed with error: %d\n", status);
     }
 
-#if defined(CONFIG_BT)
+#if TRIGGER_MODE
+    /* Trigger mode: timer stays stopped until a trigger edge starts it through DPPI */
+    current_pulse_width_us = CONFIG_PULSE_WIDTH_US;
+    current_period_us = 1000000u / CONFIG_STIM_FREQUENCY_HZ;
+    trigger_compare_setup(current_pulse_width_us, current_period_us);
+    printf("Timer status: stopped (external trigger)\n");
+#elif MULTICHANNEL_ACTIVE
+    /* Multichannel: free-running, one compare per plan edge; started by sched_init() */
+    current_pulse_width_us = CONFIG_PULSE_WIDTH_US;
+    printf("Timer status: stopped (multichannel plan)\n");
+#elif FLPR_SEQ_ACTIVE
+    /* FLPR sequencer: the plan goes to the mailbox; started by flpr_seq_init() */
+    current_pulse_width_us = DEFAULT_PULSE_WIDTH;
+    printf("Timer status: stopped (FLPR sequencer)\n");
+#elif defined(CONFIG_BT)
     /* BLE mode: continuous timer, period on CC0, clear on compare */
     current_pulse_width_us = DEFAULT_PULSE_WIDTH;
     uint32_t event1_ticks = nrfx_timer_us_to_ticks(&timer_inst, DEFAULT_PULSE_WIDTH);
@@ -168,8 +449,11 @@ void timer_init(void)
     printf("Timer status: %s (BLE continuous)\n",
         nrfx_timer_is_enabled(&timer_inst) ? "enabled" : "disabled");
 #else
-    /* RTC low-power mode: timer not started; started per period from rtc_stim */
+    /* RTC low-power mode: timer not started; started per period from rtc_stim and stopped
+     * by hardware after the last phase edge */
     current_pulse_width_us = CONFIG_PULSE_WIDTH_US;
+    phase_compare_setup(current_pulse_width_us);
+    nrf_timer_shorts_enable(timer_inst.p_reg, NRF_TIMER_SHORT_COMPARE3_STOP_MASK);
     printf("Timer status: one-shot (RTC-driven)\n");
 #endif
 }
@@ -177,33 +461,25 @@ void timer_init(void)
 #if !defined(CONFIG_BT)
 void timer_do_event0(void)
 {
-#if defined(CONFIG_SOC_NRF5340_CPUAPP)
-    p1_mcu_select_app_sync();
-#endif
     /* First pulse (DAC1): same as timer COMPARE0 */
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 0));
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 1));
-    nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(0, 13));
-    nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 3));
-    {
-        uint8_t phase1_tx[] = {0xFF, 0xAA};
-        spi_write_dac1(phase1_tx, dac1_buf_rx);
-    }
+    stim_pins_phase1();
+#if SYNC_OUT_ENABLE
+    sync_out_onset();
+    sync_marker_log();
+#endif
+    boot_mark(BOOT_PHASE_FIRST_PULSE);
+    spi_write_dac1(dac_phase1_tx, dac1_buf_rx);
+#if DEADLINE_ACTIVE
+    deadline_edge_done(0);
+#endif
 }
 
 void timer_start_one_shot_biphasic(void)
 {
-    nrfx_timer_disable(&timer_inst);
-    nrfx_timer_clear(&timer_inst);
-    uint32_t e1 = nrfx_timer_us_to_ticks(&timer_inst, current_pulse_width_us);
-    uint32_t e2 = nrfx_timer_us_to_ticks(&timer_inst,
-        current_pulse_width_us + SWITCH_PERIOD);
-    uint32_t e3 = nrfx_timer_us_to_ticks(&timer_inst,
-        2 * current_pulse_width_us + SWITCH_PERIOD);
-    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, e1, true);
-    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL2, e2, true);
-    nrfx_timer_compare(&timer_inst, NRF_TIMER_CC_CHANNEL3, e3, true);
-    nrfx_timer_enable(&timer_inst);
+    /* CC1-3 stay programmed from update_pulse_width; the COMPARE3_STOP short ends the shot */
+    nrf_timer_task_trigger(timer_inst.p_reg, NRF_TIMER_TASK_STOP);
+    nrf_timer_task_trigger(timer_inst.p_reg, NRF_TIMER_TASK_CLEAR);
+    nrf_timer_task_trigger(timer_inst.p_reg, NRF_TIMER_TASK_START);
 }
 #endif
 
@@ -215,117 +491,253 @@ nrfx_timer_t measurement_timer_init() {
     return measurement_timer;
 }
 
-static void timer_handler(nrf_timer_event_t event_type, void * p_context)
+#if TRIGGER_MODE
+/* Switch onset (COMPARE0) and phase ends (COMPARE1/3) are driven by DPPI; the ISR only does
+ * what hardware cannot: phase 2 DAC write + onset, and preloading DAC1 for the next onset. */
+static void timer_trigger_handler(nrf_timer_event_t event_type)
 {
-#if defined(CONFIG_SOC_NRF5340_CPUAPP)
-	p1_mcu_select_app_sync();
+    switch (event_type) {
+        case NRF_TIMER_EVENT_COMPARE0:
+#if CHARGE_LIMIT_ACTIVE
+            /* Onset is already driven by DPPI from the word preloaded in DAC1; a stop here cuts
+             * the pulse and the train */
+            if (!charge_limit_pulse_ok(spi_dac1_last_code())) {
+                break;
+            }
 #endif
-    // Get reference to timer
-    atomic_inc(&counter);
-    //printf("Time handler count: %i \n", counter);
-    nrfx_timer_t *timer_inst = (nrfx_timer_t *)p_context;
+#if STOCHASTIC_IPI_ENABLE
+            if (stochastic_active()) {
+                nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL5, stochastic_next_ticks());
+            }
+#endif
+            trigger_on_pulse_start();
+#if SYNC_OUT_ENABLE
+            sync_marker_log();
+#endif
+            boot_mark(BOOT_PHASE_FIRST_PULSE);
+            break;
+
+        case NRF_TIMER_EVENT_COMPARE2:
+            trigger_switch_drive();
+            spi_write_dac1(dac_phase2_tx, dac2_buf_rx);
+            break;
+
+        case NRF_TIMER_EVENT_COMPARE3:
+            stim_pins_phase2_select_off();
+            /* Preload for the next onset, with any amplitude committed meanwhile */
+            (void)timer_dac_latch();
+            spi_write_dac1(dac_phase1_tx, dac1_buf_rx);
+            trigger_on_pulse_end();
+            atomic_inc(&pulse_count);
+            break;
+
+        default:
+            break;
+    }
+}
+#endif
+
+#if MEASURE_TIMER
+/* Timing accuracy against the measurement timer. Edge 0 checks the period, edges 1-3 the
+ * spacing from the previous edge. */
+static void timer_measure_edge(uint8_t edge)
+{
+    static atomic_t *const edge_error_max[] = {
+        &event0_error_max, &event1_error_max, &event2_error_max, &event3_error_max,
+    };
+    static uint32_t prev_edge_time;
     uint32_t current_time;
-    uint32_t current_max;
     uint32_t my_error;
-    uint32_t elapsed1_ticks;
-    
-    switch(event_type) {
+
+    if (edge == 0) {
+        current_time = nrfx_timer_capture(&measurement_timer, NRF_TIMER_CC_CHANNEL0);
+        if (prev_main_event_time > 0) {
+            // Calculate actual interval duration
+            uint32_t interval_ticks = current_time - prev_main_event_time;
+            uint32_t expected_ticks = nrfx_timer_us_to_ticks(&measurement_timer, current_period_us);
+            my_error = abs((int32_t)(interval_ticks - expected_ticks));
+            atomic_add(&event0_error_counter, my_error);
+            if (my_error > (uint32_t)atomic_get(&event0_error_max)) {
+                atomic_set(&event0_error_max, my_error);
+            }
+        }
+        prev_main_event_time = current_time;
+        // Capture timestamp when main event occurs (after timer reset)
+        main_event_time = nrfx_timer_capture(&timer_inst, NRF_TIMER_CC_CHANNEL4);
+        return;
+    }
+    if (edge == 1) {
+        // The pulse starts at the cleared timer (RTC one-shot) or at the COMPARE0 capture
+        prev_edge_time = main_event_time;
+    }
+
+    uint32_t expected_us = (edge == 2) ? SWITCH_PERIOD : current_pulse_width_us;
+
+    current_time = nrfx_timer_capture(&timer_inst, NRF_TIMER_CC_CHANNEL4);
+    my_error = abs((int32_t)(current_time - prev_edge_time - expected_us * (timer_freq_hz / 1000000u)));
+    prev_edge_time = current_time;
+    atomic_add(&error, my_error);
+    if (my_error > (uint32_t)atomic_get(edge_error_max[edge])) {
+        atomic_set(edge_error_max[edge], my_error);
+    }
+}
+#define TIMER_MEASURE_EDGE(edge) timer_measure_edge(edge)
+#else
+#define TIMER_MEASURE_EDGE(edge)
+#endif
+
+/*
+ * One compare handler per engine, picked at build time: each build only carries the edges
+ * its engine raises, and nothing on the pulse path tests the mode at run time.
+ */
+#if TRIGGER_MODE
+#define TIMER_ENGINE_NAME "trigger"
+#define timer_engine(event_type) timer_trigger_handler(event_type)
+
+#elif MULTICHANNEL_ACTIVE
+#define TIMER_ENGINE_NAME "multichannel"
+static inline void timer_engine(nrf_timer_event_t event_type)
+{
+    if (event_type == NRF_TIMER_EVENT_COMPARE0) {
+        sched_on_edge();
+    }
+}
+
+#else
+#if FLPR_SEQ_ACTIVE
+/* Compiled but never raised: the stim TIMER is not started */
+#define TIMER_ENGINE_NAME "flpr"
+#elif defined(CONFIG_BT)
+#define TIMER_ENGINE_NAME "continuous"
+#else
+#define TIMER_ENGINE_NAME "one-shot"
+#endif
+static inline void timer_engine(nrf_timer_event_t event_type)
+{
+    switch (event_type) {
+#if defined(CONFIG_BT)
+        /* RTC one-shot: phase 1 onset runs from the RTC handler (timer_do_event0) */
         case NRF_TIMER_EVENT_COMPARE0:
-            if(MEASURE_TIMER == 1){
-                current_time = nrfx_timer_capture(&measurement_timer, NRF_TIMER_CC_CHANNEL0);
-                    
-                if (prev_main_event_time > 0) {
-                    // Calculate actual interval duration
-                    uint32_t interval_ticks = current_time - prev_main_event_time;
-                    uint32_t expected_ticks = nrfx_timer_us_to_ticks(&measurement_timer, DEFAULT_STIM_PERIOD);
-                    uint32_t event0_error = abs(interval_ticks - expected_ticks);
-                    
-                    // Update statistics
-                    atomic_add(&event0_error_counter, event0_error);
-                    
-                    // Track maximum error
-                    current_max = atomic_get(&event0_error_max);
-                    if (event0_error > current_max) {
-                        atomic_set(&event0_error_max, event0_error);
-                    }
-                }
-                prev_main_event_time = current_time;
-                // Capture timestamp when main event occurs (after timer reset)
-                main_event_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
+            /* Timer was just cleared by the SHORT; the new CC0 is the interval to the next pulse */
+#if STOCHASTIC_IPI_ENABLE
+            if (stochastic_active()) {
+                nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, stochastic_next_ticks());
+            } else
+#endif
+            if (current_period_frac != 0) {
+                /* Fractional period: one extra tick often enough that the mean rate is exact */
+                period_frac_acc += current_period_frac;
+                nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0,
+                                 current_period_ticks + (period_frac_acc >> 16));
+                period_frac_acc &= 0xFFFFu;
             }
+            TIMER_MEASURE_EDGE(0);
+#if CHARGE_LIMIT_ACTIVE
+            if (!charge_limit_pulse_ok(timer_dac_latch())) {
+                break;
+            }
+#else
+            (void)timer_dac_latch();
+#endif
 
+            pulse_open = true;
+            phase_edges_masked = false;
             // First pulse (DAC1): 1.00=0, 1.01=0, 0.13=0; 1.03=1 before & during TX
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 0));
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 1));
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(0, 13));
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 3));
-            {
-                uint8_t phase1_tx[] = {0xFF, 0xAA};
-                spi_write_dac1(phase1_tx, dac1_buf_rx);
-            }
+            stim_pins_phase1();
+#if STRESS_ACTIVE
+            stress_edge(0);
+#endif
+#if SYNC_OUT_ENABLE
+            sync_marker_log();
+#endif
+            boot_mark(BOOT_PHASE_FIRST_PULSE);
+            spi_write_dac1(dac_phase1_tx, dac1_buf_rx);
+#if DEADLINE_ACTIVE
+            deadline_edge_done(0);
+#endif
             break;
-            
+#endif /* CONFIG_BT */
+
         case NRF_TIMER_EVENT_COMPARE1:
-            if(MEASURE_TIMER == 1){
-                // Capture timestamp when event 1 occurs
-                current_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
-                // Calculate elapsed time from main event
-                elapsed1_ticks = current_time - main_event_time;
-                my_error = abs(elapsed1_ticks-DEFAULT_PULSE_WIDTH*timer_freq_hz/1000000);
-                atomic_add(&error,my_error);
-                current_max = atomic_get(&event1_error_max);
-                if (my_error > current_max) {atomic_set(&event1_error_max, my_error);}
+#if defined(CONFIG_BT)
+            /* After a restart, until the next onset */
+            if (phase_edges_masked) {
+                break;
             }
-        
+#endif
+            TIMER_MEASURE_EDGE(1);
             // Interphase 10 us: 1.03=0, 1.00=1, 1.01=1
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 3));
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 0));
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 1));
+            stim_pins_interphase();
+#if STRESS_ACTIVE
+            stress_edge(1);
+#endif
+#if DEADLINE_ACTIVE
+            deadline_edge_done(1);
+#endif
             break;
-            
+
         case NRF_TIMER_EVENT_COMPARE2:
-            if(MEASURE_TIMER == 1){
-                // Capture timestamp when event 2 occurs
-                current_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
-                // Calculate elapsed time from event 1
-                my_error = abs(elapsed1_ticks-SWITCH_PERIOD*timer_freq_hz/1000000);
-                atomic_add(&error, my_error);
-                current_max = atomic_get(&event2_error_max);
-                if (my_error > current_max) {atomic_set(&event2_error_max, my_error);}
+#if defined(CONFIG_BT)
+            if (phase_edges_masked) {
+                break;
             }
-            
+#endif
+            TIMER_MEASURE_EDGE(2);
             // Second pulse (DAC2): 1.00=0, 1.01=0, 0.13=1; DAC2 TX
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 0));
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 1));
-            //nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(0, 13));
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 3));
-            {
-                uint8_t phase2_tx[] = {0x00, 0x56};
-                spi_write_dac1(phase2_tx, dac2_buf_rx);
-            }
+            stim_pins_phase2();
+#if STRESS_ACTIVE
+            stress_edge(2);
+#endif
+            spi_write_dac1(dac_phase2_tx, dac2_buf_rx);
+#if DEADLINE_ACTIVE
+            deadline_edge_done(2);
+#endif
             break;
-            
+
         case NRF_TIMER_EVENT_COMPARE3:
-            if(MEASURE_TIMER == 1){
-                // Capture timestamp when event 3 occurs
-                current_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
-                // Calculate elapsed time from event 2
-                my_error = abs(elapsed1_ticks-DEFAULT_PULSE_WIDTH*timer_freq_hz/1000000);
-                atomic_add(&error,my_error);
-                current_max = atomic_get(&event3_error_max);
-                if (my_error > current_max) {atomic_set(&event3_error_max, my_error);}
+#if defined(CONFIG_BT)
+            if (phase_edges_masked) {
+                break;
             }
-
-            /* Between biphasic pairs: 1.03=0, 0.13=0, 1.00=1, 1.01=1 */
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 3));
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(0, 13));
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 0));
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 1));
-
-#if !defined(CONFIG_BT)
-            /* RTC mode: one shot per period; disable timer until next RTC wake */
-            nrfx_timer_disable(timer_inst);
+            pulse_open = false;
+#endif
+            TIMER_MEASURE_EDGE(3);
+            /* Between biphasic pairs: 1.03=0, 0.13=0, 1.00=1, 1.01=1. In the RTC engine the
+             * COMPARE3_STOP short has already stopped the timer until the next wake. */
+            stim_pins_idle();
+            atomic_inc(&pulse_count);
+#if STRESS_ACTIVE
+            stress_edge(3);
 #endif
+#if STIM_PLL_ACTIVE
+            /* Before the deadline check, which reads the CC0 this rewrites */
+            stim_pll_on_pulse();
+#endif
+#if DEADLINE_ACTIVE
+            deadline_edge_done(3);
+#endif
+            break;
+
+        default:
             break;
     }
-}
\ No newline at end of file
+}
+#endif
+
+const char *timer_engine_name(void)
+{
+    return TIMER_ENGINE_NAME;
+}
+
+static void timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+    ARG_UNUSED(p_context);
+    CLOCK_HOT_BEGIN(clk);
+    ISR_CYC_BEGIN(cyc);
+#if MEASURE_TIMER
+    atomic_inc(&counter);
+#endif
+    timer_engine(event_type);
+    ISR_CYC_END(ISR_PATH_TIMER, cyc);
+    CLOCK_HOT_END(CLOCK_PATH_EDGE, clk);
+}
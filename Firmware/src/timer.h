@@ -26,13 +26,56 @@ typedef struct {
 void timer_init(void);
 void get_error_data(error_data *data);
 nrfx_timer_t measurement_timer_init(void);
+/** Stim and measurement TIMER instances, for DPPI endpoint wiring (trigger.c). */
+nrfx_timer_t const *timer_stim_instance(void);
+nrfx_timer_t const *timer_measurement_instance(void);
 void update_stim_frequency(uint16_t frequency_hz);
+/**
+ * Set the stim rate in mHz (STIM_RATE_MIN_MHZ..STIM_RATE_MAX_MHZ, e.g. 500 = 0.5 Hz). The
+ * period is kept in ns; the TIMER prescaler is the finest at which it fits 32 bits, and the
+ * fractional tick is dithered across periods so the mean rate is exact. -ERANGE outside the
+ * range the running engine can time.
+ */
+int update_stim_rate_mhz(uint32_t rate_mhz);
+/** 0 if the engine takes this rate with this pulse width, -ERANGE if not. Changes nothing. */
+int timer_plan_check(uint32_t rate_mhz, uint16_t pulse_width_us);
+uint32_t timer_get_rate_mhz(void);
+uint64_t timer_get_period_ns(void);
+/** Stim TIMER tick rate at the prescaler now in use (Hz). */
+uint32_t timer_stim_tick_hz(void);
+/** Compare handler this build was compiled with: "continuous", "one-shot", "trigger" or "multichannel";
+ *  "flpr" when the FLPR sequences the pulses (flpr_seq.h). */
+const char *timer_engine_name(void);
 void update_pulse_width(uint16_t pulse_width_us);
+/** Re-load the fixed period register (after stochastic intervals are switched off). */
+void timer_restore_period(void);
+uint32_t timer_get_pulse_width_us(void);
+/** Stim period currently loaded (us), as last set by update_stim_frequency(). */
+uint32_t timer_get_period_us(void);
+/** Completed biphasic pulses since boot, all engines. */
+uint32_t timer_pulse_count(void);
+/** Count one completed pulse (engines whose pulse end is not a timer_handler COMPARE3). ISR safe. */
+void timer_pulse_done(void);
+/**
+ * Pulse onset: take the committed DAC words (update_dac_amplitude) for both phases of the pulse
+ * starting now and return its phase 1 word, for charge_limit_pulse_ok(). ISR context.
+ */
+uint16_t timer_dac_latch(void);
+/** Trigger mode, between trains: latch the committed words and write phase 1 to DAC1. */
+void timer_dac_preload(void);
+/* Rate range in mHz. 0.01 Hz is a 100 s period; 5 kHz still leaves room for short pulses
+ * (TIMER_MIN_PERIOD_US bounds it further for a given pulse width). */
+#define STIM_RATE_MIN_MHZ 10u
+#define STIM_RATE_MAX_MHZ 5000000u
+#define STIM_RATE_TO_PERIOD_NS(mhz) (1000000000000ull / (mhz))
+
+/** Shortest stim period that still fits one biphasic pulse plus ISR margin. */
+#define TIMER_MIN_PERIOD_US(pw) (2u * (pw) + SWITCH_PERIOD + 50u)
 
 #if !defined(CONFIG_BT)
 /** First pulse (DAC1): GPIO + SPI. Called from RTC handler at start of each period. */
 void timer_do_event0(void);
-/** Start one biphasic period: clear timer, set CC1/2/3, enable. Disables after COMPARE3. */
+/** Start one biphasic period from the programmed CC1/2/3. The timer stops itself at COMPARE3. */
 void timer_start_one_shot_biphasic(void);
 #endif
 
@@ -0,0 +1,316 @@
+/*
+ * External trigger mode: a rising edge on TRIGGER_PIN starts a biphasic pulse or a train
+ * without CPU involvement. The edge and every pulse onset/end are routed through DPPI, so
+ * trigger-to-onset latency is a fixed number of 16 MHz peripheral clocks plus one TIMER tick.
+ * The ISR only writes the DAC and counts pulses.
+ */
+#include <nrfx_gpiote.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_gpio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include "trigger.h"
+#include "timer.h"
+#include "spi.h"
+#include "stim_pins.h"
+#include "config.h"
+
+#if TRIGGER_MODE
+
+/* The instance trigger.h picks has to be compiled in: prj*.conf (nRF5340), nrf54l.conf (nRF54L15) */
+#if defined(CONFIG_SOC_SERIES_NRF54LX) && !defined(CONFIG_NRFX_GPIOTE20)
+#error "TRIGGER_MODE on the nRF54L needs CONFIG_NRFX_GPIOTE20: add -DEXTRA_CONF_FILE=nrf54l.conf"
+#elif !defined(CONFIG_SOC_SERIES_NRF54LX) && !defined(CONFIG_NRFX_GPIOTE0)
+#error "TRIGGER_MODE needs CONFIG_NRFX_GPIOTE0"
+#endif
+
+/* Switch pins owned by GPIOTE while trigger mode is active (same pins as timer_handler) */
+#define SW_SHUNT_A_PIN STIM_PIN_SHUNT_A
+#define SW_SHUNT_B_PIN STIM_PIN_SHUNT_B
+#define SW_DRIVE_PIN   STIM_PIN_DRIVE
+
+/* Measurement timer CC channels latched by DPPI (CC0/CC4 are used by MEASURE_TIMER) */
+#define MEAS_CC_TRIGGER NRF_TIMER_CC_CHANNEL2
+#define MEAS_CC_ONSET   NRF_TIMER_CC_CHANNEL3
+
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(TRIGGER_GPIOTE_INST_IDX);
+static uint8_t ch_trigger;      // trigger edge -> TIMER start, group disable
+static uint8_t ch_onset;        // COMPARE0 -> drive
+static uint8_t ch_shunt;        // COMPARE1/3 -> shunt
+static nrfx_gppi_channel_group_t trigger_group;
+
+static uint16_t train_length = CONFIG_TRIGGER_TRAIN_PULSES;
+static uint16_t pulses_done;
+static bool armed;
+static volatile bool in_train;  // from the first onset ISR to the end of the train
+static bool initialized;
+
+static atomic_t trigger_count;
+static atomic_t latency_min;
+static atomic_t latency_max;
+static atomic_t latency_sum;
+
+static int output_task_init(uint32_t pin, nrf_gpiote_outinit_t init_val)
+{
+    uint8_t ch;
+    if (nrfx_gpiote_channel_alloc(&gpiote, &ch) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    nrfx_gpiote_output_config_t out_cfg = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+    nrfx_gpiote_task_config_t task_cfg = {
+        .task_ch = ch,
+        .polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+        .init_val = init_val,
+    };
+    if (nrfx_gpiote_output_configure(&gpiote, pin, &out_cfg, &task_cfg) != NRFX_SUCCESS) {
+        return -EIO;
+    }
+    nrfx_gpiote_out_task_enable(&gpiote, pin);
+    return 0;
+}
+
+static int input_event_init(uint32_t pin)
+{
+    uint8_t ch;
+    if (nrfx_gpiote_channel_alloc(&gpiote, &ch) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    static const nrf_gpio_pin_pull_t pull = NRF_GPIO_PIN_PULLDOWN;
+    nrfx_gpiote_trigger_config_t trig_cfg = {
+        .trigger = NRFX_GPIOTE_TRIGGER_LOTOHI,
+        .p_in_channel = &ch,
+    };
+    nrfx_gpiote_input_pin_config_t in_cfg = {
+        .p_pull_config = &pull,
+        .p_trigger_config = &trig_cfg,
+        .p_handler_config = NULL,   // event only, no interrupt
+    };
+    if (nrfx_gpiote_input_configure(&gpiote, pin, &in_cfg) != NRFX_SUCCESS) {
+        return -EIO;
+    }
+    nrfx_gpiote_trigger_enable(&gpiote, pin, false);
+    return 0;
+}
+
+int trigger_init(void)
+{
+    nrfx_timer_t const *stim = timer_stim_instance();
+    nrfx_timer_t const *meas = timer_measurement_instance();
+    int err;
+
+    /* As update_stim_rate_mhz: a train period shorter than the pulse would cut and restart it */
+    if (timer_get_period_us() < TIMER_MIN_PERIOD_US(timer_get_pulse_width_us())) {
+        printf("Trigger: %lu us train period is shorter than a %lu us pulse\n",
+               timer_get_period_us(), timer_get_pulse_width_us());
+        return -ERANGE;
+    }
+
+    if (!nrfx_gpiote_init_check(&gpiote)) {
+        if (nrfx_gpiote_init(&gpiote, NRFX_GPIOTE_DEFAULT_CONFIG_IRQ_PRIORITY) != NRFX_SUCCESS) {
+            printf("Trigger: GPIOTE init failed\n");
+            return -EIO;
+        }
+    }
+
+    /* Idle state matches the end of COMPARE3: shunts closed, drive open */
+    err = output_task_init(SW_SHUNT_A_PIN, NRF_GPIOTE_INITIAL_VALUE_HIGH);
+    err = err ? err : output_task_init(SW_SHUNT_B_PIN, NRF_GPIOTE_INITIAL_VALUE_HIGH);
+    err = err ? err : output_task_init(SW_DRIVE_PIN, NRF_GPIOTE_INITIAL_VALUE_LOW);
+    err = err ? err : input_event_init(TRIGGER_PIN);
+    if (err) {
+        printf("Trigger: GPIOTE channel setup failed (%d)\n", err);
+        return err;
+    }
+
+    if (nrfx_gppi_channel_alloc(&ch_trigger) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_onset) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_shunt) != NRFX_SUCCESS ||
+        nrfx_gppi_group_alloc(&trigger_group) != NRFX_SUCCESS) {
+        printf("Trigger: out of DPPI channels\n");
+        return -ENOMEM;
+    }
+
+    /* Trigger edge: restart the stim timer; CC0 (TRIGGER_ONSET_TICKS) then produces the onset.
+     * The trigger channel disables its own group so edges during a train are ignored. */
+    nrfx_gppi_channel_endpoints_setup(ch_trigger,
+        nrfx_gpiote_in_event_address_get(&gpiote, TRIGGER_PIN),
+        nrfx_timer_task_address_get(stim, NRF_TIMER_TASK_CLEAR));
+    nrfx_gppi_fork_endpoint_setup(ch_trigger,
+        nrfx_timer_task_address_get(stim, NRF_TIMER_TASK_START));
+    nrfx_gppi_fork_endpoint_setup(ch_trigger,
+        nrfx_gppi_task_address_get(nrfx_gppi_group_disable_task_get(trigger_group)));
+    nrfx_gppi_channels_include_in_group(BIT(ch_trigger), trigger_group);
+
+    /* Pulse onset: every COMPARE0 of the train (first one is TRIGGER_ONSET_TICKS after the edge) */
+    nrfx_gppi_channel_endpoints_setup(ch_onset,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL0),
+        nrfx_gpiote_clr_task_address_get(&gpiote, SW_SHUNT_A_PIN));
+    nrfx_gppi_fork_endpoint_setup(ch_onset, nrfx_gpiote_clr_task_address_get(&gpiote, SW_SHUNT_B_PIN));
+    nrfx_gppi_fork_endpoint_setup(ch_onset, nrfx_gpiote_set_task_address_get(&gpiote, SW_DRIVE_PIN));
+
+    /* End of phase 1 and phase 2: hardware-exact pulse width */
+    nrfx_gppi_channel_endpoints_setup(ch_shunt,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL1),
+        nrfx_gpiote_clr_task_address_get(&gpiote, SW_DRIVE_PIN));
+    nrfx_gppi_event_endpoint_setup(ch_shunt,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL3));
+    nrfx_gppi_fork_endpoint_setup(ch_shunt, nrfx_gpiote_set_task_address_get(&gpiote, SW_SHUNT_A_PIN));
+    nrfx_gppi_fork_endpoint_setup(ch_shunt, nrfx_gpiote_set_task_address_get(&gpiote, SW_SHUNT_B_PIN));
+
+    if (MEASURE_TIMER == 1) {
+        /* Latch the free-running measurement timer at the edge and at the onset */
+        nrfx_gppi_fork_endpoint_setup(ch_trigger,
+            nrfx_timer_capture_task_address_get(meas, MEAS_CC_TRIGGER));
+        nrfx_gppi_fork_endpoint_setup(ch_onset,
+            nrfx_timer_capture_task_address_get(meas, MEAS_CC_ONSET));
+    }
+
+    /* DAC1 holds the phase 1 code between pulses so the hardware onset needs no SPI */
+    timer_dac_preload();
+    initialized = true;
+
+    atomic_set(&latency_min, UINT32_MAX);
+    nrfx_gppi_channels_enable(BIT(ch_onset) | BIT(ch_shunt));
+    trigger_arm(true);
+
+    printf("Trigger: P%d.%02d rising edge, %u pulse(s) per trigger\n",
+           (TRIGGER_PIN >> 5), (TRIGGER_PIN & 0x1F), train_length);
+    return 0;
+}
+
+void trigger_arm(bool enable)
+{
+    armed = enable;
+    if (enable) {
+        /* trigger_abort() cut the onset link */
+        nrfx_gppi_channels_enable(BIT(ch_onset));
+        nrfx_gppi_group_enable(trigger_group);
+    } else {
+        nrfx_gppi_group_disable(trigger_group);
+    }
+}
+
+/* A train started by an edge just before the lock has its onset compare pending, one TIMER
+ * tick after the start, before its ISR has run */
+static bool train_running(void)
+{
+    return in_train ||
+           nrf_timer_event_check(timer_stim_instance()->p_reg, NRF_TIMER_EVENT_COMPARE0);
+}
+
+void trigger_dac_preload(void)
+{
+    if (!initialized) {
+        return;     // trigger_init() preloads
+    }
+    unsigned int key = irq_lock();
+
+    /* No edge may start a train while DAC1 is rewritten */
+    nrfx_gppi_group_disable(trigger_group);
+    if (!train_running()) {
+        timer_dac_preload();
+        if (armed) {
+            nrfx_gppi_group_enable(trigger_group);
+        }
+    }
+    irq_unlock(key);
+}
+
+void trigger_set_train_length(uint16_t pulses)
+{
+    if (pulses == 0) {
+        printf("Invalid train length: 0 pulses\n");
+        return;
+    }
+    train_length = pulses;
+    printf("Trigger train length updated to %u pulse(s)\n", pulses);
+}
+
+uint16_t trigger_get_train_length(void)
+{
+    return train_length;
+}
+
+void trigger_switch_drive(void)
+{
+    nrfx_gpiote_clr_task_trigger(&gpiote, SW_SHUNT_A_PIN);
+    nrfx_gpiote_clr_task_trigger(&gpiote, SW_SHUNT_B_PIN);
+    nrfx_gpiote_set_task_trigger(&gpiote, SW_DRIVE_PIN);
+}
+
+void trigger_on_pulse_start(void)
+{
+    if (pulses_done != 0) {
+        return;
+    }
+    in_train = true;
+    atomic_inc(&trigger_count);
+    if (MEASURE_TIMER == 1) {
+        nrfx_timer_t const *meas = timer_measurement_instance();
+        uint32_t latency = nrfx_timer_capture_get(meas, MEAS_CC_ONSET) -
+                           nrfx_timer_capture_get(meas, MEAS_CC_TRIGGER);
+        atomic_add(&latency_sum, latency);
+        if (latency < (uint32_t)atomic_get(&latency_min)) {
+            atomic_set(&latency_min, latency);
+        }
+        if (latency > (uint32_t)atomic_get(&latency_max)) {
+            atomic_set(&latency_max, latency);
+        }
+    }
+}
+
+void trigger_on_pulse_end(void)
+{
+    if (++pulses_done < train_length) {
+        return;
+    }
+    /* Train complete: stop before re-arming so a new edge always starts from a cleared timer */
+    pulses_done = 0;
+    in_train = false;
+    nrfx_timer_disable(timer_stim_instance());
+    nrfx_timer_clear(timer_stim_instance());
+    if (armed) {
+        nrfx_gppi_group_enable(trigger_group);
+    }
+}
+
+void trigger_abort(void)
+{
+    trigger_arm(false);
+    nrfx_gppi_channels_disable(BIT(ch_onset));
+    pulses_done = 0;
+    in_train = false;
+    nrfx_timer_disable(timer_stim_instance());
+    nrfx_timer_clear(timer_stim_instance());
+    /* The onset may already have switched the drive on, and the CC1/CC3 edges that would
+     * have ended it will not come. The pins are GPIOTE-owned: OUT writes do not reach them. */
+    nrfx_gpiote_clr_task_trigger(&gpiote, SW_DRIVE_PIN);
+    nrfx_gpiote_set_task_trigger(&gpiote, SW_SHUNT_A_PIN);
+    nrfx_gpiote_set_task_trigger(&gpiote, SW_SHUNT_B_PIN);
+}
+
+uint8_t trigger_onset_channel(void)
+{
+    return ch_onset;
+}
+
+uint8_t trigger_shunt_channel(void)
+{
+    return ch_shunt;
+}
+
+uint8_t trigger_start_channel(void)
+{
+    return ch_trigger;
+}
+
+void get_trigger_stats(trigger_stats *stats)
+{
+    stats->triggers = atomic_get(&trigger_count);
+    stats->latency_min = atomic_get(&latency_min);
+    stats->latency_max = atomic_get(&latency_max);
+    stats->latency_sum = atomic_get(&latency_sum);
+}
+
+#endif /* TRIGGER_MODE */
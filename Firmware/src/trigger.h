@@ -0,0 +1,76 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <hal/nrf_gpio.h>
+
+/* Trigger input from behavior rig / recording system (rising edge, 3.3 V logic) */
+#define TRIGGER_PIN NRF_GPIO_PIN_MAP(1, 4)
+
+/* GPIOTE instance serving port 1 (switch pins and trigger input) */
+#if defined(CONFIG_SOC_SERIES_NRF54LX)
+#define TRIGGER_GPIOTE_INST_IDX 20
+#else
+#define TRIGGER_GPIOTE_INST_IDX 0
+#endif
+
+/* Onset compare (CC0) in trigger mode: one TIMER tick after the trigger starts the timer.
+ * Period of a train moves to CC5, which clears the timer so the next pulse lands on CC0 again. */
+#define TRIGGER_ONSET_TICKS 1
+
+typedef struct {
+    uint32_t triggers;        // accepted trigger edges (trains started)
+    uint32_t latency_min;     // trigger edge -> switch onset, measurement timer ticks
+    uint32_t latency_max;
+    uint32_t latency_sum;
+} trigger_stats;
+
+/**
+ * Route TRIGGER_PIN and the stim TIMER through DPPI:
+ *  trigger edge  -> TIMER CLEAR/START, disarm trigger (no retrigger during a train)
+ *  COMPARE0      -> switch onset (1.00=0, 1.01=0, 1.03=1)
+ *  COMPARE1/3    -> switch shunt (1.03=0, 1.00=1, 1.01=1)
+ * Call after timer_init(). Leaves the trigger armed. -ERANGE, nothing armed, if the train
+ * period is shorter than TIMER_MIN_PERIOD_US of the pulse width.
+ */
+int trigger_init(void);
+
+/** Enable/disable the trigger input. Disarming does not cut a train already running. */
+void trigger_arm(bool enable);
+
+/**
+ * Rewrite the DAC1 preload with the committed phase 1 word (update_dac_amplitude). Between
+ * trains only: a train already running picks the word up at its next COMPARE3. Thread context.
+ */
+void trigger_dac_preload(void);
+
+/** Set number of biphasic pulses started by one trigger edge (>= 1). */
+void trigger_set_train_length(uint16_t pulses);
+uint16_t trigger_get_train_length(void);
+
+/** Phase 2 onset from the ISR; switch pins are GPIOTE-owned in trigger mode. */
+void trigger_switch_drive(void);
+
+/** Called from COMPARE0. Records latency for the first pulse of a train. */
+void trigger_on_pulse_start(void);
+
+/** Called from COMPARE3. Stops the timer and re-arms the trigger once the train is complete. */
+void trigger_on_pulse_end(void);
+
+/**
+ * Disarm and stop mid-train, onset link off and the switches in the idle state (drive open,
+ * shunts closed) through their GPIOTE tasks; the next arm starts a fresh train. ISR safe.
+ */
+void trigger_abort(void);
+
+void get_trigger_stats(trigger_stats *stats);
+
+/** DPPI channels carrying pulse onset (COMPARE0) and phase ends (COMPARE1/3), for extra subscribers. */
+uint8_t trigger_onset_channel(void);
+uint8_t trigger_shunt_channel(void);
+
+/** DPPI channel the trigger edge publishes on; another event published on it starts a train the same way. */
+uint8_t trigger_start_channel(void);
+
+#endif /* TRIGGER_H */
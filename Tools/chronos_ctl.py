@@ -0,0 +1,828 @@
+#!/usr/bin/env python3
+"""
+Chronos host control and latency benchmark.
+
+Speaks the device control protocol (Firmware/src/data.h) over the NUS UART using the
+framed transport [0xC7][len][payload]. Works with any tty: the DK's VCOM port, a USB CDC
+port, or a pty (e.g. one end of a socat pair). Python 3 standard library only.
+
+  chronos_ctl.py /dev/ttyACM0 get
+  chronos_ctl.py /dev/ttyACM0 set 0xFFAA 200 130
+  chronos_ctl.py /dev/ttyACM0 bench --count 200 --max-p99-ms 20
+
+bench measures command round-trip latency, then pipelined throughput (--count requests
+written back to back), then applies alternating settings and reads each one back to check
+that the engine took it, reporting updates per second. It exits non-zero on a lost reply,
+any mismatch, or if the p99 latency exceeds --max-p99-ms. Each applied setting
+is also committed to flash by the stim store, so keep --updates modest on real hardware.
+
+  chronos_ctl.py /dev/ttyACM0 log --from-seq 1 --out session.bin
+
+log reads the flash session log (SESSION_LOG_ENABLE builds) page by page, checks each page's
+CRC and the sequence numbers, and prints the records. It exits non-zero on a corrupt page or
+a gap in the sequence, so after cutting power mid-write it shows whether the device resumed
+cleanly: at most the page being written (and records still in RAM) may be missing.
+
+  chronos_ctl.py /dev/ttyACM0 clock --compare 30 --commits 20
+
+clock --compare runs the plan under each CPU clock policy (CLOCK_POLICY_ENABLE builds) for the
+given seconds, re-committing the running rate --commits times in each, and prints edge and
+commit latency and the CPU current estimate side by side, relative to the high policy. The
+policy in effect before the run is restored.
+
+  chronos_ctl.py /dev/ttyACM0 stress --duration 120 --interval-us 5000
+
+stress runs the on-device parameter-update stress (STRESS_ENABLE builds): random rate, pulse
+width and amplitude updates at random phases of the pulse while the continuous engine runs,
+each pulse's edge timing and DAC words checked on the device against the plan. It exits
+non-zero if any pulse was dropped, doubled, stretched, unbalanced or sent the wrong amplitude,
+or if the worst update-induced timing error exceeds --max-update-err-us.
+
+  chronos_ctl.py /dev/ttyACM0 loop --phase 180 --band 4 8 --watch 60 --max-latency-us 1000
+
+loop reads and sets the phase-locked closed loop (CLOSED_LOOP_ENABLE builds): target phase of
+the band (0 peak, 180 trough), pass band and amplitude gate, then watches it. The report has
+the phase error of the pulses given, the decision latency (crossing sample to pulse armed)
+and the CPU share of the block handler. It exits non-zero if the worst decision latency
+exceeds --max-latency-us or the mean phase error exceeds --max-err-deg. The same estimator
+runs on a recording on the host with Tools/cl_replay.c.
+
+  chronos_ctl.py /dev/ttyACM0 flpr
+
+flpr reads the FLPR sequencer (FLPR_SEQ_ENABLE builds on the nRF54L15): its state, pulses
+played, edges started late and the worst lateness, the plans sent, taken, refused or left
+unsent, and the halts: stalls, and pulses sent at another amplitude than their plan's. It
+exits non-zero unless the sequencer is running. The sequencer's core runs on the
+host with Tools/seq_trace.c.
+
+  chronos_ctl.py /dev/ttyACM0 sync /dev/ttyACM1 /dev/ttyACM2 --duration 60
+
+sync locks follower units (STIM_PLL_ENABLE builds) to the leader on the first port without
+a wire between them: each unit's timebase is mapped onto the host clock by timestamp pings,
+and every --interval the leader's pulse train is translated into each follower's timebase
+and sent as its reference. Accuracy is bounded by the ping jitter of the control links;
+wire SYNC_OUT to TRIGGER_PIN ("pll --source wire") for sub-microsecond skew.
+"""
+import argparse
+import os
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+import zlib
+
+CTRL_UART_SYNC = 0xC7
+
+CMD_STIM_STORE = 0x13
+CMD_BOOT_PHASES = 0x14
+CMD_DEADLINE_STATS = 0x16
+CMD_ISR_CYCLES = 0x17
+CMD_GET_SETTING = 0x18
+CMD_ENERGY = 0x19
+CMD_TELEMETRY = 0x1A
+CMD_PLL = 0x1B
+CMD_SET_RATE = 0x1C
+CMD_CHARGE_LIMIT = 0x1D
+CMD_SESSION_LOG = 0x1E
+CMD_CLOCK_POLICY = 0x1F
+CMD_STRESS = 0x20
+CMD_CLOSED_LOOP = 0x21
+CMD_FLPR = 0x22
+
+TELEM_FLAGS = ["running", "connected", "overrun", "reset", "restored", "trigger", "multichannel", "limit"]
+
+BOOT_PHASES = ["main", "clock/pins/spi", "stim plan", "stim armed", "first pulse",
+               "bt ready", "advertising", "uart ready"]
+PLL_SOURCES = ["off", "wire", "ble"]
+CHARGE_FAULTS = ["none", "amplitude", "pulse width", "charge per phase", "charge per second",
+                 "charge in a one-second span", "DAC word not the committed amplitude"]
+PLAN_ORIGINS = ["boot", "setting", "rate", "channel"]
+LOG_FAULT_SOURCES = ["", "charge limit (rejected)", "charge limit (safe stop)"]
+SLOG_MAGIC = 0x31474C53
+ISR_PATHS = ["timer_handler", "rtc_handler", "spi_write_dac1", "closed_loop"]
+CLOCK_POLICIES = ["high", "low", "boost"]
+
+BAUD = {9600: termios.B9600, 115200: termios.B115200, 230400: termios.B230400,
+        460800: getattr(termios, "B460800", termios.B230400),
+        1000000: getattr(termios, "B1000000", termios.B230400)}
+
+
+class Link:
+    """Raw tty carrying [sync][len][payload] frames. Bytes outside frames are ignored."""
+
+    def __init__(self, path, baud):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        if os.isatty(self.fd):
+            tty.setraw(self.fd)
+            attrs = termios.tcgetattr(self.fd)
+            attrs[4] = attrs[5] = BAUD[baud]
+            termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+            termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.rx = bytearray()
+
+    def close(self):
+        os.close(self.fd)
+
+    def send(self, payload):
+        if not 0 < len(payload) <= 16:
+            raise ValueError("command frames are 1-16 bytes")
+        os.write(self.fd, bytes([CTRL_UART_SYNC, len(payload)]) + bytes(payload))
+
+    def send_frames(self, payloads):
+        """Write several frames back to back in one go (no waiting for replies)."""
+        data = b"".join(bytes([CTRL_UART_SYNC, len(p)]) + bytes(p) for p in payloads)
+        while data:
+            data = data[os.write(self.fd, data):]
+
+    def recv(self, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            frame = self._take_frame()
+            if frame is not None:
+                return frame
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            ready, _, _ = select.select([self.fd], [], [], left)
+            if ready:
+                self.rx += os.read(self.fd, 512)
+
+    def _take_frame(self):
+        start = self.rx.find(CTRL_UART_SYNC)
+        if start < 0:
+            self.rx.clear()
+            return None
+        del self.rx[:start]
+        if len(self.rx) < 2 or len(self.rx) < 2 + self.rx[1]:
+            return None
+        n = self.rx[1]
+        frame = bytes(self.rx[2:2 + n])
+        del self.rx[:2 + n]
+        return frame
+
+    def request(self, payload, timeout=1.0):
+        """Send a command and return the first reply with the same opcode."""
+        self.send(payload)
+        deadline = time.monotonic() + timeout
+        while True:
+            frame = self.recv(max(0.0, deadline - time.monotonic()))
+            if frame is None:
+                raise TimeoutError("no reply to command 0x%02X" % payload[0])
+            if frame[0] == payload[0]:
+                return frame
+
+
+def setting_bytes(amplitude, pulse_width, frequency):
+    return struct.pack("<HHH", amplitude, pulse_width, frequency)
+
+
+def get_setting(link):
+    r = link.request([CMD_GET_SETTING])
+    amp, pw, freq, engine_pw, engine_period = struct.unpack_from("<HHHII", r, 1)
+    s = {"amplitude": amp, "pulse_width": pw, "frequency": freq,
+         "engine_pulse_width_us": engine_pw, "engine_period_us": engine_period}
+    if len(r) >= 19:
+        s["engine_rate_mhz"] = struct.unpack_from("<I", r, 15)[0]
+    return s
+
+
+def cmd_get(link, args):
+    s = get_setting(link)
+    print("amplitude 0x%04X  pulse width %u us  frequency %u Hz" %
+          (s["amplitude"], s["pulse_width"], s["frequency"]))
+    print("engine: pulse width %u us, period %u us%s" %
+          (s["engine_pulse_width_us"], s["engine_period_us"],
+           ", rate %.3f Hz" % (s["engine_rate_mhz"] / 1000.0) if "engine_rate_mhz" in s else ""))
+    return 0
+
+
+def cmd_rate(link, args):
+    rate_mhz = int(round(args.hz * 1000))
+    r = link.request([CMD_SET_RATE] + list(struct.pack("<I", rate_mhz)))
+    err = struct.unpack_from("<b", r, 1)[0]
+    if err:
+        print("error %d" % err)
+        return 1
+    s = get_setting(link)
+    print("rate %.3f Hz, period %u us" % (s.get("engine_rate_mhz", rate_mhz) / 1000.0, s["engine_period_us"]))
+    return 0
+
+
+def verify(link, amplitude, pulse_width, frequency):
+    s = get_setting(link)
+    return (s["amplitude"] == amplitude and s["pulse_width"] == pulse_width and
+            s["frequency"] == frequency and s["engine_pulse_width_us"] == pulse_width and
+            s["engine_period_us"] == 1000000 // frequency)
+
+
+def cmd_set(link, args):
+    link.send(setting_bytes(args.amplitude, args.pulse_width, args.frequency))
+    ok = verify(link, args.amplitude, args.pulse_width, args.frequency)
+    print("applied" if ok else "MISMATCH: device reports a different setting")
+    return 0 if ok else 1
+
+
+def cmd_boot(link, args):
+    r = link.request([CMD_BOOT_PHASES])
+    within, n = r[1], r[2]
+    for i, us in enumerate(struct.unpack_from("<%dI" % n, r, 3)):
+        name = BOOT_PHASES[i] if i < len(BOOT_PHASES) else "phase %d" % i
+        print("  %-16s %s" % (name, "%u us" % us if us else "-"))
+    print("first pulse %s budget" % ("within" if within else "NOT within"))
+    return 0
+
+
+def cmd_store(link, args):
+    r = link.request([CMD_STIM_STORE, 0])
+    source, seen, us = r[1], r[2], struct.unpack_from("<I", r, 3)[0]
+    print("plan source: %s, first pulse %s" %
+          ("restored" if source else "defaults", "%u us after boot" % us if seen else "not seen"))
+    return 0
+
+
+def cmd_deadline(link, args):
+    r = link.request([CMD_DEADLINE_STATS])
+    edge = r[1]
+    overruns, missed, late, slack, wdt, fatal = struct.unpack_from("<6I", r, 2)
+    print("overruns %u (worst %u us on edge %u), missed compares %u" % (overruns, late, edge, missed))
+    print("min slack %s, watchdog resets %u, fatal resets %u" %
+          ("-" if slack == 0xFFFFFFFF else "%u us" % slack, wdt, fatal))
+    return 0
+
+
+def cmd_cycles(link, args):
+    r = link.request([CMD_ISR_CYCLES, 1 if args.reset else 0])
+    within, n = r[1], r[2]
+    for i in range(n):
+        calls, avg, mx, budget, over = struct.unpack_from("<5I", r, 3 + 20 * i)
+        name = ISR_PATHS[i] if i < len(ISR_PATHS) else "path %d" % i
+        print("  %-16s calls %u avg %u max %u budget %u over %u" % (name, calls, avg, mx, budget, over))
+    print("ISR cycles %s budget" % ("within" if within else "OVER"))
+    return 0 if within else 1
+
+
+def cmd_energy(link, args):
+    r = link.request([CMD_ENERGY, 1 if args.reset else 0])
+    elapsed, hf, isr, thread, idle, spi, radio, ua = struct.unpack_from("<8I", r, 1)
+    print("elapsed %u ms, HFCLK on %u ms (%.1f%%)" % (elapsed, hf, 100.0 * hf / elapsed if elapsed else 0.0))
+    print("CPU: stim ISR %u us, threads %u ms, idle %u ms" % (isr, thread, idle))
+    print("SPI %u us, radio events %u (estimated)" % (spi, radio))
+    print("estimated average current %u uA" % ua)
+    return 0
+
+
+def cmd_limits(link, args):
+    r = link.request([CMD_CHARGE_LIMIT, 1 if args.clear else 0])
+    (stopped, reason, channel, fault_stopped, faults, rejected, charge_pc, budget, amp, pw,
+     rate_mhz, value, limit, uptime_ms) = struct.unpack_from("<BBBBIIIIHHIIII", r, 1)
+    print("%s, plan %.1f nC per phase, budget %u pulses/s" %
+          ("SAFE STOP" if stopped else "running", charge_pc / 1000.0, budget))
+    print("faults %u, rejected plans %u" % (faults, rejected))
+    if reason:
+        name = CHARGE_FAULTS[reason] if reason < len(CHARGE_FAULTS) else str(reason)
+        print("last: %s at %u ms (%s): %u over limit %u, channel %u, amplitude 0x%04X %u us %.3f Hz" %
+              (name, uptime_ms, "stopped" if fault_stopped else "rejected", value, limit, channel,
+               amp, pw, rate_mhz / 1000.0))
+    return 1 if stopped else 0
+
+
+FLPR_STATES = ["off", "ready", "running", "FAULT"]
+
+
+def cmd_flpr(link, args):
+    r = link.request([CMD_FLPR])
+    (state, pulses, late, worst_late_ns, sent, applied, rejected, unsent,
+     stalls, wrong_amplitude) = struct.unpack_from("<B9I", r, 1)
+    name = FLPR_STATES[state] if state < len(FLPR_STATES) else str(state)
+    print("%s, %u pulses, %u late edges (worst %.2f us)" % (name, pulses, late, worst_late_ns / 1000.0))
+    print("plans sent %u, applied %u, rejected %u, unsent %u; stalls %u, wrong amplitude %u" %
+          (sent, applied, rejected, unsent, stalls, wrong_amplitude))
+    return 0 if state == 2 and not stalls and not wrong_amplitude else 1
+
+
+def clock_stats(link, policy):
+    r = link.request([CMD_CLOCK_POLICY, 0, policy])
+    keys = ("in_effect", "mhz", "time_ms", "held_us", "busy_ms", "switches", "switch_max_ns", "est_ua",
+            "edge_calls", "edge_avg_ns", "edge_max_ns", "commit_calls", "commit_avg_ns", "commit_max_ns")
+    return dict(zip(keys, struct.unpack_from("<BB12I", r, 3)))
+
+
+def clock_select(link, policy):
+    r = link.request([CMD_CLOCK_POLICY, 1, policy])
+    return struct.unpack_from("<b", r, 2)[0]
+
+
+def cmd_clock(link, args):
+    stats = [clock_stats(link, i) for i in range(len(CLOCK_POLICIES))]
+    current = next((i for i, st in enumerate(stats) if st["in_effect"]), 0)
+    if args.policy is not None:
+        err = clock_select(link, CLOCK_POLICIES.index(args.policy))
+        print("policy %s" % args.policy if err == 0 else "error %d" % err)
+        return 1 if err else 0
+    if args.compare:
+        # Re-committing the running rate exercises the commit path without changing the plan
+        rate_mhz = get_setting(link).get("engine_rate_mhz")
+        commits = args.commits if rate_mhz else 0
+        link.request([CMD_CLOCK_POLICY, 2, 0])
+        for i in range(len(CLOCK_POLICIES)):
+            if clock_select(link, i):
+                print("error selecting policy %s" % CLOCK_POLICIES[i])
+                return 1
+            for _ in range(commits):
+                link.request([CMD_SET_RATE] + list(struct.pack("<I", rate_mhz)))
+                time.sleep(args.compare / (commits + 1))
+            time.sleep(args.compare / (commits + 1))
+        clock_select(link, current)
+        stats = [clock_stats(link, i) for i in range(len(CLOCK_POLICIES))]
+    print("policy  time_s  edge avg/max ns   commit avg/max ns  switches (max ns)  busy ms  est CPU uA")
+    for i, st in enumerate(stats):
+        print("%-6s%s %6.1f  %7u/%-8u  %8u/%-8u  %8u (%5u)  %7u  %10u" %
+              (CLOCK_POLICIES[i], "*" if i == current else " ", st["time_ms"] / 1000.0,
+               st["edge_avg_ns"], st["edge_max_ns"], st["commit_avg_ns"], st["commit_max_ns"],
+               st["switches"], st["switch_max_ns"], st["busy_ms"], st["est_ua"]))
+    base = stats[0]
+    for i in range(1, len(CLOCK_POLICIES)):
+        st = stats[i]
+        if base["edge_calls"] and st["edge_calls"] and base["est_ua"]:
+            print("%s vs high: edge latency %+.0f%%, commit latency %s, CPU current %+.0f%%" %
+                  (CLOCK_POLICIES[i], 100.0 * st["edge_avg_ns"] / base["edge_avg_ns"] - 100.0,
+                   "%+.0f%%" % (100.0 * st["commit_avg_ns"] / base["commit_avg_ns"] - 100.0)
+                   if base["commit_calls"] and st["commit_calls"] else "-",
+                   100.0 * st["est_ua"] / base["est_ua"] - 100.0))
+    print("CPU at %u MHz" % stats[current]["mhz"])
+    return 0
+
+
+def stress_report(link):
+    r = link.request([CMD_STRESS, 0])
+    keys = ("running", "updates", "in_pulse", "rejected", "pulses", "dropped", "doubled", "stretched",
+            "unbalanced", "late", "worst_err_ns", "worst_update_err_ns", "wrong_amplitude")
+    return dict(zip(keys, struct.unpack_from("<B12I", r, 2)))
+
+
+def cmd_stress(link, args):
+    r = link.request([CMD_STRESS, 1] + list(struct.pack("<HI", args.duration, args.interval_us)))
+    err = struct.unpack_from("<b", r, 2)[0]
+    if err:
+        print("error %d" % err)
+        return 1
+    try:
+        while True:
+            time.sleep(1.0)
+            st = stress_report(link)
+            print("\r%u updates, %u pulses, %u faults" %
+                  (st["updates"], st["pulses"],
+                   st["dropped"] + st["doubled"] + st["stretched"] + st["unbalanced"] + st["wrong_amplitude"]),
+                  end="", flush=True)
+            if not st["running"]:
+                break
+    except KeyboardInterrupt:
+        link.request([CMD_STRESS, 2])
+        st = stress_report(link)
+    print()
+    print("updates %u (%u inside a pulse, %u refused), pulses checked %u" %
+          (st["updates"], st["in_pulse"], st["rejected"], st["pulses"]))
+    print("dropped %u, doubled %u, stretched %u, unbalanced %u, late %u, wrong amplitude %u" %
+          (st["dropped"], st["doubled"], st["stretched"], st["unbalanced"], st["late"], st["wrong_amplitude"]))
+    print("worst timing error %.1f us, worst update-induced %.1f us" %
+          (st["worst_err_ns"] / 1000.0, st["worst_update_err_ns"] / 1000.0))
+    failed = st["dropped"] or st["doubled"] or st["stretched"] or st["unbalanced"] or st["wrong_amplitude"]
+    if failed:
+        print("FAIL: waveform faults")
+    if args.max_update_err_us is not None and st["worst_update_err_ns"] > args.max_update_err_us * 1000:
+        print("FAIL: update-induced error over %.1f us" % args.max_update_err_us)
+        failed = True
+    return 1 if failed else 0
+
+
+def loop_report(link):
+    r = link.request([CMD_CLOSED_LOOP, 0])
+    keys = ("running", "target_deg", "band_lo_dhz", "band_hi_dhz", "min_amplitude", "blocks", "resyncs",
+            "crossings", "rejected", "gated", "deferred", "scheduled", "refreshed", "missed", "fired",
+            "evaluated", "err_mean_cdeg", "abs_err_mean_cdeg", "abs_err_max_cdeg", "period_us", "amplitude",
+            "latency_avg_us", "latency_max_us", "over_latency", "block_max_us", "load_ppm")
+    return dict(zip(keys, struct.unpack_from("<B4H11Ii9I", r, 2)))
+
+
+def cmd_loop(link, args):
+    st = loop_report(link)
+    if args.phase is not None or args.band or args.min_amplitude is not None:
+        params = (args.phase if args.phase is not None else st["target_deg"],
+                  int(round(args.band[0] * 10)) if args.band else st["band_lo_dhz"],
+                  int(round(args.band[1] * 10)) if args.band else st["band_hi_dhz"],
+                  args.min_amplitude if args.min_amplitude is not None else st["min_amplitude"])
+        r = link.request([CMD_CLOSED_LOOP, 1] + list(struct.pack("<4H", *params)))
+        err = struct.unpack_from("<b", r, 2)[0]
+        if err:
+            print("error %d (band outside the filter rate, or phase >= 360)" % err)
+            return 1
+    if args.start or args.stop:
+        r = link.request([CMD_CLOSED_LOOP, 2, 1 if args.start else 0])
+        err = struct.unpack_from("<b", r, 2)[0]
+        if err:
+            print("error %d" % err)
+            return 1
+    try:
+        deadline = time.monotonic() + args.watch
+        while time.monotonic() < deadline:
+            time.sleep(1.0)
+            st = loop_report(link)
+            print("\r%u pulses, period %.1f ms, amplitude %u, error %+.1f deg" %
+                  (st["fired"], st["period_us"] / 1000.0, st["amplitude"], st["err_mean_cdeg"] / 100.0),
+                  end="", flush=True)
+        if args.watch:
+            print()
+    except KeyboardInterrupt:
+        print()
+    st = loop_report(link)
+    print("%s, target %u deg, band %.1f-%.1f Hz, gate %u codes" %
+          ("running" if st["running"] else "stopped", st["target_deg"], st["band_lo_dhz"] / 10.0,
+           st["band_hi_dhz"] / 10.0, st["min_amplitude"]))
+    print("blocks %u (resyncs %u), crossings %u (out of band %u, gated %u)" %
+          (st["blocks"], st["resyncs"], st["crossings"], st["rejected"], st["gated"]))
+    print("pulses armed %u (moved %u, a cycle on %u), missed %u, fired %u" %
+          (st["scheduled"], st["refreshed"], st["deferred"], st["missed"], st["fired"]))
+    print("phase error over %u pulses: mean %+.1f deg, mean abs %.1f deg, max abs %.1f deg" %
+          (st["evaluated"], st["err_mean_cdeg"] / 100.0, st["abs_err_mean_cdeg"] / 100.0,
+           st["abs_err_max_cdeg"] / 100.0))
+    print("period %.1f ms, amplitude %u codes" % (st["period_us"] / 1000.0, st["amplitude"]))
+    print("decision latency avg %u us max %u us (%u over budget), block handler max %u us, CPU %.3f%%" %
+          (st["latency_avg_us"], st["latency_max_us"], st["over_latency"], st["block_max_us"],
+           st["load_ppm"] / 10000.0))
+    failed = False
+    if args.max_latency_us is not None and st["latency_max_us"] > args.max_latency_us:
+        print("FAIL: decision latency over %u us" % args.max_latency_us)
+        failed = True
+    if args.max_err_deg is not None and (st["evaluated"] == 0 or st["abs_err_mean_cdeg"] > args.max_err_deg * 100):
+        print("FAIL: mean phase error over %.1f deg" % args.max_err_deg)
+        failed = True
+    return 1 if failed else 0
+
+
+def log_info(link):
+    r = link.request([CMD_SESSION_LOG, 0])
+    keys = ("ready", "boot", "pages", "first_seq", "last_seq", "pages_written", "dropped", "errors", "buffered")
+    return dict(zip(keys, struct.unpack_from("<BHHIIIIIH", r, 2)))
+
+
+def log_pages(link, from_seq, max_pages, timeout=5.0):
+    """Dump pages from the device; returns {seq: bytes} as received."""
+    link.send([CMD_SESSION_LOG, 1] + list(struct.pack("<IH", from_seq, max_pages)))
+    pages = {}
+    while True:
+        frame = link.recv(timeout)
+        if frame is None:
+            raise TimeoutError("session log dump stalled")
+        if frame[0] != CMD_SESSION_LOG or frame[1] != 1:
+            continue
+        seq, offset = struct.unpack_from("<IH", frame, 2)
+        if seq == 0:
+            return pages
+        page = pages.setdefault(seq, bytearray())
+        if offset == len(page):
+            page += frame[8:]
+
+
+def decode_log_page(page):
+    """Check a page (slog_page_header + records, Firmware/src/session_log.h); yields records."""
+    magic, seq, boot, used, crc = struct.unpack_from("<IIHHI", page, 0)
+    if magic != SLOG_MAGIC or len(page) != 16 + used or zlib.crc32(page[16:], zlib.crc32(page[:12])) != crc:
+        raise ValueError("page %u: bad header or CRC" % seq)
+    off = 16
+    while off + 6 <= len(page):
+        rtype, n, uptime_ms = struct.unpack_from("<BBI", page, off)
+        body = page[off + 6:off + 6 + n]
+        off += 6 + n
+        if rtype == 1 and n >= 9:
+            source, wdt, fatal = struct.unpack_from("<BII", body)
+            text = "boot: plan %s, %u watchdog + %u fatal resets since power-on" % (
+                "restored" if source else "defaults", wdt, fatal)
+        elif rtype == 2 and n >= 14:
+            pulse, origin, ch, amp, pw, rate = struct.unpack_from("<IBBHHI", body)
+            text = "plan (%s) at pulse %u: ch %u amplitude 0x%04X %u us %.3f Hz" % (
+                PLAN_ORIGINS[origin] if origin < len(PLAN_ORIGINS) else origin, pulse, ch, amp, pw, rate / 1000.0)
+        elif rtype == 3 and n >= 14:
+            pulse, source, reason, value, limit = struct.unpack_from("<IBBII", body)
+            name = CHARGE_FAULTS[reason] if reason < len(CHARGE_FAULTS) else str(reason)
+            text = "FAULT %s at pulse %u: %s, %u over limit %u" % (
+                LOG_FAULT_SOURCES[source] if source < len(LOG_FAULT_SOURCES) else source, pulse, name, value, limit)
+        elif rtype == 4 and n >= 16:
+            text = "counters: %u pulses, %u overruns, %u missed, %u charge faults" % struct.unpack_from("<IIII", body)
+        else:
+            text = "record type %u (%u bytes)" % (rtype, n)
+        yield boot, uptime_ms, text
+
+
+def cmd_log(link, args):
+    if args.flush:
+        r = link.request([CMD_SESSION_LOG, 2])
+        if struct.unpack_from("<b", r, 2)[0] == 0:
+            time.sleep(1.0)     # the write runs in the pulse gaps
+    info = log_info(link)
+    print("boot %u, %u pages in ring, seq %u..%u in flash, %u written this boot, %u records dropped, "
+          "%u flash errors, %u bytes buffered%s" %
+          (info["boot"], info["pages"], info["first_seq"], info["last_seq"], info["pages_written"],
+           info["dropped"], info["errors"], info["buffered"], "" if info["ready"] else " (not scanned yet)"))
+    pages = log_pages(link, args.from_seq, args.max_pages)
+    failed = False
+    expected = None
+    for seq in sorted(pages):
+        if expected is not None and seq != expected:
+            print("GAP: pages %u..%u missing" % (expected, seq - 1))
+            failed = True
+        expected = seq + 1
+        page = bytes(pages[seq])
+        if args.out:
+            args.out.write(page)
+        try:
+            for boot, uptime_ms, text in decode_log_page(page):
+                print("[%u] boot %u +%.3f s  %s" % (seq, boot, uptime_ms / 1000.0, text))
+        except ValueError as e:
+            print("CORRUPT: %s" % e)
+            failed = True
+    if info["errors"]:
+        failed = True
+    return 1 if failed else 0
+
+
+def cmd_telemetry(link, args):
+    r = link.request([CMD_TELEMETRY, 0 if args.off else 1] + list(struct.pack("<H", args.update_ms)))
+    err = struct.unpack_from("<b", r, 1)[0]
+    print("telemetry %s" % ("off" if args.off else "on") if err == 0 else "error %d" % err)
+    return 0 if err == 0 else 1
+
+
+def decode_telemetry(data):
+    """Periodic advertising manufacturer data (telem_payload, Firmware/src/telemetry.h)."""
+    (company, version, seq, flags, amp, pw, freq, pulses, uptime, overruns,
+     resets) = struct.unpack("<HBBBHHHIIHB", data[:24])
+    names = [n for i, n in enumerate(TELEM_FLAGS) if flags & (1 << i)]
+    return ("v%u seq %u [%s] amplitude 0x%04X %u us %u Hz, %u pulses, up %u s, "
+            "%u overruns, %u resets" % (version, seq, " ".join(names), amp, pw, freq, pulses,
+                                        uptime, overruns, resets))
+
+
+def cmd_decode(args):
+    print(decode_telemetry(bytes.fromhex("".join(args.hex))))
+    return 0
+
+
+def pll_status(link):
+    r = link.request([CMD_PLL, 0])
+    (source, locked, skew, skew_max, skew_avg, adj_ppm, missing, onset,
+     period_ns) = struct.unpack_from("<BBiIIiIQI", r, 2)
+    return {"source": source, "locked": bool(locked), "skew_us": skew, "skew_max_us": skew_max,
+            "skew_avg_us": skew_avg, "adj_ppm": adj_ppm, "ref_missing": missing,
+            "onset_us": onset, "period_ns": period_ns}
+
+
+def pll_select(link, source, offset_us):
+    r = link.request([CMD_PLL, 3, PLL_SOURCES.index(source)] + list(struct.pack("<i", offset_us)))
+    return struct.unpack_from("<b", r, 2)[0]
+
+
+def format_pll(st):
+    return ("%s %s skew %d us (avg %u, max %u), correction %d ppm, %u missing ref" %
+            (PLL_SOURCES[st["source"]] if st["source"] < len(PLL_SOURCES) else "?",
+             "locked" if st["locked"] else "unlocked", st["skew_us"], st["skew_avg_us"],
+             st["skew_max_us"], st["adj_ppm"], st["ref_missing"]))
+
+
+def cmd_pll(link, args):
+    if args.source is not None:
+        err = pll_select(link, args.source, args.offset_us)
+        if err:
+            print("error %d" % err)
+            return 1
+    print(format_pll(pll_status(link)))
+    return 0
+
+
+class DeviceClock:
+    """Linear map from host time to a unit's timebase, fitted on the fastest ping of each round."""
+
+    def __init__(self, link, window=8):
+        self.link = link
+        self.window = window
+        self.samples = []       # (host_us, device_us)
+        self.rate = 1.0
+        self.offset = 0.0
+
+    def ping(self, count=5):
+        best = None
+        for _ in range(count):
+            t0 = time.monotonic_ns()
+            r = self.link.request([CMD_PLL, 1])
+            t1 = time.monotonic_ns()
+            if best is None or t1 - t0 < best[0]:
+                best = (t1 - t0, (t0 + t1) / 2000.0, struct.unpack_from("<Q", r, 2)[0])
+        self.samples = (self.samples + [best[1:]])[-self.window:]
+        n = len(self.samples)
+        hm = sum(h for h, _ in self.samples) / n
+        dm = sum(d for _, d in self.samples) / n
+        var = sum((h - hm) ** 2 for h, _ in self.samples)
+        if n > 1 and var > 0:
+            self.rate = sum((h - hm) * (d - dm) for h, d in self.samples) / var
+        self.offset = dm - self.rate * hm
+
+    def to_device(self, host_us):
+        return self.rate * host_us + self.offset
+
+    def to_host(self, device_us):
+        return (device_us - self.offset) / self.rate
+
+
+def cmd_sync(link, args):
+    leader = DeviceClock(link)
+    followers = []
+    failed = False
+    try:
+        for path in args.followers:
+            f = Link(path, args.baud)
+            followers.append((path, f, DeviceClock(f)))
+            err = pll_select(f, "ble", args.offset_us)
+            if err:
+                print("%s: error %d selecting the BLE reference" % (path, err))
+                return 1
+        t_end = time.monotonic() + args.duration
+        while True:
+            leader.ping()
+            ref = pll_status(link)
+            ref_host = leader.to_host(ref["onset_us"])
+            period_host_ns = ref["period_ns"] / leader.rate
+            last = time.monotonic() >= t_end
+            failed = False
+            for path, f, clock in followers:
+                clock.ping()
+                onset = int(round(clock.to_device(ref_host)))
+                period_ns = int(round(period_host_ns * clock.rate))
+                f.request([CMD_PLL, 2] + list(struct.pack("<QI", onset, period_ns)))
+                st = pll_status(f)
+                # Independent of the follower's own detector: both onsets seen from the host clock
+                period_us = period_host_ns / 1000.0
+                d = (clock.to_host(st["onset_us"]) - ref_host - args.offset_us) % period_us
+                host_skew = d - period_us if d > period_us / 2 else d
+                print("%s: %s | host view %+.1f us, clock %+.1f ppm vs leader" %
+                      (path, format_pll(st), host_skew, (clock.rate / leader.rate - 1.0) * 1e6))
+                if not st["locked"] or (args.max_skew_us is not None and
+                                        abs(st["skew_us"]) > args.max_skew_us):
+                    failed = True
+            if last:
+                break
+            time.sleep(args.interval)
+    finally:
+        for _, f, _ in followers:
+            f.close()
+    return 1 if failed else 0
+
+
+def cmd_raw(link, args):
+    link.send(bytes.fromhex("".join(args.hex)))
+    frame = link.recv(args.timeout)
+    print(frame.hex(" ") if frame is not None else "(no reply)")
+    return 0
+
+
+def percentile(sorted_values, p):
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
+
+
+def cmd_bench(link, args):
+    rtt = []
+    for _ in range(args.count):
+        t0 = time.perf_counter()
+        link.request([CMD_GET_SETTING])
+        rtt.append((time.perf_counter() - t0) * 1000.0)
+    rtt.sort()
+    p99 = percentile(rtt, 99)
+    print("round trip (%d): min %.2f  p50 %.2f  p99 %.2f  max %.2f ms" %
+          (len(rtt), rtt[0], percentile(rtt, 50), p99, rtt[-1]))
+
+    # Pipelined: all requests written at once, so the device sees frames back to back at line rate
+    t0 = time.perf_counter()
+    link.send_frames([[CMD_GET_SETTING]] * args.count)
+    replies = 0
+    while replies < args.count:
+        frame = link.recv(1.0)
+        if frame is None:
+            break
+        if frame[0] == CMD_GET_SETTING:
+            replies += 1
+    elapsed = time.perf_counter() - t0
+    wire_s = args.count * 3 * 10.0 / args.baud
+    print("pipelined: %d/%d replies in %.2f s (%.0f commands/s; the requests alone take %.2f s on the wire)" %
+          (replies, args.count, elapsed, replies / elapsed if elapsed else 0.0, wire_s))
+    lost = args.count - replies
+
+    original = get_setting(link)
+    plans = [(0xFFAA, 200, 130), (0xC000, 150, 100)]
+    mismatches = 0
+    t0 = time.perf_counter()
+    for i in range(args.updates):
+        amp, pw, freq = plans[i % len(plans)]
+        link.send(setting_bytes(amp, pw, freq))
+        if not verify(link, amp, pw, freq):
+            mismatches += 1
+    elapsed = time.perf_counter() - t0
+    link.send(setting_bytes(original["amplitude"], original["pulse_width"], original["frequency"]))
+    print("updates: %d applied+verified in %.2f s (%.1f /s), %d mismatch(es)" %
+          (args.updates, elapsed, args.updates / elapsed if elapsed else 0.0, mismatches))
+
+    failed = mismatches > 0 or lost > 0
+    if lost:
+        print("FAIL: %d pipelined command(s) without a reply" % lost)
+    if args.max_p99_ms is not None and p99 > args.max_p99_ms:
+        print("FAIL: p99 %.2f ms over budget %.2f ms" % (p99, args.max_p99_ms))
+        failed = True
+    return 1 if failed else 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("port", help="tty or pty path")
+    ap.add_argument("--baud", type=int, default=115200, choices=sorted(BAUD))
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    sub.add_parser("get", help="read the applied setting")
+    p = sub.add_parser("set", help="apply a setting (legacy 6-byte write) and verify it")
+    p.add_argument("amplitude", type=lambda v: int(v, 0))
+    p.add_argument("pulse_width", type=int, help="us per phase")
+    p.add_argument("frequency", type=int, help="Hz")
+    p = sub.add_parser("rate", help="set a fine stim rate (0.01 Hz to 5 kHz, not stored)")
+    p.add_argument("hz", type=float, help="Hz, e.g. 0.5 or 2.5")
+    sub.add_parser("boot", help="boot-phase timestamps")
+    sub.add_parser("store", help="stored-plan boot info")
+    sub.add_parser("deadline", help="pulse-deadline monitor stats")
+    p = sub.add_parser("cycles", help="ISR cycle counts")
+    p.add_argument("--reset", action="store_true")
+    p = sub.add_parser("energy", help="active-time counters and current estimate")
+    p.add_argument("--reset", action="store_true")
+    p = sub.add_parser("limits", help="charge limiter state and last fault")
+    p.add_argument("--clear", action="store_true", help="clear the fault record and counters after reading")
+    p = sub.add_parser("clock", help="CPU clock policy counters, select a policy, or compare all three")
+    p.add_argument("--policy", choices=CLOCK_POLICIES, default=None)
+    p.add_argument("--compare", type=float, default=0.0, help="seconds to run each policy (0: read only)")
+    p.add_argument("--commits", type=int, default=10, help="rate re-commits per policy during --compare")
+    p = sub.add_parser("stress", help="random parameter updates during stimulation, checked per pulse")
+    p.add_argument("--duration", type=int, default=60, help="seconds")
+    p.add_argument("--interval-us", type=int, default=10000, help="mean time between updates (>= 1000)")
+    p.add_argument("--max-update-err-us", type=float, default=None)
+    p = sub.add_parser("loop", help="phase-locked closed loop: parameters, start/stop, report")
+    p.add_argument("--phase", type=int, default=None, help="target phase, deg (0 peak, 90 falling, 180 trough)")
+    p.add_argument("--band", type=float, nargs=2, default=None, metavar=("LO_HZ", "HI_HZ"))
+    p.add_argument("--min-amplitude", type=int, default=None, help="amplitude gate, SAADC codes (peak)")
+    g = p.add_mutually_exclusive_group()
+    g.add_argument("--start", action="store_true", help="start from zeroed counters")
+    g.add_argument("--stop", action="store_true")
+    p.add_argument("--watch", type=float, default=0.0, help="seconds to watch before the report")
+    p.add_argument("--max-latency-us", type=int, default=None)
+    p.add_argument("--max-err-deg", type=float, default=None)
+    sub.add_parser("flpr", help="FLPR sequencer state, lateness and plan counters")
+    p = sub.add_parser("log", help="read and check the flash session log")
+    p.add_argument("--from-seq", type=int, default=0, help="first page to read (0: oldest in flash)")
+    p.add_argument("--max-pages", type=int, default=0, help="pages to read (0: all)")
+    p.add_argument("--flush", action="store_true", help="write the buffered records first")
+    p.add_argument("--out", type=argparse.FileType("wb"), default=None, help="also save the raw pages")
+    p = sub.add_parser("telemetry", help="periodic-advertising status broadcast on/off")
+    p.add_argument("--off", action="store_true")
+    p.add_argument("--update-ms", type=int, default=0, help="payload update period (0: unchanged)")
+    p = sub.add_parser("decode", help="decode telemetry manufacturer data from any scanner (no port used)")
+    p.add_argument("hex", nargs="+")
+    p = sub.add_parser("pll", help="stimulation PLL status, or select its reference")
+    p.add_argument("--source", choices=PLL_SOURCES, default=None)
+    p.add_argument("--offset-us", type=int, default=0, help="phase offset from the reference")
+    p = sub.add_parser("sync", help="lock follower units to this one over their control links")
+    p.add_argument("followers", nargs="+", help="follower tty or pty paths")
+    p.add_argument("--offset-us", type=int, default=0, help="follower phase offset from the leader")
+    p.add_argument("--interval", type=float, default=1.0, help="seconds between reference updates")
+    p.add_argument("--duration", type=float, default=30.0, help="seconds to run")
+    p.add_argument("--max-skew-us", type=int, default=None, help="fail if a follower's final skew exceeds this")
+    p = sub.add_parser("raw", help="send a raw command, print the reply")
+    p.add_argument("hex", nargs="+")
+    p.add_argument("--timeout", type=float, default=1.0)
+    p = sub.add_parser("bench", help="round-trip latency and update throughput")
+    p.add_argument("--count", type=int, default=200, help="latency round trips")
+    p.add_argument("--updates", type=int, default=50, help="settings applied and verified")
+    p.add_argument("--max-p99-ms", type=float, default=None)
+
+    args = ap.parse_args()
+    if args.cmd == "decode":
+        return cmd_decode(args)
+    handlers = {"get": cmd_get, "set": cmd_set, "rate": cmd_rate, "boot": cmd_boot, "store": cmd_store,
+                "deadline": cmd_deadline, "cycles": cmd_cycles, "energy": cmd_energy, "limits": cmd_limits, "clock": cmd_clock, "stress": cmd_stress, "loop": cmd_loop, "flpr": cmd_flpr, "raw": cmd_raw,
+                "log": cmd_log, "telemetry": cmd_telemetry, "pll": cmd_pll, "sync": cmd_sync, "bench": cmd_bench}
+    link = Link(args.port, args.baud)
+    try:
+        return handlers[args.cmd](link, args)
+    except TimeoutError as e:
+        print("error: %s" % e, file=sys.stderr)
+        return 2
+    finally:
+        link.close()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,162 @@
+/*
+ * Closed-loop replay: runs a recorded signal through the firmware's own band-pass and phase
+ * estimator (Firmware/src/cl_dsp.c) on the host, block by block as the SAADC delivers it,
+ * and reports how close to the target phase each stimulation target landed. Targets are
+ * taken to be delivered at their time, as the device's DPPI compare delivers them.
+ *
+ *   cc -O2 -I../Firmware/src -o cl_replay cl_replay.c ../Firmware/src/cl_dsp.c -lm
+ *   ./cl_replay -b 4 8 -p 0 lfp.txt
+ *
+ * The recording is raw SAADC codes at the sample rate (-r), one per line; for CSV only the
+ * first column is read, and lines that do not start with a number are skipped. Defaults
+ * are the CONFIG_CL_* values in config.h. With -e the exit status is 1 if the mean
+ * absolute phase error is above the given degrees or no target was evaluated.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "config.h"
+#include "cl_dsp.h"
+
+#define MAX_BLOCK 256
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-r sample_hz] [-d decimation] [-n block_samples] [-b lo_hz hi_hz]\n"
+            "          [-p target_deg] [-a min_amplitude] [-f refractory_ms] [-l lead_us]\n"
+            "          [-o targets.csv] [-e max_mean_err_deg] recording\n", prog);
+    exit(2);
+}
+
+static int next_sample(FILE *in, int16_t *out)
+{
+    char line[256];
+
+    while (fgets(line, sizeof(line), in)) {
+        char *p = line;
+
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '-' || isdigit((unsigned char)*p)) {
+            *out = (int16_t)strtol(p, NULL, 10);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    cl_dsp_config cfg = {
+        .sample_hz = CONFIG_CL_SAMPLE_HZ,
+        .decimation = CONFIG_CL_DECIMATION,
+        .band_lo_dhz = CONFIG_CL_BAND_LO_DHZ,
+        .band_hi_dhz = CONFIG_CL_BAND_HI_DHZ,
+        .target_deg = CONFIG_CL_TARGET_DEG,
+        .min_amplitude = CONFIG_CL_MIN_AMPLITUDE,
+        .refractory_ms = CONFIG_CL_REFRACTORY_MS,
+        .min_lead_us = CONFIG_CL_MIN_LEAD_US,
+    };
+    uint32_t block = CONFIG_CL_BLOCK_SAMPLES;
+    const char *targets_path = NULL;
+    double max_err = -1.0;
+    int i;
+
+    for (i = 1; i < argc - 1 && argv[i][0] == '-'; i++) {
+        switch (argv[i][1]) {
+        case 'r': cfg.sample_hz = (uint32_t)atol(argv[++i]); break;
+        case 'd': cfg.decimation = (uint16_t)atoi(argv[++i]); break;
+        case 'n': block = (uint32_t)atol(argv[++i]); break;
+        case 'b':
+            if (i + 2 >= argc) {
+                usage(argv[0]);
+            }
+            cfg.band_lo_dhz = (uint16_t)(atof(argv[++i]) * 10.0 + 0.5);
+            cfg.band_hi_dhz = (uint16_t)(atof(argv[++i]) * 10.0 + 0.5);
+            break;
+        case 'p': cfg.target_deg = (uint16_t)atoi(argv[++i]); break;
+        case 'a': cfg.min_amplitude = (uint16_t)atoi(argv[++i]); break;
+        case 'f': cfg.refractory_ms = (uint16_t)atoi(argv[++i]); break;
+        case 'l': cfg.min_lead_us = (uint16_t)atoi(argv[++i]); break;
+        case 'o': targets_path = argv[++i]; break;
+        case 'e': max_err = atof(argv[++i]); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (i != argc - 1 || block == 0 || block > MAX_BLOCK) {
+        usage(argv[0]);
+    }
+
+    static cl_dsp dsp;
+    if (cl_dsp_init(&dsp, &cfg) != 0) {
+        fprintf(stderr, "invalid band, decimation or target phase\n");
+        return 2;
+    }
+    FILE *in = fopen(argv[i], "r");
+    if (!in) {
+        perror(argv[i]);
+        return 2;
+    }
+    FILE *targets = targets_path ? fopen(targets_path, "w") : NULL;
+    if (targets) {
+        fprintf(targets, "target_s,crossing_s,kind\n");
+    }
+
+    int16_t buf[MAX_BLOCK];
+    uint32_t n = 0, samples = 0, blocks = 0;
+    double q8_s = 1.0 / (256.0 * cfg.sample_hz);
+
+    for (;;) {
+        int more = next_sample(in, &buf[n]);
+
+        n += more;
+        if (n < block && more) {
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        /* The last block may be short */
+        cl_decision d = cl_dsp_block(&dsp, buf, n);
+
+        if (targets && d.kind != CL_DECISION_NONE) {
+            fprintf(targets, "%.6f,%.6f,%s\n", d.at_q8 * q8_s, d.crossing_q8 * q8_s,
+                    d.kind == CL_DECISION_SCHEDULE ? "schedule" : "refresh");
+        }
+        samples += n;
+        blocks++;
+        n = 0;
+        if (!more) {
+            break;
+        }
+    }
+    fclose(in);
+    if (targets) {
+        fclose(targets);
+    }
+
+    const cl_dsp_stats *st = &dsp.stats;
+    double mean = st->evaluated ? st->err_sum_cdeg / 100.0 / st->evaluated : 0.0;
+    double mean_abs = st->evaluated ? st->abs_err_sum_cdeg / 100.0 / st->evaluated : 0.0;
+
+    printf("%lu samples (%.1f s) in %lu blocks of %lu, band %.1f-%.1f Hz, target %u deg\n",
+           (unsigned long)samples, (double)samples / cfg.sample_hz, (unsigned long)blocks,
+           (unsigned long)block, cfg.band_lo_dhz / 10.0, cfg.band_hi_dhz / 10.0, cfg.target_deg);
+    printf("crossings %lu rejected %lu gated %lu\n", (unsigned long)st->crossings,
+           (unsigned long)st->rejected, (unsigned long)st->gated);
+    printf("targets %lu refreshed %lu deferred %lu evaluated %lu\n", (unsigned long)st->scheduled,
+           (unsigned long)st->refreshed, (unsigned long)st->deferred, (unsigned long)st->evaluated);
+    printf("phase error mean %+.1f deg, mean abs %.1f deg, max abs %.1f deg\n",
+           mean, mean_abs, st->abs_err_max_cdeg / 100.0);
+    printf("last period %.1f ms, amplitude %lu codes\n",
+           st->period_q8 * q8_s * 1000.0, (unsigned long)st->envelope);
+
+    if (max_err >= 0.0 && (st->evaluated == 0 || mean_abs > max_err)) {
+        printf("FAIL: mean abs phase error above %.1f deg\n", max_err);
+        return 1;
+    }
+    return 0;
+}
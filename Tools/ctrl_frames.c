@@ -0,0 +1,253 @@
+/*
+ * Control framing check: feeds the UART receive parser (Firmware/src/ctrl_frame.c) a random
+ * mix of control frames, bridged text lines, frames with a bad length and frames cut off by
+ * a pause, split into receive spans at random points as the UART DMA reports them, and
+ * checks that:
+ *  - every frame is delivered once, in order, with its payload, and in place when it lies
+ *    wholly inside one span
+ *  - the bridged bytes are exactly the text, in chunks that end a line or fill the bridge
+ *    buffer; a sync byte inside a line is bridged as text
+ *  - bad lengths, frames cut off by a pause longer than CTRL_UART_TIMEOUT_MS and frames cut
+ *    off by lost bytes (ctrl_frame_resync(), no pause) are dropped and counted, and what
+ *    follows them parses normally
+ *
+ *   cc -O2 -I../Firmware/src -o ctrl_frames ctrl_frames.c ../Firmware/src/ctrl_frame.c
+ *   ./ctrl_frames -n 100000 -s 7 -b 40 -m 256
+ *
+ * -n items in the stream, -s seed, -b bridge buffer (BLE.h UART_BUF_SIZE), -m longest span
+ * (BLE.h UART_RX_BUF_LEN). The exit status is 1 on any failed check.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ctrl_frame.h"
+
+typedef struct {
+    size_t at;                  // payload offset in the stream
+    uint8_t len;
+} frame;
+
+typedef struct {
+    const uint8_t *stream;
+    const frame *frames;
+    size_t n_frames;
+    size_t next_frame;
+    const uint8_t *text;
+    size_t text_len;
+    size_t text_pos;
+    uint16_t bridge_size;
+    const uint8_t *span;        // the span being fed, copied as the DMA buffer would hold it
+    size_t span_at;             // its offset in the stream
+    size_t span_len;
+    uint32_t in_place;
+    uint32_t failures;
+} checker;
+
+static uint32_t rng_state;
+
+static uint32_t rnd(uint32_t n)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state % n;
+}
+
+static void fail(checker *c, const char *what)
+{
+    if (c->failures++ < 20) {
+        printf("FAIL: %s (frame %zu, text byte %zu)\n", what, c->next_frame, c->text_pos);
+    }
+}
+
+static void on_frame(void *ctx, const uint8_t *data, uint16_t len)
+{
+    checker *c = ctx;
+
+    if (c->next_frame == c->n_frames) {
+        fail(c, "frame not sent");
+        return;
+    }
+    const frame *f = &c->frames[c->next_frame++];
+    bool whole = f->at >= c->span_at && f->at + f->len <= c->span_at + c->span_len;
+    bool inside = data >= c->span && data < c->span + c->span_len;
+
+    if (len != f->len || memcmp(data, &c->stream[f->at], len) != 0) {
+        fail(c, "frame payload differs");
+    }
+    if (whole != inside) {
+        fail(c, whole ? "frame inside one span copied" : "split frame not collected");
+    }
+    c->in_place += inside;
+}
+
+static void on_bridge(void *ctx, const uint8_t *data, uint16_t len)
+{
+    checker *c = ctx;
+
+    if (len == 0 || len > c->bridge_size) {
+        fail(c, "bridge chunk length");
+        return;
+    }
+    if (len < c->bridge_size && data[len - 1] != '\n' && data[len - 1] != '\r') {
+        fail(c, "bridge chunk flushed before line end");
+    }
+    if (c->text_pos + len > c->text_len || memcmp(data, &c->text[c->text_pos], len) != 0) {
+        fail(c, "bridged bytes differ from the text");
+    }
+    c->text_pos += len;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n items] [-s seed] [-b bridge_size] [-m max_span]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t items = 100000, seed = 1;
+    uint16_t bridge_size = 40, max_span = 256;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        switch (argv[i][1]) {
+        case 'n': items = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 's': seed = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'b': bridge_size = (uint16_t)strtoul(argv[++i], NULL, 0); break;
+        case 'm': max_span = (uint16_t)strtoul(argv[++i], NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (items == 0 || bridge_size == 0 || max_span == 0) {
+        usage(argv[0]);
+    }
+    rng_state = seed ? seed : 1;
+
+    /* Every item is at most 2 + 100 bytes; a text line always ends the stream */
+    size_t cap = (size_t)(items + 1) * 102;
+    uint8_t *stream = malloc(cap), *text = malloc(cap), *span = malloc(max_span);
+    frame *frames = malloc(sizeof(frame) * items);
+    bool *cut_after = calloc(cap + 1, sizeof(bool));     // a pause follows this stream offset
+    bool *lost_after = calloc(cap + 1, sizeof(bool));    // bytes were lost after this offset
+    size_t len = 0, text_len = 0, n_frames = 0;
+    uint32_t dropped = 0, lines = 0;
+
+    if (!stream || !text || !span || !frames || !cut_after || !lost_after) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    for (uint32_t k = 0; k <= items; k++) {
+        uint32_t kind = k == items ? 0 : rnd(10);
+
+        if (kind < 4) {
+            /* Text line; the bridge is empty at its start, so a sync byte is text only where
+             * the bridge holds something */
+            uint32_t n = 1 + rnd(100);
+
+            for (uint32_t p = 0; p < n; p++) {
+                uint8_t b;
+
+                if (p == n - 1) {
+                    b = '\n';
+                } else if (p % bridge_size != 0 && rnd(20) == 0) {
+                    b = CTRL_UART_SYNC;
+                } else {
+                    b = (uint8_t)(' ' + rnd(95));
+                }
+                stream[len++] = b;
+                text[text_len++] = b;
+            }
+            lines++;
+        } else if (kind < 8) {
+            uint8_t n = (uint8_t)(1 + rnd(CMD_MAX_LEN));
+
+            stream[len++] = CTRL_UART_SYNC;
+            stream[len++] = n;
+            frames[n_frames].at = len;
+            frames[n_frames++].len = n;
+            for (uint8_t p = 0; p < n; p++) {
+                stream[len++] = (uint8_t)rnd(256);
+            }
+        } else if (kind == 8) {
+            stream[len++] = CTRL_UART_SYNC;
+            stream[len++] = rnd(2) ? 0 : (uint8_t)(CMD_MAX_LEN + 1 + rnd(255 - CMD_MAX_LEN));
+            dropped++;
+        } else {
+            uint8_t n = (uint8_t)(1 + rnd(CMD_MAX_LEN));
+            uint8_t have = (uint8_t)rnd(n);
+
+            stream[len++] = CTRL_UART_SYNC;
+            stream[len++] = n;
+            for (uint8_t p = 0; p < have; p++) {
+                stream[len++] = (uint8_t)rnd(256);
+            }
+            /* The rest of the frame goes quiet, or never arrives at all */
+            if (rnd(2)) {
+                cut_after[len] = true;
+            } else {
+                lost_after[len] = true;
+            }
+            dropped++;
+        }
+    }
+
+    checker c = {
+        .stream = stream, .frames = frames, .n_frames = n_frames, .text = text,
+        .text_len = text_len, .bridge_size = bridge_size, .span = span,
+    };
+    uint8_t *bridge = malloc(bridge_size);
+    ctrl_frame_rx rx;
+    uint32_t now = 0, spans = 0;
+
+    ctrl_frame_init(&rx, bridge, bridge_size, on_frame, on_bridge, &c);
+    for (size_t at = 0; at < len; ) {
+        size_t n = 1 + rnd(max_span);
+
+        if (n > len - at) {
+            n = len - at;
+        }
+        /* A span ends where the line goes quiet */
+        for (size_t e = at + 1; e < at + n; e++) {
+            if (cut_after[e] || lost_after[e]) {
+                n = e - at;
+                break;
+            }
+        }
+        if (lost_after[at]) {
+            ctrl_frame_resync(&rx);
+        }
+        memcpy(span, &stream[at], n);
+        c.span_at = at;
+        c.span_len = n;
+        ctrl_frame_feed(&rx, span, (uint16_t)n, now);
+        spans++;
+        at += n;
+        /* Spans of one frame stay well inside the timeout; a pause goes past it */
+        now += cut_after[at] ? CTRL_UART_TIMEOUT_MS + 1 + rnd(1000) : rnd(6);
+    }
+
+    if (c.next_frame != n_frames) {
+        fail(&c, "frames lost");
+    }
+    if (c.text_pos != text_len) {
+        fail(&c, "bridged text lost");
+    }
+    if (rx.frames != n_frames || rx.dropped != dropped) {
+        printf("FAIL: parser counted %lu frames, %lu dropped; sent %zu, %lu bad\n",
+               (unsigned long)rx.frames, (unsigned long)rx.dropped, n_frames,
+               (unsigned long)dropped);
+        c.failures++;
+    }
+    printf("%zu bytes in %lu spans: %zu frames (%lu in place), %lu lines, %lu dropped\n", len,
+           (unsigned long)spans, n_frames, (unsigned long)c.in_place, (unsigned long)lines,
+           (unsigned long)rx.dropped);
+    if (c.failures) {
+        printf("FAIL: %lu checks\n", (unsigned long)c.failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * PLL simulation: runs the stim period PLL's loop (Firmware/src/pll_core.c) on the host for a
+ * follower unit locking to a leader's sync-out over the wire, as stim_pll.c does it: own
+ * onset and the latest reference edge latched by the 16 MHz measurement timer (32 bits,
+ * wrapping), the error folded to the nominal period and the next CC0 written at the end of
+ * the pulse. Each unit's crystal is off by its own ppm; leader edges can jitter, go missing
+ * (holdover) or step in phase. Checks, against the true times rather than the loop's view:
+ *  - the loop reports lock within the pulses a slew at CONFIG_PLL_MAX_PPM needs, plus
+ *    PLL_SETTLE_PULSES
+ *  - once locked, every onset is within CONFIG_PLL_LOCK_US (plus jitter and a measurement
+ *    tick) of the reference and the lock is never lost; after a phase step too small to
+ *    drop the lock, within the unlock threshold (4x) until the loop is back under it
+ *  - the correction stays within CONFIG_PLL_MAX_PPM and settles at the frequency difference
+ *    of the two units, including the fraction of a tick the nominal CC0 leaves out
+ *
+ *   cc -O2 -I../Firmware/src -o pll_sim pll_sim.c ../Firmware/src/pll_core.c -lm
+ *   ./pll_sim                               the built-in cases
+ *   ./pll_sim -r 130000 -l 20 -f -30 -p 0.4 -j 200 -m 10 -s 1500 -d 120
+ *
+ * -r rate_mhz, -l / -f leader / follower clock ppm, -p initial leader phase (fraction of a
+ * period), -j leader edge jitter ns (uniform), -m missing edges %, -s phase step us at half
+ * time, -o phase offset us, -d seconds, -t stim TIMER Hz. The exit status is 1 on any failed
+ * check.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "pll_core.h"
+
+#define MEAS_HZ 16000000u
+#define PLL_SETTLE_PULSES 256u      // from inside the slew to lock, at the default gains
+
+typedef struct {
+    uint32_t rate_mhz;
+    double leader_ppm;
+    double follower_ppm;
+    double phase;               // leader's first edge, fraction of a period after ours
+    double jitter_ns;
+    uint32_t miss_pct;
+    double step_us;
+    double offset_us;
+    double seconds;
+    uint32_t tick_hz;
+} pll_case;
+
+static const pll_case builtin[] = {
+    { 130000u, 20.0, -20.0, 0.30, 0.0, 0, 0.0, 0.0, 60.0, 16000000u },
+    { 1000u, -30.0, 25.0, 0.45, 0.0, 0, 0.0, 0.0, 1800.0, 16000000u },
+    { 5000000u, 50.0, -50.0, -0.20, 0.0, 0, 0.0, 0.0, 20.0, 16000000u },
+    { 130000u, 10.0, -15.0, 0.10, 500.0, 10, 0.0, 0.0, 120.0, 16000000u },
+    { 20000u, -5.0, 5.0, 0.05, 100.0, 0, 2000.0, 250.0, 400.0, 16000000u },
+    { 130000u, 450.0, -400.0, 0.25, 0.0, 0, 0.0, 0.0, 120.0, 16000000u },
+};
+
+/* Deterministic per-edge noise, so the latest edge before any time is well defined */
+static uint32_t edge_hash(uint64_t k, uint32_t salt)
+{
+    uint64_t x = k * 0x9E3779B97F4A7C15ull + salt;
+
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 29;
+    return (uint32_t)x;
+}
+
+typedef struct {
+    const pll_case *c;
+    double period_s;            // leader period, true time
+    double first;               // leader edge 0, true time
+    double step_at;
+} leader;
+
+static bool edge_missing(const leader *l, int64_t k)
+{
+    return l->c->miss_pct && edge_hash((uint64_t)k, 1u) % 100u < l->c->miss_pct;
+}
+
+static double edge_time(const leader *l, int64_t k)
+{
+    double t = l->first + k * l->period_s;
+
+    if (l->c->jitter_ns > 0.0) {
+        t += ((edge_hash((uint64_t)k, 2u) / 4294967296.0) * 2.0 - 1.0) * l->c->jitter_ns * 1e-9;
+    }
+    if (l->c->step_us != 0.0 && l->first + k * l->period_s >= l->step_at) {
+        t += l->c->step_us * 1e-6;
+    }
+    return t;
+}
+
+/* Latest edge the measurement timer latched by t, -1 if none yet */
+static int64_t edge_latched(const leader *l, double t)
+{
+    int64_t k = (int64_t)floor((t - l->first) / l->period_s) + 1;
+
+    while (k >= 0 && (edge_missing(l, k) || edge_time(l, k) > t)) {
+        k--;
+    }
+    return k;
+}
+
+/* Own onset minus the nearest ideal reference (the edge grid without jitter), true time, ns */
+static double true_skew_ns(const leader *l, double t)
+{
+    double k = floor((t - l->first) / l->period_s + 0.5);
+    double ref = l->first + k * l->period_s;
+
+    if (l->c->step_us != 0.0 && ref >= l->step_at) {
+        ref += l->c->step_us * 1e-6;
+        k = floor((t - ref) / l->period_s + 0.5);
+        ref += k * l->period_s;
+    }
+    return (t - ref) * 1e9 - l->c->offset_us * 1e3;
+}
+
+static int run(const pll_case *c, bool verbose)
+{
+    const uint64_t period_ns = 1000000000000ull / c->rate_mhz;     // STIM_RATE_TO_PERIOD_NS
+    const uint32_t nominal = (uint32_t)((uint64_t)period_ns * c->tick_hz / 1000000000u);
+    const double f_stim = c->tick_hz * (1.0 + c->follower_ppm * 1e-6);
+    const double f_meas = MEAS_HZ * (1.0 + c->follower_ppm * 1e-6);    // same crystal
+    const double width_s = CONFIG_PULSE_WIDTH_US * 2e-6 + 10e-6;        // onset to COMPARE3
+    leader l = {
+        .c = c,
+        .period_s = period_ns * 1e-9 / (1.0 + c->leader_ppm * 1e-6),
+    };
+    pll_core loop;
+    uint32_t failures = 0, pulses = 0, lock_at = 0, lost = 0, holdovers = 0;
+    uint32_t last_ref = 0;
+    bool have_ref = false, was_locked = false, stepped = false, step_seen = false, settling = false;
+    double skew_max = 0.0, adj_sum = 0.0, adj_max = 0.0, phase0;
+    uint32_t adj_n = 0, pulses_from = 0, step_pulse = 0;
+    /* timer.c: whole + Q16 ticks, the fraction dithered into CC0 at each COMPARE0 */
+    const uint64_t prod = period_ns * c->tick_hz;
+    const uint32_t frac = (uint32_t)(((prod % 1000000000u) << 16) / 1000000000u);
+    uint32_t frac_acc = 0, cc0 = nominal;
+
+    l.first = fmod(c->phase, 1.0) * period_ns * 1e-9;
+    if (l.first < 0.0) {
+        l.first += period_ns * 1e-9;
+    }
+    l.step_at = c->step_us != 0.0 ? c->seconds / 2.0 : INFINITY;
+    phase0 = fabs(true_skew_ns(&l, 0.0));
+
+    memset(&loop, 0, sizeof(loop));
+    pll_core_resync(&loop, nominal, c->tick_hz);
+
+    /* Slew the loop can make per pulse once the frequency difference is taken out */
+    const double dppm = fabs(c->follower_ppm - c->leader_ppm);
+    const double slew_ns = (CONFIG_PLL_MAX_PPM - dppm) * 1e-6 * period_ns;
+    const double skew_bound = CONFIG_PLL_LOCK_US * 1e3 + 2.0 * c->jitter_ns + 1e9 / MEAS_HZ;
+    uint32_t lock_bound = (uint32_t)ceil(phase0 / slew_ns) + PLL_SETTLE_PULSES;
+    const double expect_ppm = ((double)l.period_s * f_stim / nominal - 1.0) * 1e6;
+
+    if (slew_ns <= 0.0) {
+        printf("FAIL: %.0f ppm apart is beyond CONFIG_PLL_MAX_PPM\n", dppm);
+        return 1;
+    }
+
+    for (double t = 0.0; t < c->seconds; ) {
+        uint32_t onset = (uint32_t)(uint64_t)(t * f_meas);
+        int64_t k = edge_latched(&l, t + width_s);
+
+        /* COMPARE0: the engine's own dither; COMPARE3 below rewrites CC0 when the loop runs */
+        if (frac != 0) {
+            frac_acc += frac;
+            cc0 = nominal + (frac_acc >> 16);
+            frac_acc &= 0xFFFFu;
+        }
+        pulses++;
+        /* The reference jumps: the loop has to drop lock at its next measurement and regain it
+         * (a step under the unlock threshold is absorbed and checked like any other skew) */
+        if (!stepped && t + l.period_s >= l.step_at) {
+            stepped = true;
+            step_pulse = pulses;
+            settling = true;
+        }
+        if (stepped && !step_seen && pulses > step_pulse + 2u && loop.locked) {
+            step_seen = true;
+        }
+        if (k >= 0) {
+            uint32_t ref = (uint32_t)(uint64_t)(edge_time(&l, k) * f_meas);
+
+            if (have_ref && ref == last_ref) {
+                holdovers++;                    // no edge since the last pulse
+                cc0 = pll_core_hold(&loop);
+            } else {
+                int64_t err_ns = (int64_t)(int32_t)(onset - ref) * 1000 / (MEAS_HZ / 1000000u);
+
+                have_ref = true;
+                last_ref = ref;
+                err_ns = pll_phase_fold(err_ns - (int64_t)(c->offset_us * 1000.0), period_ns);
+                cc0 = pll_core_update(&loop, err_ns);
+            }
+        }
+
+        double skew = fabs(true_skew_ns(&l, t));
+        double adj_ppm = loop.adj * 1e6 / ((double)nominal * (1u << PLL_FRAC_BITS));
+
+        if (fabs(adj_ppm) > CONFIG_PLL_MAX_PPM + 1e-9) {
+            printf("FAIL: correction %.1f ppm at %.3f s\n", adj_ppm, t);
+            failures++;
+        }
+        if (loop.locked && !was_locked) {
+            was_locked = true;
+            lock_at = pulses - pulses_from;
+            if (lock_at > lock_bound) {
+                printf("FAIL: locked after %u pulses, bound %u\n", lock_at, lock_bound);
+                failures++;
+            }
+        } else if (!loop.locked && was_locked) {
+            was_locked = false;
+            if (stepped && !step_seen) {
+                step_seen = true;
+                pulses_from = pulses;
+                lock_bound = (uint32_t)ceil(fabs(c->step_us) * 1e3 / slew_ns) + PLL_SETTLE_PULSES;
+            } else {
+                lost++;
+                printf("FAIL: lock lost at %.3f s (skew %.0f ns)\n", t, skew);
+                failures++;
+            }
+        }
+        if (stepped && !step_seen && loop.locked) {
+            /* Onsets before the loop's first look at the stepped reference */
+        } else if (was_locked) {
+            if (skew > skew_max) {
+                skew_max = skew;
+            }
+            settling = settling && skew >= CONFIG_PLL_LOCK_US * 1e3;
+            if (skew > (settling ? 4.0 * CONFIG_PLL_LOCK_US * 1e3 : skew_bound) && failures < 20) {
+                printf("FAIL: locked but %.0f ns off the reference at %.3f s\n", skew, t);
+                failures++;
+            }
+            adj_sum += adj_ppm;
+            adj_n++;
+            if (fabs(adj_ppm - expect_ppm) > adj_max) {
+                adj_max = fabs(adj_ppm - expect_ppm);
+            }
+        }
+        if (verbose) {
+            printf("%.6f %+.0f %+.3f %d\n", t, true_skew_ns(&l, t), adj_ppm, loop.locked);
+        }
+        t += cc0 / f_stim;
+    }
+
+    if (!was_locked) {
+        printf("FAIL: not locked at the end\n");
+        failures++;
+    }
+    double adj_mean = adj_n ? adj_sum / adj_n : 0.0;
+
+    /* The mean correction is the frequency difference; the dither and the PI ripple average out */
+    if (adj_n && fabs(adj_mean - expect_ppm) > 1.0) {
+        printf("FAIL: mean correction %.3f ppm, frequency difference %.3f ppm\n", adj_mean, expect_ppm);
+        failures++;
+    }
+    printf("%8lu %+6.0f %+6.0f %5.2f %5.0f %3lu%% %6.0f %8lu %6lu/%-6lu %8.3f %+9.3f %+9.3f %4lu  %s\n",
+           (unsigned long)c->rate_mhz, c->leader_ppm, c->follower_ppm, c->phase, c->jitter_ns,
+           (unsigned long)c->miss_pct, c->step_us, (unsigned long)pulses, (unsigned long)lock_at,
+           (unsigned long)lock_bound, skew_max / 1e3, adj_mean, expect_ppm, (unsigned long)holdovers,
+           failures ? "FAIL" : "ok");
+    return failures ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-r rate_mhz] [-l leader_ppm] [-f follower_ppm] [-p phase] [-j jitter_ns]\n"
+            "       [-m missing_pct] [-s step_us] [-o offset_us] [-d seconds] [-t tick_hz] [-v]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    pll_case c = builtin[0];
+    bool custom = false, verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || (argv[i][1] != 'v' && i + 1 >= argc)) {
+            usage(argv[0]);
+        }
+        custom = custom || argv[i][1] != 'v';
+        switch (argv[i][1]) {
+        case 'r': c.rate_mhz = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'l': c.leader_ppm = atof(argv[++i]); break;
+        case 'f': c.follower_ppm = atof(argv[++i]); break;
+        case 'p': c.phase = atof(argv[++i]); break;
+        case 'j': c.jitter_ns = atof(argv[++i]); break;
+        case 'm': c.miss_pct = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 's': c.step_us = atof(argv[++i]); break;
+        case 'o': c.offset_us = atof(argv[++i]); break;
+        case 'd': c.seconds = atof(argv[++i]); break;
+        case 't': c.tick_hz = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'v': verbose = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (c.rate_mhz == 0 || c.tick_hz < 1000u || c.miss_pct >= 100) {
+        usage(argv[0]);
+    }
+
+    int rc = 0;
+
+    printf("%8s %6s %6s %5s %5s %4s %6s %8s %13s %8s %9s %9s %4s\n", "rate_mHz", "lead", "foll",
+           "phase", "jit", "miss", "step", "pulses", "lock/bound", "skew_us", "adj_ppm", "expect",
+           "hold");
+    if (custom) {
+        return run(&c, verbose);
+    }
+    for (size_t n = 0; n < sizeof(builtin) / sizeof(builtin[0]); n++) {
+        rc |= run(&builtin[n], verbose);
+    }
+    return rc;
+}
@@ -0,0 +1,356 @@
+/*
+ * RTC drift simulation: runs the RTC engine's period dithering (Firmware/src/rtc_period.h)
+ * and the LFCLK calibration's measurement (lfclk_cal.h, the steps of lfclk_cal.c) on the
+ * host against an LFRC whose frequency drifts, and reports the stimulation rate error with
+ * and without the correction.
+ *
+ *   cc -O2 -I../Firmware/src -o rtc_drift rtc_drift.c -lm
+ *   ./rtc_drift                         every scenario at the default rates
+ *   ./rtc_drift -s ramp -r 130000 -x 20 -v
+ *
+ * Scenarios are LFRC offsets from 32768 Hz over time, what is left after the RC trim:
+ * offset, ramp (warming to body temperature), step and sine. The calibration is polled as
+ * lfclk_cal.c does it (one compare skipped after arming, a window of at least
+ * CONFIG_LFCLK_CAL_WINDOW_MS, LFCLK_CAL_WINDOW_MAX_MS to give up) every -i seconds, against
+ * a 16 MHz reference -x ppm off, captured to the tick and wrapping at 32 bits. HFXO start
+ * and the RC trim take no time here.
+ *
+ * The corrected run is split where a correction takes effect. Each span's mean rate has to
+ * be within what the correction could know: the drift since its window, the reference error,
+ * the Q16 fraction's truncation (1/65536 tick per period, 2.3 ppm at 5 kHz), one dither tick
+ * over the span and 1 ppm of capture and mHz rounding. err_ppm is the worst span run at a
+ * measured rate, first_ppm the span before the first measurement. The exit status is 1 if
+ * a span is outside its bound or a calibration fails.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "lfclk_cal.h"
+#include "rtc_period.h"
+
+#define HF_HZ 16000000u
+#define CAL_SNAP_POLL_S 0.05    // lfclk_cal.c CAL_SNAP_POLL_MS
+#define MAX_RATES 16
+
+typedef struct {
+    const char *name;
+    double (*ppm)(double t);
+} scenario;
+
+static double drift_offset(double t) { (void)t; return 250.0; }
+static double drift_ramp(double t) { return t < 600.0 ? t : 600.0; }
+static double drift_step(double t) { return t < 95.0 ? 0.0 : -400.0; }
+static double drift_sine(double t) { return 300.0 * sin(2.0 * M_PI * t / 300.0); }
+
+static const scenario scenarios[] = {
+    { "offset", drift_offset },     // +250 ppm throughout
+    { "ramp", drift_ramp },         // +1 ppm/s for 10 minutes, then steady
+    { "step", drift_step },         // -400 ppm at 95 s
+    { "sine", drift_sine },         // 300 ppm over a 5 minute cycle
+};
+
+typedef struct {
+    double interval_s;
+    double ref_ppm;
+    double seconds;
+    bool verbose;
+} options;
+
+typedef struct {
+    uint64_t pulses;
+    uint32_t spans;
+    uint32_t cals;
+    uint32_t cal_failed;
+    uint32_t failures;
+    double first_err;           // span before the first measurement, ppm
+    double max_err;             // worst span at a measured rate, ppm
+    double max_bound;           // bound of that span
+} result;
+
+/* Span of pulses run at one LFCLK estimate */
+typedef struct {
+    bool started;
+    bool measured;              // run at a calibrated estimate
+    double first;               // time of the first compare
+    double last;
+    uint32_t periods;
+    uint64_t ticks;
+    double drift;               // worst error the estimate's window allows, ppm
+} span;
+
+/* Rate error of an estimate made over a window where the LFRC was at w_lo..w_hi ppm, at a
+ * time it is at p ppm */
+static double estimate_error_ppm(double p, double w_lo, double w_hi)
+{
+    double lo = fabs((1.0 + p * 1e-6) / (1.0 + w_lo * 1e-6) - 1.0) * 1e6;
+    double hi = fabs((1.0 + p * 1e-6) / (1.0 + w_hi * 1e-6) - 1.0) * 1e6;
+
+    return lo > hi ? lo : hi;
+}
+
+static void span_close(const span *s, uint32_t rate_mhz, const options *o, bool check, result *r)
+{
+    if (s->periods < 2) {
+        return;
+    }
+    double exact = rate_mhz / 1000.0;
+    double mean = s->periods / (s->last - s->first);
+    double err = (mean - exact) / exact * 1e6;
+    double q16 = 1e6 * s->periods / (65536.0 * (double)s->ticks);
+    double bound = s->drift + fabs(o->ref_ppm) + q16 + 1e6 / (double)s->ticks + 1.0;
+
+    r->spans++;
+    if (check && !s->measured) {
+        r->first_err = err;
+    } else if (fabs(err) > fabs(r->max_err)) {
+        r->max_err = err;
+        r->max_bound = bound;
+    }
+    if (o->verbose) {
+        printf("  %9.3f..%9.3f s  %7lu pulses  %+9.3f ppm (bound %.3f)\n", s->first, s->last,
+               (unsigned long)s->periods, err, check ? bound : 0.0);
+    }
+    if (check && fabs(err) > bound) {
+        printf("FAIL: %.3f..%.3f s rate error %+.3f ppm, bound %.3f\n", s->first, s->last, err,
+               bound);
+        r->failures++;
+    }
+}
+
+/* Time the LFRC takes for ticks from t (midpoint rule; the drift is slow next to a period) */
+static double lf_advance(const scenario *sc, double t, uint32_t ticks)
+{
+    double dt = ticks / (LFCLK_FREQ_HZ * (1.0 + sc->ppm(t) * 1e-6));
+
+    return ticks / (LFCLK_FREQ_HZ * (1.0 + sc->ppm(t + dt / 2.0) * 1e-6));
+}
+
+static void run(const scenario *sc, uint32_t rate_mhz, bool correct, const options *o, result *r)
+{
+    enum { CAL_IDLE, CAL_SNAP_FIRST, CAL_SNAP_WINDOW } state = CAL_IDLE;
+    const uint64_t period_ns = 1000000000000ull / rate_mhz;  // STIM_RATE_TO_PERIOD_NS
+    const double hf_true = HF_HZ * (1.0 + o->ref_ppm * 1e-6);
+    uint32_t lfclk_mhz = LFCLK_FREQ_HZ * 1000u;
+    uint32_t whole, frac, acc = 0;
+    uint32_t lf_total = 0, seq = 0, snap_seq = 0, snap_lf = 0, snap_hf = 0, cap_lf = 0, cap_hf = 0;
+    uint32_t polls = 0;
+    bool armed = false, switch_pending = false, measured = false;
+    double t = 0.0, t_cap = 0.0, t_snap = 0.0, next_poll = correct ? 0.0 : INFINITY;
+    double w_lo = 0.0, w_hi = 0.0, next_w_lo = 0.0, next_w_hi = 0.0, next_split = o->interval_s;
+    span s = { 0 };
+
+    memset(r, 0, sizeof(*r));
+    rtc_period_split(period_ns, lfclk_mhz, &whole, &frac);
+    uint32_t ticks = rtc_period_dither(whole, frac, &acc);
+    double next_cmp = lf_advance(sc, t, ticks);
+
+    while (t < o->seconds) {
+        if (next_poll < next_cmp) {
+            /* Calibration work item */
+            double now = next_poll;
+            bool done = false, ok = true;
+
+            switch (state) {
+            case CAL_IDLE:
+                snap_seq = seq;
+                armed = true;
+                polls = 0;
+                state = CAL_SNAP_FIRST;
+                next_poll = now + CAL_SNAP_POLL_S;
+                break;
+            case CAL_SNAP_FIRST:
+                if (seq - snap_seq < 2) {
+                    if (++polls * CAL_SNAP_POLL_S * 1000.0 >= LFCLK_CAL_WINDOW_MAX_MS) {
+                        done = true;
+                        ok = false;
+                    } else {
+                        next_poll = now + CAL_SNAP_POLL_S;
+                    }
+                    break;
+                }
+                snap_seq = seq;
+                snap_lf = cap_lf;
+                snap_hf = cap_hf;
+                t_snap = t_cap;
+                polls = 0;
+                state = CAL_SNAP_WINDOW;
+                next_poll = now + CONFIG_LFCLK_CAL_WINDOW_MS / 1000.0;
+                break;
+            case CAL_SNAP_WINDOW:
+                if (seq == snap_seq ||
+                    (uint64_t)(cap_hf - snap_hf) * 1000u < (uint64_t)HF_HZ * CONFIG_LFCLK_CAL_WINDOW_MS) {
+                    if (++polls * CAL_SNAP_POLL_S * 1000.0 >= LFCLK_CAL_WINDOW_MAX_MS) {
+                        done = true;
+                        ok = false;
+                    } else {
+                        next_poll = now + CAL_SNAP_POLL_S;
+                    }
+                    break;
+                }
+                done = true;
+                uint32_t mhz = lfclk_cal_mhz(cap_lf - snap_lf, cap_hf - snap_hf, HF_HZ);
+                int32_t ppm = lfclk_cal_ppm(mhz);
+
+                if (ppm > LFCLK_CAL_MAX_PPM || ppm < -LFCLK_CAL_MAX_PPM) {
+                    ok = false;
+                    break;
+                }
+                /* Takes effect from the period armed at the next compare */
+                lfclk_mhz = mhz;
+                rtc_period_split(period_ns, lfclk_mhz, &whole, &frac);
+                double p0 = sc->ppm(t_snap), p1 = sc->ppm((t_snap + t_cap) / 2.0), p2 = sc->ppm(t_cap);
+                next_w_lo = fmin(p0, fmin(p1, p2));
+                next_w_hi = fmax(p0, fmax(p1, p2));
+                switch_pending = true;
+                break;
+            }
+            if (done) {
+                r->cals++;
+                if (!ok) {
+                    r->cal_failed++;
+                    printf("FAIL: %s at %lu mHz: calibration at %.3f s failed\n", sc->name,
+                           (unsigned long)rate_mhz, now);
+                    r->failures++;
+                }
+                armed = false;
+                state = CAL_IDLE;
+                next_poll = now + o->interval_s;
+            }
+            continue;
+        }
+
+        /* Compare: a pulse, captured if the calibration is armed */
+        t = next_cmp;
+        lf_total += ticks;
+        r->pulses++;
+        if (armed) {
+            cap_lf = lf_total;
+            cap_hf = (uint32_t)(uint64_t)(t * hf_true);
+            t_cap = t;
+            seq++;
+        }
+        if (!s.started) {
+            s.started = true;
+            s.first = t;
+        } else {
+            double d = estimate_error_ppm(sc->ppm(t), w_lo, w_hi);
+
+            s.periods++;
+            s.ticks += ticks;
+            s.last = t;
+            if (d > s.drift) {
+                s.drift = d;
+            }
+        }
+        /* The period armed next runs at the new estimate: a new span starts here */
+        if (switch_pending || (!correct && t >= next_split)) {
+            span_close(&s, rate_mhz, o, correct, r);
+            memset(&s, 0, sizeof(s));
+            s.started = true;
+            s.first = t;
+            s.measured = measured;
+            if (switch_pending) {
+                w_lo = next_w_lo;
+                w_hi = next_w_hi;
+                switch_pending = false;
+                s.measured = measured = true;
+            }
+            while (next_split <= t) {
+                next_split += o->interval_s;
+            }
+        }
+        ticks = rtc_period_dither(whole, frac, &acc);
+        next_cmp = t + lf_advance(sc, t, ticks);
+    }
+    span_close(&s, rate_mhz, o, correct, r);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-s offset|ramp|step|sine] [-r rate_mhz]... [-i interval_s] [-x ref_ppm]\n"
+            "       [-d seconds] [-v]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    options o = {
+        .interval_s = CONFIG_LFCLK_CAL_INTERVAL_S,
+        .ref_ppm = 0.0,
+        .seconds = 900.0,
+        .verbose = false,
+    };
+    uint32_t rates[MAX_RATES] = { 500u, 2500u, 20000u, 130000u, 1000000u, 5000000u };
+    int n_rates = 6, n_given = 0;
+    const char *only = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || (argv[i][1] != 'v' && i + 1 >= argc)) {
+            usage(argv[0]);
+        }
+        switch (argv[i][1]) {
+        case 's': only = argv[++i]; break;
+        case 'r':
+            if (n_given == MAX_RATES) {
+                usage(argv[0]);
+            }
+            rates[n_given++] = (uint32_t)strtoul(argv[++i], NULL, 0);
+            n_rates = n_given;
+            break;
+        case 'i': o.interval_s = atof(argv[++i]); break;
+        case 'x': o.ref_ppm = atof(argv[++i]); break;
+        case 'd': o.seconds = atof(argv[++i]); break;
+        case 'v': o.verbose = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    for (int k = 0; k < n_rates; k++) {
+        if (rates[k] == 0u) {
+            usage(argv[0]);
+        }
+    }
+
+    uint32_t failures = 0;
+    bool found = false;
+
+    printf("%-7s %9s %9s %5s %6s %10s %10s %10s %11s\n", "drift", "rate_mHz", "pulses", "cals",
+           "failed", "first_ppm", "err_ppm", "bound_ppm", "uncorr_ppm");
+    for (size_t n = 0; n < sizeof(scenarios) / sizeof(scenarios[0]); n++) {
+        const scenario *sc = &scenarios[n];
+
+        if (only && strcmp(only, sc->name) != 0) {
+            continue;
+        }
+        found = true;
+        for (int k = 0; k < n_rates; k++) {
+            result corr, raw;
+
+            if (o.verbose) {
+                printf("%s at %lu mHz, corrected:\n", sc->name, (unsigned long)rates[k]);
+            }
+            run(sc, rates[k], true, &o, &corr);
+            if (o.verbose) {
+                printf("%s at %lu mHz, uncorrected:\n", sc->name, (unsigned long)rates[k]);
+            }
+            run(sc, rates[k], false, &o, &raw);
+            printf("%-7s %9lu %9lu %5lu %6lu %+10.3f %+10.3f %10.3f %+11.3f\n", sc->name,
+                   (unsigned long)rates[k], (unsigned long)corr.pulses, (unsigned long)corr.cals,
+                   (unsigned long)corr.cal_failed, corr.first_err, corr.max_err, corr.max_bound,
+                   raw.max_err);
+            failures += corr.failures;
+        }
+    }
+    if (!found) {
+        usage(argv[0]);
+    }
+    if (failures) {
+        printf("FAIL: %lu checks\n", (unsigned long)failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Sequencer trace: runs the FLPR's pulse sequencer (Firmware/src/seq_core.c) on the host
+ * through a plan and a schedule of plan updates, as the FLPR loop does (an update is read
+ * at its time and moves an onset no nearer than 10 us), and checks every edge it gives:
+ *  - order onset, interphase, phase 2, end, and times that never go back
+ *  - both phases a pulse width and the gap the interphase gap of the plan the pulse began
+ *    with (a pulse is never split between two plans), DAC codes the plan's amplitude and
+ *    its mirror
+ *  - onsets a whole or whole-plus-one tick period apart while a plan runs
+ * and reports the mean rate error of each plan's span and the time from an update to the
+ * first pulse of the new plan.
+ *
+ *   cc -O2 -I../Firmware/src -o seq_trace seq_trace.c ../Firmware/src/seq_core.c
+ *   ./seq_trace -p 130000 200 0xFFAA -u 2500 2500 100 0x8000 -d 10
+ *
+ * -u at_ms rate_mhz width_us amplitude commits a plan at that time (repeatable). Defaults
+ * are the CONFIG_* boot plan of config.h. The exit status is 1 on any failed check.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "seq_core.h"
+
+#define MAX_UPDATES 64
+#define SWITCH_PERIOD_US 10u    // timer.h SWITCH_PERIOD
+
+typedef struct {
+    uint64_t at;                // ticks
+    seq_plan plan;
+} update;
+
+/* Mean rate of the onsets first..last against the plan's, ppm */
+static double span_error_ppm(const seq_plan *plan, uint32_t tick_hz, uint64_t first, uint64_t last,
+                             uint32_t onsets)
+{
+    double exact = plan->rate_mhz / 1000.0;
+    double mean = (onsets - 1u) * (double)tick_hz / (double)(last - first);
+    double ppm = (mean - exact) / exact * 1e6;
+
+    return ppm < 0 ? -ppm : ppm;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t tick_hz] [-p rate_mhz width_us amplitude] [-g gap_us]\n"
+            "          [-u at_ms rate_mhz width_us amplitude]... [-d seconds] [-o edges.csv]\n", prog);
+    exit(2);
+}
+
+static void read_plan(char **argv, int *i, int argc, seq_plan *plan)
+{
+    if (*i + 3 >= argc) {
+        usage(argv[0]);
+    }
+    plan->rate_mhz = (uint32_t)strtoul(argv[++*i], NULL, 0);
+    plan->pulse_width_us = (uint32_t)strtoul(argv[++*i], NULL, 0);
+    plan->amplitude = (uint32_t)strtoul(argv[++*i], NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t tick_hz = 16000000u;
+    seq_plan plan = {
+        .rate_mhz = CONFIG_STIM_RATE_MHZ ? CONFIG_STIM_RATE_MHZ : CONFIG_STIM_FREQUENCY_HZ * 1000u,
+        .pulse_width_us = CONFIG_PULSE_WIDTH_US,
+        .gap_us = SWITCH_PERIOD_US,
+        .amplitude = CONFIG_STIM_AMPLITUDE,
+    };
+    static update updates[MAX_UPDATES];
+    int n_updates = 0;
+    double seconds = 10.0;
+    const char *edges_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || (argv[i][1] != 'p' && argv[i][1] != 'u' && i + 1 >= argc)) {
+            usage(argv[0]);
+        }
+        switch (argv[i][1]) {
+        case 't': tick_hz = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'p': read_plan(argv, &i, argc, &plan); break;
+        case 'g': plan.gap_us = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'u':
+            if (n_updates == MAX_UPDATES || i + 1 >= argc) {
+                usage(argv[0]);
+            }
+            updates[n_updates].at = (uint64_t)(atof(argv[++i]) * tick_hz / 1000.0);
+            read_plan(argv, &i, argc, &updates[n_updates].plan);
+            n_updates++;
+            break;
+        case 'd': seconds = atof(argv[++i]); break;
+        case 'o': edges_path = argv[++i]; break;
+        default: usage(argv[0]);
+        }
+    }
+    for (int u = 0; u < n_updates; u++) {
+        updates[u].plan.gap_us = plan.gap_us;
+        if (u > 0 && updates[u].at < updates[u - 1].at) {
+            fprintf(stderr, "updates out of order\n");
+            return 2;
+        }
+    }
+
+    static seq_core seq;
+    const uint32_t lead = tick_hz / 100000u;
+
+    if (seq_init(&seq, tick_hz, &plan, lead) != 0) {
+        fprintf(stderr, "plan does not fit: the pulse has to fit the period\n");
+        return 2;
+    }
+    FILE *edges = edges_path ? fopen(edges_path, "w") : NULL;
+    if (edges) {
+        fprintf(edges, "t_s,edge,dac\n");
+    }
+
+    /* Time is kept in 64 bits on the host; the core works modulo 2^32 */
+    const uint64_t end = (uint64_t)(seconds * tick_hz);
+    uint64_t t = 0, last = 0, span_start = 0;
+    uint32_t last_at = 0, expect = SEQ_EDGE_ONSET, span_pulses = 0;
+    uint32_t pulses = 0, rejected = 0, failures = 0;
+    uint64_t onset = 0, commit_at = 0;
+    bool have_prev = false, awaiting = false;
+    seq_core at_onset;              // plan and timing the pulse began with
+    double latency_max_us = 0.0, rate_err_max_ppm = 0.0;
+    int next_update = 0;
+
+    memset(&at_onset, 0, sizeof(at_onset));
+    while (t < end) {
+        seq_edge e = seq_peek(&seq);
+        uint64_t at = last + (uint32_t)(e.at - last_at);
+
+        /* The FLPR reads an update on its next pass: before any edge due after it */
+        if (next_update < n_updates && updates[next_update].at <= at) {
+            uint64_t ua = updates[next_update].at;
+            int r = seq_commit(&seq, &updates[next_update].plan, (uint32_t)(ua + lead));
+
+            if (r < 0) {
+                rejected++;
+            } else {
+                commit_at = ua;
+                awaiting = true;
+            }
+            next_update++;
+            continue;
+        }
+
+        if (e.kind != expect || at < t) {
+            printf("FAIL: edge %d at %.6f s out of order\n", e.kind, at / (double)tick_hz);
+            failures++;
+        }
+        expect = (e.kind + 1u) % SEQ_EDGE_COUNT;
+        t = at;
+
+        switch (e.kind) {
+        case SEQ_EDGE_ONSET: {
+            bool new_plan = !have_prev || at_onset.applied != seq.applied;
+
+            if (!new_plan) {
+                uint64_t d = at - onset;
+
+                if (d != seq.period_ticks && d != seq.period_ticks + 1u) {
+                    printf("FAIL: onset at %.6f s %llu ticks after the last, period %u\n",
+                           at / (double)tick_hz, (unsigned long long)d, seq.period_ticks);
+                    failures++;
+                }
+            } else {
+                if (span_pulses > 1) {
+                    double ppm = span_error_ppm(&at_onset.plan, tick_hz, span_start, onset, span_pulses);
+
+                    if (ppm > rate_err_max_ppm) {
+                        rate_err_max_ppm = ppm;
+                    }
+                }
+                span_start = at;
+                span_pulses = 0;
+            }
+            if (awaiting) {
+                double us = (at - commit_at) * 1e6 / tick_hz;
+
+                if (us > latency_max_us) {
+                    latency_max_us = us;
+                }
+                awaiting = false;
+            }
+            onset = at;
+            have_prev = true;
+            span_pulses++;
+            at_onset = seq;
+            if (e.dac_code != (uint16_t)seq.plan.amplitude) {
+                printf("FAIL: phase 1 code 0x%04X, plan 0x%04X\n", e.dac_code, seq.plan.amplitude);
+                failures++;
+            }
+            break;
+        }
+
+        case SEQ_EDGE_INTERPHASE:
+            if (at - onset != at_onset.width_ticks) {
+                printf("FAIL: phase 1 at %.6f s is %llu ticks, plan %u\n", onset / (double)tick_hz,
+                       (unsigned long long)(at - onset), at_onset.width_ticks);
+                failures++;
+            }
+            break;
+
+        case SEQ_EDGE_PHASE2:
+            if (at - onset != at_onset.width_ticks + at_onset.gap_ticks) {
+                printf("FAIL: interphase gap at %.6f s off the plan\n", onset / (double)tick_hz);
+                failures++;
+            }
+            if (e.dac_code != at_onset.dac_phase2) {
+                printf("FAIL: phase 2 code 0x%04X, plan 0x%04X\n", e.dac_code, at_onset.dac_phase2);
+                failures++;
+            }
+            break;
+
+        default:
+            if (at - onset != 2u * at_onset.width_ticks + at_onset.gap_ticks) {
+                printf("FAIL: phase 2 at %.6f s off the plan\n", onset / (double)tick_hz);
+                failures++;
+            }
+            pulses++;
+            break;
+        }
+        if (edges) {
+            fprintf(edges, "%.9f,%d,%u\n", at / (double)tick_hz, e.kind,
+                    (e.kind == SEQ_EDGE_ONSET || e.kind == SEQ_EDGE_PHASE2) ? e.dac_code : 0u);
+        }
+        last = at;
+        last_at = e.at;
+        seq_advance(&seq);
+    }
+    if (edges) {
+        fclose(edges);
+    }
+    if (span_pulses > 1) {
+        double ppm = span_error_ppm(&at_onset.plan, tick_hz, span_start, onset, span_pulses);
+
+        if (ppm > rate_err_max_ppm) {
+            rate_err_max_ppm = ppm;
+        }
+    }
+
+    printf("%lu pulses in %.1f s at %lu Hz ticks, %d updates (%lu rejected)\n", (unsigned long)pulses,
+           seconds, (unsigned long)tick_hz, n_updates, (unsigned long)rejected);
+    printf("update to first pulse of the new plan: max %.1f us\n", latency_max_us);
+    printf("mean rate error per plan: max %.3f ppm\n", rate_err_max_ppm);
+    if (failures) {
+        printf("FAIL: %lu edge checks\n", (unsigned long)failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ * Session log power-loss check: runs the page ring of Firmware/src/slog_core.c on a simulated
+ * partition through many boots, each ended by a power loss at a random flash operation. The
+ * operation the power fails in is torn at a random byte: a torn write leaves a prefix written
+ * and one byte half done; a torn erase leaves the start or the end of the slot erased and the
+ * rest as it was. After each loss the boot scan runs, and the tool checks that:
+ *  - every page the scan accepts is, byte for byte, a page the writer completed under that
+ *    sequence number: a torn page is never taken for a good one
+ *  - every completed page whose slot has not been invalidated since is found
+ *  - first_seq..last_seq are all in flash where slog_ring_locate() says, and no more of them
+ *    than the ring has slots; this is checked after every completed page as well, and a page
+ *    whose slot is being rewritten is not located
+ *  - writing resumes in the slot after the newest completed page, with the next sequence
+ *    number and the next boot count
+ *
+ *   cc -O2 -I../Firmware/src -o slog_power slog_power.c ../Firmware/src/slog_core.c
+ *   ./slog_power -n 5000 -s 7 -p 6
+ *   ./slog_power -n 5000 -s 7 -p 6 -r
+ *
+ * -n boots, -s seed, -p slots in the partition, -r RRAM (no explicit erase: a slot is
+ * invalidated by zeroing its header; writes overwrite). Without -r the partition is NOR flash:
+ * erased bytes are 0xFF and a write can only clear bits. The exit status is 1 on any failed check.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "slog_core.h"
+
+typedef struct {
+    uint8_t *mem;
+    uint32_t size;
+    bool rram;
+    uint32_t ops;
+    uint32_t cut_at;            // the power fails in this operation (1-based)
+    bool dead;
+    uint32_t torn_writes;
+    uint32_t torn_erases;
+} sim_flash;
+
+/* Record header (slog_record_header) and the longest payload the firmware writes, with room */
+#define REC_HEADER 6u
+#define REC_PAYLOAD_MAX 24u
+
+static uint32_t rng_state;
+
+static uint32_t rnd(uint32_t n)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state % n;
+}
+
+static bool power_fails(sim_flash *f)
+{
+    if (f->dead) {
+        return true;
+    }
+    if (++f->ops == f->cut_at) {
+        f->dead = true;
+    }
+    return false;
+}
+
+static void program(sim_flash *f, uint32_t at, uint8_t b)
+{
+    f->mem[at] = f->rram ? b : (uint8_t)(f->mem[at] & b);
+}
+
+static int sim_read(void *ctx, uint32_t off, void *buf, uint32_t len)
+{
+    sim_flash *f = ctx;
+
+    if (off + len > f->size) {
+        return -EINVAL;
+    }
+    memcpy(buf, &f->mem[off], len);
+    return 0;
+}
+
+static int sim_write(void *ctx, uint32_t off, const void *data, uint32_t len)
+{
+    sim_flash *f = ctx;
+    const uint8_t *d = data;
+
+    if (off + len > f->size || power_fails(f)) {
+        return -EIO;
+    }
+    if (!f->dead) {
+        for (uint32_t i = 0; i < len; i++) {
+            program(f, off + i, d[i]);
+        }
+        return 0;
+    }
+    uint32_t n = rnd(len + 1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        program(f, off + i, d[i]);
+    }
+    if (n < len) {
+        /* Half-programmed byte: NOR clears some of the bits it was clearing */
+        program(f, off + n, f->rram ? (uint8_t)rnd(256) : (uint8_t)(d[n] | rnd(256)));
+    }
+    f->torn_writes++;
+    return -EIO;
+}
+
+static int sim_erase(void *ctx, uint32_t off, uint32_t len)
+{
+    sim_flash *f = ctx;
+
+    if (off + len > f->size || power_fails(f)) {
+        return -EIO;
+    }
+    if (!f->dead) {
+        memset(&f->mem[off], 0xFF, len);
+        return 0;
+    }
+    /* The order a sector erases in is not specified: a torn one leaves either end erased */
+    uint32_t n = rnd(len + 1);
+
+    memset(&f->mem[rnd(2) ? off : off + len - n], 0xFF, n);
+    f->torn_erases++;
+    return -EIO;
+}
+
+/* Records of page seq: the same bytes every time that sequence number is written */
+static uint16_t page_fill(uint8_t *page, uint32_t seq)
+{
+    uint32_t saved = rng_state;
+    uint16_t used = 0;
+
+    rng_state = seq * 2654435761u + 1u;
+    uint16_t want = (uint16_t)(rnd(8) == 0 ? SLOG_PAGE_PAYLOAD : rnd(SLOG_PAGE_PAYLOAD + 1));
+
+    while (used + REC_HEADER <= want) {
+        uint8_t len = (uint8_t)rnd(REC_PAYLOAD_MAX + 1);
+        uint8_t *p = page + sizeof(slog_page_header) + used;
+
+        if (used + REC_HEADER + len > want) {
+            break;
+        }
+        p[0] = (uint8_t)(1 + rnd(4));
+        p[1] = len;
+        for (uint32_t i = 2; i < REC_HEADER + len; i++) {
+            p[i] = (uint8_t)rnd(256);
+        }
+        used += REC_HEADER + len;
+    }
+    rng_state = saved;
+    ((slog_page_header *)page)->used = used;
+    return used;
+}
+
+typedef struct {
+    uint32_t n_slots;
+    uint32_t *slot_seq;         // completed page in the slot, 0: none or invalidated since
+    uint32_t last_seq;          // newest completed page
+    uint16_t last_boot;
+    uint32_t last_index;
+    uint32_t failures;
+    uint32_t boot_no;
+} checker;
+
+static void fail(checker *c, const char *what, uint32_t seq)
+{
+    if (c->failures++ < 20) {
+        printf("FAIL: %s (boot %u, seq %u)\n", what, c->boot_no, seq);
+    }
+}
+
+/* The page in a slot: valid, and if so the one completed under its sequence number */
+static bool slot_page(checker *c, sim_flash *f, uint32_t index, uint32_t *seq)
+{
+    uint8_t *buf = &f->mem[index * SLOG_PAGE_SIZE];
+    const slog_page_header *h = (const slog_page_header *)buf;
+    static uint8_t want[SLOG_PAGE_SIZE];
+
+    if (!slog_page_valid(buf)) {
+        return false;
+    }
+    *seq = h->seq;
+    if (h->seq > c->last_seq) {
+        fail(c, "page valid that never completed", h->seq);
+        return true;
+    }
+    memset(want, 0, sizeof(want));
+    page_fill(want, h->seq);
+    if (h->used != ((slog_page_header *)want)->used ||
+        memcmp(buf + sizeof(*h), want + sizeof(*h), h->used) != 0) {
+        fail(c, "page accepted with records that were never written", h->seq);
+    }
+    return true;
+}
+
+/* first_seq..last_seq are the valid pages in flash, each where slog_ring_locate() says */
+static void check_range(checker *c, sim_flash *f, const slog_ring *r, uint32_t valid)
+{
+    if (r->first_seq == 0 || r->last_seq - r->first_seq + 1 != valid || valid > c->n_slots) {
+        fail(c, "first..last is not the pages in flash", r->first_seq);
+        return;
+    }
+    for (uint32_t s = r->first_seq; s && s <= r->last_seq; s++) {
+        int index = slog_ring_locate(r, s);
+        const uint8_t *buf = index < 0 ? NULL : &f->mem[(uint32_t)index * SLOG_PAGE_SIZE];
+
+        /* Contents were checked when the page was written and at each scan */
+        if (!buf || !slog_page_valid(buf) || ((const slog_page_header *)buf)->seq != s) {
+            fail(c, "locate does not find the page", s);
+        }
+    }
+}
+
+static void check_scan(checker *c, sim_flash *f, const slog_ring *r)
+{
+    uint32_t valid = 0;
+
+    for (uint32_t i = 0; i < c->n_slots; i++) {
+        uint32_t seq = 0;
+        bool ok = slot_page(c, f, i, &seq);
+
+        valid += ok;
+        if (c->slot_seq[i] && (!ok || seq != c->slot_seq[i])) {
+            fail(c, "completed page lost", c->slot_seq[i]);
+        }
+    }
+    if (r->last_seq != c->last_seq) {
+        fail(c, "scan missed the newest page", r->last_seq);
+    }
+    if (c->last_seq == 0) {
+        if (r->first_seq != 0 || r->next_seq != 1 || r->next_index != 0 || r->boot != 1) {
+            fail(c, "empty partition does not start from the beginning", r->next_seq);
+        }
+        return;
+    }
+    if (r->next_seq != c->last_seq + 1 || r->next_index != (c->last_index + 1) % c->n_slots) {
+        fail(c, "writing does not resume after the newest page", r->next_seq);
+    }
+    if (r->boot != (uint16_t)(c->last_boot + 1)) {
+        fail(c, "boot count does not move on", r->boot);
+    }
+    check_range(c, f, r, valid);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n boots] [-s seed] [-p slots] [-r]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t boots = 5000, seed = 1, n_slots = 6;
+    bool rram = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            usage(argv[0]);
+        }
+        if (argv[i][1] == 'r') {
+            rram = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        switch (argv[i][1]) {
+        case 'n': boots = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 's': seed = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'p': n_slots = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (boots == 0 || n_slots < 2 || n_slots > 1000) {
+        usage(argv[0]);
+    }
+    rng_state = seed ? seed : 1;
+
+    if (slog_crc32(0, "123456789", 9) != 0xCBF43926u) {
+        printf("FAIL: CRC-32 check value\n");
+        return 1;
+    }
+
+    sim_flash f = { .size = n_slots * SLOG_PAGE_SIZE, .rram = rram };
+    checker c = { .n_slots = n_slots };
+    static uint8_t page[SLOG_PAGE_SIZE], scratch[SLOG_PAGE_SIZE];
+    uint32_t pages = 0, late = 0;
+
+    f.mem = malloc(f.size);
+    c.slot_seq = calloc(n_slots, sizeof(uint32_t));
+    if (!f.mem || !c.slot_seq) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    /* A partition as shipped: erased, or RRAM holding whatever it held */
+    for (uint32_t i = 0; i < f.size; i++) {
+        f.mem[i] = rram ? (uint8_t)rnd(256) : 0xFF;
+    }
+
+    const slog_flash flash = {
+        .read = sim_read,
+        .write = sim_write,
+        .erase = rram ? NULL : sim_erase,
+        .ctx = &f,
+    };
+
+    for (c.boot_no = 1; c.boot_no <= boots; c.boot_no++) {
+        slog_ring r;
+
+        f.ops = 0;
+        f.dead = false;
+        slog_ring_scan(&r, &flash, (uint16_t)n_slots, scratch);
+        check_scan(&c, &f, &r);
+
+        /* Up to two laps of the ring; about 70 operations per full page */
+        f.cut_at = 1 + rnd(2 * n_slots * 72);
+        while (!f.dead) {
+            memset(page, 0, sizeof(page));
+            page_fill(page, r.next_seq);
+            slog_ring_begin(&r, page);
+
+            /* From its first operation the slot no longer holds its old page for sure */
+            uint32_t index = r.next_index, old_seq = c.slot_seq[index];
+            slog_step at = r.step;
+
+            c.slot_seq[index] = 0;
+            while (r.step != SLOG_STEP_IDLE) {
+                at = r.step;
+                if (slog_ring_step(&r) != 0) {
+                    break;
+                }
+                if (r.step != SLOG_STEP_IDLE && old_seq && slog_ring_locate(&r, old_seq) >= 0) {
+                    fail(&c, "locate finds a page whose slot is being rewritten", old_seq);
+                }
+            }
+            if (f.dead) {
+                /* A header write may have landed in full as the power went: the page is then
+                 * complete, and the scan has to find it */
+                uint32_t seq, before = c.last_seq;
+
+                if (at == SLOG_STEP_HEADER && slog_page_valid(&f.mem[index * SLOG_PAGE_SIZE])) {
+                    c.last_seq = before + 1;
+                    if (slot_page(&c, &f, index, &seq) && seq == c.last_seq) {
+                        c.slot_seq[index] = seq;
+                        c.last_index = index;
+                        c.last_boot = r.boot;
+                        late++;
+                    } else {
+                        c.last_seq = before;
+                    }
+                }
+                break;
+            }
+            /* The checker keeps its own account: the ring has to agree with it */
+            uint32_t seq = 0, valid = 0;
+
+            c.last_seq++;
+            if (!slot_page(&c, &f, index, &seq) || seq != c.last_seq) {
+                fail(&c, "page not in flash when its write completed", c.last_seq);
+            }
+            c.slot_seq[index] = c.last_seq;
+            c.last_index = index;
+            c.last_boot = r.boot;
+            pages++;
+            if (r.last_seq != c.last_seq || r.last_index != index) {
+                fail(&c, "ring does not record the page it wrote", r.last_seq);
+            }
+            for (uint32_t i = 0; i < n_slots; i++) {
+                valid += c.slot_seq[i] != 0;
+            }
+            check_range(&c, &f, &r, valid);
+        }
+    }
+
+    slog_ring r;
+
+    slog_ring_scan(&r, &flash, (uint16_t)n_slots, scratch);
+    check_scan(&c, &f, &r);
+    printf("%u boots on %u %s slots: %u pages written (%u as the power failed), %u torn writes, "
+           "%u torn erases, last page %u\n", boots, n_slots, rram ? "RRAM" : "NOR", pages + late,
+           late, f.torn_writes, f.torn_erases, r.last_seq);
+    if (c.failures) {
+        printf("FAIL: %u checks\n", c.failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ * Stress checker simulation: drives the per-pulse checker of the parameter-update stress run
+ * (Firmware/src/stress_core.c) from a simulated continuous engine that behaves as timer.c
+ * does: the TIMER clears at each onset (CC0) and the phase edges are CC1-CC3; a rate or pulse
+ * width update waits for the gap between two pulses (timer_lock_between_pulses), a width
+ * update rewrites CC1-CC3 there, and a rate update clears the TIMER there and masks CC1-CC3
+ * until the next onset; the DAC words are latched at the onset and clocked out after edges 0
+ * and 2, and an amplitude reaches the words (charge limiter commit) before the plan that
+ * carries it. Edges are timestamped after a random ISR latency. Random updates are made at
+ * every phase of a pulse, and faults are injected on pulses no update is near. Every change of
+ * the checker's counts is charged to the pulse period it was counted in, and the tool checks
+ * that:
+ *  - an injected fault is counted in exactly its categories, and nothing else is counted:
+ *    a dropped pulse, phase edges repeated, a late onset (and only that onset), a long phase 2,
+ *    a phase-1 or phase-2 DAC word not clocked out, and a pulse sending an amplitude other than
+ *    the committed one
+ *  - every other pulse is checked once and counted nowhere, an update near it or not: a rate
+ *    restart is neither dropped, doubled nor late, a width change leaves no pulse stretched or
+ *    unbalanced, and a pulse that sent an amplitude before its plan reached the checker is not
+ *    a wrong amplitude
+ *  - with no faults, the worst error is within the ISR latency, near updates and away from them
+ *  - the checker saw every plan update
+ *
+ *   cc -O2 -I../Firmware/src -o stress_sim stress_sim.c ../Firmware/src/stress_core.c
+ *   ./stress_sim -n 200000 -s 7
+ *   ./stress_sim -n 200000 -s 7 -f 0
+ *
+ * -n pulse periods, -s seed, -u mean pulse periods between updates, -f one pulse in f on
+ * average gets a fault where none is near an update (0: none). Rates, widths and the
+ * tolerance are the CONFIG_STRESS_* of config.h, in 16 MHz measurement ticks; the stim TIMER
+ * is taken to tick with it. The exit status is 1 on any failed check.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "stress_core.h"
+
+#define MEAS_HZ 16000000u
+#define TICKS_US (MEAS_HZ / 1000000u)
+#define GAP (10u * TICKS_US)                    // timer.h SWITCH_PERIOD
+#define MIN_PERIOD(pw) (2u * (pw) + GAP + 50u * TICKS_US)     // timer.h TIMER_MIN_PERIOD_US
+#define TOL (CONFIG_STRESS_TOL_US * TICKS_US)
+#define JITTER (TOL / 2u)                       // ISR latency, uniform 0..JITTER
+#define FAULT_SHIFT (3u * TOL)                  // a late onset or a long phase 2
+#define GAP_POLL (5u * TICKS_US)                // timer.c PULSE_GAP_POLL_US
+#define EDGES_MASKED 0x0Eu                      // CC1-CC3 after a restart, until the onset
+
+typedef enum {
+    F_NONE,
+    F_DROP,         // no edges for a whole period
+    F_REPEAT,       // CC1-CC3 run again after the pulse
+    F_LATE,         // onset ISR late: a short phase 1
+    F_LONG,         // phase 2 ends late
+    F_WORD1,        // phase-1 word not clocked out
+    F_WORD2,        // phase-2 word not clocked out
+    F_STALE,        // the pulse sends an amplitude other than the committed one
+    F_COUNT
+} fault;
+
+static const char *const fault_names[F_COUNT] = {
+    "none", "dropped pulse", "repeated phase edges", "late onset", "long phase 2",
+    "phase-1 word lost", "phase-2 word lost", "stale amplitude",
+};
+
+/* Counts a fault window (the faulty period and the next) should show */
+static const stress_counts fault_counts[F_COUNT] = {
+    [F_DROP] = { .pulses = 1, .dropped = 1 },
+    [F_REPEAT] = { .pulses = 2, .doubled = 1 },
+    [F_LATE] = { .pulses = 2, .late = 1, .stretched = 1, .unbalanced = 1 },
+    [F_LONG] = { .pulses = 2, .stretched = 1, .unbalanced = 1 },
+    [F_WORD1] = { .pulses = 2, .wrong_amplitude = 1 },
+    [F_WORD2] = { .pulses = 2, .wrong_amplitude = 1 },
+    [F_STALE] = { .pulses = 2, .wrong_amplitude = 1 },
+};
+
+/* One pulse period, onset to onset: what happened in it and what the checker counted */
+typedef struct {
+    uint16_t updates;
+    uint8_t fault;
+    stress_counts counted;
+} period_rec;
+
+typedef struct {
+    uint64_t tb;                // last TIMER clear
+    uint64_t t_write;           // last CC1-CC3 write
+    uint32_t period;
+    uint32_t pw;
+    uint8_t fired;              // CC1-CC3 fired (or masked) since the clear, bit per edge
+    bool open;                  // onset handled, COMPARE3 not yet: updates wait
+    uint16_t words;             // amplitude in the DAC words
+    uint16_t lat1, lat2;        // latched at the onset
+    uint16_t last_code;         // last word clocked out
+} engine;
+
+static uint32_t rng_state;
+static uint32_t failures;
+
+static uint32_t rnd(uint32_t n)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state % n;
+}
+
+static uint32_t rand_range(uint32_t lo, uint32_t hi)
+{
+    return lo + rnd(hi - lo + 1u);
+}
+
+static void fail(const char *what, uint32_t period)
+{
+    if (failures++ < 20) {
+        printf("FAIL: %s (pulse period %u)\n", what, period);
+    }
+}
+
+static uint16_t mirror(uint16_t a)
+{
+    return a ? (uint16_t)(0x10000u - a) : 0xFFFFu;
+}
+
+static uint32_t cc(const engine *e, uint8_t edge)
+{
+    return edge == 1 ? e->pw : edge == 2 ? e->pw + GAP : 2u * e->pw + GAP;
+}
+
+/* Next engine event after the clear: an armed phase edge (1-3) or the onset (0) */
+static uint64_t next_edge(const engine *e, uint8_t *edge)
+{
+    uint64_t t = e->tb + e->period;
+
+    *edge = 0;
+    for (uint8_t k = 1; k <= 3; k++) {
+        uint64_t tk = e->tb + cc(e, k);
+
+        if (!(e->fired & (1u << k)) && tk > e->t_write && tk < t) {
+            t = tk;
+            *edge = k;
+        }
+    }
+    return t;
+}
+
+static void counts_add(stress_counts *sum, const stress_counts *a, const stress_counts *b, int sign)
+{
+    uint32_t *s = (uint32_t *)sum;
+    const uint32_t *x = (const uint32_t *)a, *y = (const uint32_t *)b;
+
+    /* The event counters lead the struct; the worst errors are not counts */
+    for (size_t i = 0; i < offsetof(stress_counts, worst_err) / sizeof(uint32_t); i++) {
+        s[i] = x[i] + (uint32_t)sign * y[i];
+    }
+}
+
+static bool counts_equal(const stress_counts *a, const stress_counts *b)
+{
+    return a->pulses == b->pulses && a->dropped == b->dropped && a->doubled == b->doubled &&
+           a->stretched == b->stretched && a->unbalanced == b->unbalanced && a->late == b->late &&
+           a->wrong_amplitude == b->wrong_amplitude;
+}
+
+static void counts_print(const char *what, const stress_counts *n)
+{
+    printf("%s: pulses %u dropped %u doubled %u stretched %u unbalanced %u late %u wrong amplitude %u\n",
+           what, n->pulses, n->dropped, n->doubled, n->stretched, n->unbalanced, n->late,
+           n->wrong_amplitude);
+}
+
+static stress_checker chk;
+static period_rec *recs;
+static uint32_t cur;                // pulse period the engine is in
+
+/* One edge to the checker; what it counts goes to the current pulse period */
+static void edge_to_checker(uint8_t edge, uint64_t t, uint16_t code)
+{
+    stress_counts before = chk.n;
+
+    stress_core_edge(&chk, edge, (uint32_t)t, code);
+    counts_add(&recs[cur].counted, &recs[cur].counted, &chk.n, 1);
+    counts_add(&recs[cur].counted, &recs[cur].counted, &before, -1);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n periods] [-s seed] [-u mean_periods_between_updates] [-f fault_one_in]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n_periods = 200000, seed = 1, mean_periods = 3, fault_one_in = 20;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        switch (argv[i][1]) {
+        case 'n': n_periods = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 's': seed = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'u': mean_periods = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        case 'f': fault_one_in = (uint32_t)strtoul(argv[++i], NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (n_periods < 10 || mean_periods == 0) {
+        usage(argv[0]);
+    }
+    rng_state = seed ? seed : 1;
+    recs = calloc(n_periods + 2, sizeof(period_rec));
+    if (!recs) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    /* Start close to the 32-bit wrap of the measurement TIMER */
+    engine e = {
+        .tb = 0xFFFFFFFFull - 20u * MEAS_HZ / CONFIG_STRESS_RATE_MIN_HZ,
+        .period = MEAS_HZ / CONFIG_STRESS_RATE_MIN_HZ,
+        .pw = CONFIG_STRESS_PW_MIN_US * TICKS_US,
+        .words = 0xC000,
+    };
+    e.t_write = e.tb;
+    e.lat1 = e.words;
+    e.lat2 = mirror(e.words);
+    e.last_code = e.lat2;
+
+    stress_plan plan = { .period = e.period, .pw = e.pw, .amplitude = e.words };
+    uint64_t upd_at = e.tb + rand_range(e.period / 2u, e.period * mean_periods * 3u / 2u);
+    uint64_t plan_at = UINT64_MAX;      // an amplitude's plan, after its words
+    stress_plan waiting;                // a rate or width update waiting for the gap
+    uint32_t waiting_kind = 0;
+    bool wait = false;
+    uint32_t plans = 0, refused = 0, ahead = 0, faults[F_COUNT] = { 0 };
+    uint8_t fault = F_NONE;
+
+    stress_core_start(&chk, &plan, TOL, GAP);
+    while (cur <= n_periods) {
+        uint8_t edge;
+        uint64_t t = next_edge(&e, &edge);
+
+        if (plan_at <= t) {
+            stress_core_plan(&chk, &plan, false, (uint32_t)plan_at);
+            plans++;
+            recs[cur].updates++;
+            upd_at = plan_at + rand_range(e.period / 2u, e.period * mean_periods * 3u / 2u);
+            plan_at = UINT64_MAX;
+            continue;
+        }
+        if (upd_at <= t && wait) {
+            /* The update that waited for the pulse to end */
+            wait = false;
+            if (waiting_kind == 0) {
+                e.period = waiting.period;
+                e.tb = upd_at;
+                e.fired = EDGES_MASKED;
+            } else {
+                e.pw = waiting.pw;
+                e.t_write = upd_at;
+            }
+            stress_core_plan(&chk, &waiting, waiting_kind == 0, (uint32_t)upd_at);
+            plans++;
+            upd_at += rand_range(e.period / 2u, e.period * mean_periods * 3u / 2u);
+            continue;
+        }
+        if (upd_at <= t) {
+            /* Like stress.c inject_one(): one of rate, width or amplitude */
+            stress_plan next = plan;
+            uint32_t kind = rnd(3);
+
+            if (kind == 0) {
+                next.period = MEAS_HZ / rand_range(CONFIG_STRESS_RATE_MIN_HZ, CONFIG_STRESS_RATE_MAX_HZ);
+            } else if (kind == 1) {
+                next.pw = rand_range(CONFIG_STRESS_PW_MIN_US, CONFIG_STRESS_PW_MAX_US) * TICKS_US;
+            } else {
+                next.amplitude = (uint16_t)rand_range(0x8000u, 0xFFFFu);
+            }
+            if (next.period < MIN_PERIOD(next.pw)) {
+                refused++;
+                upd_at += rand_range(e.period / 2u, e.period * mean_periods * 3u / 2u);
+                continue;
+            }
+            stress_core_amplitude_coming(&chk, next.amplitude);
+            e.words = next.amplitude;
+            recs[cur].updates++;
+            plan = next;
+            if (kind == 2) {
+                /* The plan reaches the checker when the injector gets to it */
+                plan_at = upd_at + rnd(e.period * 3u / 2u);
+                upd_at = UINT64_MAX;
+                continue;
+            }
+            /* Applied at once in the gap, else after the COMPARE3 of the pulse running */
+            waiting = next;
+            waiting_kind = kind;
+            wait = true;
+            if (e.open) {
+                upd_at = UINT64_MAX;
+            }
+            continue;
+        }
+
+        uint64_t ts = t + rnd(JITTER + 1u);
+
+        if (edge == 0) {
+            cur++;
+            e.tb = t;
+            e.fired = 0;
+
+            /* A fault only where the period before, this one and the next are free of updates */
+            uint64_t quiet_until = t + 2u * (uint64_t)e.period + MIN_PERIOD(e.pw);
+
+            fault = F_NONE;
+            if (fault_one_in && cur > 3 && rnd(fault_one_in) == 0 && recs[cur - 1].updates == 0 &&
+                recs[cur - 1].fault == F_NONE && upd_at > quiet_until && plan_at > quiet_until) {
+                fault = (uint8_t)(1 + rnd(F_COUNT - 1));
+                /* The same word in both phases cannot show a lost write */
+                if ((fault == F_WORD1 || fault == F_WORD2) && mirror(e.words) == e.words) {
+                    fault = F_NONE;
+                }
+            }
+            recs[cur].fault = fault;
+            faults[fault]++;
+            if (fault == F_DROP) {
+                continue;
+            }
+            if (fault == F_LATE) {
+                ts += FAULT_SHIFT;
+            }
+            edge_to_checker(0, ts, e.last_code);
+            e.open = true;
+            e.lat1 = fault == F_STALE ? (uint16_t)(e.words ^ 0x0040u) : e.words;
+            e.lat2 = mirror(e.lat1);
+            if (fault != F_WORD1) {
+                e.last_code = e.lat1;
+            }
+            continue;
+        }
+
+        e.fired |= (uint8_t)(1u << edge);
+        if (fault == F_DROP) {
+            continue;
+        }
+        if (edge == 1 && e.lat1 != plan.amplitude && chk.plan.amplitude != e.lat1) {
+            ahead++;            // words changed, plan not checked in yet
+        }
+        if (edge == 3 && fault == F_LONG) {
+            ts += FAULT_SHIFT;
+        }
+        edge_to_checker(edge, ts, e.last_code);
+        if (edge == 2 && fault != F_WORD2) {
+            e.last_code = e.lat2;
+        }
+        if (edge == 3) {
+            e.open = false;
+            if (wait) {
+                upd_at = ts + rnd(GAP_POLL + 1u);
+            }
+        }
+        if (edge == 3 && fault == F_REPEAT) {
+            /* The phase edges once more, as after a TIMER clear at the end of the pulse */
+            for (uint8_t k = 1; k <= 3; k++) {
+                edge_to_checker(k, t + cc(&e, k) + rnd(JITTER + 1u), e.last_code);
+                if (k == 2) {
+                    e.last_code = e.lat2;
+                }
+            }
+        }
+    }
+
+    /* Periods 1-2 are the checker syncing; the last one is cut short */
+    const stress_counts one = { .pulses = 1 };
+    stress_counts touched = { 0 }, injected = { 0 };
+    uint32_t clean = 0, n_touched = 0;
+
+    for (uint32_t k = 3; k + 1 < cur; k++) {
+        const period_rec *r = &recs[k];
+
+        if (r->fault != F_NONE) {
+            stress_counts window;
+
+            counts_add(&window, &r->counted, &recs[k + 1].counted, 1);
+            if (!counts_equal(&window, &fault_counts[r->fault])) {
+                char what[80];
+
+                snprintf(what, sizeof(what), "%s not counted as it should be", fault_names[r->fault]);
+                fail(what, k);
+                counts_print("  counted", &window);
+                counts_print("  expected", &fault_counts[r->fault]);
+            }
+            counts_add(&injected, &injected, &window, 1);
+            continue;
+        }
+        if (recs[k - 1].fault != F_NONE) {
+            continue;           // part of that fault's window
+        }
+        if (!counts_equal(&r->counted, &one)) {
+            fail(r->updates || recs[k - 1].updates ? "pulse an update touched was counted"
+                                                   : "pulse no update or fault touched was counted", k);
+            counts_print("  counted", &r->counted);
+        }
+        if (r->updates == 0 && recs[k - 1].updates == 0) {
+            clean++;
+            continue;
+        }
+        counts_add(&touched, &touched, &r->counted, 1);
+        n_touched++;
+    }
+    if (chk.n.updates != plans) {
+        fail("checker missed plan updates", cur);
+    }
+    if (fault_one_in == 0 && chk.n.worst_err > JITTER) {
+        printf("FAIL: worst error outside updates %u ticks, latency at most %u\n", chk.n.worst_err, JITTER);
+        failures++;
+    }
+    if (fault_one_in == 0 && chk.n.worst_update_err > JITTER) {
+        printf("FAIL: worst update-induced error %u ticks, latency at most %u\n",
+               chk.n.worst_update_err, JITTER);
+        failures++;
+    }
+
+    printf("%u pulse periods, %u plan updates (%u in a pulse, %u refused), %u pulses checked\n",
+           cur, plans, chk.n.in_pulse, refused, chk.n.pulses);
+    printf("%u clean periods counted nowhere; %u pulses sent an amplitude ahead of its plan\n", clean, ahead);
+    printf("faults injected:");
+    for (int f = 1; f < F_COUNT; f++) {
+        printf(" %s %u%s", fault_names[f], faults[f], f + 1 < F_COUNT ? "," : "\n");
+    }
+    counts_print("counted in fault windows", &injected);
+    printf("%u periods an update touched, ", n_touched);
+    counts_print("counted there", &touched);
+    printf("worst error outside updates %.1f us, update-induced %.1f us\n",
+           chk.n.worst_err / (double)TICKS_US, chk.n.worst_update_err / (double)TICKS_US);
+    if (failures) {
+        printf("FAIL: %u checks\n", failures);
+        return 1;
+    }
+    return 0;
+}